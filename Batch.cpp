@@ -0,0 +1,508 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Batch.cpp
+//
+// Desc: Batched UDP receive/send (recvmmsg/sendmmsg) helpers, with optional
+//       UDP GRO/GSO segmentation offload.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "Batch.h"
+#include "SocketAddress.h"
+#include "Server.h"
+#include "Error.h"
+
+#define GRO_BUFFER_SIZE         65535       /* A GRO receive can be up to a full UDP datagram */
+#define GSO_MAX_SEGMENTS        64          /* Kernel cap per UDP_SEGMENT send (older kernels) */
+#define GSO_MAX_BYTES           65507       /* Max UDP payload of the coalesced send */
+#define GSO_MAX_SEGMENT_SIZE    1232        /* Only coalesce what fits the IPv6 minimum MTU */
+
+
+//################################################################################
+//##
+//## Class: RecvBatch
+//##
+//##  Desc: Receives up to N datagrams per recvmmsg() call into a preallocated
+//##        ring of buffers.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: RecvBatch::RecvBatch()
+//  Description: Constructor. The buffers come from Setup().
+//       Inputs: inServer (IN) server, used for statistics
+//               inSize (IN) max datagrams per recvmmsg() call
+//               inBufferSize (IN) size of each datagram buffer. With GRO on
+//                   every buffer is made big enough for a coalesced receive.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+RecvBatch::RecvBatch(Server *inServer, unsigned int inSize, size_t inBufferSize)
+: mServer(inServer),
+  mSize(inSize ? inSize : 1),
+  mBufferSize(inBufferSize),
+  mGRO(inServer->GetConfig().mUDPGSO),
+  mBuffers(nullptr)
+{
+    // With GRO every buffer is made big enough for a coalesced receive
+    if (mGRO && mBufferSize < GRO_BUFFER_SIZE)
+        mBufferSize = GRO_BUFFER_SIZE;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: RecvBatch::Setup()
+//  Description: Allocate every buffer up front.
+//      Returns: Non-zero on failure, the batch can't be used then.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int RecvBatch::Setup()
+{
+    try
+    {
+        mMsgs.resize(mSize);
+        mIovecs.resize(mSize);
+        mAddrs.resize(mSize);
+        if (mGRO)
+            mControl.resize(mSize * CMSG_SPACE(sizeof(int)));
+        mSegments.reserve(mSize);
+        mBuffers = (unsigned char*) malloc(mSize * mBufferSize);
+    }
+    catch (const bad_alloc&)
+    {
+        mBuffers = nullptr;
+    }
+    if (!mBuffers)
+    {
+        ReportError("Failed to allocate %u receive buffers of %zu bytes", mSize, mBufferSize);
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: RecvBatch::~RecvBatch()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+RecvBatch::~RecvBatch()
+{
+    if (mBuffers)
+    {
+        free(mBuffers);
+        mBuffers = nullptr;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: RecvBatch::Receive()
+//  Description: Receive a batch of datagrams. Blocks until at least one arrives
+//               (unless MSG_DONTWAIT is passed) and then takes whatever else is
+//               already queued on the socket, up to the batch size.
+//       Inputs: inSocket (IN) socket to read from
+//               inFlags (IN) extra recvmmsg() flags, e.g. MSG_DONTWAIT
+//      Returns: Number of datagrams received (after splitting GRO receives),
+//               or -1 on error/nothing ready.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int RecvBatch::Receive(int inSocket, int inFlags)
+{
+    size_t controlSize = CMSG_SPACE(sizeof(int));
+    for (unsigned int i = 0; i < mSize; ++i)
+    {
+        mIovecs[i].iov_base = mBuffers + i * mBufferSize;
+        mIovecs[i].iov_len = mBufferSize;
+        memset(&mMsgs[i], 0, sizeof(struct mmsghdr));
+        mMsgs[i].msg_hdr.msg_iov = &mIovecs[i];
+        mMsgs[i].msg_hdr.msg_iovlen = 1;
+        mMsgs[i].msg_hdr.msg_name = &mAddrs[i];
+        mMsgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        if (mGRO)
+        {
+            mMsgs[i].msg_hdr.msg_control = &mControl[i * controlSize];
+            mMsgs[i].msg_hdr.msg_controllen = controlSize;
+        }
+    }
+
+    // MSG_TRUNC: a datagram too big for its buffer reports its real length,
+    // so the caller can tell it was cut short
+    mSegments.clear();
+    int count = recvmmsg(inSocket, &mMsgs[0], mSize, MSG_WAITFORONE | MSG_TRUNC | inFlags, nullptr);
+    if (count <= 0)
+        return -1;
+
+    for (int i = 0; i < count; ++i)
+    {
+        unsigned char *data = mBuffers + i * mBufferSize;
+        size_t len = mMsgs[i].msg_len;
+
+        // A GRO receive is a run of gso_size datagrams from one sender (the
+        // last may be shorter); split it back up
+        int segSize = 0;
+        if (mGRO)
+        {
+            for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mMsgs[i].msg_hdr); cmsg;
+                 cmsg = CMSG_NXTHDR(&mMsgs[i].msg_hdr, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+                    memcpy(&segSize, CMSG_DATA(cmsg), sizeof(segSize));
+            }
+        }
+
+        if (segSize <= 0 || (size_t)segSize >= len || len > mBufferSize)
+        {
+            mSegments.push_back({data, len, (unsigned int)i});
+            continue;
+        }
+
+        mServer->mStats.Add(STATS_GRO_RECEIVES);
+        for (size_t offset = 0; offset < len; offset += segSize)
+        {
+            size_t segLen = len - offset < (size_t)segSize ? len - offset : (size_t)segSize;
+            mSegments.push_back({data + offset, segLen, (unsigned int)i});
+            mServer->mStats.Add(STATS_GRO_SEGMENTS);
+        }
+    }
+
+    mServer->mStats.Add(STATS_RECV_BATCHES);
+    mServer->mStats.Add(STATS_RECV_DATAGRAMS, mSegments.size());
+    return (int)mSegments.size();
+}
+
+
+//################################################################################
+//##
+//## Class: SendBatch
+//##
+//##  Desc: Queues outgoing datagrams for one socket and sends them with a single
+//##        sendmmsg() call.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::SendBatch()
+//  Description: Constructor. The buffers come from Setup().
+//       Inputs: inServer (IN) server, used for statistics
+//               inSocket (IN) socket all queued datagrams are sent on
+//               inSize (IN) max datagrams per sendmmsg() call
+//               inBufferSize (IN) size of each datagram buffer
+//               inFlushUS (IN) max microseconds a datagram may sit queued
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SendBatch::SendBatch(Server *inServer, int inSocket, unsigned int inSize,
+                     size_t inBufferSize, unsigned int inFlushUS)
+: mServer(inServer),
+  mSocket(inSocket),
+  mSize(inSize ? inSize : 1),
+  mBufferSize(inBufferSize),
+  mFlushUS(inFlushUS),
+  mCount(0),
+  mGSO(inServer->GetConfig().mUDPGSO),
+  mBuffers(nullptr)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::Setup()
+//  Description: Allocate every buffer up front.
+//      Returns: Non-zero on failure, the batch can't be used then.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int SendBatch::Setup()
+{
+    try
+    {
+        mMsgs.resize(mSize);
+        mIovecs.resize(mSize);
+        mAddrs.resize(mSize);
+        if (mGSO)
+        {
+            mGSOIovecs.resize(mSize);
+            mGSOControl.resize(mSize * CMSG_SPACE(sizeof(uint16_t)));
+            mGSOGrouped.resize(mSize);
+        }
+        mBuffers = (unsigned char*) malloc(mSize * mBufferSize);
+    }
+    catch (const bad_alloc&)
+    {
+        mBuffers = nullptr;
+    }
+    if (!mBuffers)
+    {
+        ReportError("Failed to allocate %u send buffers of %zu bytes", mSize, mBufferSize);
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::~SendBatch()
+//  Description: Destructor. Anything still queued is dropped.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SendBatch::~SendBatch()
+{
+    if (mBuffers)
+    {
+        free(mBuffers);
+        mBuffers = nullptr;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::Queue()
+//  Description: Copy a datagram into the batch. Flushes first if the batch is
+//               already full.
+//       Inputs: inData (IN) datagram data. Will be copied.
+//               inLen (IN) datagram length
+//               inTo (IN) destination address
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int SendBatch::Queue(const unsigned char *inData, size_t inLen,
+                     const struct sockaddr *inTo)
+{
+    if (inLen > mBufferSize)
+    {
+        ReportError("Datagram too large to batch (%d bytes), discarded.", (int)inLen);
+        return -1;
+    }
+
+    if (mCount == mSize)
+        Flush();
+
+    if (mCount == 0)
+        mOldestQueued = chrono::steady_clock::now();
+
+    unsigned char *buffer = mBuffers + mCount * mBufferSize;
+    memcpy(buffer, inData, inLen);
+    memcpy(&mAddrs[mCount], inTo, SocketAddress::Length(inTo));
+    mIovecs[mCount].iov_base = buffer;
+    mIovecs[mCount].iov_len = inLen;
+    ++mCount;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::Flush()
+//  Description: Send everything queued, one message per datagram or, with GSO
+//               on, per run of datagrams grouped by GroupGSO().
+//      Returns: Non-zero if any datagram failed to send.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int SendBatch::Flush()
+{
+    if (mCount == 0)
+        return 0;
+
+    unsigned int msgCount = mCount;
+    if (mGSO)
+        msgCount = GroupGSO();
+    else
+    {
+        for (unsigned int i = 0; i < mCount; ++i)
+        {
+            memset(&mMsgs[i], 0, sizeof(struct mmsghdr));
+            mMsgs[i].msg_hdr.msg_iov = &mIovecs[i];
+            mMsgs[i].msg_hdr.msg_iovlen = 1;
+            mMsgs[i].msg_hdr.msg_name = &mAddrs[i];
+            mMsgs[i].msg_hdr.msg_namelen = SocketAddress::Length((struct sockaddr*)&mAddrs[i]);
+        }
+    }
+
+    int rc = SendMessages(msgCount);
+    mCount = 0;
+    return rc;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::SendMessages()
+//  Description: sendmmsg() the prepared messages. It may stop short, so we keep
+//               going until all are out. A message that fails outright is
+//               reported and skipped.
+//       Inputs: inMsgCount (IN) number of messages in mMsgs
+//      Returns: Non-zero if any message failed to send.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int SendBatch::SendMessages(unsigned int inMsgCount)
+{
+    int rc = 0;
+    unsigned int sent = 0;
+    while (sent < inMsgCount)
+    {
+        int nsent = sendmmsg(mSocket, &mMsgs[sent], inMsgCount - sent, 0);
+        if (nsent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ReportError("sendmmsg failed (socket: %d, errno: %d)", mSocket, errno);
+            rc = -1;
+            nsent = 1;
+        }
+        else
+        {
+            mServer->mStats.Add(STATS_SEND_BATCHES);
+            for (int i = 0; i < nsent; ++i)
+            {
+                int segments = (int)mMsgs[sent + i].msg_hdr.msg_iovlen;
+                mServer->mStats.Add(STATS_SEND_DATAGRAMS, segments);
+                if (segments > 1)
+                {
+                    mServer->mStats.Add(STATS_GSO_SENDS);
+                    mServer->mStats.Add(STATS_GSO_SEGMENTS, segments);
+                }
+            }
+        }
+        sent += nsent;
+    }
+    return rc;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::GroupGSO()
+//  Description: Build the messages for a GSO flush. Each queued datagram starts
+//               a message (unless an earlier one took it) and pulls in the
+//               later datagrams to the same destination while they have the
+//               same length; a shorter one may end the run, since the kernel
+//               allows the last segment to be short. A longer one ends it
+//               without being taken, so per destination the send order is
+//               unchanged. Messages of more than one datagram carry a
+//               UDP_SEGMENT cmsg with the segment size.
+//      Returns: Number of messages in mMsgs.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unsigned int SendBatch::GroupGSO()
+{
+    size_t controlSize = CMSG_SPACE(sizeof(uint16_t));
+    memset(&mGSOGrouped[0], 0, mCount);
+
+    unsigned int msgCount = 0;
+    unsigned int iovCount = 0;
+    for (unsigned int i = 0; i < mCount; ++i)
+    {
+        if (mGSOGrouped[i])
+            continue;
+
+        struct sockaddr *to = (struct sockaddr*)&mAddrs[i];
+        size_t segSize = mIovecs[i].iov_len;
+        size_t total = segSize;
+        unsigned int first = iovCount;
+        mGSOIovecs[iovCount++] = mIovecs[i];
+        mGSOGrouped[i] = 1;
+
+        if (segSize <= GSO_MAX_SEGMENT_SIZE)
+        {
+            for (unsigned int j = i + 1; j < mCount; ++j)
+            {
+                if (mGSOGrouped[j] || !SocketAddress::Equal(to, (struct sockaddr*)&mAddrs[j]))
+                    continue;
+                size_t len = mIovecs[j].iov_len;
+                if (len > segSize || total + len > GSO_MAX_BYTES ||
+                    iovCount - first == GSO_MAX_SEGMENTS)
+                    break;
+                mGSOIovecs[iovCount++] = mIovecs[j];
+                mGSOGrouped[j] = 1;
+                total += len;
+                if (len < segSize)
+                    break;
+            }
+        }
+
+        struct msghdr *hdr = &mMsgs[msgCount].msg_hdr;
+        memset(&mMsgs[msgCount], 0, sizeof(struct mmsghdr));
+        hdr->msg_iov = &mGSOIovecs[first];
+        hdr->msg_iovlen = iovCount - first;
+        hdr->msg_name = to;
+        hdr->msg_namelen = SocketAddress::Length(to);
+        if (hdr->msg_iovlen > 1)
+        {
+            hdr->msg_control = &mGSOControl[msgCount * controlSize];
+            hdr->msg_controllen = controlSize;
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            uint16_t gsoSize = (uint16_t)segSize;
+            memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+        }
+        ++msgCount;
+    }
+    return msgCount;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::FlushDue()
+//  Description: Check the flush deadline.
+//      Returns: True if the oldest queued datagram has waited long enough.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool SendBatch::FlushDue()
+{
+    if (mCount == 0)
+        return false;
+    long waitedUS = chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now() - mOldestQueued).count();
+    return waitedUS >= mFlushUS;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SendBatch::GSOSupported()
+//  Description: Probe the kernel for UDP_SEGMENT (Linux 4.18+.)
+//      Returns: True if UDP GSO can be used.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool SendBatch::GSOSupported()
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return false;
+    int segSize = GSO_MAX_SEGMENT_SIZE;
+    bool supported = setsockopt(sock, SOL_UDP, UDP_SEGMENT, &segSize, sizeof(segSize)) == 0;
+    close(sock);
+    return supported;
+}
+
@@ -0,0 +1,139 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Batch.h
+//
+// Desc: Batched UDP receive/send (recvmmsg/sendmmsg) helpers, with optional
+//       UDP GRO/GSO segmentation offload.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef BATCH_H
+#define BATCH_H
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <vector>
+#include <chrono>
+
+using namespace std;
+
+class Server;
+
+
+//################################################################################
+//##
+//## Class: RecvBatch
+//##
+//##  Desc: Receives up to N datagrams per recvmmsg() call into a preallocated
+//##        ring of buffers. The buffers are reused by every call, so the data
+//##        must be copied out before the next Receive().
+//##
+//##        With UDP_GRO on the socket the kernel may hand back several
+//##        datagrams from one sender glued together; they are split again
+//##        here, so callers always see single datagrams.
+//##
+//################################################################################
+
+class RecvBatch
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    RecvBatch(Server *inServer, unsigned int inSize, size_t inBufferSize);
+    virtual ~RecvBatch();
+
+    //
+    // Public member functions
+    //
+    int                     Setup();
+    int                     Receive(int inSocket, int inFlags);
+    unsigned char*          GetData(int inIndex) { return mSegments[inIndex].mData; }
+    size_t                  GetLen(int inIndex) { return mSegments[inIndex].mLen; }
+    struct sockaddr*        GetFrom(int inIndex) { return (struct sockaddr*)&mAddrs[mSegments[inIndex].mMsg]; }
+
+    //
+    // Protected data
+    //
+protected:
+    struct RecvSegment
+    {
+        unsigned char           *mData;
+        size_t                  mLen;
+        unsigned int            mMsg;       // recvmmsg() message it came in
+    };
+
+    Server                      *mServer;
+    unsigned int                mSize;
+    size_t                      mBufferSize;
+    bool                        mGRO;
+    unsigned char               *mBuffers;
+    vector<struct mmsghdr>      mMsgs;
+    vector<struct iovec>        mIovecs;
+    vector<struct sockaddr_storage> mAddrs;
+    vector<unsigned char>       mControl;   // UDP_GRO cmsg space per message
+    vector<RecvSegment>         mSegments;  // The datagrams of the last Receive()
+};
+
+
+//################################################################################
+//##
+//## Class: SendBatch
+//##
+//##  Desc: Queues outgoing datagrams for one socket and sends them with a single
+//##        sendmmsg() call. The owner flushes when the batch is full, before it
+//##        blocks, or once the oldest queued datagram passes the flush deadline.
+//##
+//##        With GSO on, runs of same sized datagrams to the same destination
+//##        go out as one UDP_SEGMENT message, which the kernel (or NIC) splits
+//##        after one trip through the UDP stack.
+//##
+//################################################################################
+
+class SendBatch
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    SendBatch(Server *inServer, int inSocket, unsigned int inSize,
+              size_t inBufferSize, unsigned int inFlushUS);
+    virtual ~SendBatch();
+
+    //
+    // Public member functions
+    //
+    int                     Setup();
+    int                     Queue(const unsigned char *inData, size_t inLen,
+                                  const struct sockaddr *inTo);
+    int                     Flush();
+    bool                    FlushDue();
+    bool                    Empty() { return mCount == 0; }
+    static bool             GSOSupported();
+
+    //
+    // Protected data
+    //
+protected:
+    Server                      *mServer;
+    int                         mSocket;
+    unsigned int                mSize;
+    size_t                      mBufferSize;
+    unsigned int                mFlushUS;
+    unsigned int                mCount;
+    bool                        mGSO;
+    unsigned char               *mBuffers;
+    vector<struct mmsghdr>      mMsgs;
+    vector<struct iovec>        mIovecs;
+    vector<struct sockaddr_storage> mAddrs;
+    vector<struct iovec>        mGSOIovecs;     // mIovecs regrouped by message
+    vector<unsigned char>       mGSOControl;    // UDP_SEGMENT cmsg space per message
+    vector<unsigned char>       mGSOGrouped;    // Datagram already in a message
+    chrono::steady_clock::time_point mOldestQueued;
+
+    int                         SendMessages(unsigned int inMsgCount);
+    unsigned int                GroupGSO();
+};
+
+
+#endif
+
@@ -0,0 +1,176 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: CoTask.cpp
+//
+// Desc: Fire and forget C++20 coroutine task with pooled frames.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <stdlib.h>
+#include <new>
+#include "CoTask.h"
+#include "Error.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: FramePool
+//##
+//##  Desc: Per thread size class free lists for coroutine frames.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: FramePool::FramePool()
+//  Description: Constructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+FramePool::FramePool()
+: mStatsFrames(0),
+  mStatsHeapFrames(0),
+  mStatsLive(0),
+  mStatsPeakLive(0),
+  mStatsChunks(0),
+  mChunkNext(nullptr),
+  mChunkLeft(0)
+{
+    for (unsigned int i = 0; i < kClasses; ++i)
+        mFreeLists[i] = nullptr;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: FramePool::~FramePool()
+//  Description: Destructor. Gives the chunks back, any frame still in one is
+//               gone with it.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+FramePool::~FramePool()
+{
+    for (auto chunk : mChunks)
+        free(chunk);
+    mChunks.clear();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: FramePool::Get()
+//  Description: The calling thread's pool.
+//      Returns: The pool.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+FramePool& FramePool::Get()
+{
+    static thread_local FramePool sPool;
+    return sPool;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: FramePool::Allocate()
+//  Description: Allocate a frame. It comes off the free list of its size class,
+//               or is carved out of the current chunk when that list is empty.
+//       Inputs: inSize (IN) frame size
+//      Returns: The frame. Throws bad_alloc when out of memory.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void* FramePool::Allocate(size_t inSize)
+{
+    ++mStatsFrames;
+    if (++mStatsLive > mStatsPeakLive)
+        mStatsPeakLive = mStatsLive;
+
+    if (inSize == 0 || inSize > FRAME_POOL_MAX_SIZE)
+    {
+        ++mStatsHeapFrames;
+        return ::operator new(inSize);
+    }
+
+    unsigned int sizeClass = (unsigned int)((inSize - 1) / FRAME_POOL_GRAIN);
+    FreeFrame *frame = mFreeLists[sizeClass];
+    if (frame)
+    {
+        mFreeLists[sizeClass] = frame->mNext;
+        return frame;
+    }
+
+    // Nothing to reuse, carve it (what is left of the old chunk is wasted)
+    size_t frameSize = (size_t)(sizeClass + 1) * FRAME_POOL_GRAIN;
+    if (mChunkLeft < frameSize)
+    {
+        unsigned char *chunk = (unsigned char*) malloc(FRAME_POOL_CHUNK_SIZE);
+        if (!chunk)
+        {
+            --mStatsLive;
+            ReportError("Out of memory for coroutine frames");
+            throw bad_alloc();
+        }
+        mChunks.push_back(chunk);
+        ++mStatsChunks;
+        mChunkNext = chunk;
+        mChunkLeft = FRAME_POOL_CHUNK_SIZE;
+    }
+    void *carved = mChunkNext;
+    mChunkNext += frameSize;
+    mChunkLeft -= frameSize;
+    return carved;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: FramePool::Free()
+//  Description: Free a frame, onto the free list of its size class.
+//       Inputs: inFrame (IN) the frame
+//               inSize (IN) the size it was allocated with
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void FramePool::Free(void *inFrame, size_t inSize)
+{
+    --mStatsLive;
+    if (inSize == 0 || inSize > FRAME_POOL_MAX_SIZE)
+    {
+        ::operator delete(inFrame);
+        return;
+    }
+
+    unsigned int sizeClass = (unsigned int)((inSize - 1) / FRAME_POOL_GRAIN);
+    FreeFrame *frame = (FreeFrame*) inFrame;
+    frame->mNext = mFreeLists[sizeClass];
+    mFreeLists[sizeClass] = frame;
+}
+
+
+//################################################################################
+//##
+//## Class: CoTask
+//##
+//##  Desc: Fire and forget coroutine task.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: CoTask::promise_type::unhandled_exception()
+//  Description: An exception got out of the coroutine. There's nobody to hand
+//               it to, so it is reported and the coroutine ends (its frame is
+//               freed as if it had returned.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void CoTask::promise_type::unhandled_exception()
+{
+    ReportError("Caught exception in a coroutine");
+}
@@ -0,0 +1,110 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: CoTask.h
+//
+// Desc: Fire and forget C++20 coroutine task with pooled frames.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef CO_TASK_H
+#define CO_TASK_H
+#include <stddef.h>
+#include <stdint.h>
+#include <coroutine>
+#include <vector>
+
+using namespace std;
+
+#define FRAME_POOL_GRAIN        64                  /* Frame sizes are rounded up to this */
+#define FRAME_POOL_MAX_SIZE     4096                /* Bigger frames come from the heap */
+#define FRAME_POOL_CHUNK_SIZE   (64 * 1024)         /* Frames are carved out of chunks this big */
+
+
+//################################################################################
+//##
+//## Class: FramePool
+//##
+//##  Desc: Allocator for coroutine frames. Every query runs as a coroutine, so
+//##        a frame is allocated and freed per query; here that is popping and
+//##        pushing a free list of the frame's size class instead of a trip
+//##        through malloc. Memory is carved out of chunks that are only given
+//##        back when the pool goes away.
+//##
+//##        There is one pool per thread (see Get()) and no locking: a frame
+//##        has to be freed on the thread that allocated it, which holds as
+//##        long as coroutines are only ever resumed by the thread running
+//##        them.
+//##
+//################################################################################
+
+class FramePool
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    FramePool();
+    virtual ~FramePool();
+
+    //
+    // Public member functions
+    //
+    void*               Allocate(size_t inSize);
+    void                Free(void *inFrame, size_t inSize);
+    static FramePool&   Get();
+
+    //
+    // Public data (statistics)
+    //
+    uint64_t            mStatsFrames;       // Frames allocated
+    uint64_t            mStatsHeapFrames;   // Of those, too big for the pool
+    size_t              mStatsLive;         // Frames allocated right now
+    size_t              mStatsPeakLive;
+    size_t              mStatsChunks;       // Chunks carved so far
+
+    //
+    // Protected data
+    //
+protected:
+    struct FreeFrame
+    {
+        FreeFrame       *mNext;
+    };
+
+    enum { kClasses = FRAME_POOL_MAX_SIZE / FRAME_POOL_GRAIN };
+
+    FreeFrame           *mFreeLists[kClasses];
+    vector<unsigned char*> mChunks;
+    unsigned char       *mChunkNext;        // Uncarved part of the newest chunk
+    size_t              mChunkLeft;
+};
+
+
+//################################################################################
+//##
+//## Class: CoTask
+//##
+//##  Desc: Return type of a coroutine that is started and then left to run on
+//##        its own. It starts right away, runs until its first co_await that
+//##        has to wait, and frees its frame when it finishes. Whatever it
+//##        waits on resumes it. Nothing can co_await a CoTask itself.
+//##
+//################################################################################
+
+class CoTask
+{
+public:
+    struct promise_type
+    {
+        CoTask              get_return_object() { return CoTask(); }
+        suspend_never       initial_suspend() noexcept { return suspend_never(); }
+        suspend_never       final_suspend() noexcept { return suspend_never(); }
+        void                return_void() { }
+        void                unhandled_exception();
+
+        static void*        operator new(size_t inSize) { return FramePool::Get().Allocate(inSize); }
+        static void         operator delete(void *inFrame, size_t inSize) { FramePool::Get().Free(inFrame, inSize); }
+    };
+};
+
+
+#endif
@@ -6,6 +6,9 @@
 //
 //////////////////////////////////////////////////////////////////////////////////
 #include <stdlib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
 #include <iostream>
 #include "Error.h"
 
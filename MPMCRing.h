@@ -0,0 +1,238 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: MPMCRing.h
+//
+// Desc: Bounded lock-free multi-producer/multi-consumer ring of pointers.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef MPMC_RING_H
+#define MPMC_RING_H
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <vector>
+
+using namespace std;
+
+#define MPMC_CACHE_LINE     64
+
+
+//################################################################################
+//##
+//## Class: MPMCRing
+//##
+//##  Desc: Fixed size ring of T* (a power of 2 slots). Every slot carries a
+//##        sequence number that says whether it is free for the producer at
+//##        that position or filled for the consumer at it, so producers and
+//##        consumers only ever contend on their own position counter, with a
+//##        single CAS per push or pop. The batch calls claim several
+//##        consecutive slots with that one CAS. The two counters are kept on
+//##        cache lines of their own. The ring never owns what it holds.
+//##
+//################################################################################
+
+template <class T>
+class MPMCRing
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    MPMCRing(size_t inCapacity);
+    virtual ~MPMCRing() { }
+
+    //
+    // Public member functions
+    //
+    bool                    Push(T *inItem) { return PushBatch(&inItem, 1) == 1; }
+    T*                      Pop() { T *item = nullptr; PopBatch(&item, 1); return item; }
+    size_t                  PushBatch(T * const *inItems, size_t inCount);
+    size_t                  PopBatch(T **outItems, size_t inMax);
+    size_t                  GetCapacity() { return mMask + 1; }
+    size_t                  GetSize();
+
+    //
+    // Protected data
+    //
+protected:
+    struct Slot
+    {
+        atomic<size_t>      mSequence;
+        T                   *mItem;
+    };
+
+    static size_t           RoundCapacity(size_t inCapacity);
+
+    vector<Slot>            mSlots;
+    size_t                  mMask;
+    char                    mPad0[MPMC_CACHE_LINE];
+    atomic<size_t>          mPushPos;
+    char                    mPad1[MPMC_CACHE_LINE - sizeof(size_t)];
+    atomic<size_t>          mPopPos;
+    char                    mPad2[MPMC_CACHE_LINE - sizeof(size_t)];
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: MPMCRing::MPMCRing()
+//  Description: Constructor.
+//       Inputs: inCapacity (IN) slots, rounded up to a power of 2
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+MPMCRing<T>::MPMCRing(size_t inCapacity)
+: mSlots(RoundCapacity(inCapacity)),
+  mMask(mSlots.size() - 1),
+  mPushPos(0),
+  mPopPos(0)
+{
+    for (size_t i = 0; i < mSlots.size(); ++i)
+    {
+        mSlots[i].mSequence.store(i, memory_order_relaxed);
+        mSlots[i].mItem = nullptr;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: MPMCRing::RoundCapacity()
+//  Description: Round a capacity up to a power of 2 (at least 2.)
+//       Inputs: inCapacity (IN) requested slots
+//      Returns: The slot count to use.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+size_t MPMCRing<T>::RoundCapacity(size_t inCapacity)
+{
+    size_t capacity = 2;
+    while (capacity < inCapacity)
+        capacity <<= 1;
+    return capacity;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: MPMCRing::PushBatch()
+//  Description: Add up to inCount items, in order. A slot at position pos is
+//               free for us when its sequence is pos.
+//       Inputs: inItems (IN) the items
+//               inCount (IN) number of items
+//      Returns: How many were added (from the front), fewer if the ring filled.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+size_t MPMCRing<T>::PushBatch(T * const *inItems, size_t inCount)
+{
+    size_t pos = mPushPos.load(memory_order_relaxed);
+    while (inCount)
+    {
+        size_t count = 0;
+        intptr_t diff = 0;
+        while (count < inCount)
+        {
+            size_t seq = mSlots[(pos + count) & mMask].mSequence.load(memory_order_acquire);
+            diff = (intptr_t)seq - (intptr_t)(pos + count);
+            if (diff != 0)
+                break;
+            ++count;
+        }
+
+        if (count == 0)
+        {
+            if (diff < 0)
+                return 0;   // Full
+            pos = mPushPos.load(memory_order_relaxed);
+            continue;       // Another producer got there first
+        }
+
+        if (mPushPos.compare_exchange_weak(pos, pos + count, memory_order_relaxed))
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                Slot &slot = mSlots[(pos + i) & mMask];
+                slot.mItem = inItems[i];
+                slot.mSequence.store(pos + i + 1, memory_order_release);
+            }
+            return count;
+        }
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: MPMCRing::PopBatch()
+//  Description: Take up to inMax items, in order. A slot at position pos is
+//               filled for us when its sequence is pos + 1.
+//       Inputs: outItems (OUT) the items
+//               inMax (IN) room in outItems
+//      Returns: How many were taken, 0 if the ring is empty.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+size_t MPMCRing<T>::PopBatch(T **outItems, size_t inMax)
+{
+    size_t pos = mPopPos.load(memory_order_relaxed);
+    while (inMax)
+    {
+        size_t count = 0;
+        intptr_t diff = 0;
+        while (count < inMax)
+        {
+            size_t seq = mSlots[(pos + count) & mMask].mSequence.load(memory_order_acquire);
+            diff = (intptr_t)seq - (intptr_t)(pos + count + 1);
+            if (diff != 0)
+                break;
+            ++count;
+        }
+
+        if (count == 0)
+        {
+            if (diff < 0)
+                return 0;   // Empty
+            pos = mPopPos.load(memory_order_relaxed);
+            continue;       // Another consumer got there first
+        }
+
+        if (mPopPos.compare_exchange_weak(pos, pos + count, memory_order_relaxed))
+        {
+            for (size_t i = 0; i < count; ++i)
+            {
+                Slot &slot = mSlots[(pos + i) & mMask];
+                outItems[i] = slot.mItem;
+                slot.mSequence.store(pos + i + mMask + 1, memory_order_release);
+            }
+            return count;
+        }
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: MPMCRing::GetSize()
+//  Description: Items in the ring right now. Only a snapshot while other
+//               threads are pushing and popping.
+//      Returns: The count.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+template <class T>
+size_t MPMCRing<T>::GetSize()
+{
+    size_t popPos = mPopPos.load(memory_order_relaxed);
+    size_t pushPos = mPushPos.load(memory_order_relaxed);
+    return pushPos > popPos ? pushPos - popPos : 0;
+}
+
+
+#endif
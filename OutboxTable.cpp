@@ -0,0 +1,262 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: OutboxTable.cpp
+//
+// Desc: Lock-free table of the Requests waiting on the remote DNS server.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include "OutboxTable.h"
+#include "Request.h"
+#include "Stats.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: OutboxTable
+//##
+//##  Desc: Generation tagged slots, one CAS per state change.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::OutboxTable()
+//  Description: Constructor.
+//       Inputs: inStats (IN) where to count stale replies and evictions
+//               inFwdCount (IN) forward sockets, each gets its slots
+//               inSlotBits (IN) packet ID bits used for a socket's slot index
+//                   (1-16), the rest carry the generation
+//               inConnCount (IN) upstream TCP connections, forward indexes
+//                   after the sockets'
+//               inConnSlotBits (IN) the same for a connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+OutboxTable::OutboxTable(Stats *inStats, unsigned int inFwdCount, unsigned int inSlotBits,
+                         unsigned int inConnCount, unsigned int inConnSlotBits)
+: mStats(inStats),
+  mSlotTotal(0)
+{
+    unsigned int fwdTotal = inFwdCount + inConnCount;
+    mForwards.reset(new Forward[fwdTotal]);
+    for (unsigned int i = 0; i < fwdTotal; ++i)
+    {
+        unsigned int bits = i < inFwdCount ? inSlotBits : inConnSlotBits;
+        Forward &fwd = mForwards[i];
+        fwd.mFirst = mSlotTotal;
+        fwd.mSlotBits = bits < 1 ? 1 : (bits > 16 ? 16 : bits);
+        fwd.mSlotMask = (1u << fwd.mSlotBits) - 1;
+        fwd.mGenMask = (1u << (16 - fwd.mSlotBits)) - 1;
+        fwd.mCursor.store(0, memory_order_relaxed);
+        mSlotTotal += (size_t) fwd.mSlotMask + 1;
+    }
+
+    mSlots.reset(new Slot[mSlotTotal]);
+    for (size_t i = 0; i < mSlotTotal; ++i)
+    {
+        mSlots[i].mState.store(kSlotFree, memory_order_relaxed);
+        mSlots[i].mReq.store(nullptr, memory_order_relaxed);
+        mSlots[i].mTimer.store(0, memory_order_relaxed);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::~OutboxTable()
+//  Description: Destructor. Deletes the Requests still in flight, nothing else
+//               may be using the table by now.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+OutboxTable::~OutboxTable()
+{
+    for (size_t i = 0; i < mSlotTotal; ++i)
+    {
+        if ((mSlots[i].mState.load() & kStateMask) == kSlotInFlight)
+            delete mSlots[i].mReq.load();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::Reserve()
+//  Description: Take a free slot of a forward socket and start its next
+//               generation. If every slot is in flight the one at the cursor
+//               is taken over and its Request handed back to be dropped.
+//       Inputs: inFwdIndex (IN) the forward socket/connection
+//               outEvicted (OUT) the Request that lost its slot, if any
+//      Returns: The packet ID to send with, Publish() or Release() it after.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unsigned short OutboxTable::Reserve(unsigned short inFwdIndex, unique_ptr<Request> &outEvicted)
+{
+    Forward &fwd = mForwards[inFwdIndex];
+
+    // A lap around the slots looking for a free one
+    for (unsigned int tries = 0; tries <= fwd.mSlotMask; ++tries)
+    {
+        unsigned int index = fwd.mCursor.fetch_add(1, memory_order_relaxed) & fwd.mSlotMask;
+        Slot *slot = GetSlot(inFwdIndex, (unsigned short) index);
+        uint64_t state = slot->mState.load(memory_order_acquire);
+        if ((state & kStateMask) != kSlotFree)
+            continue;
+        uint64_t generation = (state >> kStateBits) + 1;
+        if (slot->mState.compare_exchange_strong(state, (generation << kStateBits) | kSlotReserved,
+                                                 memory_order_acq_rel))
+            return MakeID(fwd, index, generation);
+    }
+
+    // Full: evict the next Request in flight (claims race us for it like a timeout)
+    for (;;)
+    {
+        unsigned int index = fwd.mCursor.fetch_add(1, memory_order_relaxed) & fwd.mSlotMask;
+        Slot *slot = GetSlot(inFwdIndex, (unsigned short) index);
+        uint64_t state = slot->mState.load(memory_order_acquire);
+        if ((state & kStateMask) == kSlotReserved)
+            continue;
+        Request *req = slot->mReq.load(memory_order_relaxed);
+        uint64_t generation = (state >> kStateBits) + 1;
+        if (slot->mState.compare_exchange_strong(state, (generation << kStateBits) | kSlotReserved,
+                                                 memory_order_acq_rel))
+        {
+            if ((state & kStateMask) == kSlotInFlight)
+            {
+                outEvicted.reset(req);
+                mStats->Add(STATS_OUTBOX_EVICTIONS);
+            }
+            return MakeID(fwd, index, generation);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::Release()
+//  Description: Give back a reserved slot that never got a Request.
+//       Inputs: inFwdIndex (IN) the forward socket/connection
+//               inID (IN) the packet ID Reserve() returned
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void OutboxTable::Release(unsigned short inFwdIndex, unsigned short inID)
+{
+    Slot *slot = GetSlot(inFwdIndex, inID);
+    uint64_t state = slot->mState.load(memory_order_relaxed);
+    slot->mState.store((state & ~(uint64_t)kStateMask) | kSlotFree, memory_order_release);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::Publish()
+//  Description: Put a Request into the slot reserved for it. Its mFwdIndex and
+//               mOurPacketID say which. From here on replies and its timer can
+//               claim it.
+//       Inputs: inReq (IN) the Request
+//               inTimer (IN) its timeout timer, handed back by Claim()
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void OutboxTable::Publish(unique_ptr<Request> inReq, uint64_t inTimer)
+{
+    Slot *slot = GetSlot(inReq->mFwdIndex, inReq->mOurPacketID);
+    uint64_t state = slot->mState.load(memory_order_relaxed);
+    slot->mReq.store(inReq.release(), memory_order_relaxed);
+    slot->mTimer.store(inTimer, memory_order_relaxed);
+    slot->mState.store((state & ~(uint64_t)kStateMask) | kSlotInFlight, memory_order_release);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::Claim()
+//  Description: Take the Request a reply is for. The pointer is read before the
+//               CAS and only trusted if the CAS shows the slot didn't change
+//               in between.
+//       Inputs: inFwdIndex (IN) the forward socket/connection it came in on
+//               inID (IN) the packet ID of the reply
+//               outTimer (OUT) the Request's timer, for the caller to cancel
+//      Returns: The Request, or nullptr if it timed out, was answered already or
+//               the reply is for an earlier generation of the slot.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unique_ptr<Request> OutboxTable::Claim(unsigned short inFwdIndex, unsigned short inID, uint64_t &outTimer)
+{
+    Slot *slot = GetSlot(inFwdIndex, inID);
+    uint64_t state = slot->mState.load(memory_order_acquire);
+    if ((state & kStateMask) != kSlotInFlight)
+        return nullptr;
+    Forward &fwd = mForwards[inFwdIndex];
+    if (MakeID(fwd, inID & fwd.mSlotMask, state >> kStateBits) != inID)
+    {
+        mStats->Add(STATS_OUTBOX_STALE_REPLIES);
+        return nullptr;
+    }
+
+    Request *req = slot->mReq.load(memory_order_relaxed);
+    uint64_t timer = slot->mTimer.load(memory_order_relaxed);
+    if (!slot->mState.compare_exchange_strong(state, (state & ~(uint64_t)kStateMask) | kSlotFree,
+                                              memory_order_acq_rel))
+        return nullptr;
+    outTimer = timer;
+    return unique_ptr<Request>(req);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::ClaimTimer()
+//  Description: Take the Request whose timeout timer fired. A timer that lost
+//               the race to a reply finds the slot free, or holding a newer
+//               Request with another timer, and leaves it alone.
+//       Inputs: inFwdIndex (IN) the forward socket/connection
+//               inID (IN) the packet ID of the Request
+//               inTimer (IN) the timer that fired
+//      Returns: The Request, or nullptr if it isn't there anymore.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unique_ptr<Request> OutboxTable::ClaimTimer(unsigned short inFwdIndex, unsigned short inID, uint64_t inTimer)
+{
+    Slot *slot = GetSlot(inFwdIndex, inID);
+    uint64_t state = slot->mState.load(memory_order_acquire);
+    if ((state & kStateMask) != kSlotInFlight)
+        return nullptr;
+    if (slot->mTimer.load(memory_order_relaxed) != inTimer)
+        return nullptr;
+
+    Request *req = slot->mReq.load(memory_order_relaxed);
+    if (!slot->mState.compare_exchange_strong(state, (state & ~(uint64_t)kStateMask) | kSlotFree,
+                                              memory_order_acq_rel))
+        return nullptr;
+    return unique_ptr<Request>(req);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: OutboxTable::GetInFlight()
+//  Description: Count the Requests waiting on a reply. Walks every slot, so it
+//               is for shutdown and statistics, not the forwarding path.
+//      Returns: The count, a snapshot while other threads are at work.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t OutboxTable::GetInFlight()
+{
+    size_t count = 0;
+    for (size_t i = 0; i < mSlotTotal; ++i)
+    {
+        if ((mSlots[i].mState.load() & kStateMask) == kSlotInFlight)
+            ++count;
+    }
+    return count;
+}
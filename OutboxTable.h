@@ -0,0 +1,106 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: OutboxTable.h
+//
+// Desc: Lock-free table of the Requests waiting on the remote DNS server.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef OUTBOX_TABLE_H
+#define OUTBOX_TABLE_H
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+
+using namespace std;
+
+class Request;
+class Stats;
+
+
+//################################################################################
+//##
+//## Class: OutboxTable
+//##
+//##  Desc: Slots for the Requests in flight, a power of 2 of them for every
+//##        forward socket/connection. The packet ID we send is the slot index
+//##        in the low bits and the slot's generation in the high bits, so a
+//##        late reply to an earlier user of a slot fails the generation check
+//##        instead of answering whoever holds the slot now. The forward
+//##        sockets and the upstream TCP connections after them are sized
+//##        separately: a connection has a packet ID space of its own and can
+//##        use all of it.
+//##
+//##        Each slot has one atomic state word (generation and state) and every
+//##        change to it is a single CAS: Reserve() takes a free slot and bumps
+//##        the generation, Publish() hands it the Request and its timeout
+//##        timer, and Claim() (a reply) or ClaimTimer() (the timer firing)
+//##        take the Request back out. Only one of the claims can win, nobody
+//##        ever waits on a lock, and the loser just sees the slot is gone.
+//##
+//################################################################################
+
+class OutboxTable
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    OutboxTable(Stats *inStats, unsigned int inFwdCount, unsigned int inSlotBits,
+                unsigned int inConnCount, unsigned int inConnSlotBits);
+    virtual ~OutboxTable();
+
+    //
+    // Public member functions
+    //
+    unsigned short          Reserve(unsigned short inFwdIndex, unique_ptr<Request> &outEvicted);
+    void                    Release(unsigned short inFwdIndex, unsigned short inID);
+    void                    Publish(unique_ptr<Request> inReq, uint64_t inTimer);
+    unique_ptr<Request>     Claim(unsigned short inFwdIndex, unsigned short inID, uint64_t &outTimer);
+    unique_ptr<Request>     ClaimTimer(unsigned short inFwdIndex, unsigned short inID, uint64_t inTimer);
+    unsigned int            GetSlotCount(unsigned short inFwdIndex)
+                                { return mForwards[inFwdIndex].mSlotMask + 1; }
+    size_t                  GetInFlight();
+
+    //
+    // Protected data
+    //
+protected:
+    enum
+    {
+        kSlotFree = 0,
+        kSlotReserved = 1,
+        kSlotInFlight = 2,
+        kStateBits = 2,
+        kStateMask = 3
+    };
+
+    struct Slot
+    {
+        atomic<uint64_t>    mState;     // (generation << kStateBits) | kSlot*
+        atomic<Request*>    mReq;       // Valid while kSlotInFlight
+        atomic<uint64_t>    mTimer;     // Valid while kSlotInFlight (see TimerWheel)
+    };
+
+    struct Forward
+    {
+        size_t              mFirst;     // Its first slot in mSlots
+        unsigned int        mSlotBits;
+        unsigned int        mSlotMask;
+        unsigned int        mGenMask;   // Generation bits that fit in the packet ID
+        atomic_uint         mCursor;    // Next slot to try
+    };
+
+    Slot*                   GetSlot(unsigned short inFwdIndex, unsigned short inID)
+                                { Forward &fwd = mForwards[inFwdIndex];
+                                  return &mSlots[fwd.mFirst + (inID & fwd.mSlotMask)]; }
+    unsigned short          MakeID(Forward &inFwd, unsigned int inSlot, uint64_t inGeneration)
+                                { return (unsigned short)(((inGeneration & inFwd.mGenMask) << inFwd.mSlotBits) | inSlot); }
+
+    Stats                       *mStats;
+    unique_ptr<Slot[]>          mSlots;
+    unique_ptr<Forward[]>       mForwards;
+    size_t                      mSlotTotal;
+};
+
+
+#endif
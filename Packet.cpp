@@ -6,6 +6,9 @@
 //
 //////////////////////////////////////////////////////////////////////////////////
 #include <arpa/inet.h>
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
 #include <iostream>
 #include "Error.h"
 #include "Packet.h"
@@ -280,6 +283,47 @@ int DNSPacket::EncodeAddrStr(
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::SkipName()
+//  Description: Step over a name in a resource record. Unlike the question
+//               name these may end in a compression pointer.
+//       Inputs: ioData (IN/OUT) data buffer
+//               ioDataLen (IN/OUT) data buffer length
+//      Outputs: Non-zero on error.
+//          Notes: Static.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::SkipName(unsigned char *&ioData, size_t &ioDataLen)
+{
+    while (ioDataLen >= 1)
+    {
+        unsigned char sectionLen = *ioData;
+        if (sectionLen == 0)
+        {
+            ++ioData;
+            --ioDataLen;
+            return 0;
+        }
+        if ((sectionLen & 0xC0) == 0xC0)
+        {
+            // Pointer, the name ends here
+            if (ioDataLen < 2)
+                return -1;
+            ioData += 2;
+            ioDataLen -= 2;
+            return 0;
+        }
+        if (ioDataLen < 1 + (size_t)sectionLen)
+            return -1;
+        ioData += 1 + sectionLen;
+        ioDataLen -= 1 + sectionLen;
+    }
+    return -1;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////
 //
 //     Function: DNSPacket::Print()
@@ -386,4 +430,395 @@ int DNSPacket::GetRawPacketID(unsigned short& outID)
 }
 
 
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::Truncate()
+//  Description: Cut the raw packet down to its header and question (and the
+//               EDNS0 OPT record, if any) and set the TC bit, for a reply too
+//               large for the client's transport. The client is expected to
+//               retry over TCP.
+//       Inputs: inQuery (IN) the query this replies to, or nullptr. If the
+//                   reply has lost its OPT record (it was cut short) and the
+//                   query has one, a new one goes in with the query's payload
+//                   size and DO bit.
+//      Outputs: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::Truncate(DNSPacket *inQuery)
+{
+    size_t headerSize = sizeof(DNS_HEADER);
+    if (!mRawPacketData || mRawPacketLen < headerSize)
+    {
+        ReportError("No raw packet data set");
+        return -1;
+    }
+    
+    // Find the end of the question
+    unsigned char *data = mRawPacketData + headerSize;
+    size_t dataLen = mRawPacketLen - headerSize;
+    string questionName;
+    if (DNSPacket::DecodeAddrStr(data, dataLen, questionName) || dataLen < sizeof(DNS_QUESTION))
+        return -1;
+    size_t questionEnd = (data - mRawPacketData) + sizeof(DNS_QUESTION);
+    
+    // An EDNS0 reply keeps its OPT record (RFC 6891), moved up behind the question
+    size_t optOffset, optLen;
+    bool hasOPT = !FindRawOPT(optOffset, optLen);
+    if (hasOPT)
+    {
+        memmove(mRawPacketData + questionEnd, mRawPacketData + optOffset, optLen);
+        mRawPacketLen = questionEnd + optLen;
+    }
+    else
+    {
+        mRawPacketLen = questionEnd;
+    }
+    
+    unsigned short payloadSize;
+    bool queryDO = false;
+    if (!hasOPT && inQuery && !inQuery->GetEDNSPayloadSize(payloadSize))
+    {
+        inQuery->GetEDNSDO(queryDO);
+        unsigned short flags = queryDO ? DNS_EDNS_DO : 0;
+        unsigned char opt[] = {
+            0,                                                  // Root name
+            0, DNS_TYPE_OPT,
+            (unsigned char)(payloadSize >> 8), (unsigned char)(payloadSize & 0xFF),
+            0, 0,                                               // Extended RCODE, version
+            (unsigned char)(flags >> 8), (unsigned char)(flags & 0xFF),
+            0, 0                                                // No options
+        };
+        unsigned char *data = (unsigned char*) realloc(mRawPacketData, questionEnd + sizeof(opt));
+        if (!data)
+        {
+            ReportError("Failed to grow the packet for an OPT record");
+            return -1;
+        }
+        mRawPacketData = data;
+        memcpy(mRawPacketData + questionEnd, opt, sizeof(opt));
+        mRawPacketLen = questionEnd + sizeof(opt);
+        hasOPT = true;
+    }
+    
+    // TC=1, one question and no records
+    DNS_HEADER *header = (DNS_HEADER*) mRawPacketData;
+    header->tc = 1;
+    header->qdcount = htons(1);
+    header->ancount = 0;
+    header->nscount = 0;
+    header->arcount = hasOPT ? htons(1) : 0;
+    mHeader.tc = 1;
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::MakeEmptyReply()
+//  Description: Turn a raw query into a reply without any records, just its
+//               question (and EDNS0 OPT record), to answer it without asking
+//               anyone: REFUSED, or TC=1 to send the client to TCP. Only a
+//               standard query with one question gets a reply; answering a
+//               response would start a ping-pong with whoever sent it.
+//       Inputs: inTruncated (IN) set TC
+//               inRCode (IN) response code
+//      Outputs: Non-zero on error, or if the packet isn't such a query.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::MakeEmptyReply(bool inTruncated, unsigned int inRCode)
+{
+    if (!mRawPacketData || mRawPacketLen < sizeof(DNS_HEADER))
+        return -1;
+    
+    DNS_HEADER *header = (DNS_HEADER*) mRawPacketData;
+    if (header->resp || header->opcode != 0 || ntohs(header->qdcount) != 1)
+        return -1;
+    
+    if (Truncate(nullptr))
+        return -1;
+    
+    header->resp = 1;
+    header->tc = inTruncated ? 1 : 0;
+    header->rcode = inRCode;
+    mHeader.resp = 1;
+    mHeader.tc = header->tc;
+    mHeader.rcode = inRCode;
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::FindRawOPT()
+//  Description: Find the EDNS0 OPT record in the raw data by walking every
+//               question and record.
+//       Inputs: outOffset (OUT) start of the OPT record
+//               outLen (OUT) length of the whole OPT record
+//      Outputs: Non-zero if there is none (or the packet is malformed.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::FindRawOPT(size_t &outOffset, size_t &outLen)
+{
+    size_t headerSize = sizeof(DNS_HEADER);
+    if (!mRawPacketData || mRawPacketLen < headerSize)
+        return -1;
+    
+    DNS_HEADER *header = (DNS_HEADER*) mRawPacketData;
+    unsigned int qdcount = ntohs(header->qdcount);
+    unsigned int rrcount = ntohs(header->ancount) + ntohs(header->nscount);
+    unsigned int arcount = ntohs(header->arcount);
+    if (arcount == 0)
+        return -1;
+    
+    unsigned char *data = mRawPacketData + headerSize;
+    size_t dataLen = mRawPacketLen - headerSize;
+    for (unsigned int i = 0; i < qdcount; ++i)
+    {
+        if (DNSPacket::SkipName(data, dataLen) || dataLen < sizeof(DNS_QUESTION))
+            return -1;
+        data += sizeof(DNS_QUESTION);
+        dataLen -= sizeof(DNS_QUESTION);
+    }
+    
+    // Type(2) Class(2) TTL(4) RDLength(2) after the name
+    for (unsigned int i = 0; i < rrcount + arcount; ++i)
+    {
+        unsigned char *record = data;
+        if (DNSPacket::SkipName(data, dataLen) || dataLen < 10)
+            return -1;
+        unsigned short type = (data[0] << 8) | data[1];
+        size_t rdLen = (data[8] << 8) | data[9];
+        if (dataLen < 10 + rdLen)
+            return -1;
+        data += 10 + rdLen;
+        dataLen -= 10 + rdLen;
+        
+        if (i >= rrcount && type == DNS_TYPE_OPT)
+        {
+            outOffset = record - mRawPacketData;
+            outLen = data - record;
+            return 0;
+        }
+    }
+    
+    return -1;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::GetEDNSPayloadSize()
+//  Description: The UDP payload size advertised in the EDNS0 OPT record.
+//       Inputs: outSize (OUT) the payload size
+//      Outputs: Non-zero if the packet has no OPT record.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::GetEDNSPayloadSize(unsigned short& outSize)
+{
+    size_t offset, len;
+    if (FindRawOPT(offset, len))
+        return -1;
+    
+    // Root name (1 byte) then TYPE, CLASS is the payload size
+    unsigned char *payloadSize = mRawPacketData + offset + 3;
+    outSize = (payloadSize[0] << 8) | payloadSize[1];
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::SetEDNSPayloadSize()
+//  Description: Rewrite the UDP payload size in the EDNS0 OPT record.
+//       Inputs: inSize (IN) the new payload size
+//      Outputs: Non-zero if the packet has no OPT record.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::SetEDNSPayloadSize(unsigned short inSize)
+{
+    size_t offset, len;
+    if (FindRawOPT(offset, len))
+        return -1;
+    
+    unsigned char *payloadSize = mRawPacketData + offset + 3;
+    payloadSize[0] = (unsigned char)(inSize >> 8);
+    payloadSize[1] = (unsigned char)(inSize & 0xFF);
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::GetEDNSDO()
+//  Description: The DNSSEC OK bit of the EDNS0 OPT record.
+//       Inputs: outDO (OUT) set if DO is
+//      Outputs: Non-zero if the packet has no OPT record.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::GetEDNSDO(bool& outDO)
+{
+    size_t offset, len;
+    if (FindRawOPT(offset, len))
+        return -1;
+    
+    // Root name, TYPE, CLASS, then the TTL: extended RCODE, version, flags
+    unsigned char *flags = mRawPacketData + offset + 7;
+    outDO = (((flags[0] << 8) | flags[1]) & DNS_EDNS_DO) != 0;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::GetMinTTL()
+//  Description: How long an answer may be cached: the smallest TTL of its
+//               records, leaving out the OPT record. An answer without any
+//               (NXDOMAIN or no data) is cached as long as its SOA says,
+//               the smaller of the SOA's TTL and MINIMUM (RFC 2308).
+//               Optionally also where every TTL field is, the OPT record's
+//               (its flags) aside, so a copy can be aged without parsing it.
+//       Inputs: outTTL (OUT) seconds
+//               outOffsets (OUT) offsets of the TTL fields, if not nullptr
+//      Outputs: Non-zero if there is nothing to bound it by (or the packet is
+//               malformed.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::GetMinTTL(unsigned int& outTTL, vector<unsigned short>* outOffsets)
+{
+    size_t headerSize = sizeof(DNS_HEADER);
+    if (!mRawPacketData || mRawPacketLen < headerSize)
+        return -1;
+    
+    DNS_HEADER *header = (DNS_HEADER*) mRawPacketData;
+    unsigned int qdcount = ntohs(header->qdcount);
+    unsigned int ancount = ntohs(header->ancount);
+    unsigned int nscount = ntohs(header->nscount);
+    unsigned int rrcount = ancount + nscount + ntohs(header->arcount);
+    
+    unsigned char *data = mRawPacketData + headerSize;
+    size_t dataLen = mRawPacketLen - headerSize;
+    for (unsigned int i = 0; i < qdcount; ++i)
+    {
+        if (DNSPacket::SkipName(data, dataLen) || dataLen < sizeof(DNS_QUESTION))
+            return -1;
+        data += sizeof(DNS_QUESTION);
+        dataLen -= sizeof(DNS_QUESTION);
+    }
+    
+    bool found = false;
+    unsigned int minTTL = 0;
+    if (outOffsets)
+        outOffsets->clear();
+    for (unsigned int i = 0; i < rrcount; ++i)
+    {
+        if (DNSPacket::SkipName(data, dataLen) || dataLen < 10)
+            return -1;
+        unsigned short type = (data[0] << 8) | data[1];
+        unsigned int ttl = ((unsigned int)data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+        size_t rdLen = (data[8] << 8) | data[9];
+        if (dataLen < 10 + rdLen)
+            return -1;
+        unsigned char *rdata = data + 10;
+        data += 10 + rdLen;
+        dataLen -= 10 + rdLen;
+        
+        if (type == DNS_TYPE_OPT)
+            continue;
+        if (outOffsets)
+            outOffsets->push_back((unsigned short)(rdata - 6 - mRawPacketData));
+        
+        // A TTL with the top bit set means zero (RFC 2181)
+        if (ttl & 0x80000000)
+            ttl = 0;
+        
+        // MINIMUM is the last field of the SOA's data
+        if (ancount == 0 && type == DNS_TYPE_SOA && i < nscount && rdLen >= 22)
+        {
+            unsigned char *soaMin = rdata + rdLen - 4;
+            unsigned int negTTL = ((unsigned int)soaMin[0] << 24) | (soaMin[1] << 16) | (soaMin[2] << 8) | soaMin[3];
+            ttl = min(ttl, negTTL);
+        }
+        else if (ancount == 0)
+        {
+            // Only the SOA says how long there is nothing
+            continue;
+        }
+        
+        minTTL = found ? min(minTTL, ttl) : ttl;
+        found = true;
+    }
+    
+    if (!found)
+        return -1;
+    outTTL = minTTL;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::GetQuestionLen()
+//  Description: Length of the (first) question in the raw data, its name, type
+//               and class, from the end of the header.
+//       Inputs: outLen (OUT) the length
+//      Outputs: Non-zero if the packet is malformed.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int DNSPacket::GetQuestionLen(size_t& outLen)
+{
+    size_t headerSize = sizeof(DNS_HEADER);
+    if (!mRawPacketData || mRawPacketLen < headerSize)
+        return -1;
+    
+    unsigned char *data = mRawPacketData + headerSize;
+    size_t dataLen = mRawPacketLen - headerSize;
+    if (DNSPacket::SkipName(data, dataLen) || dataLen < sizeof(DNS_QUESTION))
+        return -1;
+    outLen = (data - mRawPacketData) - headerSize + sizeof(DNS_QUESTION);
+    return 0;
+}
 
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: DNSPacket::SameQuestion()
+//  Description: Whether a reply answers the question of a query: one question
+//               each, the same name (any case), type and class. Compared in
+//               the raw data, so the reply needn't be decoded.
+//       Inputs: inQuery (IN) the query
+//      Outputs: True if they match.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool DNSPacket::SameQuestion(DNSPacket &inQuery)
+{
+    size_t len, queryLen;
+    if (GetQuestionLen(len) || inQuery.GetQuestionLen(queryLen) || len != queryLen)
+        return false;
+    
+    DNS_HEADER *header = (DNS_HEADER*) mRawPacketData;
+    DNS_HEADER *queryHeader = (DNS_HEADER*) inQuery.mRawPacketData;
+    if (ntohs(header->qdcount) != 1 || ntohs(queryHeader->qdcount) != 1)
+        return false;
+    
+    // Label lengths are under 64, so only the name's letters change case
+    unsigned char *question = mRawPacketData + sizeof(DNS_HEADER);
+    unsigned char *queryQuestion = inQuery.mRawPacketData + sizeof(DNS_HEADER);
+    size_t nameLen = len - sizeof(DNS_QUESTION);
+    for (size_t i = 0; i < nameLen; ++i)
+    {
+        if (tolower(question[i]) != tolower(queryQuestion[i]))
+            return false;
+    }
+    return memcmp(question + nameLen, queryQuestion + nameLen, sizeof(DNS_QUESTION)) == 0;
+}
@@ -8,7 +8,9 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include <stdlib.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -27,6 +29,17 @@ using namespace std;
 // |      Additional     | RRs holding additional information (Not implemented)
 // +---------------------+
 //
+// Apart from the header and question, only the EDNS0 OPT record (RFC 6891) in
+// the additional section and the record TTLs are looked at, straight in the
+// raw data.
+//
+
+#define DNS_TYPE_SOA        6           // Start of authority, its MINIMUM bounds negative caching (RFC 2308)
+#define DNS_TYPE_OPT        41          // EDNS0 OPT pseudo-RR, its CLASS is the UDP payload size
+#define DNS_EDNS_DO         0x8000      // DNSSEC OK, in the flags of the OPT record's TTL (RFC 3225)
+#define DNS_RCODE_NOERROR   0           // No error (RFC 1035)
+#define DNS_RCODE_NXDOMAIN  3           // Name does not exist (RFC 1035)
+#define DNS_RCODE_REFUSED   5           // Server refuses to answer (RFC 1035)
 
 struct DNS_HEADER
 {
@@ -94,6 +107,14 @@ public:
     int SetRawData(unsigned char* inData, size_t inLen);
     int SetRawPacketID(unsigned short inID);
     int GetRawPacketID(unsigned short& outID);
+    int Truncate(DNSPacket *inQuery);
+    int MakeEmptyReply(bool inTruncated, unsigned int inRCode);
+    int GetEDNSPayloadSize(unsigned short& outSize);
+    int SetEDNSPayloadSize(unsigned short inSize);
+    int GetEDNSDO(bool& outDO);
+    int GetMinTTL(unsigned int& outTTL, vector<unsigned short>* outOffsets = nullptr);
+    int GetQuestionLen(size_t& outLen);
+    bool SameQuestion(DNSPacket &inQuery);
     
     int Decode();
     int Encode(unsigned char *&outData, size_t &outDataLen, size_t inRemainsLen);
@@ -102,6 +123,7 @@ public:
     static int DecodeAddrStr(unsigned char *&ioData, size_t &ioDataLen, string &outString);
     static int EncodeAddrStr(unsigned char *&ioData, size_t &ioDataLen, size_t &ioRemainsLen,
                              string &inString);
+    static int SkipName(unsigned char *&ioData, size_t &ioDataLen);
     
     // Decoded Data
     DNS_HEADER       mHeader;
@@ -111,6 +133,9 @@ public:
     // Raw Data
     unsigned char*   mRawPacketData;
     size_t           mRawPacketLen;
+    
+protected:
+    int FindRawOPT(size_t &outOffset, size_t &outLen);
 };
 
 
@@ -14,9 +14,14 @@
 #include <memory>
 #include <chrono>
 #include "Packet.h"
+#include "SocketAddress.h"
+#include "Server.h"
 
 using namespace std;
 
+class TCPConnection;
+class CoUpstream;
+
 
 //################################################################################
 //##
@@ -32,7 +37,11 @@ class Request
 public:
     Request()
     : mClientPacketID(0),
-    mOurPacketID(0)
+    mOurPacketID(0),
+    mFwdIndex(0),
+    mMaxReplySize(SERVER_MAX_PACKET_SIZE),
+    mCoroThread(nullptr),
+    mCoroWait(nullptr)
     {
     }
     virtual ~Request()
@@ -40,11 +49,17 @@ public:
     }
     
     DNSPacket                                   mPacket;
-    struct sockaddr_in                          mClientAddr;
+    SocketAddress                               mClientAddr;
     unsigned short                              mClientPacketID;
     unsigned short                              mOurPacketID;
+    unsigned short                              mFwdIndex;      // Forward socket it went out on
+    unsigned short                              mMaxReplySize;  // Largest UDP reply the client takes (EDNS0)
+    shared_ptr<TCPConnection>                   mTCPConn;       // Set if the client came in over TCP
     string                                      mDomainName;
+    string                                      mCacheKey;      // Set if the cache missed, the answer goes in under it
     chrono::high_resolution_clock::time_point   mForwardedTime;
+    ServerThreadCoro                            *mCoroThread;   // Set on a coro engine attempt (see CoUpstream)
+    CoUpstream                                  *mCoroWait;     // The CoUpstream that sent the attempt
 };
 
 #endif
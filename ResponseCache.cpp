@@ -0,0 +1,436 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ResponseCache.cpp
+//
+// Desc: Cache of the remote DNS server's answers, bounded by their TTLs.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <arpa/inet.h>
+#include <ctype.h>
+#include <string.h>
+#include <algorithm>
+#include "Packet.h"
+#include "ResponseCache.h"
+#include "Stats.h"
+#include "TimerWheel.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: ResponseCache
+//##
+//##  Desc: Answers by question, kept as long as their TTLs say.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::ResponseCache()
+//  Description: Constructor. The entries are split evenly over the shards,
+//               each with a bucket per entry it may hold.
+//       Inputs: inStats (IN) where hits, misses and the rest are counted
+//               inMaxEntries (IN) answers kept at most, rounded up to split
+//               evenly
+//               inMaxTTL (IN) seconds an answer is kept at most
+//               inShards (IN) shards, rounded up to a power of 2
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ResponseCache::ResponseCache(Stats *inStats, size_t inMaxEntries, unsigned int inMaxTTL, unsigned int inShards)
+: mStats(inStats),
+  mMaxEntries(max(inMaxEntries, (size_t) 1)),
+  mMaxTTL(inMaxTTL),
+  mShardMask(0),
+  mShardBits(0),
+  mEpoch(1)
+{
+    size_t shards = 1;
+    while (shards < inShards && shards < mMaxEntries)
+    {
+        shards <<= 1;
+        ++mShardBits;
+    }
+    mShardMask = shards - 1;
+    mShardMaxEntries = (mMaxEntries + shards - 1) / shards;
+    mMaxEntries = mShardMaxEntries * shards;
+
+    size_t buckets = 1;
+    while (buckets < mShardMaxEntries)
+        buckets <<= 1;
+    mBucketMask = buckets - 1;
+
+    mShards.reset(new Shard[shards]);
+    for (size_t i = 0; i < shards; ++i)
+    {
+        mShards[i].mBuckets.reset(new atomic<Entry*>[buckets]);
+        for (size_t j = 0; j < buckets; ++j)
+            mShards[i].mBuckets[j].store(nullptr, memory_order_relaxed);
+        mShards[i].mCount = 0;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::~ResponseCache()
+//  Description: Destructor. Nobody may be looking any more.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ResponseCache::~ResponseCache()
+{
+    for (size_t i = 0; i <= mShardMask; ++i)
+    {
+        Shard &shard = mShards[i];
+        for (size_t j = 0; j <= mBucketMask; ++j)
+        {
+            Entry *entry = shard.mBuckets[j].load(memory_order_relaxed);
+            while (entry)
+            {
+                Entry *next = entry->mNext.load(memory_order_relaxed);
+                delete entry;
+                entry = next;
+            }
+        }
+        for (auto &retired : shard.mRetired)
+            delete retired.first;
+        shard.mRetired.clear();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::MakeKey()
+//  Description: The key of a query's question: its name in lower case (names
+//               are case insensitive, and resolvers randomize the case), type,
+//               class and DO bit, and whether it has EDNS0 and in what class
+//               of payload size. An EDNS0 answer carries an OPT record that a
+//               client without EDNS0 mustn't get, an answer without one would
+//               leave an EDNS0 client without it, and the payload size is what
+//               the remote DNS server sized the answer to.
+//       Inputs: inQuery (IN) the query, through DNSPacket::Decode()
+//               outKey (OUT) the key
+//      Returns: Non-zero if the query isn't one to cache.
+//          Notes: Static.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ResponseCache::MakeKey(DNSPacket &inQuery, string &outKey)
+{
+    // Only standard queries with the one question
+    if (inQuery.mHeader.opcode != 0 || inQuery.mHeader.qdcount != 1)
+        return -1;
+
+    bool dnssecOK = false;
+    inQuery.GetEDNSDO(dnssecOK);
+    unsigned short payloadSize = 0;
+    bool edns = !inQuery.GetEDNSPayloadSize(payloadSize);
+    unsigned int sizeClass = payloadSize > 0 ? (payloadSize - 1) / RESPONSE_CACHE_PAYLOAD : 0;
+
+    const string &name = inQuery.mQuestionName;
+    outKey.resize(name.size() + 6);
+    for (size_t i = 0; i < name.size(); ++i)
+        outKey[i] = tolower((unsigned char) name[i]);
+
+    // Fixed size tail, so no name can run into it
+    char *tail = &outKey[name.size()];
+    tail[0] = (char)(inQuery.mQuestion.qtype >> 8);
+    tail[1] = (char)(inQuery.mQuestion.qtype & 0xFF);
+    tail[2] = (char)(inQuery.mQuestion.qclass >> 8);
+    tail[3] = (char)(inQuery.mQuestion.qclass & 0xFF);
+    tail[4] = dnssecOK ? 1 : 0;
+    tail[5] = edns ? (char)(1 + sizeClass) : 0;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::Lookup()
+//  Description: Find the answer to a question, if it hasn't expired, and
+//               copy it out ready to send: under the client's packet ID,
+//               with its TTLs down by the whole seconds it has been cached.
+//               An expired one is dropped on the spot.
+//       Inputs: inKey (IN) from MakeKey()
+//               inID (IN) the client's packet ID
+//               outData (OUT) the answer
+//      Returns: True if it found one.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool ResponseCache::Lookup(const string &inKey, unsigned short inID, vector<unsigned char> &outData)
+{
+    size_t hash = std::hash<string>()(inKey);
+    int64_t nowMS = TimerWheel::NowMS();
+    bool found = false;
+
+    //
+    // Show the epoch we look in before we look. The fence pairs with the
+    // one in Reclaim(): either it sees our epoch, or we don't see what it
+    // is about to free.
+    //
+    Reader *reader = sReaderOwner == this ? sReader : AddReader();
+    reader->mEpoch.store(mEpoch.load(memory_order_acquire), memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    Entry *entry = GetBucket(GetShard(hash), hash).load(memory_order_acquire);
+    for (; entry; entry = entry->mNext.load(memory_order_acquire))
+    {
+        if (entry->mHash != hash || entry->mKey != inKey)
+            continue;
+
+        // An expired one is left for the next Insert() to the shard
+        if (entry->mExpiresMS > nowMS)
+        {
+            outData.assign(entry->mData.begin(), entry->mData.end());
+            unsigned char *data = &outData[0];
+            unsigned short packetID = htons(inID);
+            memcpy(data, &packetID, sizeof(packetID));
+
+            // Capped like the entry's own lifetime, so nobody downstream
+            // keeps an answer longer than we would
+            uint32_t age = (uint32_t)((nowMS - entry->mInsertedMS) / 1000);
+            for (unsigned short offset : entry->mTTLOffsets)
+            {
+                uint32_t ttl;
+                memcpy(&ttl, data + offset, sizeof(ttl));
+                ttl = min((uint32_t) ntohl(ttl), (uint32_t) mMaxTTL);
+                ttl = htonl(ttl > age ? ttl - age : 0);
+                memcpy(data + offset, &ttl, sizeof(ttl));
+            }
+            found = true;
+        }
+        break;
+    }
+    reader->mEpoch.store(0, memory_order_release);
+
+    mStats->Add(found ? STATS_CACHE_HITS : STATS_CACHE_MISSES);
+    return found;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::Insert()
+//  Description: Keep an answer for as long as its TTLs say, in place of any
+//               older answer to the question.
+//       Inputs: inKey (IN) from MakeKey() on the query
+//               inAnswer (IN) the answer, decoded. This will be copied.
+//      Returns: True if it was kept.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool ResponseCache::Insert(const string &inKey, DNSPacket &inAnswer)
+{
+    if (inAnswer.mHeader.tc ||
+        (inAnswer.mHeader.rcode != DNS_RCODE_NOERROR && inAnswer.mHeader.rcode != DNS_RCODE_NXDOMAIN))
+    {
+        return false;
+    }
+
+    unsigned int ttl = 0;
+    vector<unsigned short> ttlOffsets;
+    if (inAnswer.GetMinTTL(ttl, &ttlOffsets))
+        return false;
+    ttl = min(ttl, mMaxTTL);
+    if (ttl == 0)
+        return false;
+
+    // Made up before the shard is locked, readers only ever see it whole
+    int64_t nowMS = TimerWheel::NowMS();
+    Entry *entry = new Entry();
+    entry->mHash = std::hash<string>()(inKey);
+    entry->mKey = inKey;
+    entry->mData.assign(inAnswer.mRawPacketData, inAnswer.mRawPacketData + inAnswer.mRawPacketLen);
+    entry->mTTLOffsets = move(ttlOffsets);
+    entry->mInsertedMS = nowMS;
+    entry->mExpiresMS = nowMS + (int64_t) ttl * 1000;
+
+    Shard &shard = GetShard(entry->mHash);
+    lock_guard<mutex> lock(shard.mMutex);
+    RemoveExpired(shard, nowMS);
+
+    atomic<Entry*> &bucket = GetBucket(shard, entry->mHash);
+    Entry *older = bucket.load(memory_order_relaxed);
+    while (older && (older->mHash != entry->mHash || older->mKey != inKey))
+        older = older->mNext.load(memory_order_relaxed);
+
+    if (!older && shard.mCount >= mShardMaxEntries)
+    {
+        // Full, the one closest to expiring goes
+        Remove(shard, shard.mExpiries.begin()->second, nullptr);
+        mStats->Add(STATS_CACHE_EVICTED);
+    }
+
+    entry->mExpiry = shard.mExpiries.emplace(entry->mExpiresMS, entry);
+    if (older)
+    {
+        Remove(shard, older, entry);
+    }
+    else
+    {
+        entry->mNext.store(bucket.load(memory_order_relaxed), memory_order_relaxed);
+        bucket.store(entry, memory_order_release);
+    }
+    ++shard.mCount;
+    mStats->Add(STATS_CACHE_INSERTS);
+
+    if (shard.mRetired.size() >= RESPONSE_CACHE_RECLAIM)
+        Reclaim(shard);
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::GetCount()
+//  Description: Answers in the cache, expired ones included until they're
+//               dropped.
+//      Returns: The count.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ResponseCache::GetCount()
+{
+    size_t count = 0;
+    for (size_t i = 0; i <= mShardMask; ++i)
+    {
+        lock_guard<mutex> lock(mShards[i].mMutex);
+        count += mShards[i].mCount;
+    }
+    return count;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::FindLink()
+//  Description: The link that points at an entry: its bucket, or the entry
+//               before it in the bucket list. Caller holds the shard's lock.
+//       Inputs: inShard (IN) the entry's shard
+//               inEntry (IN) the entry
+//      Returns: The link.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+atomic<ResponseCache::Entry*>* ResponseCache::FindLink(Shard &inShard, Entry *inEntry)
+{
+    atomic<Entry*> *link = &GetBucket(inShard, inEntry->mHash);
+    while (link->load(memory_order_relaxed) != inEntry)
+        link = &link->load(memory_order_relaxed)->mNext;
+    return link;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::Remove()
+//  Description: Take an entry out of its bucket list, or put another in its
+//               place, and retire it. Readers already on it can still follow
+//               it to the rest of the list. Caller holds the shard's lock.
+//       Inputs: inShard (IN) the entry's shard
+//               inEntry (IN) the entry
+//               inReplacement (IN) its replacement, nullptr for none
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ResponseCache::Remove(Shard &inShard, Entry *inEntry, Entry *inReplacement)
+{
+    atomic<Entry*> *link = FindLink(inShard, inEntry);
+    Entry *next = inEntry->mNext.load(memory_order_relaxed);
+    if (inReplacement)
+    {
+        inReplacement->mNext.store(next, memory_order_relaxed);
+        link->store(inReplacement, memory_order_release);
+    }
+    else
+    {
+        link->store(next, memory_order_release);
+    }
+    inShard.mExpiries.erase(inEntry->mExpiry);
+    --inShard.mCount;
+
+    // Readers that start after the bump can't get to it any more
+    inShard.mRetired.emplace_back(inEntry, mEpoch.fetch_add(1, memory_order_seq_cst));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::RemoveExpired()
+//  Description: Drop every entry of a shard that has expired. Caller holds
+//               the shard's lock.
+//       Inputs: inShard (IN) the shard
+//               inNowMS (IN) TimerWheel::NowMS()
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ResponseCache::RemoveExpired(Shard &inShard, int64_t inNowMS)
+{
+    while (!inShard.mExpiries.empty() && inShard.mExpiries.begin()->first <= inNowMS)
+    {
+        Remove(inShard, inShard.mExpiries.begin()->second, nullptr);
+        mStats->Add(STATS_CACHE_EXPIRED);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::Reclaim()
+//  Description: Free the retired entries of a shard that no reader can be
+//               on: the ones removed before the oldest epoch a reader is
+//               looking in. Caller holds the shard's lock.
+//       Inputs: inShard (IN) the shard
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ResponseCache::Reclaim(Shard &inShard)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    uint64_t oldest = UINT64_MAX;
+    {
+        lock_guard<mutex> lock(mReadersMutex);
+        for (auto &reader : mReaders)
+        {
+            uint64_t epoch = reader->mEpoch.load(memory_order_acquire);
+            if (epoch && epoch < oldest)
+                oldest = epoch;
+        }
+    }
+
+    size_t kept = 0;
+    for (auto &retired : inShard.mRetired)
+    {
+        if (retired.second < oldest)
+            delete retired.first;
+        else
+            inShard.mRetired[kept++] = retired;
+    }
+    inShard.mRetired.resize(kept);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ResponseCache::AddReader()
+//  Description: Give the calling thread its reader record, the first time it
+//               looks something up.
+//      Returns: The record.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ResponseCache::Reader* ResponseCache::AddReader()
+{
+    Reader *reader = new Reader();
+    reader->mEpoch.store(0, memory_order_relaxed);
+    lock_guard<mutex> lock(mReadersMutex);
+    mReaders.emplace_back(reader);
+    sReaderOwner = this;
+    sReader = reader;
+    return reader;
+}
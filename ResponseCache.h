@@ -0,0 +1,145 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ResponseCache.h
+//
+// Desc: Cache of the remote DNS server's answers, bounded by their TTLs.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef RESPONSE_CACHE_H
+#define RESPONSE_CACHE_H
+#include <stdint.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class DNSPacket;
+class Stats;
+
+#define RESPONSE_CACHE_LINE     64          /* Shards and readers don't share cache lines */
+#define RESPONSE_CACHE_RECLAIM  64          /* Retired entries a shard holds before it tries to free them */
+#define RESPONSE_CACHE_PAYLOAD  512         /* EDNS0 payload sizes are keyed in steps of this */
+
+
+//################################################################################
+//##
+//## Class: ResponseCache
+//##
+//##  Desc: Answers by question: the name (any case), type, class and the
+//##        EDNS0 DO bit, since a DNSSEC OK query gets the signatures too, and
+//##        whether the query has EDNS0 and its payload size, in steps of
+//##        RESPONSE_CACHE_PAYLOAD (see MakeKey()). An answer is kept as long
+//##        as the smallest TTL in it says (see DNSPacket::GetMinTTL()), at
+//##        most mMaxTTL, and a newer answer to the same question replaces it.
+//##        Truncated answers and errors other than NXDOMAIN aren't kept.
+//##
+//##        The cache is split into a power of 2 of shards by key hash, each
+//##        with its own lock, buckets and share of the entries. Only writers
+//##        (Insert()) take a shard's lock. Entries are never changed once
+//##        they are in a bucket list, a writer links in a new one in place of
+//##        the old, so Lookup() walks the lists without any lock.
+//##
+//##        A removed entry may still be in use by a reader that found it
+//##        before, so it is retired rather than freed (epoch based
+//##        reclamation): every removal bumps the cache's epoch, a reader
+//##        shows the epoch it started at in a record of its own while it
+//##        looks, and a retired entry is freed once no reader still shows an
+//##        epoch from before its removal.
+//##
+//##        Each shard also orders its entries by when they expire. Inserting
+//##        drops the expired ones, and when the shard is full the one closest
+//##        to expiring makes room.
+//##
+//##        Where the TTL fields are is worked out once, when an answer goes
+//##        in. A lookup copies the answer into the caller's buffer and, in
+//##        the same go, puts the client's packet ID in and takes the time it
+//##        has been cached off every TTL (each capped at mMaxTTL), so the
+//##        client sees them count down without the answer being parsed again.
+//##
+//################################################################################
+
+class ResponseCache
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ResponseCache(Stats *inStats, size_t inMaxEntries, unsigned int inMaxTTL, unsigned int inShards);
+    virtual ~ResponseCache();
+
+    //
+    // Public member functions
+    //
+    static int          MakeKey(DNSPacket &inQuery, string &outKey);
+    bool                Lookup(const string &inKey, unsigned short inID, vector<unsigned char> &outData);
+    bool                Insert(const string &inKey, DNSPacket &inAnswer);
+    size_t              GetCount();
+    size_t              GetMaxEntries() { return mMaxEntries; }
+    unsigned int        GetMaxTTL() { return mMaxTTL; }
+    unsigned int        GetShardCount() { return mShardMask + 1; }
+
+    //
+    // Protected member functions
+    //
+protected:
+    struct Entry
+    {
+        size_t                              mHash;
+        string                              mKey;
+        vector<unsigned char>               mData;
+        vector<unsigned short>              mTTLOffsets;    // TTL fields in mData, as they came
+        int64_t                             mInsertedMS;    // TimerWheel::NowMS()
+        int64_t                             mExpiresMS;
+        atomic<Entry*>                      mNext;          // Bucket list
+        multimap<int64_t, Entry*>::iterator mExpiry;        // Its place in mExpiries (writers only)
+    };
+
+    struct alignas(RESPONSE_CACHE_LINE) Shard
+    {
+        mutex                               mMutex;         // Writers
+        unique_ptr<atomic<Entry*>[]>        mBuckets;
+        size_t                              mCount;
+        multimap<int64_t, Entry*>           mExpiries;      // Expiry time to entry, soonest first
+        vector<pair<Entry*, uint64_t>>      mRetired;       // Removed, with the epoch they were removed in
+    };
+
+    struct alignas(RESPONSE_CACHE_LINE) Reader
+    {
+        atomic<uint64_t>                    mEpoch;         // Epoch its lookup started in, 0 = not looking
+    };
+
+    Shard&              GetShard(size_t inHash) { return mShards[inHash & mShardMask]; }
+    atomic<Entry*>&     GetBucket(Shard &inShard, size_t inHash)
+                        { return inShard.mBuckets[(inHash >> mShardBits) & mBucketMask]; }
+    atomic<Entry*>*     FindLink(Shard &inShard, Entry *inEntry);
+    void                Remove(Shard &inShard, Entry *inEntry, Entry *inReplacement);
+    void                RemoveExpired(Shard &inShard, int64_t inNowMS);
+    void                Reclaim(Shard &inShard);
+    Reader*             AddReader();
+
+    //
+    // Protected data
+    //
+    Stats                               *mStats;
+    size_t                              mMaxEntries;
+    size_t                              mShardMaxEntries;
+    unsigned int                        mMaxTTL;        // Seconds
+    unique_ptr<Shard[]>                 mShards;
+    size_t                              mShardMask;
+    unsigned int                        mShardBits;
+    size_t                              mBucketMask;
+    alignas(RESPONSE_CACHE_LINE) atomic<uint64_t> mEpoch; // Bumped by every removal, starts at 1
+    vector<unique_ptr<Reader>>          mReaders;
+    mutex                               mReadersMutex;  // Adding readers vs. reading their epochs
+
+    // The calling thread's reader record, and whose it is
+    static inline thread_local ResponseCache    *sReaderOwner = nullptr;
+    static inline thread_local Reader           *sReader = nullptr;
+};
+
+
+#endif
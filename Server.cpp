@@ -6,14 +6,34 @@
 //
 //////////////////////////////////////////////////////////////////////////////////
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <errno.h>
 #include <iostream>
+#include <algorithm>
+#include "Batch.h"
+#include "ServerEventLoop.h"
+#include "ServerUring.h"
+#include "ServerCoro.h"
+#include "ServerTCP.h"
+#include "ServerPacketRing.h"
+#include "Wakeup.h"
+#include "OutboxTable.h"
+#include "TimerWheel.h"
+#include "ResponseCache.h"
 #include "Server.h"
 #include "Request.h"
+#include "SocketAddress.h"
 #include "Packet.h"
 #include "Error.h"
 
@@ -30,8 +50,8 @@ using namespace std;
 
 
 // Static class variables
-condition_variable  Server::sShuttingDownCV;
-mutex               Server::sShuttingDownCVMutex;
+int                     Server::sSignalFD = -1;
+volatile sig_atomic_t   Server::sSignal = 0;
 
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -41,30 +61,24 @@ mutex               Server::sShuttingDownCVMutex;
 //       Inputs: inListenPort (IN) the port to listen on
 //               inFwdStr (IN) the remote DNS server name we'll be forwarding to
 //               inFwdPort (IN) the remote DNS server port
+//               inConfig (IN) runtime settings
 //
 //////////////////////////////////////////////////////////////////////////////////
 
 Server::Server(unsigned short inListenPort, const char* inFwdStr,
-               unsigned short inFwdPort)
-: mServerPort(inListenPort),
-  mServerSocket(-1),
+               unsigned short inFwdPort, const ServerConfig& inConfig)
+: mConfig(inConfig),
+  mShuttingDown(false),
+  mDraining(false),
+  mStopFD(eventfd(0, EFD_CLOEXEC)),
+  mMaintainenceThread(nullptr),
+  mServerPort(inListenPort),
   mFwdStr(inFwdStr),
   mFwdPort(inFwdPort),
-  mFwdSocket(-1),
-  mGenIDCounter(0),
-  mInboxQueueSemaphore(nullptr),
-  mOutboxSemaphore(nullptr),
-  mMaintainenceThread(nullptr)
+  mCache(nullptr)
 {
-    if (!(mInboxQueueSemaphore = sem_open("mInboxQueueSemaphore", O_CREAT, 0666, 0)))
-    {
-        ReportError("sem_open(mInboxQueueSemaphore) failed");
-    }
-    
-    if (!(mOutboxSemaphore = sem_open("mOutboxSemaphore", O_CREAT, 0666, 0)))
-    {
-        ReportError("sem_open(mOutboxSemaphore) failed");
-    }
+    for (unsigned int i = 0; i < SERVER_ROLES; ++i)
+        mPlaced[i] = 0;
 }
 
 
@@ -77,32 +91,6 @@ Server::Server(unsigned short inListenPort, const char* inFwdStr,
 
 Server::~Server()
 {
-    // Clean up sockets
-    if (mFwdSocket != -1)
-    {
-        close(mFwdSocket);
-        mFwdSocket = -1;
-    }
-    
-    if (mServerSocket)
-    {
-        close(mServerSocket);
-        mServerSocket = -1;
-    }
-    
-    // Clean up semaphores
-    if (mInboxQueueSemaphore && sem_close(mInboxQueueSemaphore))
-    {
-        ReportError("sem_close(mInboxQueueSemaphore) failed");
-        mInboxQueueSemaphore = nullptr;
-    }
-    
-    if (mOutboxSemaphore && sem_close(mOutboxSemaphore))
-    {
-        ReportError("sem_close(mOutboxSemaphore) failed");
-        mOutboxSemaphore = nullptr;
-    }
-    
     // Clean up ServerThread memory
     for (auto stObj : mInboxThreads)
         delete stObj;
@@ -116,11 +104,45 @@ Server::~Server()
         delete stObj;
     mOutboxThreads.clear();
     
+    for (auto stObj : mEventLoopThreads)
+        delete stObj;
+    mEventLoopThreads.clear();
+    
+    for (auto stObj : mUringThreads)
+        delete stObj;
+    mUringThreads.clear();
+    
+    for (auto stObj : mCoroThreads)
+        delete stObj;
+    mCoroThreads.clear();
+    
+    for (auto stObj : mTCPThreads)
+        delete stObj;
+    mTCPThreads.clear();
+    
+    for (auto stObj : mFwdTCPThreads)
+        delete stObj;
+    mFwdTCPThreads.clear();
+    
     if (mMaintainenceThread)
     {
         delete mMaintainenceThread;
         mMaintainenceThread = nullptr;
     }
+    
+    // Clean up pipelines (sockets, queues and wakeups)
+    for (auto pipeline : mPipelines)
+        delete pipeline;
+    mPipelines.clear();
+    
+    delete mCache;
+    mCache = nullptr;
+    
+    if (mStopFD != -1)
+    {
+        close(mStopFD);
+        mStopFD = -1;
+    }
 }
 
 
@@ -142,155 +164,567 @@ int Server::RunServer()
     // To gracefully shutdown the server call:
     //        kill -s TERM <pid>
     //
+    // The handler only writes the signal eventfd, which we block on below
+    // (a signal that comes in before then isn't lost.)
+    //
+    if (sSignalFD == -1)
+    {
+        sSignalFD = eventfd(0, EFD_CLOEXEC);
+        if (sSignalFD == -1)
+        {
+            ReportError("eventfd failed, errno %d", errno);
+            return -1;
+        }
+    }
     signal(SIGINT, Server::HandleSignal);
     signal(SIGILL, Server::HandleSignal);
     signal(SIGTERM, Server::HandleSignal);
     signal(SIGABRT, Server::HandleSignal);
     
     //
-    // Setup remote DNS server structures
+    // Setup remote DNS server structures (IPv4 or IPv6, the first address
+    // the resolver prefers)
     //
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    
-    mFwdSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (mFwdSocket == -1)
+    struct addrinfo hints;
+    struct addrinfo *hostList = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+    string fwdPortStr = to_string(mFwdPort);
+    int gaiError = getaddrinfo(mFwdStr.c_str(), fwdPortStr.c_str(), &hints, &hostList);
+    if (gaiError || !hostList)
     {
-        ReportError("Could not create socket, errno %d", errno);
+        ReportError("Failed to resolve address of forward DNS server %s (%s)",
+                    mFwdStr.c_str(), gai_strerror(gaiError));
         return -1;
     }
+    memset(&mFwdSocketAddr, 0, sizeof(mFwdSocketAddr));
+    memcpy(&mFwdSocketAddr, hostList->ai_addr, hostList->ai_addrlen);
+    freeaddrinfo(hostList);
     
-    struct hostent *host = gethostbyname(mFwdStr.c_str());
-    if (!host)
+    //
+    // The io_uring engine needs a recent kernel, fall back to the threaded
+    // pipeline engine when it isn't there (or io_uring is disabled.)
+    //
+    if (mConfig.mEngine == SERVER_ENGINE_URING && !ServerThreadUring::Supported())
     {
-        ReportError("Failed to resolve address of forward DNS server %s",
-                    mFwdStr.c_str());
-        return -1;
+        printf("io_uring (multishot recvmsg, buffer rings) not available, using the pipeline engine\n");
+        mConfig.mEngine = SERVER_ENGINE_PIPELINE;
     }
-    memset(&mFwdSocketAddr, 0, sizeof(mFwdSocketAddr));
-    mFwdSocketAddr.sin_family = AF_INET;
-    mFwdSocketAddr.sin_port = htons(mFwdPort);
-    memcpy(&mFwdSocketAddr.sin_addr, host->h_addr_list[0], host->h_length);
     
     //
-    // Create 'Inbox' socket and listen
+    // UDP GSO/GRO works on the recvmmsg/sendmmsg batches (GRO receives have
+    // to be split up again), so it turns batching on. The io_uring engine
+    // sends one datagram per SQE and doesn't use it.
     //
-    mServerSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (mServerSocket == -1)
+    if (mConfig.mUDPGSO)
     {
-        ReportError("Could not create socket, errno %d", errno);
-        return -1;
+        if (mConfig.mEngine == SERVER_ENGINE_URING)
+        {
+            printf("UDP GSO/GRO is not used by the uring engine, disabled\n");
+            mConfig.mUDPGSO = false;
+        }
+        else if (!SendBatch::GSOSupported())
+        {
+            printf("UDP GSO/GRO (UDP_SEGMENT) not available, disabled\n");
+            mConfig.mUDPGSO = false;
+        }
+        else
+            mConfig.mBatchIO = true;
     }
     
-    memset(&mServerSocketAddr, 0, sizeof(mServerSocketAddr));
-    mServerSocketAddr.sin_family = AF_INET;
-    mServerSocketAddr.sin_addr.s_addr = INADDR_ANY;
-    mServerSocketAddr.sin_port = htons(mServerPort);
-    int rc = ::bind(mServerSocket, (struct sockaddr*)&mServerSocketAddr, addrLen);
-    if (rc != 0)
+    // The packet ring feeds the Inbox queue, which only the pipeline engine has
+    if (!mConfig.mPacketRing.empty() && mConfig.mEngine != SERVER_ENGINE_PIPELINE)
+    {
+        printf("The packet ring needs the pipeline engine, disabled\n");
+        mConfig.mPacketRing.clear();
+    }
+    
+    // Only one thread can walk a packet ring's blocks
+    if (!mConfig.mPacketRing.empty())
+        mConfig.mInboxThreadCount = 1;
+    
+    // The other engines always run each query to completion
+    if (mConfig.mEngine != SERVER_ENGINE_PIPELINE)
+        mConfig.mFuseStages = false;
+    
+    //
+    // Create the pipelines, each with its own 'Inbox' socket and forward socket.
+    // In SO_REUSEPORT mode there is one per core (unless configured otherwise)
+    // and the kernel load balances clients across their listener sockets.
+    // Upstream TCP is only needed for TC=1 retries from TCP clients, or when
+    // everything is forwarded over it.
+    //
+    if (!mConfig.mTCP && !mConfig.mFwdTCPAlways)
+        mConfig.mFwdTCPConns = 0;
+    
+    unsigned int scaleCount = 1;
+    if (mConfig.mReusePort)
+    {
+        scaleCount = mConfig.mPipelines ? mConfig.mPipelines : thread::hardware_concurrency();
+        if (scaleCount < 1)
+            scaleCount = 1;
+    }
+    
+    // Size the processing pools to the CPUs we may use, shared by the pipelines
+    if (mConfig.mFuseStages)
+        mConfig.mProcessThreadCount = 0;
+    else if (mConfig.mProcessThreadCount == 0)
+        mConfig.mProcessThreadCount = max(GetCPUQuota() / scaleCount, 1u);
+    
+    // Enough forward sockets for the whole packet ID space to be in flight, so
+    // the Outbox slot bits leave room for the generation (and the replies
+    // come back to more source ports.)
+    if (mConfig.mFwdSockets == 0)
+        mConfig.mFwdSockets = 1u << (16 - SERVER_OUTBOX_SLOT_BITS);
+    
+    // One cache for every pipeline, sharded so its writers rarely meet
+    if (mConfig.mCache)
+    {
+        if (mConfig.mCacheShards == 0)
+            mConfig.mCacheShards = GetCPUQuota() * 4;
+        mCache = new ResponseCache(&mStats, mConfig.mCacheEntries, mConfig.mCacheMaxTTL, mConfig.mCacheShards);
+    }
+    
+    if (SetupPlacement(scaleCount))
     {
-        ReportError("Could not listen on port %d, errno %d", mServerPort, errno);
         return -1;
     }
     
     //
-    // Spawn threads (scaleCount times each)
+    // A pipeline lives on the node its (first) listener thread is pinned to,
+    // else with --numa the pipelines take turns on the nodes. Its rings and
+    // Outbox are allocated there, and its threads prefer that node's memory
+    // for everything they allocate. A pipeline's listener sockets steer to
+    // the CPU its one listener thread is pinned to (SO_INCOMING_CPU), which
+    // is what picks the SO_REUSEPORT socket on kernels that know it (6.1+),
+    // as long as no other pipeline's listener is on that CPU too.
+    //
+    unsigned int listeners = mConfig.mEngine == SERVER_ENGINE_PIPELINE ? mConfig.mInboxThreadCount : 1;
+    for (unsigned int i = 0; i < scaleCount; ++i)
+    {
+        vector<int> listenerCPUs = GetPlacement(SERVER_ROLE_LISTENER, i * listeners);
+        int node = mTopology.GetNode(listenerCPUs);
+        if (listenerCPUs.empty() && mConfig.mNUMA)
+            node = mTopology.GetNodes()[i % mTopology.GetNodes().size()];
+        mTopology.BindThread(vector<int>(), node);
+        
+        ServerPipeline *pipeline = new ServerPipeline(this, i);
+        pipeline->SetNode(node);
+        mPipelines.push_back(pipeline);
+        if (pipeline->OpenSockets(mConfig.mReusePort))
+        {
+            LeavePlacement();
+            return -1;
+        }
+        bool ownCPU = mConfig.mReusePort && listeners == 1 && listenerCPUs.size() == 1;
+        for (unsigned int j = 0; ownCPU && j < scaleCount; ++j)
+            ownCPU = j == i || GetPlacement(SERVER_ROLE_LISTENER, j) != listenerCPUs;
+        if (ownCPU)
+            pipeline->SetIncomingCPU(listenerCPUs[0]);
+    }
+    
+    //
+    // Spawn threads (one chain, or one event loop, per pipeline). Each one
+    // starts out placed by EnterPlacement(), and its constructor allocates
+    // its buffers on its node.
     //
     ServerThreadMaintainence *stMaintainence = nullptr;
+    ServerThreadEventLoop *stEventLoop = nullptr;
+    ServerThreadUring *stUring = nullptr;
+    ServerThreadCoro *stCoro = nullptr;
+    ServerThreadTCP *stTCP = nullptr;
+    ServerThreadFwdTCP *stFwdTCP = nullptr;
     ServerThreadOutbox *stOutbox = nullptr;
     ServerThreadProcess *stProcess = nullptr;
     ServerThreadInbox *stInbox = nullptr;
     thread *stThread = nullptr;
-    int scaleCount = 1;
     
-    // We only ever need one maintainence thread
-    stMaintainence = new ServerThreadMaintainence(this);
-    stThread = new thread(&ServerThreadMaintainence::ThreadMain, stMaintainence);
-    stMaintainence->SetThread(stThread);
-    mMaintainenceThread = stMaintainence;
+    // Upstream TCP connections first, every other thread may forward over them
+    for (auto pipeline : mPipelines)
+    {
+        if (!pipeline->GetFwdTCPCount())
+            break;
+        
+        EnterPlacement(SERVER_ROLE_FWD_TCP, pipeline);
+        stFwdTCP = new ServerThreadFwdTCP(this, pipeline);
+        pipeline->SetFwdTCPThread(stFwdTCP);
+        stThread = new thread(&ServerThreadFwdTCP::ThreadMain, stFwdTCP);
+        stFwdTCP->SetThread(stThread);
+        mFwdTCPThreads.push_back(stFwdTCP);
+    }
+    
+    if (mConfig.mEngine == SERVER_ENGINE_EVENTLOOP)
+    {
+        // Event loops time out their own Requests, no maintainence thread
+        for (auto pipeline : mPipelines)
+        {
+            EnterPlacement(SERVER_ROLE_LISTENER, pipeline);
+            stEventLoop = new ServerThreadEventLoop(this, pipeline);
+            stThread = new thread(&ServerThreadEventLoop::ThreadMain, stEventLoop);
+            stEventLoop->SetThread(stThread);
+            mEventLoopThreads.push_back(stEventLoop);
+        }
+    }
+    else if (mConfig.mEngine == SERVER_ENGINE_URING)
+    {
+        // Same as the event loops, but on io_uring
+        for (auto pipeline : mPipelines)
+        {
+            EnterPlacement(SERVER_ROLE_LISTENER, pipeline);
+            stUring = new ServerThreadUring(this, pipeline);
+            stThread = new thread(&ServerThreadUring::ThreadMain, stUring);
+            stUring->SetThread(stThread);
+            mUringThreads.push_back(stUring);
+        }
+    }
+    else if (mConfig.mEngine == SERVER_ENGINE_CORO)
+    {
+        // Same as the event loops, with a coroutine per query
+        for (auto pipeline : mPipelines)
+        {
+            EnterPlacement(SERVER_ROLE_LISTENER, pipeline);
+            stCoro = new ServerThreadCoro(this, pipeline);
+            pipeline->SetCoroThread(stCoro);
+            stThread = new thread(&ServerThreadCoro::ThreadMain, stCoro);
+            stCoro->SetThread(stThread);
+            mCoroThreads.push_back(stCoro);
+        }
+    }
+    else
+    {
+        // We only ever need one maintainence thread
+        EnterPlacement(SERVER_ROLE_MAINTAINENCE, nullptr);
+        stMaintainence = new ServerThreadMaintainence(this);
+        stThread = new thread(&ServerThreadMaintainence::ThreadMain, stMaintainence);
+        stMaintainence->SetThread(stThread);
+        mMaintainenceThread = stMaintainence;
+    }
     
-    for (int i = 0; i < scaleCount; ++i)
+    for (auto pipeline : mPipelines)
     {
+        if (mConfig.mEngine != SERVER_ENGINE_PIPELINE)
+            break;
+        
         // Start them up in reverse order
-        stOutbox = new ServerThreadOutbox(this);
+        EnterPlacement(SERVER_ROLE_OUTBOX, pipeline);
+        stOutbox = new ServerThreadOutbox(this, pipeline);
         stThread = new thread(&ServerThreadOutbox::ThreadMain, stOutbox);
         stOutbox->SetThread(stThread);
         mOutboxThreads.push_back(stOutbox);
         
-        stProcess = new ServerThreadProcess(this);
-        stThread = new thread(&ServerThreadProcess::ThreadMain, stProcess);
-        stProcess->SetThread(stThread);
-        mProcessThreads.push_back(stProcess);
+        // A work stealing pool over the pipeline's Inbox rings, none when
+        // the fused inbox threads do their work instead
+        for (unsigned int i = 0; i < mConfig.mProcessThreadCount; ++i)
+        {
+            EnterPlacement(SERVER_ROLE_PROCESS, pipeline);
+            stProcess = new ServerThreadProcess(this, pipeline, i);
+            stThread = new thread(&ServerThreadProcess::ThreadMain, stProcess);
+            stProcess->SetThread(stThread);
+            mProcessThreads.push_back(stProcess);
+        }
+        
+        // A packet ring takes the place of reading the listener socket
+        for (unsigned int i = 0; i < mConfig.mInboxThreadCount; ++i)
+        {
+            EnterPlacement(SERVER_ROLE_LISTENER, pipeline);
+            if (pipeline->GetPacketRing())
+                stInbox = new ServerThreadPacketRing(this, pipeline);
+            else
+                stInbox = new ServerThreadInbox(this, pipeline);
+            stThread = new thread(&ServerThreadInbox::ThreadMain, stInbox);
+            stInbox->SetThread(stThread);
+            mInboxThreads.push_back(stInbox);
+        }
+    }
+    
+    // TCP clients get one thread per pipeline whatever the engine
+    for (auto pipeline : mPipelines)
+    {
+        if (!mConfig.mTCP)
+            break;
         
-        stInbox = new ServerThreadInbox(this);
-        stThread = new thread(&ServerThreadInbox::ThreadMain, stInbox);
-        stInbox->SetThread(stThread);
-        mInboxThreads.push_back(stInbox);
+        EnterPlacement(SERVER_ROLE_TCP, pipeline);
+        stTCP = new ServerThreadTCP(this, pipeline);
+        stThread = new thread(&ServerThreadTCP::ThreadMain, stTCP);
+        stTCP->SetThread(stThread);
+        mTCPThreads.push_back(stTCP);
     }
+    LeavePlacement();
     
-    printf("DNS server started:\n\tPort: %d\n\tForwarding: %s:%d\n\n",
-           (int)mServerPort, mFwdStr.c_str(), (int)mFwdPort);
+    printf("DNS server started:\n\tPort: %d (%s, %s)\n\tForwarding: %s (%s, %u sockets)\n\tPipelines: %u%s\n\tEngine: %s%s\n\n",
+           (int)mServerPort, mConfig.mTCP ? "UDP+TCP" : "UDP",
+           mPipelines[0]->GetServerFamily() == AF_INET6 ? "IPv6+IPv4" : "IPv4",
+           mFwdStr.c_str(), SocketAddress::ToString(GetFwdSocketAddr()).c_str(),
+           mConfig.mFwdSockets, scaleCount,
+           mConfig.mReusePort ? " (SO_REUSEPORT)" : "",
+           mConfig.mEngine == SERVER_ENGINE_EVENTLOOP ? "eventloop" :
+           mConfig.mEngine == SERVER_ENGINE_URING ? "uring" :
+           mConfig.mEngine == SERVER_ENGINE_CORO ? "coro" :
+           mConfig.mFuseStages ? "pipeline (fused stages)" : "pipeline",
+           mConfig.mPacketRing.empty() ? "" : (" (packet ring on " + mConfig.mPacketRing + ")").c_str());
+    ReportTopology();
     fflush(stdout);
     
     //
-    // Wait for shutdown signal (via condition_variable)
+    // Wait for shutdown signal (via the signal eventfd)
     //
-    unique_lock<mutex> shutdownLock(sShuttingDownCVMutex);
-    sShuttingDownCV.wait(shutdownLock);
-    this->mShuttingDown = true;
-    printf("Shutting down...\n");
+    uint64_t signals = 0;
+    while (read(sSignalFD, &signals, sizeof(signals)) < 0)
+    {
+        if (errno != EINTR)
+        {
+            ReportError("eventfd read failed, errno %d", errno);
+            break;
+        }
+    }
+    printf("Received signal %d, shutting down...\n", (int)sSignal);
     fflush(stdout);
     
     //
-    // Shutdown threads:
-    // All of our threads block on sem_wait or recvfrom. These are cancellation points.
-    // The threads default to the PTHREAD_CANCEL_DEFERRED, meaning they can only cancel
-    // while inside of one of these cancellation points. This should protect us from
-    // memory leaks during the processing/handling stage of each thread.
-    // pthread_setcancelstate(PTHREAD_CANCEL_ENABLE/DISABLE) are also wrapped around the
-    // processing stage in case that code calls any other cancellation points.
-    // Joins all the cancelled threads to cleanup their memory (stack and descriptor.)
+    // Drain: stop taking new queries but keep answering the ones we have, so
+    // their clients don't all time out and retry elsewhere at once.
+    // Shutting the listeners down for reading refuses new TCP connections and
+    // makes the inbox threads' reads return, so they exit. The event loops,
+    // io_uring threads and TCP threads stop reading queries when they see
+    // Draining(). Everything else runs until nothing is in flight or the
+    // drain deadline is up. Another signal kills us outright.
     //
-    printf("Shutting down threads...\n");
+    chrono::steady_clock::time_point drainStart = chrono::steady_clock::now();
+    chrono::steady_clock::time_point lastReport = drainStart;
+    unsigned long long servedBefore = mStats.Get(STATS_SERVED);
+    unsigned long long timeOutsBefore = mStats.Get(STATS_TIMEOUTS);
+    size_t inFlight = 0;
+    
+    mDraining = true;
+    for (auto pipeline : mPipelines)
+        pipeline->StopIntake();
     for (auto stObj : mInboxThreads)
     {
         if (stObj->GetThread())
-        {
-            pthread_cancel(stObj->GetThread()->native_handle());
             stObj->GetThread()->join();
+    }
+    
+    while (!Drained(inFlight))
+    {
+        chrono::steady_clock::time_point rightNow = chrono::steady_clock::now();
+        long elapsedMS = chrono::duration_cast<chrono::milliseconds>(rightNow - drainStart).count();
+        if (elapsedMS >= (long) mConfig.mDrainMS)
+            break;
+        if (rightNow - lastReport >= chrono::milliseconds(500))
+        {
+            unsigned long long drained = mStats.Get(STATS_SERVED) - servedBefore;
+            printf("Draining: %zu in flight, %llu answered, %ld ms left\n",
+                   inFlight, drained, (long) mConfig.mDrainMS - elapsedMS);
+            fflush(stdout);
+            lastReport = rightNow;
         }
+        this_thread::sleep_for(chrono::milliseconds(10));
+    }
+    long drainMS = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - drainStart).count();
+    
+    //
+    // Shutdown threads:
+    // Every thread checks ShuttingDown() each time around its loop, so we
+    // only have to wake up the ones that are waiting. The stop eventfd is in
+    // every epoll, poll and io_uring wait; the processing threads wait on
+    // their pipeline's Inbox wakeup instead. Then join them all to clean up
+    // their memory (stack and descriptor.)
+    //
+    printf("Shutting down threads...\n");
+    mShuttingDown = true;
+    uint64_t one = 1;
+    if (write(mStopFD, &one, sizeof(one)) < 0)
+    {
+        ReportError("eventfd write failed, errno %d", errno);
     }
+    for (auto stObj : mProcessThreads)
+        stObj->GetPipeline()->GetInboxWakeup()->Post();
+    
     for (auto stObj : mProcessThreads)
     {
         if (stObj->GetThread())
-        {
-            pthread_cancel(stObj->GetThread()->native_handle());
             stObj->GetThread()->join();
-        }
     }
     for (auto stObj : mOutboxThreads)
     {
         if (stObj->GetThread())
-        {
-            pthread_cancel(stObj->GetThread()->native_handle());
             stObj->GetThread()->join();
-        }
     }
-    pthread_cancel(mMaintainenceThread->GetThread()->native_handle());
-    mMaintainenceThread->GetThread()->join();
+    for (auto stObj : mEventLoopThreads)
+    {
+        if (stObj->GetThread())
+            stObj->GetThread()->join();
+    }
+    for (auto stObj : mUringThreads)
+    {
+        if (stObj->GetThread())
+            stObj->GetThread()->join();
+    }
+    for (auto stObj : mCoroThreads)
+    {
+        if (stObj->GetThread())
+            stObj->GetThread()->join();
+    }
+    for (auto stObj : mTCPThreads)
+    {
+        if (stObj->GetThread())
+            stObj->GetThread()->join();
+    }
+    for (auto stObj : mFwdTCPThreads)
+    {
+        if (stObj->GetThread())
+            stObj->GetThread()->join();
+    }
+    if (mMaintainenceThread)
+    {
+        mMaintainenceThread->GetThread()->join();
+    }
+    
+    // Whatever is still queued or waiting on the remote DNS server now is dropped
+    Drained(inFlight);
     printf("Shutting down threads: complete.\n");
     
     //
-    // Print stats
+    // Print stats (every thread is done, the snapshot is exact)
     //
-    int packetsIn = mStatsPacketsIn;
-    int packetsOut = mStatsPacketsOut;
-    int requests = mStatsRequests;
-    int served = mStatsServed;
-    int timeOuts = mStatsTimeOuts;
-    int processing = mStatsRequests - (mStatsServed+mStatsTimeOuts);
+    StatsSnapshot stats;
+    mStats.Snapshot(stats);
+    long long processing = (long long)(stats[STATS_REQUESTS] -
+                                       (stats[STATS_SERVED] + stats[STATS_TIMEOUTS] + stats[STATS_WRONG_QUESTIONS]));
     printf("\nStatistics:\n\t");
-    printf("PacketsIn(%d), PacketsOut(%d), Requests(%d), Served(%d), TimeOuts(%d), Processing(%d)\n\n",
-           packetsIn, packetsOut, requests, served, timeOuts, processing);
+    printf("PacketsIn(%llu), PacketsOut(%llu), Requests(%llu), Served(%llu), TimeOuts(%llu), WrongQuestions(%llu), "
+           "Processing(%lld)\n\n",
+           stats[STATS_PACKETS_IN], stats[STATS_PACKETS_OUT], stats[STATS_REQUESTS], stats[STATS_SERVED],
+           stats[STATS_TIMEOUTS], stats[STATS_WRONG_QUESTIONS], processing);
+    printf("Drain (max %u ms):\n\t", mConfig.mDrainMS);
+    printf("Drained(%llu), TimedOut(%llu), Abandoned(%zu), Took(%ld ms)\n\n",
+           stats[STATS_SERVED] - servedBefore, stats[STATS_TIMEOUTS] - timeOutsBefore, inFlight, drainMS);
+    if (mConfig.mBatchIO)
+    {
+        unsigned long long recvBatches = stats[STATS_RECV_BATCHES];
+        unsigned long long sendBatches = stats[STATS_SEND_BATCHES];
+        printf("Batching (max %u per call):\n\t", mConfig.mBatchSize);
+        printf("RecvBatches(%llu) AvgFill(%.2f), SendBatches(%llu) AvgFill(%.2f)\n\n",
+               recvBatches, recvBatches ? (double)stats[STATS_RECV_DATAGRAMS] / recvBatches : 0.0,
+               sendBatches, sendBatches ? (double)stats[STATS_SEND_DATAGRAMS] / sendBatches : 0.0);
+    }
+    if (mCache)
+    {
+        printf("Cache (%zu of max %zu entries in %u shards, max TTL %u s):\n\t", mCache->GetCount(),
+               mCache->GetMaxEntries(), mCache->GetShardCount(), mCache->GetMaxTTL());
+        printf("Hits(%llu), Misses(%llu), Inserts(%llu), Expired(%llu), Evicted(%llu)\n\n",
+               stats[STATS_CACHE_HITS], stats[STATS_CACHE_MISSES], stats[STATS_CACHE_INSERTS],
+               stats[STATS_CACHE_EXPIRED], stats[STATS_CACHE_EVICTED]);
+    }
+    if (mConfig.mTCP)
+    {
+        printf("TCP:\n\tConnections(%llu), Queries(%llu)\n\n",
+               stats[STATS_TCP_CONNECTIONS], stats[STATS_TCP_QUERIES]);
+    }
+    if (mConfig.mFwdTCPConns)
+    {
+        printf("Upstream TCP (%u connections per pipeline):\n\tQueries(%llu), TCRetries(%llu)\n\n",
+               mConfig.mFwdTCPConns, stats[STATS_FWD_TCP_QUERIES], stats[STATS_FWD_TCP_RETRIES]);
+    }
+    if (mConfig.mUDPGSO)
+    {
+        unsigned long long gsoSends = stats[STATS_GSO_SENDS];
+        unsigned long long groReceives = stats[STATS_GRO_RECEIVES];
+        printf("UDP GSO/GRO:\n\t");
+        printf("GSOSends(%llu) AvgSegments(%.2f), GROReceives(%llu) AvgSegments(%.2f)\n\n",
+               gsoSends, gsoSends ? (double)stats[STATS_GSO_SEGMENTS] / gsoSends : 0.0,
+               groReceives, groReceives ? (double)stats[STATS_GRO_SEGMENTS] / groReceives : 0.0);
+    }
+    if (mConfig.mFuseStages)
+    {
+        printf("Stages: fused (%u inbox threads per pipeline process their own queries)\n\n",
+               mConfig.mInboxThreadCount);
+    }
+    else if (mConfig.mEngine == SERVER_ENGINE_PIPELINE)
+    {
+        printf("Inbox wakeups (spin %u):\n\tSpinHits(%llu), Sleeps(%llu)\n\n",
+               mConfig.mWakeupSpin, stats[STATS_INBOX_SPIN_HITS], stats[STATS_INBOX_SLEEPS]);
+        
+        size_t depth = 0;
+        size_t peakDepth = 0;
+        for (auto pipeline : mPipelines)
+        {
+            depth += pipeline->GetInboxDepth();
+            peakDepth = max(peakDepth, pipeline->GetInboxPeakDepth());
+        }
+        printf("Inbox rings (%zu slots each, %u inbox/%u processing threads per pipeline):\n\t",
+               mPipelines[0]->GetInboxCapacity(), mConfig.mInboxThreadCount, mConfig.mProcessThreadCount);
+        printf("Depth(%zu), PeakDepth(%zu), Full(%llu)\n\n", depth, peakDepth, stats[STATS_INBOX_FULL]);
+        
+        printf("Shedding (%s, limit %zu per pipeline):\n\t", GetShedPolicyName(mConfig.mShedPolicy),
+               mPipelines[0]->GetInboxLimit());
+        printf("DropNewest(%llu), DropOldest(%llu), Refused(%llu), Truncated(%llu), CacheMisses(%llu), CacheHits(%llu)\n\n",
+               stats[STATS_SHED_DROP_NEWEST], stats[STATS_SHED_DROP_OLDEST], stats[STATS_SHED_REFUSED],
+               stats[STATS_SHED_TRUNCATED], stats[STATS_SHED_CACHE_MISSES], stats[STATS_SHED_CACHE_HITS]);
+        
+        printf("Processing threads:\n");
+        for (auto stObj : mProcessThreads)
+        {
+            unsigned long long workerRequests = stObj->mStatsRequests;
+            unsigned long long workerStolen = stObj->mStatsStolen;
+            printf("\tPipeline %u worker %u: Utilization(%.1f%%), Requests(%llu), Stolen(%llu)\n",
+                   stObj->GetPipeline()->GetIndex(), stObj->GetWorker(), stObj->GetUtilization() * 100.0,
+                   workerRequests, workerStolen);
+        }
+        printf("\n");
+    }
+    else if (mConfig.mEngine == SERVER_ENGINE_CORO)
+    {
+        uint64_t retries = 0;
+        uint64_t hedges = 0;
+        uint64_t hedgeWins = 0;
+        uint64_t frames = 0;
+        uint64_t heapFrames = 0;
+        size_t peakFrames = 0;
+        size_t frameChunks = 0;
+        for (auto stObj : mCoroThreads)
+        {
+            retries += stObj->mStatsRetries;
+            hedges += stObj->mStatsHedges;
+            hedgeWins += stObj->mStatsHedgeWins;
+            frames += stObj->mStatsFrames;
+            heapFrames += stObj->mStatsHeapFrames;
+            peakFrames = max(peakFrames, stObj->mStatsPeakFrames);
+            frameChunks += stObj->mStatsFrameChunks;
+        }
+        printf("Coroutines (%u retries, hedge after %u ms):\n\t", mConfig.mCoroRetries, mConfig.mCoroHedgeMS);
+        printf("Retries(%llu), Hedges(%llu), HedgeWins(%llu)\n\t", (unsigned long long) retries,
+               (unsigned long long) hedges, (unsigned long long) hedgeWins);
+        printf("Frames(%llu), HeapFrames(%llu), PeakLive(%zu), PoolChunks(%zu)\n\n",
+               (unsigned long long) frames, (unsigned long long) heapFrames, peakFrames, frameChunks);
+    }
+    {
+        OutboxTable *outbox = mPipelines[0]->GetOutbox();
+        unsigned int fwdCount = mPipelines[0]->GetFwdSocketCount();
+        printf("Outbox (%u slots per forward socket, %u per upstream TCP connection):\n"
+               "\tStaleReplies(%llu), Evictions(%llu)\n\n",
+               outbox->GetSlotCount(0), mConfig.mFwdTCPConns ? outbox->GetSlotCount(fwdCount) : 0,
+               stats[STATS_OUTBOX_STALE_REPLIES], stats[STATS_OUTBOX_EVICTIONS]);
+    }
+    if (!mConfig.mPacketRing.empty())
+    {
+        printf("Packet rings (%s):\n", mConfig.mPacketRing.c_str());
+        for (auto pipeline : mPipelines)
+        {
+            PacketRing *ring = pipeline->GetPacketRing();
+            if (!ring)
+                continue;
+            ring->UpdateStats();
+            unsigned long long ringPackets = ring->mStatsPackets;
+            unsigned long long ringDrops = ring->mStatsDrops;
+            unsigned long long ringFreezes = ring->mStatsFreezes;
+            printf("\tRing %u: Packets(%llu), Drops(%llu), Freezes(%llu)\n",
+                   pipeline->GetIndex(), ringPackets, ringDrops, ringFreezes);
+        }
+        printf("\n");
+    }
     fflush(stdout);
     
     return 0;
@@ -300,16 +734,23 @@ int Server::RunServer()
 //////////////////////////////////////////////////////////////////////////////////
 //
 //     Function: Server::HandleSignal()
-//  Description: Handle any signal tells us to shut down.
+//  Description: Handle any signal tells us to shut down. Runs in a signal
+//               handler, so it only makes async-signal-safe calls: it writes
+//               the signal eventfd RunServer() is blocked reading.
 //        Input: Signal
 //
 //////////////////////////////////////////////////////////////////////////////////
 
 void Server::HandleSignal(int inSig)
 {
-    printf("Received signal %d, shutting down...\n", inSig);
-    fflush(stdout);
-    sShuttingDownCV.notify_all();
+    int savedErrno = errno;
+    sSignal = inSig;
+    uint64_t one = 1;
+    if (write(sSignalFD, &one, sizeof(one)) < 0)
+    {
+        // Nothing we can report from here, the eventfd can't overflow
+    }
+    errno = savedErrno;
     
     // Reset signal handlers in case the shutdown stalled.
     signal(SIGINT, nullptr);
@@ -321,274 +762,1896 @@ void Server::HandleSignal(int inSig)
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::InboxQueuePopFront()
-//  Description: Push the next Request object onto the Inbox queue.
-//        Input: inReq (IN) the Request.
-//      Returns: Non-zero on failure.
+//     Function: Server::Drained()
+//  Description: Check whether anything is left to answer. A busy thread may be
+//               between taking a Request off one stage and putting it on the
+//               next (or sending its reply), so we look at the threads both
+//               before and after the stages.
+//       Inputs: outInFlight (OUT) Requests in the Inbox rings and the Outboxes
+//                   (the coro engine's queries instead of their Outbox attempts)
+//      Returns: True if nothing is in flight and no thread is busy.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-int Server::InboxQueuePushBack(unique_ptr<Request> inReq)
+bool Server::Drained(size_t &outInFlight)
 {
-    mInboxQueueMutex.lock();
-    mInboxQueue.push(move(inReq));
-    ++mStatsPacketsIn;
-    mInboxQueueMutex.unlock();
-    if (sem_post(mInboxQueueSemaphore))
+    bool busy = ThreadsBusy();
+    outInFlight = 0;
+    for (auto pipeline : mPipelines)
     {
-        ReportError("sem_post(mInboxQueueSemaphore) failed");
-        return -1;
+        // Every Request in a coro engine Outbox is a waiting coroutine's attempt
+        outInFlight += pipeline->GetInboxDepth();
+        if (pipeline->GetCoroThread())
+            outInFlight += pipeline->GetCoroThread()->GetInFlight();
+        else
+            outInFlight += pipeline->GetOutbox()->GetInFlight();
     }
-    return 0;
+    if (ThreadsBusy())
+        busy = true;
+    return !busy && outInFlight == 0;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::InboxQueuePopFront()
-//  Description: Pop the next Request object off the Inbox queue.
-//      Returns: The Request object or nullptr.
+//     Function: Server::ThreadsBusy()
+//  Description: Check whether any thread that moves Requests along is in the
+//               middle of handling something.
+//      Returns: True if one is.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-unique_ptr<Request> Server::InboxQueuePopFront()
+bool Server::ThreadsBusy()
 {
-    mInboxQueueMutex.lock();
-    if (!mInboxQueue.front())
+    for (auto stObj : mProcessThreads)
     {
-        mInboxQueueMutex.unlock();
-        return nullptr;
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mOutboxThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mEventLoopThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mUringThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mCoroThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mTCPThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
+    }
+    for (auto stObj : mFwdTCPThreads)
+    {
+        if (stObj->IsBusy())
+            return true;
     }
-    unique_ptr<Request> outReq(move(mInboxQueue.front()));
-    mInboxQueue.pop();
-    mInboxQueueMutex.unlock();
-    return move(outReq);
+    return false;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::InboxQueueWaitForData()
-//  Description: Block until Requests arrive in the Inbox.
-//      Returns: Non-zero on failure.
+//     Function: Server::GetCPUQuota()
+//  Description: How many CPUs we may keep busy: the cgroup CPU quota (v2
+//               cpu.max or v1 cfs_quota_us/cfs_period_us) rounded up, capped
+//               at the cores we have. Containers often get a quota well below
+//               the host's core count.
+//      Returns: At least 1.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-int Server::InboxQueueWaitForData()
+unsigned int Server::GetCPUQuota()
 {
-    if (sem_wait(mInboxQueueSemaphore))
+    unsigned int cpus = max(thread::hardware_concurrency(), 1u);
+    long long quota = -1;
+    long long period = 0;
+
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (file)
     {
-        ReportError("sem_wait() failed");
-        return -1;
+        char quotaStr[32];
+        if (fscanf(file, "%31s %lld", quotaStr, &period) == 2 && strcmp(quotaStr, "max"))
+            quota = atoll(quotaStr);
+        fclose(file);
     }
-    return 0;
+    else if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r")) != nullptr)
+    {
+        if (fscanf(file, "%lld", &quota) != 1)
+            quota = -1;
+        fclose(file);
+        if ((file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r")) != nullptr)
+        {
+            if (fscanf(file, "%lld", &period) != 1)
+                period = 0;
+            fclose(file);
+        }
+    }
+
+    if (quota > 0 && period > 0)
+    {
+        unsigned int quotaCPUs = (unsigned int)((quota + period - 1) / period);
+        cpus = max(min(cpus, quotaCPUs), 1u);
+    }
+    return cpus;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::GenerateUniqueID()
-//  Description: Generate an ID unique to this server since we may be passing
-//               requests through that contain possible duplicate IDs.
-//      Returns: the ID.
+//     Function: Server::GetRole()
+//  Description: Thread role by name, as --pin takes it.
+//       Inputs: inName (IN) role name
+//      Returns: SERVER_ROLE_*, -1 if there is no such role.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-unsigned short Server::GenerateUniqueID()
+int Server::GetRole(const char *inName)
 {
-    // This could obviously be improved upon to create less predictable IDs
-    unsigned short idOut;
-    mGenIDMutex.lock();
-    if (++mGenIDCounter == USHRT_MAX)
-        mGenIDCounter = 1;
-    idOut = mGenIDCounter;
-    mGenIDMutex.unlock();
-    return idOut;
+    for (int role = 0; role < SERVER_ROLES; ++role)
+    {
+        if (!strcmp(inName, GetRoleName(role)))
+            return role;
+    }
+    return -1;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::OutboxAdd()
-//  Description: Add a request to the Outbox.
-//       Inputs: inReq (IN) the Request object.
-//      Returns: Non-zero on failure.
+//     Function: Server::GetRoleName()
+//  Description: Name of a thread role.
+//       Inputs: inRole (IN) SERVER_ROLE_*
+//      Returns: The name.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-
-int Server::OutboxAdd(unique_ptr<Request> inReq)
+const char* Server::GetRoleName(int inRole)
 {
-    mOutboxMutex.lock();
-    inReq->mForwardedTime = chrono::high_resolution_clock::now();
-    mOutboxQueue.push(inReq->mOurPacketID);
-    mOutboxArray[inReq->mOurPacketID] = move(inReq);
-    mOutboxMutex.unlock();
-    if (sem_post(mOutboxSemaphore))
-    {
-        ReportError("sem_post(mOutboxSemaphore) failed");
-        return -1;
-    }
-    return 0;
+    static const char *sNames[SERVER_ROLES] = { "listener", "process", "outbox", "tcp", "fwdtcp", "maint" };
+    return inRole >= 0 && inRole < SERVER_ROLES ? sNames[inRole] : "?";
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::OutboxRemove()
-//  Description: Remove a Request from the Outbox.
-//        Input: inID (IN) the packet ID (ours) of the Request.
-//      Returns: The Request object on success or nullptr if it didn't exist.
+//     Function: Server::GetShedPolicy()
+//  Description: Shedding policy by name, as --shed takes it.
+//       Inputs: inName (IN) policy name
+//      Returns: SERVER_SHED_*, -1 if there is no such policy.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-unique_ptr<Request> Server::OutboxRemove(unsigned short inID)
+int Server::GetShedPolicy(const char *inName)
 {
-    mOutboxMutex.lock();
-    unique_ptr<Request>& storedAtID = mOutboxArray[inID];
-    if (storedAtID.get() == nullptr)
+    for (int policy = 0; policy < SERVER_SHED_POLICIES; ++policy)
     {
-        mOutboxMutex.unlock();
-        return nullptr;
+        if (!strcmp(inName, GetShedPolicyName(policy)))
+            return policy;
     }
-    unique_ptr<Request> outReq(move((storedAtID)));
-    mOutboxMutex.unlock();
-    return move(outReq);
+    return -1;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::OutboxTimeout()
-//  Description: Actively remove Requests from the Outbox that are over the server
-//               timeout limit. For the active method we use a separate queue
-//               (which is ordered by time) to quickly identify only the timed out
-//               packets.
+//     Function: Server::GetShedPolicyName()
+//  Description: Name of a shedding policy.
+//       Inputs: inPolicy (IN) SERVER_SHED_*
+//      Returns: The name.
 //
-//               All Requests check their timeout before responding, so nothing
-//               goes back to the client that is outside the timeout window. This
-//               method just cleans up those timeouts actively instead of waiting
-//               for a response or ID re-use to do it passively.
+//////////////////////////////////////////////////////////////////////////////////
+
+const char* Server::GetShedPolicyName(int inPolicy)
+{
+    static const char *sNames[SERVER_SHED_POLICIES] = { "drop-newest", "drop-oldest", "refused", "tc", "cache-first" };
+    return inPolicy >= 0 && inPolicy < SERVER_SHED_POLICIES ? sNames[inPolicy] : "?";
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Server::SetupPlacement()
+//  Description: Load the CPU/NUMA topology and work out the CPUs we may pin
+//               threads to: the per role lists (CPUs we can't run on are left
+//               out) and the CPUs of the RX queue IRQs for the listeners.
+//       Inputs: inPipelineCount (IN) pipelines there will be
+//      Returns: Non-zero on error.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-void Server::OutboxTimeout()
+int Server::SetupPlacement(unsigned int inPipelineCount)
 {
-    mOutboxMutex.lock();
-    chrono::high_resolution_clock::time_point rightNow = chrono::high_resolution_clock::now();
-    Request* oldestReq = nullptr;
-    unsigned short oldestReqID = 0;
+    if (mTopology.Load())
+        return -1;
     
-    while (!mOutboxQueue.empty())
+    for (int role = 0; role < SERVER_ROLES; ++role)
     {
-        oldestReqID = mOutboxQueue.front();
+        mPlaced[role] = 0;
+        mPinCPUs[role].clear();
+        if (mConfig.mPinCPUs[role].empty())
+            continue;
         
-        // Check that this entry exists in the mOutboxArray still
-        unique_ptr<Request> &storedAtID = mOutboxArray[oldestReqID];
-        if ((oldestReq = storedAtID.get()) == nullptr)
+        vector<int> cpus;
+        if (Topology::ParseCPUList(mConfig.mPinCPUs[role].c_str(), cpus))
+        {
+            ReportError("Invalid CPU list %s for %s threads", mConfig.mPinCPUs[role].c_str(), GetRoleName(role));
+            return -1;
+        }
+        for (auto cpu : cpus)
+        {
+            if (mTopology.IsUsable(cpu))
+                mPinCPUs[role].push_back(cpu);
+            else
+                printf("CPU %d isn't usable, %s threads won't be pinned to it\n", cpu, GetRoleName(role));
+        }
+        if (mPinCPUs[role].empty())
+        {
+            ReportError("None of the CPUs %s for %s threads are usable", mConfig.mPinCPUs[role].c_str(),
+                        GetRoleName(role));
+            return -1;
+        }
+    }
+    
+    // Like the other optional features, listeners just aren't aligned when this fails
+    mIRQCPUs.clear();
+    if (!mConfig.mIRQAffinity.empty())
+    {
+        vector<int> irqCPUs;
+        if (mTopology.GetIRQCPUs(mConfig.mIRQAffinity, irqCPUs) == 0)
+        {
+            for (auto cpu : irqCPUs)
+            {
+                if (mTopology.IsUsable(cpu))
+                    mIRQCPUs.push_back(cpu);
+            }
+        }
+        if (mIRQCPUs.empty())
+        {
+            printf("No usable RX queue IRQ CPUs for %s, listener threads not aligned\n", mConfig.mIRQAffinity.c_str());
+            mConfig.mIRQAffinity.clear();
+        }
+    }
+    
+    mPlacements.assign(inPipelineCount + 1, array<vector<string>, SERVER_ROLES>());
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Server::GetPlacement()
+//  Description: The CPU a thread is pinned to. Listeners go round robin over
+//               the RX queue IRQ CPUs if they are aligned, everything else
+//               round robin over its role's CPU list.
+//       Inputs: inRole (IN) SERVER_ROLE_*
+//               inOrdinal (IN) how many threads of the role came before it
+//      Returns: The CPU, none if it isn't pinned to one.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+vector<int> Server::GetPlacement(int inRole, unsigned int inOrdinal)
+{
+    if (inRole == SERVER_ROLE_LISTENER && !mIRQCPUs.empty())
+        return vector<int>(1, mIRQCPUs[inOrdinal % mIRQCPUs.size()]);
+    if (!mPinCPUs[inRole].empty())
+        return vector<int>(1, mPinCPUs[inRole][inOrdinal % mPinCPUs[inRole].size()]);
+    return vector<int>();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Server::EnterPlacement()
+//  Description: Bind the calling (main) thread the way the next thread of a
+//               role should run, so the thread starts out that way and its
+//               constructor's allocations come from its node: pinned to its
+//               CPU (GetPlacement()), else with --numa to its pipeline's
+//               node, and preferring the memory of the node it runs on. Call
+//               LeavePlacement() once every thread is running.
+//       Inputs: inRole (IN) SERVER_ROLE_*
+//               inPipeline (IN) its pipeline, nullptr for shared threads
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void Server::EnterPlacement(int inRole, ServerPipeline *inPipeline)
+{
+    vector<int> cpus = GetPlacement(inRole, mPlaced[inRole]++);
+    int node = inPipeline ? inPipeline->GetNode() : -1;
+    if (!cpus.empty())
+        node = mTopology.GetNode(cpus);
+    else if (mConfig.mNUMA && node >= 0)
+        cpus = mTopology.GetNodeCPUs(node);
+    mTopology.BindThread(cpus, node);
+    
+    size_t index = inPipeline ? inPipeline->GetIndex() : mPlacements.size() - 1;
+    mPlacements[index][inRole].push_back(cpus.empty() ? "any" : Topology::FormatCPUList(cpus));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Server::LeavePlacement()
+//  Description: Unbind the calling (main) thread again.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void Server::LeavePlacement()
+{
+    mTopology.BindThread(vector<int>(), -1);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Server::ReportTopology()
+//  Description: Print the topology and where each pipeline's threads went.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void Server::ReportTopology()
+{
+    string nodes;
+    for (auto node : mTopology.GetNodes())
+    {
+        nodes += nodes.empty() ? "" : ", ";
+        nodes += "node " + to_string(node) + ": " + Topology::FormatCPUList(mTopology.GetNodeCPUs(node));
+    }
+    printf("Topology:\n\tCPUs: %s (%zu of %u online), NUMA nodes: %zu (%s)\n\tMemory policy: %s\n",
+           Topology::FormatCPUList(mTopology.GetCPUs()).c_str(), mTopology.GetCPUs().size(),
+           mTopology.GetOnlineCount(), mTopology.GetNodes().size(), nodes.c_str(),
+           mTopology.HasMemPolicy() ? "node local" : "not available");
+    if (!mIRQCPUs.empty())
+    {
+        vector<int> irqCPUs = mIRQCPUs;
+        sort(irqCPUs.begin(), irqCPUs.end());
+        irqCPUs.erase(unique(irqCPUs.begin(), irqCPUs.end()), irqCPUs.end());
+        printf("\tRX queue IRQs (%s): %zu on CPUs %s\n", mConfig.mIRQAffinity.c_str(), mIRQCPUs.size(),
+               Topology::FormatCPUList(irqCPUs).c_str());
+    }
+    
+    bool placed = false;
+    for (auto &roles : mPlacements)
+    {
+        for (auto &threads : roles)
+            placed = placed || count(threads.begin(), threads.end(), "any") != (long) threads.size();
+    }
+    if (!placed)
+    {
+        printf("\tThreads: not pinned (see --numa, --pin, --irq-affinity)\n\n");
+        return;
+    }
+    
+    // A role's threads all on the same CPUs read "process 0-7 x4", else "process 4/5/6/7"
+    for (size_t i = 0; i < mPlacements.size(); ++i)
+    {
+        string line;
+        for (int role = 0; role < SERVER_ROLES; ++role)
         {
-            // This Request has already been processed, move on
-            mOutboxQueue.pop();
+            const vector<string> &threads = mPlacements[i][role];
+            if (threads.empty())
+                continue;
+            bool same = true;
+            string cpus;
+            for (auto &thread : threads)
+            {
+                same = same && thread == threads[0];
+                cpus += (cpus.empty() ? "" : "/") + thread;
+            }
+            if (same)
+                cpus = threads[0] + (threads.size() > 1 ? " x" + to_string(threads.size()) : "");
+            line += (line.empty() ? "" : ", ") + string(GetRoleName(role)) + " " + cpus;
+        }
+        if (line.empty())
             continue;
+        if (i < mPipelines.size() && mPipelines[i]->GetNode() >= 0)
+            printf("\tPipeline %zu (node %d): %s\n", i, mPipelines[i]->GetNode(), line.c_str());
+        else if (i < mPipelines.size())
+            printf("\tPipeline %zu: %s\n", i, line.c_str());
+        else
+            printf("\tShared: %s\n", line.c_str());
+    }
+    printf("\n");
+}
+
+
+//################################################################################
+//##
+//## Class: ServerPipeline
+//##
+//##  Desc: One inbox/process/outbox chain with its own sockets, packet ID
+//##        space, inbox queue and outbox.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::ServerPipeline()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inIndex (IN) index of this pipeline
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerPipeline::ServerPipeline(Server *inServer, unsigned int inIndex)
+: mServer(inServer),
+  mIndex(inIndex),
+  mNode(-1),
+  mServerSocket(-1),
+  mTCPSocket(-1),
+  mPacketRing(nullptr),
+  mFwdTCPCount(inServer->GetConfig().mFwdTCPConns),
+  mFwdTCPThread(nullptr),
+  mCoroThread(nullptr),
+  mGenIDNextFwd(0),
+  mNextWorkQueue(0),
+  mInboxPeakDepth(0),
+  mInboxLimit(0),
+  mInboxWakeup(nullptr),
+  mOutbox(nullptr),
+  mOutboxWakeup(nullptr),
+  mTimers(nullptr)
+{
+    unsigned int fwdCount = mServer->GetConfig().mFwdSockets;
+    if (fwdCount < 1)
+        fwdCount = 1;
+    mFwdSockets.assign(fwdCount, -1);
+    mOutbox = new OutboxTable(&mServer->mStats, fwdCount, SERVER_OUTBOX_SLOT_BITS, mFwdTCPCount, SERVER_OUTBOX_CONN_BITS);
+    
+    // An Inbox ring per processing thread (one even if the stages are fused)
+    unsigned int workers = mServer->GetConfig().mProcessThreadCount;
+    for (unsigned int i = 0; i < max(workers, 1u); ++i)
+        mWorkQueues.emplace_back(new MPMCRing<Request>(SERVER_INBOX_RING_SIZE));
+    mInboxLimit = mWorkQueues.size() * mWorkQueues[0]->GetCapacity();
+    if (mServer->GetConfig().mInboxLimit)
+        mInboxLimit = min(mInboxLimit, (size_t) mServer->GetConfig().mInboxLimit);
+    mTimers = new TimerWheel();
+    
+    // Handoff wakeups, private to this pipeline
+    mInboxWakeup = new Wakeup(mServer->GetConfig().mWakeupSpin, &mServer->mStats,
+                              STATS_INBOX_SPIN_HITS, STATS_INBOX_SLEEPS);
+    mOutboxWakeup = new Wakeup(mServer->GetConfig().mWakeupSpin, nullptr, 0, 0);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::~ServerPipeline()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerPipeline::~ServerPipeline()
+{
+    // Clean up sockets
+    for (auto &fwdSocket : mFwdSockets)
+    {
+        if (fwdSocket != -1)
+        {
+            close(fwdSocket);
+            fwdSocket = -1;
+        }
+    }
+    
+    if (mServerSocket != -1)
+    {
+        close(mServerSocket);
+        mServerSocket = -1;
+    }
+    
+    if (mTCPSocket != -1)
+    {
+        close(mTCPSocket);
+        mTCPSocket = -1;
+    }
+    
+    if (mPacketRing)
+    {
+        delete mPacketRing;
+        mPacketRing = nullptr;
+    }
+    
+    // Requests still waiting in the Inbox
+    vector<unique_ptr<Request>> leftOver;
+    bool stolen;
+    while (InboxQueuePopBatch(leftOver, SERVER_INBOX_POP_BATCH, 0, stolen))
+        leftOver.clear();
+    
+    // Clean up wakeups
+    if (mInboxWakeup)
+    {
+        delete mInboxWakeup;
+        mInboxWakeup = nullptr;
+    }
+    
+    if (mOutboxWakeup)
+    {
+        delete mOutboxWakeup;
+        mOutboxWakeup = nullptr;
+    }
+    
+    // Requests still in flight go with the table, their timers with the wheel
+    if (mOutbox)
+    {
+        delete mOutbox;
+        mOutbox = nullptr;
+    }
+    
+    if (mTimers)
+    {
+        delete mTimers;
+        mTimers = nullptr;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OpenSockets()
+//  Description: Create the forward socket pool and the 'Inbox' socket (and the
+//               TCP listener) and listen.
+//       Inputs: inReusePort (IN) set SO_REUSEPORT so several pipelines can bind
+//               the same port.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::OpenSockets(bool inReusePort)
+{
+    unsigned short serverPort = mServer->GetServerPort();
+    int fwdFamily = mServer->GetFwdSocketAddr()->sa_family;
+    
+    for (auto &fwdSocket : mFwdSockets)
+    {
+        fwdSocket = socket(fwdFamily, SOCK_DGRAM, 0);
+        if (fwdSocket == -1)
+        {
+            ReportError("Could not create socket, errno %d", errno);
+            return -1;
+        }
+        if (mServer->GetConfig().mUDPGSO && EnableGRO(fwdSocket))
+            return -1;
+    }
+    
+    //
+    // Listen dual-stack on AF_INET6 (IPv4 clients show up as IPv4-mapped
+    // addresses), or on plain AF_INET if that's all the host has.
+    //
+    memset(&mServerSocketAddr, 0, sizeof(mServerSocketAddr));
+    mServerSocket = -1;
+    if (mServer->GetConfig().mIPv6)
+    {
+        mServerSocket = socket(AF_INET6, SOCK_DGRAM, 0);
+        if (mServerSocket == -1 && errno != EAFNOSUPPORT)
+        {
+            ReportError("Could not create socket, errno %d", errno);
+            return -1;
+        }
+    }
+    if (mServerSocket != -1)
+    {
+        struct sockaddr_in6 *addr6 = (struct sockaddr_in6*) &mServerSocketAddr;
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_addr = in6addr_any;
+        addr6->sin6_port = htons(serverPort);
+    }
+    else
+    {
+        mServerSocket = socket(AF_INET, SOCK_DGRAM, 0);
+        if (mServerSocket == -1)
+        {
+            ReportError("Could not create socket, errno %d", errno);
+            return -1;
+        }
+        struct sockaddr_in *addr4 = (struct sockaddr_in*) &mServerSocketAddr;
+        addr4->sin_family = AF_INET;
+        addr4->sin_addr.s_addr = INADDR_ANY;
+        addr4->sin_port = htons(serverPort);
+    }
+    int family = mServerSocketAddr.ss_family;
+    socklen_t addrLen = SocketAddress::Length((struct sockaddr*) &mServerSocketAddr);
+    
+    int off = 0;
+    if (family == AF_INET6 &&
+        setsockopt(mServerSocket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)))
+    {
+        ReportError("setsockopt(IPV6_V6ONLY) failed, errno %d", errno);
+        return -1;
+    }
+    
+    if (mServer->GetConfig().mUDPGSO && EnableGRO(mServerSocket))
+        return -1;
+    
+    if (inReusePort)
+    {
+        int on = 1;
+        if (setsockopt(mServerSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)))
+        {
+            ReportError("setsockopt(SO_REUSEPORT) failed, errno %d", errno);
+            return -1;
+        }
+    }
+    
+    int rc = ::bind(mServerSocket, (struct sockaddr*)&mServerSocketAddr, addrLen);
+    if (rc != 0)
+    {
+        ReportError("Could not listen on port %d, errno %d", serverPort, errno);
+        return -1;
+    }
+    
+    //
+    // With a packet ring the queries are read from the ring (every pipeline's
+    // ring is in one fanout group) and the listener only sends the replies.
+    //
+    const string &ringInterface = mServer->GetConfig().mPacketRing;
+    if (!ringInterface.empty())
+    {
+        mPacketRing = new PacketRing();
+        if (mPacketRing->Open(ringInterface, serverPort, family, (unsigned short)getpid()) ||
+            PacketRing::MuteSocket(mServerSocket))
+        {
+            return -1;
+        }
+    }
+    
+    //
+    // TCP listener on the same port (non-blocking, the TCP thread accepts
+    // from epoll.)
+    //
+    if (mServer->GetConfig().mTCP)
+    {
+        mTCPSocket = socket(family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (mTCPSocket == -1)
+        {
+            ReportError("Could not create socket, errno %d", errno);
+            return -1;
         }
         
-        // If this entry hasn't timed out, none of the newer entries above it have either
-        long elapsedMS = chrono::duration_cast<chrono::milliseconds>(rightNow-oldestReq->mForwardedTime).count();
-        if (elapsedMS < SERVER_TIMEOUT_MS)
-            break;
+        int on = 1;
+        if (setsockopt(mTCPSocket, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+            (inReusePort && setsockopt(mTCPSocket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on))))
+        {
+            ReportError("setsockopt(SO_REUSEADDR/SO_REUSEPORT) failed, errno %d", errno);
+            return -1;
+        }
+        if (family == AF_INET6 &&
+            setsockopt(mTCPSocket, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off)))
+        {
+            ReportError("setsockopt(IPV6_V6ONLY) failed, errno %d", errno);
+            return -1;
+        }
         
-        // Timed out, remove it and delete it from the mOutboxArray
+        if (::bind(mTCPSocket, (struct sockaddr*)&mServerSocketAddr, addrLen) ||
+            listen(mTCPSocket, SERVER_TCP_BACKLOG))
+        {
+            ReportError("Could not listen on TCP port %d, errno %d", serverPort, errno);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::StopIntake()
+//  Description: Stop taking new queries when the server starts draining. The
+//               listener socket is shut down for reading: it isn't connected,
+//               so that fails with ENOTCONN, but it still wakes up everyone
+//               reading the socket and makes their reads return 0. Replies
+//               still go out on it. The TCP listener stops accepting and
+//               refuses new connections.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerPipeline::StopIntake()
+{
+    shutdown(mServerSocket, SHUT_RD);
+    if (mTCPSocket != -1)
+        shutdown(mTCPSocket, SHUT_RD);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::EnableGRO()
+//  Description: Let the kernel coalesce datagrams from one sender on a UDP
+//               socket (RecvBatch splits them up again.)
+//       Inputs: inSocket (IN) the socket
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::EnableGRO(int inSocket)
+{
+    int on = 1;
+    if (setsockopt(inSocket, SOL_UDP, UDP_GRO, &on, sizeof(on)))
+    {
+        ReportError("setsockopt(UDP_GRO) failed, errno %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::SetIncomingCPU()
+//  Description: Tell the kernel which CPU reads the listener sockets
+//               (SO_INCOMING_CPU), so it can hand this pipeline's socket the
+//               packets that arrive on that CPU.
+//       Inputs: inCPU (IN) the listener thread's CPU
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::SetIncomingCPU(int inCPU)
+{
+    for (int listenSocket : { mServerSocket, mTCPSocket })
+    {
+        if (listenSocket == -1)
+            continue;
+        if (setsockopt(listenSocket, SOL_SOCKET, SO_INCOMING_CPU, &inCPU, sizeof(inCPU)))
+        {
+            ReportError("setsockopt(SO_INCOMING_CPU) failed, errno %d", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::InboxQueuePushBatch()
+//  Description: Push Request objects onto the next processing thread's Inbox
+//               ring (round robin) with one claim and wake the processing
+//               threads once. What doesn't fit spills into the rings after
+//               it, and what doesn't fit anywhere is dropped.
+//        Input: inReqs (IN) the Requests, emptied.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::InboxQueuePushBatch(vector<unique_ptr<Request>> &inReqs)
+{
+    size_t count = inReqs.size();
+    if (count == 0)
+        return 0;
+    mServer->mStats.Add(STATS_PACKETS_IN, count);
+    
+    vector<Request*> reqs(count);
+    for (size_t i = 0; i < count; ++i)
+        reqs[i] = inReqs[i].get();
+    size_t queues = mWorkQueues.size();
+    size_t first = mNextWorkQueue++ % queues;
+    size_t pushed = 0;
+    for (size_t i = 0; i < queues && pushed < count; ++i)
+        pushed += mWorkQueues[(first + i) % queues]->PushBatch(&reqs[pushed], count - pushed);
+    for (size_t i = 0; i < pushed; ++i)
+        inReqs[i].release();
+    if (pushed < count)
+        mServer->mStats.Add(STATS_INBOX_FULL, count - pushed);
+    inReqs.clear();
+    
+    // Occupancy gauge, high water mark
+    size_t depth = GetInboxDepth();
+    size_t peak = mInboxPeakDepth.load(memory_order_relaxed);
+    while (depth > peak && !mInboxPeakDepth.compare_exchange_weak(peak, depth, memory_order_relaxed))
+    {
+    }
+    
+    if (pushed && mInboxWakeup->Post((unsigned int)pushed))
+    {
+        ReportError("Post(mInboxWakeup) failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::InboxQueuePopBatch()
+//  Description: Pop up to inMax Request objects off a processing thread's own
+//               Inbox ring. If it is empty, steal up to half of the fullest
+//               other ring instead.
+//       Inputs: outReqs (OUT) the Requests are appended here
+//               inMax (IN) most to pop
+//               inWorker (IN) the processing thread's ring
+//               outStolen (OUT) true if they came from another ring
+//      Returns: Number popped.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ServerPipeline::InboxQueuePopBatch(vector<unique_ptr<Request>> &outReqs, size_t inMax,
+                                          unsigned int inWorker, bool &outStolen)
+{
+    Request *reqs[SERVER_INBOX_POP_BATCH];
+    if (inMax > SERVER_INBOX_POP_BATCH)
+        inMax = SERVER_INBOX_POP_BATCH;
+    size_t queues = mWorkQueues.size();
+    size_t count = mWorkQueues[inWorker % queues]->PopBatch(reqs, inMax);
+    outStolen = false;
+    
+    while (count == 0 && queues > 1)
+    {
+        size_t victim = 0;
+        size_t victimSize = 0;
+        for (size_t i = 1; i < queues; ++i)
+        {
+            size_t index = (inWorker + i) % queues;
+            size_t size = mWorkQueues[index]->GetSize();
+            if (size > victimSize)
+            {
+                victim = index;
+                victimSize = size;
+            }
+        }
+        if (victimSize == 0)
+            break;
+        count = mWorkQueues[victim]->PopBatch(reqs, min(inMax, (victimSize + 1) / 2));
+        outStolen = count > 0;
+    }
+    
+    for (size_t i = 0; i < count; ++i)
+        outReqs.emplace_back(reqs[i]);
+    return count;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::GetInboxDepth()
+//  Description: Requests waiting in all of the Inbox rings (a snapshot.)
+//      Returns: The count.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ServerPipeline::GetInboxDepth()
+{
+    size_t depth = 0;
+    for (auto &queue : mWorkQueues)
+        depth += queue->GetSize();
+    return depth;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::GetInboxRoom()
+//  Description: How many more Requests the Inbox admits (a snapshot.)
+//      Returns: The count.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ServerPipeline::GetInboxRoom()
+{
+    size_t depth = GetInboxDepth();
+    return depth < mInboxLimit ? mInboxLimit - depth : 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::InboxQueueDropOldest()
+//  Description: Make room in the Inbox by dropping the Requests that have been
+//               waiting longest, off the heads of the fullest rings (the
+//               rings fill round robin, so their heads are about as old.)
+//       Inputs: inMax (IN) most to drop
+//      Returns: Number dropped.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ServerPipeline::InboxQueueDropOldest(size_t inMax)
+{
+    Request *reqs[SERVER_INBOX_POP_BATCH];
+    size_t dropped = 0;
+    while (dropped < inMax)
+    {
+        MPMCRing<Request> *fullest = nullptr;
+        size_t fullestSize = 0;
+        for (auto &queue : mWorkQueues)
+        {
+            size_t size = queue->GetSize();
+            if (size > fullestSize)
+            {
+                fullest = queue.get();
+                fullestSize = size;
+            }
+        }
+        if (!fullest)
+            break;
+    
+        size_t count = fullest->PopBatch(reqs, min(inMax - dropped, (size_t) SERVER_INBOX_POP_BATCH));
+        if (count == 0)
+            break;
+        for (size_t i = 0; i < count; ++i)
+            delete reqs[i];
+        dropped += count;
+    }
+    
+    // They were posted when pushed, take that back so nobody wakes up for them
+    if (dropped)
+        mInboxWakeup->Take((unsigned int) dropped);
+    return dropped;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::InboxQueueWaitForData()
+//  Description: Block until Requests arrive in the Inbox (spinning for a
+//               while first, see Wakeup.)
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::InboxQueueWaitForData()
+{
+    if (mInboxWakeup->Wait())
+    {
+        ReportError("Wait(mInboxWakeup) failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::InboxQueueTryWaitForData()
+//  Description: Like InboxQueueWaitForData() but never blocks. Batch mode uses
+//               this to find out if it should flush before going to sleep.
+//      Returns: Non-zero if no Requests are waiting.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::InboxQueueTryWaitForData()
+{
+    return mInboxWakeup->TryWait();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::GenerateUniqueID()
+//  Description: Generate an ID unique to this server since we may be passing
+//               requests through that contain possible duplicate IDs. The
+//               forward sockets (or upstream TCP connections) are used round
+//               robin and the ID comes from reserving one of that socket's
+//               Outbox slots, so it never collides with a live Request. The
+//               slot must be filled by OutboxAdd() or given back with
+//               ReleaseUniqueID().
+//       Inputs: outFwdIndex (OUT) the forward socket/connection to send on.
+//               inTCP (IN) pick an upstream TCP connection instead of a socket.
+//      Returns: the ID.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unsigned short ServerPipeline::GenerateUniqueID(unsigned short &outFwdIndex, bool inTCP)
+{
+    // This could obviously be improved upon to create less predictable IDs
+    unsigned int fwdFirst = inTCP ? (unsigned int) mFwdSockets.size() : 0;
+    unsigned int fwdCount = inTCP ? mFwdTCPCount : (unsigned int) mFwdSockets.size();
+    unsigned short fwdIndex = (unsigned short)(fwdFirst + mGenIDNextFwd++ % fwdCount);
+    unique_ptr<Request> evicted;
+    unsigned short idOut = mOutbox->Reserve(fwdIndex, evicted);
+    if (evicted && evicted->mCoroThread)
+    {
+        // Every slot of this forward socket is in flight, a coroutine waiting
+        // on the old one hears it timed out
+        ServerThreadCoro *coroThread = evicted->mCoroThread;
+        coroThread->QueueAnswer(move(evicted));
+    }
+    else if (evicted)
+    {
+        // Every slot of this forward socket is in flight, drop the old one
+        mServer->mStats.Add(STATS_TIMEOUTS);
+    }
+    outFwdIndex = fwdIndex;
+    return idOut;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::ReleaseUniqueID()
+//  Description: Give back an ID from GenerateUniqueID() that was never used.
+//       Inputs: inFwdIndex (IN) the forward socket/connection it was for.
+//               inID (IN) the ID.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerPipeline::ReleaseUniqueID(unsigned short inFwdIndex, unsigned short inID)
+{
+    mOutbox->Release(inFwdIndex, inID);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OutboxAdd()
+//  Description: Add a request to the Outbox, in the slot GenerateUniqueID()
+//               reserved for its mFwdIndex and mOurPacketID, and start its
+//               timeout.
+//       Inputs: inReq (IN) the Request object.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::OutboxAdd(unique_ptr<Request> inReq)
+{
+    inReq->mForwardedTime = chrono::high_resolution_clock::now();
+    uint64_t key = ((uint64_t) inReq->mFwdIndex << 16) | inReq->mOurPacketID;
+    uint64_t timer = mTimers->Arm(SERVER_TIMEOUT_MS, OutboxTimerFired, this, key);
+    mOutbox->Publish(move(inReq), timer);
+    if (mOutboxWakeup->Post())
+    {
+        ReportError("Post(mOutboxWakeup) failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OutboxRemove()
+//  Description: Remove a Request from the Outbox. A reply for an ID whose slot
+//               has since moved on to a newer Request is rejected. Its timeout
+//               isn't cancelled, that would take the timer wheel's lock on
+//               every reply: the timer fires into OutboxTimeout(), whose
+//               ClaimTimer() finds the slot doesn't hold it anymore.
+//        Input: inFwdIndex (IN) the forward socket the reply came in on.
+//               inID (IN) the packet ID (ours) of the Request.
+//      Returns: The Request object on success or nullptr if it didn't exist.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unique_ptr<Request> ServerPipeline::OutboxRemove(unsigned short inFwdIndex, unsigned short inID)
+{
+    if (inFwdIndex >= mFwdSockets.size() + mFwdTCPCount)
+        return nullptr;
+    
+    uint64_t timer = 0;
+    return mOutbox->Claim(inFwdIndex, inID, timer);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::RunTimers()
+//  Description: Fire the timers that are due. Called by whichever thread drives
+//               this pipeline's wheel once its timerfd is readable.
+//      Returns: How many fired.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t ServerPipeline::RunTimers()
+{
+    return mTimers->Advance();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OutboxTimerFired()
+//  Description: TimerWheel callback for a Request's timeout.
+//       Inputs: inContext (IN) the pipeline
+//               inData (IN) forward index << 16 | packet ID
+//               inTimer (IN) the timer
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerPipeline::OutboxTimerFired(void *inContext, uint64_t inData, uint64_t inTimer)
+{
+    ServerPipeline *pipeline = (ServerPipeline*) inContext;
+    pipeline->OutboxTimeout((unsigned short)(inData >> 16), (unsigned short) inData, inTimer);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OutboxTimeout()
+//  Description: Actively remove a Request from the Outbox that is over the server
+//               timeout limit. It is claimed from its slot the same way a reply
+//               would claim it, so whichever comes first wins.
+//
+//               All Requests check their timeout before responding, so nothing
+//               goes back to the client that is outside the timeout window. This
+//               method just cleans up those timeouts actively instead of waiting
+//               for a response or ID re-use to do it passively.
+//       Inputs: inFwdIndex (IN) the forward socket/connection
+//               inID (IN) the packet ID (ours) of the Request
+//               inTimer (IN) the timer that fired
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerPipeline::OutboxTimeout(unsigned short inFwdIndex, unsigned short inID, uint64_t inTimer)
+{
+    unique_ptr<Request> oldestReq(mOutbox->ClaimTimer(inFwdIndex, inID, inTimer));
+    if (!oldestReq)
+        return;
+    
+#if SERVER_VERBOSE
+    chrono::high_resolution_clock::time_point rightNow = chrono::high_resolution_clock::now();
+    long elapsedMS = chrono::duration_cast<chrono::milliseconds>(rightNow-oldestReq->mForwardedTime).count();
+    printf(">> Timeout(Active): %s, took %ld ms (max %d)\n", oldestReq->mDomainName.c_str(),
+           elapsedMS, SERVER_TIMEOUT_MS);
+    fflush(stdout);
+#endif
+    mServer->mStats.Add(STATS_TIMEOUTS);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerPipeline::OutboxWaitForData()
+//  Description: Block until Requests arrive in the Outbox.
+//        Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerPipeline::OutboxWaitForData()
+{
+    if (mOutboxWakeup->Wait())
+    {
+        ReportError("Wait(mOutboxWakeup) failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+//################################################################################
+//##
+//## Class: ServerThread
+//##
+//##  Desc: Server thread base class.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::ServerThread()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves, or nullptr
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThread::ServerThread(Server *inServer, ServerPipeline *inPipeline)
+: mServer(inServer),
+  mPipeline(inPipeline),
+  mThread(nullptr),
+  mClientBatch(nullptr),
+  mRecvBuffer(inServer->GetConfig().mMaxUDPSize),
+  mBusy(false)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::~ServerThread()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThread::~ServerThread()
+{
+    if (mThread)
+        delete mThread;
+    
+    if (mClientBatch)
+    {
+        delete mClientBatch;
+        mClientBatch = nullptr;
+    }
+    
+    for (auto fwdBatch : mFwdBatches)
+        delete fwdBatch;
+    mFwdBatches.clear();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::SendPacket()
+//  Description: Send a datagram, or queue it on a batch when batch mode is on.
+//       Inputs: inBatch (IN) the batch to queue on, nullptr to send right away
+//               inSocket (IN) socket to send on when not batching
+//               inData (IN) datagram data
+//               inLen (IN) datagram length
+//               inTo (IN) destination address
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThread::SendPacket(SendBatch *inBatch, int inSocket, const unsigned char *inData,
+                             size_t inLen, const struct sockaddr *inTo)
+{
+    if (inBatch)
+    {
+        return inBatch->Queue(inData, inLen, inTo);
+    }
+    
+    if (sendto(inSocket, inData, inLen, 0, inTo, SocketAddress::Length(inTo)) < 0)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::SendReply()
+//  Description: Send a reply to the client of a Request, over UDP or over the
+//               TCP connection it came in on.
+//       Inputs: inReq (IN) the Request
+//               inData (IN) reply data
+//               inLen (IN) reply length
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThread::SendReply(Request *inReq, unsigned char *inData, size_t inLen)
+{
+    if (inReq->mTCPConn)
+    {
+        inReq->mTCPConn->mOwner->QueueReply(inReq->mTCPConn, inData, inLen);
+        return 0;
+    }
+    
+    struct sockaddr_storage clientAddr;
+    if (!inReq->mClientAddr.Get(&clientAddr, mPipeline->GetServerFamily()))
+    {
+        return -1;
+    }
+    return SendPacket(mClientBatch, mPipeline->GetServerSocket(), inData, inLen,
+                      (struct sockaddr*) &clientAddr);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::CreateBatches()
+//  Description: Set up the send batches for this thread's pipeline when batch
+//               mode is on. Without them SendPacket() sends right away, which
+//               is also what happens if they can't all be allocated.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThread::CreateBatches()
+{
+    const ServerConfig& config = mServer->GetConfig();
+    if (config.mBatchIO && mPipeline)
+    {
+        mClientBatch = new SendBatch(mServer, mPipeline->GetServerSocket(), config.mBatchSize,
+                                     config.mMaxUDPSize, config.mBatchFlushUS);
+        bool failed = mClientBatch->Setup() != 0;
+        for (unsigned int i = 0; i < mPipeline->GetFwdSocketCount() && !failed; ++i)
+        {
+            mFwdBatches.push_back(new SendBatch(mServer, mPipeline->GetFwdSocket(i), config.mBatchSize,
+                                                config.mMaxUDPSize, config.mBatchFlushUS));
+            failed = mFwdBatches.back()->Setup() != 0;
+        }
+        
+        if (failed)
+        {
+            printf("Send batches could not be allocated, batching disabled\n");
+            delete mClientBatch;
+            mClientBatch = nullptr;
+            for (auto fwdBatch : mFwdBatches)
+                delete fwdBatch;
+            mFwdBatches.clear();
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::FlushBatches()
+//  Description: Flush the send batches (batch mode only.)
+//       Inputs: inForce (IN) flush regardless of the flush deadline
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThread::FlushBatches(bool inForce)
+{
+    for (auto fwdBatch : mFwdBatches)
+    {
+        if (inForce || fwdBatch->FlushDue())
+            fwdBatch->Flush();
+    }
+    if (mClientBatch && (inForce || mClientBatch->FlushDue()))
+        mClientBatch->Flush();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::ReadRequests()
+//  Description: Read client requests off the listener socket and hand each
+//               to HandlePacket(). Stops after SERVER_EVENT_BUDGET datagrams
+//               so replies from the remote DNS server don't starve; epoll
+//               will report the socket again if anything is left.
+//       Inputs: inBatch (IN) receive batch, or nullptr when not batching.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThread::ReadRequests(RecvBatch *inBatch)
+{
+    int serverSocket = mPipeline->GetServerSocket();
+    struct sockaddr_storage recvAddress;
+    int handled = 0;
+    
+    while (handled < SERVER_EVENT_BUDGET)
+    {
+        if (inBatch)
+        {
+            int count = inBatch->Receive(serverSocket, MSG_DONTWAIT);
+            if (count <= 0)
+                return;
+            for (int i = 0; i < count; ++i)
+            {
+                if (HandlePacket(inBatch->GetData(i), inBatch->GetLen(i), inBatch->GetFrom(i)))
+                {
+                    ReportError("Error handling packet");
+                }
+            }
+            handled += count;
+        }
+        else
+        {
+            socklen_t addrLen = sizeof(recvAddress);
+            int nbytes = recvfrom(serverSocket, (char*)&mRecvBuffer[0], mRecvBuffer.size(),
+                                  MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr*) &recvAddress, &addrLen);
+            if (nbytes <= 0)
+                return;
+            if (HandlePacket(&mRecvBuffer[0], nbytes, (struct sockaddr*) &recvAddress))
+            {
+                ReportError("Error handling packet");
+            }
+            ++handled;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::ReadReplies()
+//  Description: Read replies off one forward socket and send them on to the
+//               clients. Stops after SERVER_EVENT_BUDGET datagrams so the other
+//               sockets don't starve; epoll will report the socket again if
+//               anything is left.
+//       Inputs: inFwdIndex (IN) the forward socket to read.
+//               inBatch (IN) receive batch, or nullptr when not batching.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThread::ReadReplies(unsigned short inFwdIndex, RecvBatch *inBatch)
+{
+    int fwdSocket = mPipeline->GetFwdSocket(inFwdIndex);
+    struct sockaddr_storage recvAddress;
+    int handled = 0;
+    
+    while (handled < SERVER_EVENT_BUDGET)
+    {
+        if (inBatch)
+        {
+            int count = inBatch->Receive(fwdSocket, MSG_DONTWAIT);
+            if (count <= 0)
+                return;
+            for (int i = 0; i < count; ++i)
+            {
+                if (HandleReply(inBatch->GetData(i), inBatch->GetLen(i), inBatch->GetFrom(i),
+                                inFwdIndex))
+                {
+                    ReportError("Error handling packet");
+                }
+            }
+            handled += count;
+        }
+        else
+        {
+            socklen_t addrLen = sizeof(recvAddress);
+            int nbytes = recvfrom(fwdSocket, (char*)&mRecvBuffer[0], mRecvBuffer.size(),
+                                  MSG_DONTWAIT | MSG_TRUNC, (struct sockaddr*) &recvAddress, &addrLen);
+            if (nbytes < 0)
+                return;
+            if (HandleReply(&mRecvBuffer[0], nbytes, (struct sockaddr*) &recvAddress, inFwdIndex))
+            {
+                ReportError("Error handling packet");
+            }
+            ++handled;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::MakeRequest()
+//  Description: Turn a client packet into a Request. Nothing is checked but
+//               its size, this may not even be a valid packet.
+//       Inputs: inData (IN) packet data. Will be copied.
+//               inLen (IN) length of packet data.
+//               inFrom (IN) address this packet came from.
+//      Returns: The Request, nullptr if the packet is too large.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unique_ptr<Request> ServerThread::MakeRequest(unsigned char *inData, size_t inLen,
+                                              const struct sockaddr *inFrom)
+{
+    // Enforce max packet size (EDNS0 queries may be larger than 512 bytes)
+    if (inLen > mServer->GetConfig().mMaxUDPSize)
+    {
+        ReportError("Packet too large (%d bytes), discarded.", (int)inLen);
+        return nullptr;
+    }
+    
+    unique_ptr<Request> newReq(new Request());
+    newReq->mPacket.SetRawData(inData, inLen);
+    newReq->mClientAddr.Set(inFrom);
+    return newReq;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::PrepareRequest()
+//  Description: Decode and check a client's request, cap its EDNS0 payload
+//               size and remember the client's packet id. The first step of
+//               the processing stage, whichever engine runs it.
+//               It isn't counted here: the caller counts it as a request
+//               once it takes it on (a shed lookup isn't one.)
+//       Inputs: inReq (IN) the Request.
+//      Returns: Non-zero if the Request is to be dropped.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThread::PrepareRequest(Request *inReq)
+{
+    //
+    // Decode the packet
+    //
+    int rc = inReq->mPacket.Decode();
+    if (rc)
+    {
+        ReportError("Error decoding packet");
+        return -1;
+    }
+    
+    //cout << "ServerThread::PrepareRequest()\n";
+    //inReq->mPacket.Print();
+    
+    //
+    // Check packet validity and set domain
+    //
+    if (inReq->mPacket.mHeader.resp)
+    {
+        // This is a response packet, we're only supposed to see question
+        // packets here. Ignore it.
+        ReportError("Response packet found where question packet expected");
+        return -1;
+    }
+    inReq->mDomainName = inReq->mPacket.mQuestionName;
+    
+    //
+    // EDNS0: the client takes UDP replies up to its advertised payload size,
+    // which we cap at mMaxUDPSize (upstream sees the capped size too.)
+    //
+    unsigned short ednsSize = 0;
+    if (!inReq->mPacket.GetEDNSPayloadSize(ednsSize))
+    {
+        unsigned int maxUDPSize = mServer->GetConfig().mMaxUDPSize;
+        if (ednsSize > maxUDPSize)
+        {
+            ednsSize = maxUDPSize;
+            inReq->mPacket.SetEDNSPayloadSize(ednsSize);
+        }
+        if (ednsSize > SERVER_MAX_PACKET_SIZE)
+            inReq->mMaxReplySize = ednsSize;
+    }
+    
+    //
+    // Remember the client's packet id, forwarding replaces it with our own
+    //
+    unsigned short clientPacketId = 0;
+    if (inReq->mPacket.GetRawPacketID(clientPacketId))
+    {
+        ReportError("Failed to get raw packet id");
+        return -1;
+    }
+    inReq->mClientPacketID = clientPacketId;
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::ReplyFromCache()
+//  Description: Answer a Request from the cache, if it's there. The cached
+//               answer comes out of ResponseCache::Lookup() in this thread's
+//               buffer under the client's packet ID with its TTLs aged, and
+//               gets its question spelled the way the client spelled it
+//               (the same name, but resolvers check the case they
+//               randomized) before it goes out. On a miss the
+//               Request keeps the cache key, for AnswerClient() to put the
+//               answer in under. The caller counts the answer.
+//       Inputs: inReq (IN) the Request, through PrepareRequest().
+//      Returns: True if it was answered.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool ServerThread::ReplyFromCache(Request *inReq)
+{
+    ResponseCache *cache = mServer->GetCache();
+    if (!cache || ResponseCache::MakeKey(inReq->mPacket, inReq->mCacheKey))
+    {
+        return false;
+    }
+    if (!cache->Lookup(inReq->mCacheKey, inReq->mClientPacketID, mCacheReply))
+    {
+        return false;
+    }
+    inReq->mCacheKey.clear();
+    
+    unsigned char *data = &mCacheReply[0];
+    size_t dataLen = mCacheReply.size();
+    size_t questionLen = 0;
+    if (!inReq->mPacket.GetQuestionLen(questionLen) && sizeof(DNS_HEADER) + questionLen <= dataLen)
+    {
+        memcpy(data + sizeof(DNS_HEADER), inReq->mPacket.mRawPacketData + sizeof(DNS_HEADER), questionLen);
+    }
+    
+    //
+    // Send reply to original client, TC=1 if it's more than it takes over UDP
+    //
+    mServer->mStats.Add(STATS_PACKETS_OUT);
+    DNSPacket truncated;
+    if (!inReq->mTCPConn && dataLen > inReq->mMaxReplySize)
+    {
+        truncated.SetRawData(data, dataLen);
+        truncated.Truncate(&inReq->mPacket);
+        data = truncated.mRawPacketData;
+        dataLen = truncated.mRawPacketLen;
+    }
+    if (SendReply(inReq, data, dataLen))
+    {
+        ReportError("sendto client failed");
+    }
 #if SERVER_VERBOSE
-        printf(">> Timeout(Active): %s, took %ld ms (max %d)\n", oldestReq->mDomainName.c_str(),
-               elapsedMS, SERVER_TIMEOUT_MS);
-        fflush(stdout);
+    printf(">> Processed: %s (using Cache)\n", inReq->mDomainName.c_str());
+    fflush(stdout);
 #endif
-        delete storedAtID.release();
-        oldestReq = nullptr;
-        ++mStatsTimeOuts;
-        
-        // Continue checking the next oldest entry
-        mOutboxQueue.pop();
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThread::HandleRequest()
+//  Description: The processing stage. Decodes and checks the request, answers
+//               it from the cache or forwards it to the remote DNS server and
+//               moves it into the Outbox.
+//       Inputs: inReq (IN) the Request.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThread::HandleRequest(unique_ptr<Request> inReq)
+{
+    if (PrepareRequest(inReq.get()))
+    {
+        return -1;
+    }
+    mServer->mStats.Add(STATS_REQUESTS);
+    
+    //
+    // Check for a cached response
+    //
+    if (ReplyFromCache(inReq.get()))
+    {
+        mServer->mStats.Add(STATS_SERVED);
+        return 0;
     }
     
-    mOutboxMutex.unlock();
+    bool overTCP = mServer->GetConfig().mFwdTCPAlways && mPipeline->GetFwdTCPThread();
+    return ForwardRequest(move(inReq), overTCP);
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::InboxQueueWaitForData()
-//  Description: Block until Requests arrive in the Outbox.
-//        Returns: Non-zero on failure.
+//     Function: ServerThread::ForwardRequest()
+//  Description: Give the Request one of our packet IDs, move it into the Outbox
+//               and forward it to the remote DNS server over UDP, or over one
+//               of the pipeline's upstream TCP connections.
+//       Inputs: inReq (IN) the Request, with mClientPacketID already set.
+//               inTCP (IN) forward over TCP.
+//      Returns: Non-zero on failure.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-int Server::OutboxWaitForData()
+int ServerThread::ForwardRequest(unique_ptr<Request> inReq, bool inTCP)
 {
-    if (sem_wait(mOutboxSemaphore))
+    //
+    // Replace packet id with our own
+    //
+    Request* reqPtr = inReq.get();
+    unsigned short fwdIndex = 0;
+    unsigned short ourPacketId = mPipeline->GenerateUniqueID(fwdIndex, inTCP);
+    
+    if (reqPtr->mPacket.SetRawPacketID(ourPacketId))
+    {
+        mPipeline->ReleaseUniqueID(fwdIndex, ourPacketId);
+        ReportError("Failed to set raw packet id");
+        return -1;
+    }
+    reqPtr->mOurPacketID = ourPacketId;
+    reqPtr->mFwdIndex = fwdIndex;
+#if SERVER_VERBOSE
+    printf("Processing remote DNS request (%s) their_id(%u) our_id(%d)%s\n",
+           reqPtr->mDomainName.c_str(), reqPtr->mClientPacketID,
+           reqPtr->mOurPacketID, inTCP ? " over TCP" : "");
+    fflush(stdout);
+#endif
+    
+    //
+    // Add to outbox
+    //
+    mPipeline->OutboxAdd(move(inReq));
+    
+    //
+    // Forward to DNS server
+    //
+    unsigned char *buffer = reqPtr->mPacket.mRawPacketData;
+    size_t nbytes = reqPtr->mPacket.mRawPacketLen;
+    
+    mServer->mStats.Add(STATS_PACKETS_OUT);
+    if (inTCP)
+    {
+        mServer->mStats.Add(STATS_FWD_TCP_QUERIES);
+        mPipeline->GetFwdTCPThread()->QueueQuery(fwdIndex - mPipeline->GetFwdSocketCount(),
+                                                 buffer, nbytes);
+        return 0;
+    }
+    
+    int fwdSocket = mPipeline->GetFwdSocket(fwdIndex);
+    SendBatch *fwdBatch = mFwdBatches.empty() ? nullptr : mFwdBatches[fwdIndex];
+    const struct sockaddr* fwdSocketAddr = mServer->GetFwdSocketAddr();
+    if (SendPacket(fwdBatch, fwdSocket, buffer, nbytes, fwdSocketAddr))
     {
-        ReportError("sem_wait(mOutboxSemaphore) failed");
+        ReportError("sendto fwd dns server failed (fwdSocket: %d, data_size: %u)",
+                    fwdSocket, nbytes);
         return -1;
     }
+    
     return 0;
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::AddToCacheMap()
-//  Description: Super simple caching mechanism. Add to it. This was just for
-//               experimenting. Obviously you'd need something more intelligent
-//               that has TTL values and keeps itself from growing infinitely.
-//       Inputs: inDomain (IN) domain name string to cache.
-//               inPacket (IN) the packet data to cache. This will be copied.
+//     Function: ServerThread::HandleReply()
+//  Description: Handle a fwd dns server response and send it to the client.
+//       Inputs: inData (IN) packet data. Will be copied.
+//               inLen (IN) length of packet data.
+//               inFrom (IN) address this packet came from.
+//               inFwdIndex (IN) forward socket this packet came in on.
 //      Returns: Non-zero on failure.
 //
 //////////////////////////////////////////////////////////////////////////////////
-#if SERVER_USE_CACHE
-int Server::AddToCacheMap(string inDomain, pair<unsigned char*, size_t>& inPacket)
+
+int ServerThread::HandleReply(
+                               unsigned char *inData, size_t inLen, const struct sockaddr *inFrom,
+                               unsigned short inFwdIndex)
 {
-    mCacheMapMutex.lock();
-    if (mCacheMap.find(inDomain) != mCacheMap.end())
+    //
+    // Max packet size (on UDP, TCP replies can be any size). We never let a
+    // client advertise more than mMaxUDPSize upstream, but a reply that is
+    // bigger anyway was cut short at our buffer. Its header and question are
+    // still there, so it goes on as a truncated (TC=1) reply.
+    //
+    bool overTCP = inFwdIndex >= mPipeline->GetFwdSocketCount();
+    bool cutShort = false;
+    if (!overTCP && inLen > mServer->GetConfig().mMaxUDPSize)
+    {
+        inLen = mServer->GetConfig().mMaxUDPSize;
+        cutShort = true;
+    }
+    
+    // Process Packet
+    const struct sockaddr *fwdAddress = mServer->GetFwdSocketAddr();
+    
+    //
+    // Security check: we should only receive packets from fwd dns ip
+    // address and on the correct port. Anything else is fishy.
+    //
+    if (!SocketAddress::Equal(fwdAddress, inFrom))
+    {
+        ReportError("Reply from unexpected source: %s, expected %s, ignoring",
+                    SocketAddress::ToString(inFrom).c_str(),
+                    SocketAddress::ToString(fwdAddress).c_str());
+        return -1;
+    }
+    
+    //
+    // Get our packet ID
+    //
+    DNSPacket packet;
+    unsigned short ourID = 0;
+    
+    packet.SetRawData(inData, inLen);
+    if (packet.GetRawPacketID(ourID))
+    {
+        ReportError("Unable to get packet id");
+        return -1;
+    }
+    
+    //
+    // Make sure this is a response packet
+    //
+    packet.Decode();
+    if (!packet.mHeader.resp)
     {
-        mCacheMapMutex.unlock();
+        // This is a question. (resp set to 0)
+        ReportError("Outbox received a question (id %u), ignoring", ourID);
         return -1;
     }
-    pair<unsigned char*, size_t> newPacket;
-    newPacket.second = inPacket.second;
-    newPacket.first = (unsigned char*) malloc(inPacket.second);
-    memcpy(newPacket.first, inPacket.first, inPacket.second);
-    mCacheMap[inDomain] = newPacket;
-    mCacheMapMutex.unlock();
+    if (cutShort)
+    {
+        packet.mHeader.tc = 1;
+    }
+    mServer->mStats.Add(STATS_PACKETS_IN);
+    
+    //
+    // Lookup initial request
+    //
+    unique_ptr<Request> thisReq(mPipeline->OutboxRemove(inFwdIndex, ourID));
+    if (thisReq.get() == nullptr)
+    {
+        // This Request may have timed out, normal case.
+        return 0;
+    }
+    
+    //
+    // An attempt of the coro engine: the coroutine waiting on it decides what
+    // to do with the answer, on its own thread.
+    //
+    if (thisReq->mCoroThread)
+    {
+        // The query is the coroutine's, AnswerClient() puts its OPT back
+        if (cutShort)
+            packet.Truncate(nullptr);
+        thisReq->mPacket.SetRawData(packet.mRawPacketData, packet.mRawPacketLen);
+        thisReq->mPacket.mHeader = packet.mHeader;
+        ServerThreadCoro *coroThread = thisReq->mCoroThread;
+        coroThread->QueueAnswer(move(thisReq));
+        return 0;
+    }
+    
+    //
+    // Calculate elapsed time
+    //
+    chrono::high_resolution_clock::time_point rightNow = chrono::high_resolution_clock::now();
+    long elapsedMS = chrono::duration_cast<chrono::milliseconds>(rightNow-thisReq->mForwardedTime).count();
+    
+    //
+    // Passive timeout
+    //
+    // Check if the response came fast enough, otherwise discard.
+    if (elapsedMS >= SERVER_TIMEOUT_MS)
+    {
+#if SERVER_VERBOSE
+        mServer->mStats.Add(STATS_TIMEOUTS);
+        printf(">> Timeout(Passive): %s, took %ld ms (max %d)\n", thisReq->mDomainName.c_str(),
+               elapsedMS, SERVER_TIMEOUT_MS);
+        fflush(stdout);
+#endif
+        return 0;
+    }
+    
+    //
+    // Truncated over UDP: a TCP client can take the whole answer, so ask
+    // again over an upstream TCP connection. UDP clients get the TC=1
+    // reply and retry over TCP themselves.
+    //
+    if (packet.mHeader.tc && !overTCP && thisReq->mTCPConn && mPipeline->GetFwdTCPThread())
+    {
+        mServer->mStats.Add(STATS_FWD_TCP_RETRIES);
+        return ForwardRequest(move(thisReq), true);
+    }
+    
+    AnswerClient(thisReq.get(), packet, cutShort, elapsedMS);
     return 0;
 }
-#endif
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: Server::CheckCacheMap()
-//  Description: Super simple caching mechanism. Query it.
-//       Inputs: inDomain (IN) domain name string to search for.
-//               outPacket (OUT) the cached packet result if found.
-//      Returns: True if it found a cache hit.
+//     Function: ServerThread::AnswerClient()
+//  Description: Send the remote DNS server's answer to the client of a Request
+//               under the client's packet ID, and cache it if the cache
+//               missed it. An answer to some other question (spoofed, or a
+//               confused server) is dropped, and counted.
+//       Inputs: inReq (IN) the Request
+//               inPacket (IN) the answer, decoded
+//               inCutShort (IN) the answer was cut short at our UDP buffer
+//               inElapsedMS (IN) time it took upstream
 //
 //////////////////////////////////////////////////////////////////////////////////
-#if SERVER_USE_CACHE
-bool Server::CheckCacheMap(string inDomain, pair<unsigned char*, size_t>& outPacket)
+
+void ServerThread::AnswerClient(Request *inReq, DNSPacket &inPacket, bool inCutShort, long inElapsedMS)
 {
-    mCacheMapMutex.lock();
-    auto found = mCacheMap.find(inDomain);
-    if (found != mCacheMap.end())
+    if (!inPacket.SameQuestion(inReq->mPacket))
     {
-        outPacket = found->second;
-        mCacheMapMutex.unlock();
-        return true;
+        mServer->mStats.Add(STATS_WRONG_QUESTIONS);
+#if SERVER_VERBOSE
+        printf(">> Wrong question in the answer: %s\n", inReq->mDomainName.c_str());
+        fflush(stdout);
+#endif
+        return;
     }
-    mCacheMapMutex.unlock();
-    return false;
-}
+    
+    //
+    // Send reply to original client
+    //
+    mServer->mStats.Add(STATS_SERVED);
+    mServer->mStats.Add(STATS_PACKETS_OUT);
+    inPacket.SetRawPacketID(inReq->mClientPacketID);
+    
+    //
+    // Cache it whole, before it's cut down to what this client takes
+    //
+    if (!inReq->mCacheKey.empty() && !inCutShort)
+    {
+        mServer->GetCache()->Insert(inReq->mCacheKey, inPacket);
+    }
+    
+    if (inCutShort || inPacket.mHeader.tc ||
+        (!inReq->mTCPConn && inPacket.mRawPacketLen > inReq->mMaxReplySize))
+    {
+        // More than the client can take over UDP (a TCP answer, or an EDNS0
+        // answer bigger than it advertised), or cut short. It should retry
+        // over TCP. A cut short answer has lost its OPT record, an EDNS0
+        // client gets one back.
+        inPacket.Truncate(&inReq->mPacket);
+    }
+    //inPacket.Print();
+    if (SendReply(inReq, inPacket.mRawPacketData, inPacket.mRawPacketLen))
+    {
+        ReportError("sendto client failed");
+    }
+    
+#if SERVER_VERBOSE
+    printf(">> Processed: %s (using Remote DNS Server) %ld ms\n", inReq->mDomainName.c_str(), inElapsedMS);
+    fflush(stdout);
 #endif
+}
 
 
 //################################################################################
@@ -596,29 +2659,99 @@ bool Server::CheckCacheMap(string inDomain, pair<unsigned char*, size_t>& outPac
 //## Class: ServerThreadInbox
 //##
 //##  Desc: Reads packets off InboxPort (53 generally) and adds them to the
-//##        the inbox queue.
+//##        the inbox queue, or processes them itself with fused stages.
 //##
 //################################################################################
 
 
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadInbox::ServerThreadInbox()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread reads for
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadInbox::ServerThreadInbox(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline)
+{
+    // Fused stages forward and answer from this thread
+    if (inServer->GetConfig().mFuseStages)
+        CreateBatches();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadInbox::~ServerThreadInbox()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadInbox::~ServerThreadInbox()
+{
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////
 //
 //     Function: ServerThreadInbox::ThreadMain()
-//  Description: Main thread entry point.
+//  Description: Main thread entry point. Returns once the server is draining,
+//               StopIntake() wakes us up out of the socket read.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
 void ServerThreadInbox::ThreadMain()
 {
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    int serverSocket = mServer->GetServerSocket();
-    unsigned char buffer[SERVER_BUFFER_SIZE];
-    struct sockaddr_in recvAddress;
+    socklen_t addrLen;
+    int serverSocket = mPipeline->GetServerSocket();
+    struct sockaddr_storage recvAddress;
     int nbytes;
     
-    while (!mServer->ShuttingDown())
+    //
+    // Batch mode: pull as many datagrams as are waiting with each recvmmsg()
+    //
+    const ServerConfig& config = mServer->GetConfig();
+    RecvBatch recvBatch(mServer, config.mBatchSize, config.mMaxUDPSize);
+    if (config.mBatchIO && recvBatch.Setup() == 0)
+    {
+        while (!mServer->Draining())
+        {
+            // Once StopIntake() shut the socket down we get a batch of empty reads
+            int count = recvBatch.Receive(serverSocket, 0);
+            if (count <= 0 || mServer->Draining())
+            {
+                continue;
+            }
+            
+            // Process Packets
+            mBusy = true;
+            try
+            {
+                for (int i = 0; i < count; ++i)
+                {
+                    if (this->HandlePacket(recvBatch.GetData(i), recvBatch.GetLen(i),
+                                           recvBatch.GetFrom(i)))
+                    {
+                        ReportError("Error handling packet");
+                    }
+                }
+                QueuePending();
+            }
+            catch (...)
+            {
+                ReportError("Caught exception");
+            }
+            mBusy = false;
+        }
+        return;
+    }
+    
+    while (!mServer->Draining())
     {
-        nbytes = recvfrom(serverSocket, (char*)buffer, SERVER_BUFFER_SIZE, 0,
+        addrLen = sizeof(recvAddress);
+        nbytes = recvfrom(serverSocket, (char*)&mRecvBuffer[0], mRecvBuffer.size(), MSG_TRUNC,
                           (struct sockaddr*) &recvAddress, &addrLen);
         if (nbytes <= 0)
         {
@@ -626,50 +2759,164 @@ void ServerThreadInbox::ThreadMain()
         }
         
         // Process Packet
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+        mBusy = true;
         try
         {
-            if (this->HandlePacket(buffer, nbytes, &recvAddress))
+            if (this->HandlePacket(&mRecvBuffer[0], nbytes, (struct sockaddr*) &recvAddress))
             {
                 ReportError("Error handling packet");
             }
+            QueuePending();
         }
         catch (...)
         {
             ReportError("Caught exception");
         }
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+        mBusy = false;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadInbox::HandlePacket()
+//  Description: Minimal processing is done at this stage, this may not even be
+//               a valid packet. We simply copy the data and hold it for
+//               QueuePending() to hand to the processing thread; leaving more
+//               time to read new packets on the Inbox thread.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadInbox::HandlePacket(
+                                    unsigned char *inData, size_t inLen, const struct sockaddr *inFrom)
+{
+    unique_ptr<Request> newReq = MakeRequest(inData, inLen, inFrom);
+    if (newReq)
+    {
+        mPending.push_back(move(newReq));
+    }
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadInbox::QueuePending()
+//  Description: Push everything HandlePacket() has held onto the Inbox ring,
+//               a whole receive batch at a time, as far as the Inbox limit
+//               admits it (the rest is shed.) With fused stages run it
+//               through the processing stage right here instead, and send
+//               what that queued before we block in the next receive.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadInbox::QueuePending()
+{
+    if (mServer->GetConfig().mFuseStages)
+    {
+        mServer->mStats.Add(STATS_PACKETS_IN, mPending.size());
+        for (auto &req : mPending)
+        {
+            if (this->HandleRequest(move(req)))
+            {
+                ReportError("Error handling request");
+            }
+        }
+        mPending.clear();
+        FlushBatches(true);
+        return;
+    }
+    
+    size_t room = mPipeline->GetInboxRoom();
+    if (mPending.size() > room)
+        ShedPending(room);
+    
+    if (this->mPipeline->InboxQueuePushBatch(mPending))
+    {
+        ReportError("Error queueing requests");
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadInbox::ShedPending()
+//  Description: Cut what HandlePacket() has held down to what the Inbox has
+//               room for. With drop-oldest the longest waiting Requests in
+//               the Inbox make room instead, as far as there are any. The
+//               newest of what is left over are shed.
+//       Inputs: inRoom (IN) Requests the Inbox admits
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadInbox::ShedPending(size_t inRoom)
+{
+    int policy = mServer->GetConfig().mShedPolicy;
+    size_t excess = mPending.size() - inRoom;
+    if (policy == SERVER_SHED_DROP_OLDEST)
+    {
+        size_t dropped = mPipeline->InboxQueueDropOldest(excess);
+        mServer->mStats.Add(STATS_SHED_DROP_OLDEST, dropped);
+        excess -= dropped;
+        policy = SERVER_SHED_DROP_NEWEST;
     }
+    
+    size_t admitted = mPending.size() - excess;
+    for (size_t i = admitted; i < mPending.size(); ++i)
+        Shed(move(mPending[i]), policy);
+    mPending.resize(admitted);
+    FlushBatches(true);
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: ServerThreadInbox::HandlePacket()
-//  Description: Minimal processing is done at this stage, this may not even be
-//               a valid packet. We simply copy the data and queue it up for the
-//               processing thread to look at; leaving more time to read new
-//               packets on the Inbox thread.
+//     Function: ServerThreadInbox::Shed()
+//  Description: Get rid of a Request the Inbox has no room for: drop it,
+//               answer it REFUSED, or answer it NOERROR with TC=1 so the
+//               client asks again over TCP (REFUSED if we don't serve TCP.) With cache-first,
+//               answer it from the cache if it is in there, else drop it.
+//               Counted by what was done.
+//       Inputs: inReq (IN) the Request
+//               inPolicy (IN) SERVER_SHED_*
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-int ServerThreadInbox::HandlePacket(
-                                    unsigned char *inData, size_t inLen, struct sockaddr_in *inFrom)
+void ServerThreadInbox::Shed(unique_ptr<Request> inReq, int inPolicy)
 {
-    // Enforce max packet size
-    if (inLen > SERVER_MAX_PACKET_SIZE)
+    mServer->mStats.Add(STATS_PACKETS_IN);
+    if (inPolicy == SERVER_SHED_TRUNCATED && !mServer->GetConfig().mTCP)
+        inPolicy = SERVER_SHED_REFUSED;
+    
+    if (inPolicy == SERVER_SHED_REFUSED || inPolicy == SERVER_SHED_TRUNCATED)
     {
-        ReportError("Packet too large (%d bytes), discarded.", (int)inLen);
-        return 0;
+        DNSPacket &packet = inReq->mPacket;
+        bool truncated = inPolicy == SERVER_SHED_TRUNCATED;
+        if (packet.MakeEmptyReply(truncated, truncated ? DNS_RCODE_NOERROR : DNS_RCODE_REFUSED))
+        {
+            // Not a query we'd answer (a response, another opcode, no single question)
+            mServer->mStats.Add(STATS_SHED_DROP_NEWEST);
+            return;
+        }
+        mServer->mStats.Add(STATS_SHED_DROP_NEWEST + inPolicy);
+        mServer->mStats.Add(STATS_PACKETS_OUT);
+        if (SendReply(inReq.get(), packet.mRawPacketData, packet.mRawPacketLen))
+        {
+            ReportError("sendto client failed");
+        }
+        return;
     }
     
-    // Add it
-    unique_ptr<Request> newReq(new Request());
-    newReq->mPacket.SetRawData(inData, inLen);
-    memcpy(&newReq->mClientAddr, inFrom, sizeof(struct sockaddr_in));
-    this->mServer->InboxQueuePushBack(move(newReq));
-    
-    return 0;
+    if (inPolicy == SERVER_SHED_CACHE_FIRST && mServer->GetCache() && PrepareRequest(inReq.get()) == 0)
+    {
+        if (ReplyFromCache(inReq.get()))
+        {
+            mServer->mStats.Add(STATS_SHED_CACHE_HITS);
+            return;
+        }
+    }
+    mServer->mStats.Add(STATS_SHED_DROP_NEWEST + inPolicy);
 }
 
 
@@ -684,6 +2931,44 @@ int ServerThreadInbox::HandlePacket(
 //################################################################################
 
 
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadProcess::ServerThreadProcess()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread processes for
+//               inWorker (IN) which of the pipeline's Inbox rings is ours
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadProcess::ServerThreadProcess(Server *inServer, ServerPipeline *inPipeline, unsigned int inWorker)
+: ServerThread(inServer, inPipeline),
+  mStatsRequests(0),
+  mStatsStolen(0),
+  mStatsBusyUS(0),
+  mWorker(inWorker),
+  mStartTime(chrono::steady_clock::now())
+{
+    CreateBatches();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadProcess::GetUtilization()
+//  Description: Share of this thread's lifetime spent handling Requests, as
+//               opposed to waiting for them.
+//      Returns: 0.0 to 1.0
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+double ServerThreadProcess::GetUtilization()
+{
+    int64_t aliveUS = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - mStartTime).count();
+    return aliveUS > 0 ? (double) mStatsBusyUS / aliveUS : 0.0;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////
 //
 //     Function: ServerThreadProcess::ThreadMain()
@@ -695,156 +2980,57 @@ void ServerThreadProcess::ThreadMain()
 {
     while (!mServer->ShuttingDown())
     {
-        if (mServer->InboxQueueWaitForData())
+        if (!mFwdBatches.empty() && mPipeline->InboxQueueTryWaitForData() == 0)
         {
-            // We may be shutting down now
-            continue;
+            // Batch mode and more work is already waiting, keep batching
+        }
+        else
+        {
+            // About to block, send anything we have been holding on to first
+            mBusy = true;
+            FlushBatches(true);
+            mBusy = false;
+            
+            if (mPipeline->InboxQueueWaitForData())
+            {
+                // We may be shutting down now
+                continue;
+            }
         }
         
-        // Processing Request
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+        // Processing Requests, taking whatever else is already waiting too
+        mBusy = true;
         try
         {
-            unique_ptr<Request> req(mServer->InboxQueuePopFront());
-            if (req.get() == nullptr)
-                continue;
-            
-            if (this->HandleRequest(move(req)))
+            chrono::steady_clock::time_point busyStart = chrono::steady_clock::now();
+            vector<unique_ptr<Request>> reqs;
+            bool stolen = false;
+            size_t count = mPipeline->InboxQueuePopBatch(reqs, SERVER_INBOX_POP_BATCH, mWorker, stolen);
+            if (count > 1)
             {
-                ReportError("Error handling request");
+                mPipeline->GetInboxWakeup()->Take((unsigned int)count - 1);
+            }
+            mStatsRequests += count;
+            if (stolen)
+            {
+                mStatsStolen += count;
             }
+            for (auto &req : reqs)
+            {
+                if (this->HandleRequest(move(req)))
+                {
+                    ReportError("Error handling request");
+                }
+            }
+            FlushBatches(false);
+            mStatsBusyUS += chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - busyStart).count();
         }
         catch (...)
         {
             ReportError("Caught exception");
         }
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
-    }
-}
-
-
-//////////////////////////////////////////////////////////////////////////////////
-//
-//     Function: ServerThreadProcess::HandleRequest()
-//  Description:
-//
-//////////////////////////////////////////////////////////////////////////////////
-
-int ServerThreadProcess::HandleRequest(unique_ptr<Request> inReq)
-{
-    //
-    // Decode the packet
-    //
-    Request* reqPtr = inReq.get();
-    int rc = reqPtr->mPacket.Decode();
-    if (rc)
-    {
-        ReportError("Error decoding packet");
-        return -1;
-    }
-    
-    //cout << "ServerThreadProcess::HandleRequest()\n";
-    //reqPtr->mPacket.Print();
-    
-    //
-    // Check packet validity and set domain
-    //
-    if (reqPtr->mPacket.mHeader.resp)
-    {
-        // This is a response packet, we're only supposed to see question
-        // packets here. Ignore it.
-        ReportError("Response packet found where question packet expected");
-        return -1;
-    }
-    reqPtr->mDomainName = reqPtr->mPacket.mQuestionName;
-    ++mServer->mStatsRequests;
-    
-#if SERVER_USE_CACHE
-    //
-    // Check for a cached response
-    //
-    pair<unsigned char*, size_t> packetOut;
-    bool found = mServer->CheckCacheMap(reqPtr->mDomainName, packetOut);
-    if (found)
-    {
-        //
-        // Send reply to original client
-        //
-        unsigned short clientPacketId = 0;
-        reqPtr->mPacket.GetRawPacketID(clientPacketId);
-        int serverSocket = mServer->GetServerSocket();
-        size_t addrLen = sizeof(struct sockaddr_in);
-        struct sockaddr_in *clientAddress = &reqPtr->mClientAddr;
-        unsigned char *data = packetOut.first;
-        size_t dataLen = packetOut.second;
-        
-        clientPacketId = htons(clientPacketId);
-        memcpy(data, &clientPacketId, sizeof(clientPacketId));
-        
-        ++mServer->mStatsServed;
-        ++mServer->mStatsPacketsOut;
-        if (sendto(serverSocket, data, dataLen, 0,
-                   (struct sockaddr*)clientAddress, addrLen) < 0)
-        {
-            ReportError("sendto client failed");
-        }
-#if SERVER_VERBOSE
-        printf(">> Processed: %s (using Cache)\n", reqPtr->mDomainName.c_str());
-        fflush(stdout);
-#endif
-        return 0;
-    }
-#endif
-    
-    //
-    // Replace packet id with our own
-    //
-    unsigned short ourPacketId = mServer->GenerateUniqueID();
-    unsigned short clientPacketId = 0;
-    
-    if (reqPtr->mPacket.GetRawPacketID(clientPacketId))
-    {
-        ReportError("Failed to get raw packet id");
-        return -1;
-    }
-    if (reqPtr->mPacket.SetRawPacketID(ourPacketId))
-    {
-        ReportError("Failed to set raw packet id");
-        return -1;
-    }
-    reqPtr->mClientPacketID = clientPacketId;
-    reqPtr->mOurPacketID = ourPacketId;
-#if SERVER_VERBOSE
-    printf("Processing remote DNS request (%s) their_id(%u) our_id(%d)\n",
-           reqPtr->mDomainName.c_str(), reqPtr->mClientPacketID,
-           reqPtr->mOurPacketID);
-    fflush(stdout);
-#endif
-    
-    //
-    // Add to outbox
-    //
-    mServer->OutboxAdd(move(inReq));
-    
-    //
-    // Forward to DNS server
-    //
-    size_t addrLen = sizeof(struct sockaddr_in);
-    int fwdSocket = mServer->GetFwdSocket();
-    const struct sockaddr_in* fwdSocketAddr = mServer->GetFwdSocketAddr();
-    unsigned char *buffer = reqPtr->mPacket.mRawPacketData;
-    size_t nbytes = reqPtr->mPacket.mRawPacketLen;
-    
-    ++mServer->mStatsPacketsOut;
-    if (sendto(fwdSocket, buffer, nbytes, 0,
-               (struct sockaddr*)fwdSocketAddr, addrLen) < 0)
-    {
-        ReportError("sendto fwd dns server failed (fwdSocket: %d, data_size: %u)",
-                    fwdSocket, nbytes);
-        return -1;
+        mBusy = false;
     }
-    
-    return 0;
 }
 
 
@@ -860,184 +3046,100 @@ int ServerThreadProcess::HandleRequest(unique_ptr<Request> inReq)
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: ServerThreadOutbox::ThreadMain()
-//  Description: Main thread entry point.
+//     Function: ServerThreadOutbox::~ServerThreadOutbox()
+//  Description: Destructor.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-void ServerThreadOutbox::ThreadMain()
+ServerThreadOutbox::~ServerThreadOutbox()
 {
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    int fwdSocket = mServer->GetFwdSocket();
-    int serverSocket = mServer->GetServerSocket();
-    unsigned char buffer[SERVER_BUFFER_SIZE];
-    const struct sockaddr_in *clientAddress = nullptr;
-    const struct sockaddr_in *fwdAddress = mServer->GetFwdSocketAddr();
-    struct sockaddr_in recvAddress;
-    int rc, nbytes;
-    
-    while (!mServer->ShuttingDown())
+    if (mEpollFD != -1)
     {
-        nbytes = recvfrom(fwdSocket, (char*)buffer, SERVER_BUFFER_SIZE, 0,
-                          (struct sockaddr*) &recvAddress, &addrLen);
-        if (nbytes < 0)
-        {
-            // We may be shutting down now
-            continue;
-        }
-        
-        // Processing Packet
-        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
-        try
-        {
-            if (this->HandlePacket(buffer, nbytes, &recvAddress))
-            {
-                ReportError("Error handling packet");
-            }
-        }
-        catch (...)
-        {
-            ReportError("Caught exception");
-        }
-        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+        close(mEpollFD);
+        mEpollFD = -1;
     }
 }
 
 
 //////////////////////////////////////////////////////////////////////////////////
 //
-//     Function: ServerThreadOutbox::HandlePacket()
-//  Description: Handle a fwd dns server response and send it to the client.
-//       Inputs: inData (IN) packet data. Will be copied.
-//               inLen (IN) length of packet data.
-//               inFrom (IN) address this packet came from.
-//      Returns: Non-zero on failure.
+//     Function: ServerThreadOutbox::ThreadMain()
+//  Description: Main thread entry point. Waits on the forward socket pool and
+//               the server's stop eventfd in epoll_wait.
 //
 //////////////////////////////////////////////////////////////////////////////////
 
-int ServerThreadOutbox::HandlePacket(
-                                     unsigned char *inData, size_t inLen, struct sockaddr_in *inFrom)
+void ServerThreadOutbox::ThreadMain()
 {
-    // Enforce max packet size
-    if (inLen > SERVER_MAX_PACKET_SIZE)
-    {
-        ReportError("Packet too large (%d bytes), discarded.", (int)inLen);
-        return 0;
-    }
-    
-    // Process Packet
-    socklen_t addrLen = sizeof(struct sockaddr_in);
-    const struct sockaddr_in *fwdAddress = mServer->GetFwdSocketAddr();
-    const struct sockaddr_in *clientAddress = nullptr;
-    int serverSocket = mServer->GetServerSocket();
-    int rc, nbytes;
-    
-    //
-    // Security check: we should only receive packets from fwd dns ip
-    // address and on the correct port. Anything else is fishy.
-    //
-    if (fwdAddress->sin_addr.s_addr != inFrom->sin_addr.s_addr ||
-        fwdAddress->sin_port != inFrom->sin_port)
-    {
-        unsigned short p1 = ntohs(inFrom->sin_port);
-        unsigned short p2 = ntohs(fwdAddress->sin_port);
-        unsigned long addr1 = ntohl(inFrom->sin_addr.s_addr);
-        unsigned long addr2 = ntohl(fwdAddress->sin_addr.s_addr);
-        unsigned char *a1 = (unsigned char*) &addr1;
-        unsigned char *a2 = (unsigned char*) &addr2;
-        ReportError("Reply from unexpected source: "
-                    "%d.%d.%d.%d#%u, expected %d.%d.%d.%d#%u, ignoring",
-                    a1[0], a1[1], a1[2], a1[3], p1,
-                    a2[0], a2[1], a2[2], a2[3], p2);
-        return -1;
-    }
-    
-    //
-    // Get our packet ID
-    //
-    DNSPacket packet;
-    unsigned short ourID = 0;
+    unsigned int fwdCount = mPipeline->GetFwdSocketCount();
     
-    packet.SetRawData(inData, inLen);
-    if (packet.GetRawPacketID(ourID))
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD == -1)
     {
-        ReportError("Unable to get packet id");
-        return -1;
+        ReportError("epoll_create1 failed, errno %d", errno);
+        return;
     }
-    
-    //
-    // Make sure this is a response packet
-    //
-    packet.Decode();
-    if (!packet.mHeader.resp)
+    for (unsigned int i = 0; i <= fwdCount; ++i)
     {
-        // This is a question. (resp set to 0)
-        ReportError("Outbox received a question (id %u), ignoring", ourID);
-        return -1;
+        // Forward sockets by index, then the stop eventfd
+        int fd = i < fwdCount ? mPipeline->GetFwdSocket(i) : mServer->GetStopFD();
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = i;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fd, &event))
+        {
+            ReportError("epoll_ctl(%d) failed, errno %d", fd, errno);
+            return;
+        }
     }
-    ++mServer->mStatsPacketsIn;
     
     //
-    // Lookup initial request
+    // Batch mode: read replies with recvmmsg() and hold the client replies in
+    // mClientBatch. While replies are queued we only poll the sockets, so they
+    // go out as soon as the sockets run dry or the flush deadline passes.
     //
-    unique_ptr<Request> thisReq(mServer->OutboxRemove(ourID));
-    if (thisReq.get() == nullptr)
+    const ServerConfig& config = mServer->GetConfig();
+    unique_ptr<RecvBatch> recvBatch;
+    if (mClientBatch)
     {
-        // This Request may have timed out, normal case.
-        return 0;
+        recvBatch.reset(new RecvBatch(mServer, config.mBatchSize, config.mMaxUDPSize));
+        if (recvBatch->Setup())
+            recvBatch.reset();
     }
+    vector<struct epoll_event> events(fwdCount + 1);
     
-    //
-    // Calculate elapsed time
-    //
-    chrono::high_resolution_clock::time_point rightNow = chrono::high_resolution_clock::now();
-    long elapsedMS = chrono::duration_cast<chrono::milliseconds>(rightNow-thisReq->mForwardedTime).count();
-    
-    //
-    // Passive timeout
-    //
-    // Check if the response came fast enough, otherwise discard.
-    if (elapsedMS >= SERVER_TIMEOUT_MS)
+    while (!mServer->ShuttingDown())
     {
-#if SERVER_VERBOSE
-        ++mServer->mStatsTimeOuts;
-        printf(">> Timeout(Passive): %s, took %ld ms (max %d)\n", thisReq->mDomainName.c_str(),
-               elapsedMS, SERVER_TIMEOUT_MS);
-        fflush(stdout);
-#endif
-        return 0;
+        bool pending = mClientBatch && !mClientBatch->Empty();
+        int count = epoll_wait(mEpollFD, events.data(), fwdCount + 1, pending ? 0 : -1);
+        
+        // Processing Packets
+        mBusy = true;
+        try
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                if (events[i].data.u32 < fwdCount)
+                    ReadReplies((unsigned short) events[i].data.u32, recvBatch.get());
+            }
+            if (mClientBatch && (count <= 0 || mClientBatch->FlushDue()))
+            {
+                mClientBatch->Flush();
+            }
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
     }
     
-    //
-    // Send reply to original client
-    //
-    ++mServer->mStatsServed;
-    ++mServer->mStatsPacketsOut;
-    packet.SetRawPacketID(thisReq->mClientPacketID);
-    //packet.Print();
-    clientAddress = &thisReq->mClientAddr;
-    if (sendto(serverSocket, packet.mRawPacketData, packet.mRawPacketLen, 0,
-               (struct sockaddr*)clientAddress, addrLen) < 0)
+    // Replies still held for the batch go out before we stop
+    if (mClientBatch)
     {
-        ReportError("sendto client failed");
+        mClientBatch->Flush();
     }
-    
-#if SERVER_VERBOSE
-    printf(">> Processed: %s (using Remote DNS Server) %ld ms\n", packet.mQuestionName.c_str(), elapsedMS);
-    fflush(stdout);
-#endif
-    
-#if SERVER_USE_CACHE
-    //
-    // Add to CacheMap
-    //
-    pair<unsigned char*, size_t> packetOut;
-    packetOut.first = packet.mRawPacketData;
-    packetOut.second = packet.mRawPacketLen;
-    mServer->AddToCacheMap(thisReq->mDomainName, packetOut);
-#endif
-    
-    return 0;
 }
 
 
@@ -1060,13 +3162,35 @@ int ServerThreadOutbox::HandlePacket(
 void ServerThreadMaintainence::ThreadMain()
 {
     //
-    // Actively time out Requests every X milliseconds. Right now this is the only
-    // task in our maintainence thread, but this could be expanded as needs arise.
+    // Run the pipelines' timers as their wheels tick. Right now they only time
+    // out Requests, but anything else that needs a deadline can arm one. The
+    // stop eventfd goes last.
     //
+    vector<ServerPipeline*> &pipelines = mServer->GetPipelines();
+    vector<struct pollfd> fds(pipelines.size() + 1);
+    for (size_t i = 0; i < fds.size(); ++i)
+    {
+        fds[i].fd = i < pipelines.size() ? pipelines[i]->GetTimers()->GetFD() : mServer->GetStopFD();
+        fds[i].events = POLLIN;
+    }
+    
     while (!mServer->ShuttingDown())
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(SERVER_TIMEOUT_SCAN_MS));
-        mServer->OutboxTimeout();
+        int count = poll(fds.data(), fds.size(), -1);
+        if (count < 0)
+        {
+            if (errno != EINTR)
+            {
+                ReportError("poll failed, errno %d", errno);
+                break;
+            }
+            continue;
+        }
+        for (size_t i = 0; i < pipelines.size(); ++i)
+        {
+            if (fds[i].revents & POLLIN)
+                pipelines[i]->RunTimers();
+        }
     }
 }
 
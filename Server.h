@@ -8,129 +8,424 @@
 #ifndef SERVER_H
 #define SERVER_H
 #include <netinet/in.h>
-#include <semaphore.h>
+#include <signal.h>
+#include <climits>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include <string>
 #include <queue>
 #include <list>
 #include <array>
+#include <vector>
 #include <mutex>
-#include <condition_variable>
 #include <unordered_map>
+#include "MPMCRing.h"
+#include "Topology.h"
+#include "Stats.h"
 
 using namespace std;
 
 //################################################################################
 //##
-//## Class: Server
+//## Server Settings
 //##
-//##  Desc: Main server representation object.
+//##  Desc: Compile time defaults. The runtime tunables are copied into
+//##        ServerConfig and can be overridden there.
 //##
 //################################################################################
-#define SERVER_BUFFER_SIZE       4096
-#define SERVER_MAX_PACKET_SIZE   512         /* Accept no packets over this size */
+#define SERVER_BUFFER_SIZE       4096        /* TCP read chunks */
+#define SERVER_MAX_PACKET_SIZE   512         /* Largest UDP message without EDNS0 */
+#define SERVER_MAX_UDP_SIZE      1232        /* Largest UDP message with EDNS0, sizes the UDP buffers */
 #define SERVER_TIMEOUT_MS        2000        /* How long till a request times out */
-#define SERVER_TIMEOUT_SCAN_MS   1000        /* How often to we scan for timeouts */
+#define SERVER_TIMEOUT_SCAN_MS   1000        /* Idle TCP connection scan */
+#define SERVER_DRAIN_MS          2000        /* Max time shutdown keeps answering Requests in flight, 0 = drop them */
 #define SERVER_VERBOSE           1           /* On/off: Live processing output */
-#define SERVER_USE_CACHE         0           /* On/off: Use a simple cache */
+#define SERVER_USE_CACHE         0           /* On/off: Cache the remote DNS server's answers by their TTLs */
+#define SERVER_CACHE_ENTRIES     100000      /* Max answers in the cache */
+#define SERVER_CACHE_MAX_TTL     86400       /* Max seconds an answer is cached, whatever its TTLs say */
+#define SERVER_CACHE_SHARDS      0           /* Cache shards (power of 2), 0 = 4 per CPU of the quota */
+#define SERVER_BATCH_IO          0           /* On/off: recvmmsg/sendmmsg batching */
+#define SERVER_BATCH_SIZE        32          /* Max datagrams per recvmmsg/sendmmsg */
+#define SERVER_BATCH_SIZE_MAX    1024        /* Largest --batch-size, the kernel takes no more (UIO_MAXIOV) */
+#define SERVER_BATCH_FLUSH_US    200         /* Max time a queued reply waits to go out */
+#define SERVER_REUSEPORT         0           /* On/off: One SO_REUSEPORT pipeline per core */
+#define SERVER_PIPELINES         0           /* Pipeline count for SO_REUSEPORT, 0 = #cores */
+#define SERVER_ENGINE_PIPELINE   0           /* Engine: inbox/process/outbox threads */
+#define SERVER_ENGINE_EVENTLOOP  1           /* Engine: one epoll thread per pipeline */
+#define SERVER_ENGINE_URING      2           /* Engine: one io_uring thread per pipeline */
+#define SERVER_ENGINE_CORO       3           /* Engine: one epoll thread per pipeline, a coroutine per query */
+#define SERVER_ENGINE            SERVER_ENGINE_PIPELINE
+#define SERVER_EVENT_BUDGET      64          /* Max datagrams per socket per epoll wakeup */
+#define SERVER_CORO_RETRIES      0           /* Coro engine: times a query is asked again after no answer */
+#define SERVER_CORO_HEDGE_MS     0           /* Coro engine: ask again in parallel after this long, 0 = off */
+#define SERVER_URING_ENTRIES     256         /* io_uring submission queue size */
+#define SERVER_URING_BUFFERS     512         /* Provided receive buffers, power of 2 */
+#define SERVER_URING_SENDS       256         /* Max sendmsg in flight per io_uring thread */
+#define SERVER_FWD_SOCKETS       0           /* Forward sockets per pipeline, 0 = enough for 64K in flight */
+#define SERVER_OUTBOX_SLOT_BITS  10          /* Packet ID bits for the Outbox slot (1K in flight per forward socket), the other 6 the generation */
+#define SERVER_OUTBOX_CONN_BITS  16          /* The same per upstream TCP connection, its whole packet ID space */
+#define SERVER_TCP               1           /* On/off: DNS over TCP listener (RFC 7766) */
+#define SERVER_TCP_BACKLOG       1024        /* listen() backlog */
+#define SERVER_TCP_IDLE_MS       10000       /* Close connections idle this long */
+#define SERVER_TCP_MAX_INFLIGHT  64          /* Max queries in flight per connection */
+#define SERVER_TCP_MAX_CONNS     65536       /* Max open connections per pipeline */
+#define SERVER_FWD_TCP_CONNS     2           /* Upstream TCP connections per pipeline, 0 = none */
+#define SERVER_FWD_TCP_ALWAYS    0           /* On/off: Forward everything over TCP */
+#define SERVER_IPV6              1           /* On/off: Dual-stack AF_INET6 listener */
+#define SERVER_UDP_GSO           0           /* On/off: UDP GSO sends and GRO receives */
+#define SERVER_PACKET_RING       ""          /* Interface for the TPACKET_V3 receive ring, "" = off */
+#define SERVER_RING_BLOCK_SIZE   (1 << 18)   /* Packet ring block size, multiple of the page size */
+#define SERVER_RING_BLOCKS       64          /* Packet ring blocks */
+#define SERVER_RING_FRAME_SIZE   2048        /* Packet ring frame size (frame count sizing only) */
+#define SERVER_RING_RETIRE_MS    1           /* Max time a block holds packets before we see them */
+#define SERVER_RING_POLL_MS      100         /* Packet ring poll() timeout, stats are read then */
+#define SERVER_WAKEUP_SPIN       1000        /* Rounds a thread spins for work before it sleeps */
+#define SERVER_INBOX_RING_SIZE   65536       /* Inbox ring slots per processing thread, power of 2 */
+#define SERVER_INBOX_POP_BATCH   16          /* Max Requests a processing thread takes at once */
+#define SERVER_INBOX_LIMIT       4096        /* Max Requests waiting in a pipeline's Inbox, more are shed, 0 = ring size */
+#define SERVER_SHED_DROP_NEWEST  0           /* Shedding: drop the queries that don't fit */
+#define SERVER_SHED_DROP_OLDEST  1           /* Shedding: drop the longest waiting queries to make room */
+#define SERVER_SHED_REFUSED      2           /* Shedding: answer REFUSED */
+#define SERVER_SHED_TRUNCATED    3           /* Shedding: answer TC=1, the client asks again over TCP */
+#define SERVER_SHED_CACHE_FIRST  4           /* Shedding: answer the cache hits right away, drop the rest */
+#define SERVER_SHED_POLICIES     5
+#define SERVER_SHED_POLICY       SERVER_SHED_DROP_NEWEST
+#define SERVER_INBOX_THREADS     1           /* Inbox threads per pipeline */
+#define SERVER_PROCESS_THREADS   0           /* Processing threads per pipeline, 0 = CPU quota / pipelines */
+#define SERVER_FUSE_STAGES       0           /* On/off: Inbox threads process queries themselves */
+#define SERVER_NUMA              0           /* On/off: Spread pipelines over the NUMA nodes, each one's threads and memory on its node */
+#define SERVER_IRQ_AFFINITY      ""          /* Pin listener threads to this interface's RX queue IRQ CPUs, "" = off */
+#define SERVER_ROLE_LISTENER     0           /* Thread role: reads the listener (inbox, eventloop, uring, coro) */
+#define SERVER_ROLE_PROCESS      1           /* Thread role: processing */
+#define SERVER_ROLE_OUTBOX       2           /* Thread role: outbox */
+#define SERVER_ROLE_TCP          3           /* Thread role: TCP clients */
+#define SERVER_ROLE_FWD_TCP      4           /* Thread role: upstream TCP connections */
+#define SERVER_ROLE_MAINTAINENCE 5           /* Thread role: maintainence */
+#define SERVER_ROLES             6
 
 class ServerInbox;
+class ServerPipeline;
 class Request;
+class SendBatch;
+class RecvBatch;
 class DNSPacket;
 class ServerThreadInbox;
 class ServerThreadProcess;
 class ServerThreadOutbox;
 class ServerThreadMaintainence;
+class ServerThreadEventLoop;
+class ServerThreadUring;
+class ServerThreadCoro;
+class ServerThreadTCP;
+class ServerThreadFwdTCP;
+class PacketRing;
+class Wakeup;
+class OutboxTable;
+class TimerWheel;
+class ResponseCache;
+
+//################################################################################
+//##
+//## Class: ServerConfig
+//##
+//##  Desc: Runtime server settings. Defaults come from the #defines above and
+//##        can be overridden from the command line (see main.cpp.)
+//##
+//################################################################################
+
+class ServerConfig
+{
+public:
+    ServerConfig()
+    : mBatchIO(SERVER_BATCH_IO),
+      mBatchSize(SERVER_BATCH_SIZE),
+      mBatchFlushUS(SERVER_BATCH_FLUSH_US),
+      mReusePort(SERVER_REUSEPORT),
+      mPipelines(SERVER_PIPELINES),
+      mEngine(SERVER_ENGINE),
+      mCoroRetries(SERVER_CORO_RETRIES),
+      mCoroHedgeMS(SERVER_CORO_HEDGE_MS),
+      mFwdSockets(SERVER_FWD_SOCKETS),
+      mTCP(SERVER_TCP),
+      mTCPIdleMS(SERVER_TCP_IDLE_MS),
+      mTCPMaxInFlight(SERVER_TCP_MAX_INFLIGHT),
+      mTCPMaxConns(SERVER_TCP_MAX_CONNS),
+      mFwdTCPConns(SERVER_FWD_TCP_CONNS),
+      mFwdTCPAlways(SERVER_FWD_TCP_ALWAYS),
+      mIPv6(SERVER_IPV6),
+      mMaxUDPSize(SERVER_MAX_UDP_SIZE),
+      mUDPGSO(SERVER_UDP_GSO),
+      mPacketRing(SERVER_PACKET_RING),
+      mWakeupSpin(SERVER_WAKEUP_SPIN),
+      mInboxThreadCount(SERVER_INBOX_THREADS),
+      mProcessThreadCount(SERVER_PROCESS_THREADS),
+      mFuseStages(SERVER_FUSE_STAGES),
+      mInboxLimit(SERVER_INBOX_LIMIT),
+      mShedPolicy(SERVER_SHED_POLICY),
+      mDrainMS(SERVER_DRAIN_MS),
+      mNUMA(SERVER_NUMA),
+      mIRQAffinity(SERVER_IRQ_AFFINITY),
+      mCache(SERVER_USE_CACHE),
+      mCacheEntries(SERVER_CACHE_ENTRIES),
+      mCacheMaxTTL(SERVER_CACHE_MAX_TTL),
+      mCacheShards(SERVER_CACHE_SHARDS)
+    {
+    }
+    
+    bool                           mBatchIO;        // Use recvmmsg/sendmmsg
+    unsigned int                   mBatchSize;      // Max datagrams per batch
+    unsigned int                   mBatchFlushUS;   // Flush deadline for queued sends
+    bool                           mReusePort;      // One SO_REUSEPORT pipeline per core
+    unsigned int                   mPipelines;      // Pipeline count, 0 = one per core
+    int                            mEngine;         // SERVER_ENGINE_*
+    unsigned int                   mCoroRetries;    // Asks after the first that timed out (coro engine)
+    unsigned int                   mCoroHedgeMS;    // Hedge delay, 0 = off (coro engine)
+    unsigned int                   mFwdSockets;     // Forward socket pool size per pipeline, 0 = auto
+    bool                           mTCP;            // Also serve DNS over TCP
+    unsigned int                   mTCPIdleMS;      // Idle connection timeout
+    unsigned int                   mTCPMaxInFlight; // Per connection query cap
+    unsigned int                   mTCPMaxConns;    // Per pipeline connection cap
+    unsigned int                   mFwdTCPConns;    // Upstream TCP connection pool size per pipeline
+    bool                           mFwdTCPAlways;   // Forward over TCP even without TC=1
+    bool                           mIPv6;           // Listen on IPv6 and IPv4 (else IPv4 only)
+    unsigned int                   mMaxUDPSize;     // EDNS0 payload size cap, >= SERVER_MAX_PACKET_SIZE
+    bool                           mUDPGSO;         // Coalesce batched sends/receives (needs mBatchIO)
+    string                         mPacketRing;     // Receive queries on a packet ring on this interface
+    unsigned int                   mWakeupSpin;     // Inbox/Outbox handoff spin budget, 0 = always sleep
+    unsigned int                   mInboxThreadCount; // Inbox threads per pipeline (pipeline engine)
+    unsigned int                   mProcessThreadCount; // Processing threads per pipeline (pipeline engine), 0 = auto
+    bool                           mFuseStages;     // Inbox threads run the processing stage (pipeline engine)
+    unsigned int                   mInboxLimit;     // Admission bound on a pipeline's Inbox, 0 = ring size
+    int                            mShedPolicy;     // SERVER_SHED_*, what happens to what isn't admitted
+    unsigned int                   mDrainMS;        // Shutdown drain deadline, 0 = don't drain
+    bool                           mNUMA;           // Pipelines spread over the NUMA nodes
+    string                         mIRQAffinity;    // Interface whose RX IRQ CPUs the listeners run on
+    string                         mPinCPUs[SERVER_ROLES]; // CPU list per thread role, "" = not pinned
+    bool                           mCache;          // Answer repeated questions from the cache
+    unsigned int                   mCacheEntries;   // Max answers in the cache
+    unsigned int                   mCacheMaxTTL;    // Max seconds an answer is cached
+    unsigned int                   mCacheShards;    // Cache shards, 0 = auto
+};
+
+
+//################################################################################
+//##
+//## Class: Server
+//##
+//##  Desc: Main server representation object.
+//##
+//################################################################################
 
 class Server
 {
-    // Allows access to the atomic ints for statistics
+    // Allows access to the statistics counters
 public:
     //
     // Constructors/Destructors
     //
     Server(unsigned short inListenPort, const char* inFwdStr,
-           unsigned short inFwdPort);
+           unsigned short inFwdPort, const ServerConfig& inConfig = ServerConfig());
     virtual ~Server();
     
     //
     // Get/set member functions
     //
-    int GetServerSocket() { return mServerSocket; }
-    int GetFwdSocket() { return mFwdSocket; }
-    const struct sockaddr_in* GetFwdSocketAddr() { return &mFwdSocketAddr; }
+    const ServerConfig& GetConfig() { return mConfig; }
+    unsigned short GetServerPort() { return mServerPort; }
+    const struct sockaddr* GetFwdSocketAddr() { return (struct sockaddr*)&mFwdSocketAddr; }
     
     //
     // Public member functions
     //
     int                            RunServer();
     bool                           ShuttingDown() { return mShuttingDown; }
+    bool                           Draining() { return mDraining; }
+    int                            GetStopFD() { return mStopFD; }
     static void                    HandleSignal(int inSig);
-    int                            InboxQueueWaitForData();
-    int                            InboxQueuePushBack(unique_ptr<Request> inReq);
-    unique_ptr<Request>            InboxQueuePopFront();
-    unsigned short                 GenerateUniqueID();
-    int                            OutboxWaitForData();
-    int                            OutboxAdd(unique_ptr<Request> inReq);
-    unique_ptr<Request>            OutboxRemove(unsigned short inID);
-    void                           OutboxTimeout();
-#if SERVER_USE_CACHE
-    int                            AddToCacheMap(string inDomain, pair<unsigned char*, size_t>& inPacket);
-    bool                           CheckCacheMap(string inDomain, pair<unsigned char*, size_t>& outPacket);
-#endif
+    vector<ServerPipeline*>&       GetPipelines() { return mPipelines; }
+    static unsigned int            GetCPUQuota();
+    static int                     GetRole(const char *inName);
+    static const char*             GetRoleName(int inRole);
+    static int                     GetShedPolicy(const char *inName);
+    static const char*             GetShedPolicyName(int inPolicy);
+    ResponseCache*                 GetCache() { return mCache; }
     
     //
     // Public data
     //
-    atomic_int                     mStatsPacketsIn;
-    atomic_int                     mStatsPacketsOut;
-    atomic_int                     mStatsRequests;
-    atomic_int                     mStatsServed;
-    atomic_int                     mStatsTimeOuts;
+    Stats                          mStats;          // Counted per thread, see Stats
     
     //
-    // Protected data
+    // Protected member functions
     //
 protected:
-    bool                           mShuttingDown;
+    bool                           Drained(size_t &outInFlight);
+    bool                           ThreadsBusy();
+    int                            SetupPlacement(unsigned int inPipelineCount);
+    vector<int>                    GetPlacement(int inRole, unsigned int inOrdinal);
+    void                           EnterPlacement(int inRole, ServerPipeline *inPipeline);
+    void                           LeavePlacement();
+    void                           ReportTopology();
+    
+    //
+    // Protected data
+    //
+    ServerConfig                   mConfig;
+    atomic_bool                    mShuttingDown;   // Threads exit
+    atomic_bool                    mDraining;       // No new queries, in flight ones are still answered
+    int                            mStopFD;         // eventfd, readable once mShuttingDown is set
+    vector<ServerPipeline*>        mPipelines;
     list<ServerThreadInbox*>       mInboxThreads;
     list<ServerThreadProcess*>     mProcessThreads;
     list<ServerThreadOutbox*>      mOutboxThreads;
+    list<ServerThreadEventLoop*>   mEventLoopThreads;
+    list<ServerThreadUring*>       mUringThreads;
+    list<ServerThreadCoro*>        mCoroThreads;
+    list<ServerThreadTCP*>         mTCPThreads;
+    list<ServerThreadFwdTCP*>      mFwdTCPThreads;
     ServerThreadMaintainence*      mMaintainenceThread;
-    static condition_variable      sShuttingDownCV;
-    static mutex                   sShuttingDownCVMutex;
+    
+    // Thread and memory placement (see EnterPlacement())
+    Topology                       mTopology;
+    vector<int>                    mIRQCPUs;        // A listener CPU per RX queue, empty if not aligned
+    vector<int>                    mPinCPUs[SERVER_ROLES];
+    unsigned int                   mPlaced[SERVER_ROLES]; // Threads placed so far, per role
+    vector<array<vector<string>, SERVER_ROLES>> mPlacements; // Where they went, per pipeline + shared
+    
+    static int                     sSignalFD;       // eventfd, the signal handler writes it
+    static volatile sig_atomic_t   sSignal;         // The signal that came in
     
     // Network Data: Local Server
     unsigned short                 mServerPort;
-    int                            mServerSocket;
-    struct sockaddr_in             mServerSocketAddr;
     
     // Network Data: Remote/Forward DNS Server
     string                         mFwdStr;
     unsigned short                 mFwdPort;
-    int                            mFwdSocket;
-    struct sockaddr_in             mFwdSocketAddr;
-    
-    // Unique Packet ID Generator
-    unsigned short                 mGenIDCounter;
-    recursive_mutex                mGenIDMutex;
-    
-    // InboxQueue (Inbox Thread)
-    queue<unique_ptr<Request>>     mInboxQueue;
-    recursive_mutex                mInboxQueueMutex;
-    sem_t*                         mInboxQueueSemaphore;
-    
-    // OutboxQueue (Outbox Thread)
-    array<unique_ptr<Request>, USHRT_MAX> mOutboxArray; // Used for: Successful replies
-    queue<unsigned short>          mOutboxQueue; // Used for: Active timeouts
-    recursive_mutex                mOutboxMutex;
-    sem_t*                         mOutboxSemaphore;
-    
-#if SERVER_USE_CACHE
-    // Simple caching mechanism for testing (Process Thread)
-    unordered_map<string,pair<unsigned char*, size_t>> mCacheMap;
-    recursive_mutex                mCacheMapMutex;
-#endif
+    struct sockaddr_storage        mFwdSocketAddr;
+    
+    // Answers by question, nullptr when caching is off
+    ResponseCache*                 mCache;
+};
+
+
+//################################################################################
+//##
+//## Class: ServerPipeline
+//##
+//##  Desc: One inbox/process/outbox chain. Each pipeline owns its own listener
+//##        socket, forward socket, packet ID space, inbox queue and outbox, so
+//##        pipelines never share locks. With SO_REUSEPORT the kernel spreads
+//##        clients across one pipeline per core.
+//##
+//##        Requests are forwarded over a pool of sockets. Every forward socket
+//##        has its own 16 bit packet ID space and its own slots in the Outbox
+//##        table (see OutboxTable), so the pool size sets how many Requests can
+//##        be in flight at once. Forward indexes past the UDP sockets are the
+//##        upstream TCP connections, which work the same way.
+//##
+//################################################################################
+
+class ServerPipeline
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerPipeline(Server *inServer, unsigned int inIndex);
+    virtual ~ServerPipeline();
+    
+    //
+    // Get/set member functions
+    //
+    unsigned int GetIndex() { return mIndex; }
+    int GetNode() { return mNode; }
+    void SetNode(int inNode) { mNode = inNode; }
+    int GetServerSocket() { return mServerSocket; }
+    int GetServerFamily() { return mServerSocketAddr.ss_family; }
+    int GetTCPSocket() { return mTCPSocket; }
+    int GetFwdSocket(unsigned int inFwdIndex) { return mFwdSockets[inFwdIndex]; }
+    unsigned int GetFwdSocketCount() { return (unsigned int) mFwdSockets.size(); }
+    unsigned int GetFwdTCPCount() { return mFwdTCPCount; }
+    ServerThreadFwdTCP* GetFwdTCPThread() { return mFwdTCPThread; }
+    void SetFwdTCPThread(ServerThreadFwdTCP *inThread) { mFwdTCPThread = inThread; }
+    ServerThreadCoro* GetCoroThread() { return mCoroThread; }
+    void SetCoroThread(ServerThreadCoro *inThread) { mCoroThread = inThread; }
+    PacketRing* GetPacketRing() { return mPacketRing; }
+    Wakeup* GetInboxWakeup() { return mInboxWakeup; }
+    size_t GetInboxDepth();
+    size_t GetInboxPeakDepth() { return mInboxPeakDepth; }
+    size_t GetInboxCapacity() { return mWorkQueues[0]->GetCapacity(); }
+    size_t GetInboxLimit() { return mInboxLimit; }
+    unsigned int GetWorkQueueCount() { return (unsigned int) mWorkQueues.size(); }
+    OutboxTable* GetOutbox() { return mOutbox; }
+    TimerWheel* GetTimers() { return mTimers; }
+    
+    //
+    // Public member functions
+    //
+    int                            OpenSockets(bool inReusePort);
+    int                            SetIncomingCPU(int inCPU);
+    void                           StopIntake();
+    int                            InboxQueueWaitForData();
+    int                            InboxQueueTryWaitForData();
+    int                            InboxQueuePushBatch(vector<unique_ptr<Request>> &inReqs);
+    size_t                         InboxQueuePopBatch(vector<unique_ptr<Request>> &outReqs, size_t inMax,
+                                                      unsigned int inWorker, bool &outStolen);
+    size_t                         InboxQueueDropOldest(size_t inMax);
+    size_t                         GetInboxRoom();
+    unsigned short                 GenerateUniqueID(unsigned short &outFwdIndex, bool inTCP);
+    void                           ReleaseUniqueID(unsigned short inFwdIndex, unsigned short inID);
+    int                            OutboxWaitForData();
+    int                            OutboxAdd(unique_ptr<Request> inReq);
+    unique_ptr<Request>            OutboxRemove(unsigned short inFwdIndex, unsigned short inID);
+    size_t                         RunTimers();
+    
+    //
+    // Protected member functions
+    //
+protected:
+    void                           OutboxTimeout(unsigned short inFwdIndex, unsigned short inID, uint64_t inTimer);
+    static void                    OutboxTimerFired(void *inContext, uint64_t inData, uint64_t inTimer);
+    int                            EnableGRO(int inSocket);
+    
+    //
+    // Protected data
+    //
+    Server                         *mServer;
+    unsigned int                   mIndex;
+    int                            mNode;           // NUMA node its threads and memory are on, -1 = any
+    
+    // Network Data: Local Server
+    int                            mServerSocket;
+    struct sockaddr_storage        mServerSocketAddr;
+    int                            mTCPSocket;
+    PacketRing                     *mPacketRing;    // Receives the queries instead, nullptr if off
+    
+    // Network Data: Remote/Forward DNS Server
+    vector<int>                    mFwdSockets;
+    unsigned int                   mFwdTCPCount;    // Upstream TCP connections, after the sockets
+    ServerThreadFwdTCP             *mFwdTCPThread;  // Owns them, nullptr if there are none
+    
+    // Coro engine thread, runs the TCP thread's queries too (nullptr for other engines)
+    ServerThreadCoro               *mCoroThread;
+    
+    // Unique Packet ID Generator (round robin over the forward sockets/connections)
+    atomic_uint                    mGenIDNextFwd;
+    
+    // InboxQueue (Inbox Thread): a ring per processing thread, owns the Requests it holds
+    vector<unique_ptr<MPMCRing<Request>>> mWorkQueues;
+    atomic_uint                    mNextWorkQueue;
+    atomic<size_t>                 mInboxPeakDepth;
+    size_t                         mInboxLimit;     // Admitted Requests waiting, at most
+    Wakeup                         *mInboxWakeup;
+    
+    // Outbox (Outbox Thread), owns the Requests in flight
+    OutboxTable                    *mOutbox;
+    Wakeup                         *mOutboxWakeup;
+    
+    // Timers (timeouts), driven by the maintainence thread or the event loop
+    TimerWheel                     *mTimers;
 };
 
 
@@ -138,7 +433,8 @@ protected:
 //##
 //## Class: ServerThread
 //##
-//##  Desc: Server thread base class.
+//##  Desc: Server thread base class. Also holds the request and reply stages
+//##        so that any kind of thread can run them.
 //##
 //################################################################################
 
@@ -148,8 +444,8 @@ public:
     //
     // Constructors/Destructors
     //
-    ServerThread(Server *inServer) : mServer(inServer), mThread(nullptr) { }
-    virtual ~ServerThread() { if (mThread) delete mThread; }
+    ServerThread(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThread();
     
     //
     // Public member functions
@@ -157,13 +453,42 @@ public:
     virtual void ThreadMain() = 0;
     virtual void SetThread(thread *inThread) { mThread = inThread; }
     virtual thread* GetThread() { return mThread; }
+    ServerPipeline* GetPipeline() { return mPipeline; }
+    bool IsBusy() { return mBusy; }
+    
+    //
+    // Protected member functions
+    //
+protected:
+    virtual int SendPacket(SendBatch *inBatch, int inSocket, const unsigned char *inData,
+                           size_t inLen, const struct sockaddr *inTo);
+    void CreateBatches();
+    void FlushBatches(bool inForce);
+    void ReadRequests(RecvBatch *inBatch);
+    void ReadReplies(unsigned short inFwdIndex, RecvBatch *inBatch);
+    virtual int HandlePacket(unsigned char*, size_t, const struct sockaddr*) { return 0; } // Client queries
+    int SendReply(Request *inReq, unsigned char *inData, size_t inLen);
+    int ForwardRequest(unique_ptr<Request> inReq, bool inTCP);
+    unique_ptr<Request> MakeRequest(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom);
+    int PrepareRequest(Request *inReq);
+    bool ReplyFromCache(Request *inReq);
+    int HandleRequest(unique_ptr<Request> inReq);
+    int HandleReply(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom,
+                    unsigned short inFwdIndex);
+    void AnswerClient(Request *inReq, DNSPacket &inPacket, bool inCutShort, long inElapsedMS);
     
     //
     // Protected data
     //
 protected:
-    Server    *mServer;
-    thread    *mThread;
+    Server          *mServer;
+    ServerPipeline  *mPipeline;     // nullptr for threads that serve every pipeline
+    thread          *mThread;
+    SendBatch       *mClientBatch;  // Replies back to clients (batch mode only)
+    vector<SendBatch*> mFwdBatches; // Forwards to the remote DNS server, per forward socket (batch mode only)
+    vector<unsigned char> mRecvBuffer; // One datagram of mMaxUDPSize, for the unbatched receives
+    vector<unsigned char> mCacheReply; // A cached answer, on its way to the client
+    atomic_bool     mBusy;          // Handling work rather than waiting for it (see Server::Drained())
 };
 
 
@@ -172,7 +497,8 @@ protected:
 //## Class: ServerThreadInbox
 //##
 //##  Desc: Reads packets off InboxPort (53 generally) and adds them to the
-//##        the inbox queue.
+//##        the inbox queue. Only as many as fit under the Inbox limit are
+//##        admitted, the rest are shed by the configured policy.
 //##
 //################################################################################
 
@@ -182,8 +508,8 @@ public:
     //
     // Constructors/Destructors
     //
-    ServerThreadInbox(Server *inServer) : ServerThread(inServer) { }
-    virtual ~ServerThreadInbox() { }
+    ServerThreadInbox(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadInbox();
     
     //
     // Public member functions
@@ -194,7 +520,15 @@ public:
     // Protected member functions
     //
 protected:
-    int HandlePacket(unsigned char *inData, size_t inLen, struct sockaddr_in *inFrom);
+    virtual int HandlePacket(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom);
+    void QueuePending();
+    void ShedPending(size_t inRoom);
+    void Shed(unique_ptr<Request> inReq, int inPolicy);
+    
+    //
+    // Protected data
+    //
+    vector<unique_ptr<Request>> mPending; // Requests read but not yet in the Inbox
 };
 
 
@@ -206,6 +540,12 @@ protected:
 //##        handled (caching) or the packet is forwarded to the remote/forward
 //##        DNS server and this Request is moved into the Outbox.
 //##
+//##        Each processing thread (worker) of a pipeline has its own Inbox
+//##        ring which the Inbox threads fill round robin. A worker that finds
+//##        its own ring empty steals up to half of the fullest other ring, so
+//##        one slow Request only holds up what is queued behind it until
+//##        someone else takes it.
+//##
 //################################################################################
 
 class ServerThreadProcess : public ServerThread
@@ -214,19 +554,33 @@ public:
     //
     // Constructors/Destructors
     //
-    ServerThreadProcess(Server *inServer) : ServerThread(inServer) { }
+    ServerThreadProcess(Server *inServer, ServerPipeline *inPipeline, unsigned int inWorker);
     virtual ~ServerThreadProcess() { }
     
+    //
+    // Get/set member functions
+    //
+    unsigned int GetWorker() { return mWorker; }
+    double GetUtilization();
+    
     //
     // Public member functions
     //
     virtual void ThreadMain();
     
     //
-    // Protected member functions
+    // Public data (statistics)
+    //
+    atomic<uint64_t>                    mStatsRequests;
+    atomic<uint64_t>                    mStatsStolen;   // Requests taken from other workers' rings
+    atomic<int64_t>                     mStatsBusyUS;   // Time spent handling Requests
+    
+    //
+    // Protected data
     //
 protected:
-    int HandleRequest(unique_ptr<Request> inReq);
+    unsigned int                        mWorker;        // Index of our ring in the pipeline
+    chrono::steady_clock::time_point    mStartTime;
 };
 
 
@@ -236,6 +590,7 @@ protected:
 //##
 //##  Desc: Waits for replies from the remote/forward DNS server. When received
 //##        it sends the reply to the original client. It also handles timeouts.
+//##        The forward socket pool is watched with epoll.
 //##
 //################################################################################
 
@@ -245,8 +600,9 @@ public:
     //
     // Constructors/Destructors
     //
-    ServerThreadOutbox(Server *inServer) : ServerThread(inServer) { }
-    virtual ~ServerThreadOutbox() { }
+    ServerThreadOutbox(Server *inServer, ServerPipeline *inPipeline)
+    : ServerThread(inServer, inPipeline), mEpollFD(-1) { CreateBatches(); }
+    virtual ~ServerThreadOutbox();
     
     //
     // Public member functions
@@ -254,10 +610,10 @@ public:
     virtual void ThreadMain();
     
     //
-    // Protected member functions
+    // Protected data
     //
 protected:
-    int HandlePacket(unsigned char *inData, size_t inLen, struct sockaddr_in *inFrom);
+    int     mEpollFD;
 };
 
 
@@ -265,7 +621,8 @@ protected:
 //##
 //## Class: ServerThreadMaintainence
 //##
-//##  Desc: Thread that actively times out failed requests.
+//##  Desc: Thread that drives every pipeline's timers, which actively time
+//##        out failed requests. It sleeps until one of the wheels ticks.
 //##
 //################################################################################
 
@@ -275,7 +632,7 @@ public:
     //
     // Constructors/Destructors
     //
-    ServerThreadMaintainence(Server *inServer) : ServerThread(inServer) { }
+    ServerThreadMaintainence(Server *inServer) : ServerThread(inServer, nullptr) { }
     virtual ~ServerThreadMaintainence() { }
     
     //
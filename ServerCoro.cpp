@@ -0,0 +1,837 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerCoro.cpp
+//
+// Desc: Coroutine engine: every query is a C++20 coroutine on an epoll loop.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "ServerCoro.h"
+#include "ServerTCP.h"
+#include "Batch.h"
+#include "OutboxTable.h"
+#include "TimerWheel.h"
+#include "Request.h"
+#include "Error.h"
+
+using namespace std;
+
+//
+// epoll event ids. Forward sockets use their index in the pipeline's pool.
+//
+#define EVENT_ID_SERVER     0xFFFFFFFF
+#define EVENT_ID_TIMER      0xFFFFFFFE
+#define EVENT_ID_STOP       0xFFFFFFFD
+#define EVENT_ID_REMOTE     0xFFFFFFFC
+
+
+//################################################################################
+//##
+//## Class: CoUpstream
+//##
+//##  Desc: Awaitable answer from the remote DNS server.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: CoUpstream::CoUpstream()
+//  Description: Constructor. Nothing is sent until it is co_awaited.
+//       Inputs: inThread (IN) the thread running the coroutine
+//               inQuery (IN) the query, through PrepareRequest()
+//               inTCP (IN) ask over an upstream TCP connection
+//               inTimeoutMS (IN) how long to wait for the answer
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+CoUpstream::CoUpstream(ServerThreadCoro *inThread, Request *inQuery, bool inTCP, unsigned int inTimeoutMS)
+: mThread(inThread),
+  mQuery(inQuery),
+  mTCP(inTCP),
+  mExpiry(TimerWheel::NowMS() + inTimeoutMS),
+  mAttemptCount(0),
+  mOut(0),
+  mHedgeTimer(0),
+  mSettled(false),
+  mPrev(nullptr),
+  mNext(nullptr)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: CoUpstream::~CoUpstream()
+//  Description: Destructor. Still waiting only if the thread is abandoning its
+//               coroutines at shutdown.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+CoUpstream::~CoUpstream()
+{
+    mThread->Unlink(this);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: CoUpstream::await_suspend()
+//  Description: Send the query and wait (see ServerThreadCoro::Wait()).
+//       Inputs: inHandle (IN) the coroutine
+//      Returns: False to go on right away, without an answer.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool CoUpstream::await_suspend(coroutine_handle<> inHandle)
+{
+    return mThread->Wait(this, inHandle);
+}
+
+
+//################################################################################
+//##
+//## Class: ServerThreadCoro
+//##
+//##  Desc: Serves a whole pipeline from one thread, a coroutine per query.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::ServerThreadCoro()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadCoro::ServerThreadCoro(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline),
+  mStatsRetries(0),
+  mStatsHedges(0),
+  mStatsHedgeWins(0),
+  mStatsFrames(0),
+  mStatsHeapFrames(0),
+  mStatsPeakFrames(0),
+  mStatsFrameChunks(0),
+  mEpollFD(-1),
+  mEventFD(-1),
+  mWaiting(nullptr),
+  mWaitingCount(0),
+  mQueued(0),
+  mAbandoned(0)
+{
+    CreateBatches();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::~ServerThreadCoro()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadCoro::~ServerThreadCoro()
+{
+    int fds[] = { mEventFD, mEpollFD };
+    for (int fd : fds)
+    {
+        if (fd != -1)
+            close(fd);
+    }
+    mEventFD = mEpollFD = -1;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Setup()
+//  Description: Create the eventfd and the epoll set. All sockets are made
+//               non-blocking since we drain them until they run dry.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadCoro::Setup()
+{
+    int serverSocket = mPipeline->GetServerSocket();
+
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+
+    mEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEventFD == -1)
+    {
+        ReportError("eventfd failed, errno %d", errno);
+        return -1;
+    }
+
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD == -1)
+    {
+        ReportError("epoll_create1 failed, errno %d", errno);
+        return -1;
+    }
+
+    vector<pair<int, uint32_t>> fds;
+    fds.push_back(make_pair(serverSocket, (uint32_t)EVENT_ID_SERVER));
+    fds.push_back(make_pair(mPipeline->GetTimers()->GetFD(), (uint32_t)EVENT_ID_TIMER));
+    fds.push_back(make_pair(mServer->GetStopFD(), (uint32_t)EVENT_ID_STOP));
+    fds.push_back(make_pair(mEventFD, (uint32_t)EVENT_ID_REMOTE));
+    for (unsigned int i = 0; i < mPipeline->GetFwdSocketCount(); ++i)
+    {
+        int fwdSocket = mPipeline->GetFwdSocket(i);
+        fcntl(fwdSocket, F_SETFL, fcntl(fwdSocket, F_GETFL) | O_NONBLOCK);
+        fds.push_back(make_pair(fwdSocket, (uint32_t)i));
+    }
+
+    for (auto fd : fds)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = fd.second;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fd.first, &event))
+        {
+            ReportError("epoll_ctl(%d) failed, errno %d", fd.first, errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::ThreadMain()
+//  Description: Main thread entry point. Starts Listen() and then resumes
+//               whatever coroutine an event is for, until the server's stop
+//               eventfd says it's time to go.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::ThreadMain()
+{
+    mThreadID = this_thread::get_id();
+    if (Setup())
+    {
+        ReportError("Coroutine thread %u failed to start", mPipeline->GetIndex());
+        return;
+    }
+
+    const ServerConfig& config = mServer->GetConfig();
+    unique_ptr<RecvBatch> recvBatch;
+    if (config.mBatchIO)
+    {
+        recvBatch.reset(new RecvBatch(mServer, config.mBatchSize, config.mMaxUDPSize));
+        if (recvBatch->Setup())
+            recvBatch.reset();
+    }
+
+    vector<struct epoll_event> events(mPipeline->GetFwdSocketCount() + 4);
+
+    Listen(recvBatch.get());
+    while (!mServer->ShuttingDown())
+    {
+        int count = epoll_wait(mEpollFD, events.data(), (int)events.size(), -1);
+        if (count <= 0)
+        {
+            // EINTR, or we may be shutting down now
+            continue;
+        }
+
+        mBusy = true;
+        try
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                uint32_t id = events[i].data.u32;
+                if (id == EVENT_ID_SERVER)
+                {
+                    coroutine_handle<> listener = mListener;
+                    mListener = nullptr;
+                    if (listener)
+                        listener.resume();
+                }
+                else if (id == EVENT_ID_TIMER)
+                {
+                    mPipeline->RunTimers();
+                }
+                else if (id == EVENT_ID_STOP)
+                {
+                    // ShuttingDown() ends the loop
+                }
+                else if (id == EVENT_ID_REMOTE)
+                {
+                    TakeRemote();
+                }
+                else
+                {
+                    ReadReplies((unsigned short) id, recvBatch.get());
+                }
+            }
+
+            // Resume the coroutines whose answers (or timeouts) came in
+            ProcessAnswers();
+            FlushBatches(true);
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
+    }
+
+    Abandon();
+
+    FramePool &pool = FramePool::Get();
+    mStatsFrames = pool.mStatsFrames;
+    mStatsHeapFrames = pool.mStatsHeapFrames;
+    mStatsPeakFrames = pool.mStatsPeakLive;
+    mStatsFrameChunks = pool.mStatsChunks;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Listen()
+//  Description: Coroutine that reads client queries off the listener socket
+//               and starts a ServeQuery() for each (ReadRequests(), up to
+//               SERVER_EVENT_BUDGET datagrams each time it is resumed). Ends
+//               once the server is draining.
+//       Inputs: inBatch (IN) receive batch, or nullptr when not batching.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+CoTask ServerThreadCoro::Listen(RecvBatch *inBatch)
+{
+    for (;;)
+    {
+        co_await ListenerReady { this };
+
+        if (mServer->Draining())
+        {
+            epoll_ctl(mEpollFD, EPOLL_CTL_DEL, mPipeline->GetServerSocket(), nullptr);
+            co_return;
+        }
+
+        ReadRequests(inBatch);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::HandlePacket()
+//  Description: Turn a client packet into a Request and start its coroutine.
+//               It runs up to its first wait before we get control back, so
+//               the packet data need not outlive the call.
+//       Inputs: inData (IN) packet data. Will be copied.
+//               inLen (IN) length of packet data.
+//               inFrom (IN) address this packet came from.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadCoro::HandlePacket(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom)
+{
+    unique_ptr<Request> newReq = MakeRequest(inData, inLen, inFrom);
+    if (!newReq)
+    {
+        return 0;
+    }
+    mServer->mStats.Add(STATS_PACKETS_IN);
+
+    ServeQuery(move(newReq));
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::ServeQuery()
+//  Description: The coroutine that takes one query from start to finish. The
+//               remote DNS server gets SERVER_TIMEOUT_MS in all, split evenly
+//               over the first ask and its retries. A truncated answer for a
+//               TCP client is asked again over upstream TCP (UDP clients get
+//               the TC=1 answer and retry over TCP themselves.)
+//       Inputs: inReq (IN) the Request, from the listener or the TCP thread.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+CoTask ServerThreadCoro::ServeQuery(unique_ptr<Request> inReq)
+{
+    Request *reqPtr = inReq.get();
+    if (PrepareRequest(reqPtr))
+    {
+        co_return;
+    }
+    mServer->mStats.Add(STATS_REQUESTS);
+
+    if (ReplyFromCache(reqPtr))
+    {
+        mServer->mStats.Add(STATS_SERVED);
+        co_return;
+    }
+
+    const ServerConfig& config = mServer->GetConfig();
+    bool overTCP = config.mFwdTCPAlways && mPipeline->GetFwdTCPThread();
+    int64_t startMS = TimerWheel::NowMS();
+    int64_t deadlineMS = startMS + SERVER_TIMEOUT_MS;
+    unsigned int retries = 0;
+    unique_ptr<Request> answer;
+
+    for (;;)
+    {
+        int64_t leftMS = deadlineMS - TimerWheel::NowMS();
+        if (leftMS <= 0)
+            break;
+        unsigned int tries = config.mCoroRetries - retries + 1;
+        answer = co_await CoUpstream(this, reqPtr, overTCP, (unsigned int)(leftMS / tries));
+
+        if (answer && answer->mPacket.mHeader.tc && !overTCP && reqPtr->mTCPConn &&
+            mPipeline->GetFwdTCPThread())
+        {
+            mServer->mStats.Add(STATS_FWD_TCP_RETRIES);
+            overTCP = true;
+            answer.reset();
+            continue;
+        }
+        if (answer || retries == config.mCoroRetries)
+            break;
+        ++retries;
+        ++mStatsRetries;
+    }
+
+    long elapsedMS = (long)(TimerWheel::NowMS() - startMS);
+    if (!answer)
+    {
+        mServer->mStats.Add(STATS_TIMEOUTS);
+#if SERVER_VERBOSE
+        printf(">> Timeout(Active): %s, took %ld ms (max %d)\n", reqPtr->mDomainName.c_str(),
+               elapsedMS, SERVER_TIMEOUT_MS);
+        fflush(stdout);
+#endif
+        co_return;
+    }
+
+    AnswerClient(reqPtr, answer->mPacket, false, elapsedMS);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Wait()
+//  Description: A CoUpstream is co_awaited: send its first attempt, and arm the
+//               hedge timer if hedging and there's time for it.
+//       Inputs: inWait (IN) the CoUpstream
+//               inHandle (IN) its coroutine, resumed by Settle()
+//      Returns: True to suspend, false if nothing went out.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool ServerThreadCoro::Wait(CoUpstream *inWait, coroutine_handle<> inHandle)
+{
+    inWait->mHandle = inHandle;
+    if (SendAttempt(inWait))
+    {
+        return false;
+    }
+
+    inWait->mNext = mWaiting;
+    if (mWaiting)
+        mWaiting->mPrev = inWait;
+    mWaiting = inWait;
+    ++mWaitingCount;
+
+    unsigned int hedgeMS = mServer->GetConfig().mCoroHedgeMS;
+    if (hedgeMS && !inWait->mTCP && TimerWheel::NowMS() + hedgeMS < inWait->mExpiry)
+    {
+        inWait->mHedgeTimer = mPipeline->GetTimers()->Arm(hedgeMS, HedgeTimerFired, this,
+                                                          (uint64_t)(uintptr_t) inWait);
+    }
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::SendAttempt()
+//  Description: Send the query of a CoUpstream under a new packet ID. The
+//               attempt in the Outbox is a bare Request that only knows its
+//               way back; the query keeps the packet.
+//       Inputs: inWait (IN) the CoUpstream
+//      Returns: Non-zero if nothing went out. An attempt that is in the
+//               Outbox but failed to send just times out.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadCoro::SendAttempt(CoUpstream *inWait)
+{
+    Request *query = inWait->mQuery;
+    unsigned short fwdIndex = 0;
+    unsigned short ourPacketId = mPipeline->GenerateUniqueID(fwdIndex, inWait->mTCP);
+
+    if (query->mPacket.SetRawPacketID(ourPacketId))
+    {
+        mPipeline->ReleaseUniqueID(fwdIndex, ourPacketId);
+        ReportError("Failed to set raw packet id");
+        return -1;
+    }
+#if SERVER_VERBOSE
+    printf("Processing remote DNS request (%s) their_id(%u) our_id(%d)%s%s\n",
+           query->mDomainName.c_str(), query->mClientPacketID, ourPacketId,
+           inWait->mTCP ? " over TCP" : "", inWait->mAttemptCount ? " (hedge)" : "");
+    fflush(stdout);
+#endif
+
+    unique_ptr<Request> attempt(new Request());
+    attempt->mOurPacketID = ourPacketId;
+    attempt->mFwdIndex = fwdIndex;
+    attempt->mCoroThread = this;
+    attempt->mCoroWait = inWait;
+
+    int64_t timeoutMS = max(inWait->mExpiry - TimerWheel::NowMS(), (int64_t) 1);
+    uint64_t key = ((uint64_t) fwdIndex << 16) | ourPacketId;
+    uint64_t timer = mPipeline->GetTimers()->Arm((unsigned int) timeoutMS, AttemptTimerFired, this, key);
+
+    CoUpstream::Attempt &sent = inWait->mAttempts[inWait->mAttemptCount++];
+    sent.mFwdIndex = fwdIndex;
+    sent.mID = ourPacketId;
+    sent.mTimer = timer;
+    sent.mOut = true;
+    ++inWait->mOut;
+    mPipeline->GetOutbox()->Publish(move(attempt), timer);
+
+    //
+    // Forward to DNS server
+    //
+    unsigned char *buffer = query->mPacket.mRawPacketData;
+    size_t nbytes = query->mPacket.mRawPacketLen;
+
+    mServer->mStats.Add(STATS_PACKETS_OUT);
+    if (inWait->mTCP)
+    {
+        mServer->mStats.Add(STATS_FWD_TCP_QUERIES);
+        mPipeline->GetFwdTCPThread()->QueueQuery(fwdIndex - mPipeline->GetFwdSocketCount(),
+                                                 buffer, nbytes);
+        return 0;
+    }
+
+    int fwdSocket = mPipeline->GetFwdSocket(fwdIndex);
+    SendBatch *fwdBatch = mFwdBatches.empty() ? nullptr : mFwdBatches[fwdIndex];
+    if (SendPacket(fwdBatch, fwdSocket, buffer, nbytes, mServer->GetFwdSocketAddr()))
+    {
+        ReportError("sendto fwd dns server failed (fwdSocket: %d, data_size: %u)",
+                    fwdSocket, nbytes);
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::QueueQuery()
+//  Description: Hand a query over from another thread (the TCP thread), it
+//               gets its coroutine on this one.
+//       Inputs: inReq (IN) the Request
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::QueueQuery(unique_ptr<Request> inReq)
+{
+    ++mQueued;
+    mRemoteMutex.lock();
+    bool wakeUp = mRemoteQueries.empty() && mRemoteAnswers.empty();
+    mRemoteQueries.push_back(move(inReq));
+    mRemoteMutex.unlock();
+
+    if (wakeUp)
+    {
+        uint64_t one = 1;
+        if (write(mEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            ReportError("eventfd write failed, errno %d", errno);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::QueueAnswer()
+//  Description: An attempt came back: answered (its packet holds the answer)
+//               or not (timed out, or lost its Outbox slot.) Any thread may
+//               have taken it out of the Outbox, but only this one settles it.
+//       Inputs: inAttempt (IN) the attempt
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::QueueAnswer(unique_ptr<Request> inAttempt)
+{
+    if (this_thread::get_id() == mThreadID)
+    {
+        // ProcessAnswers() gets to it before we wait again
+        mAnswers.push_back(move(inAttempt));
+        return;
+    }
+
+    mRemoteMutex.lock();
+    bool wakeUp = mRemoteQueries.empty() && mRemoteAnswers.empty();
+    mRemoteAnswers.push_back(move(inAttempt));
+    mRemoteMutex.unlock();
+
+    if (wakeUp)
+    {
+        uint64_t one = 1;
+        if (write(mEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            ReportError("eventfd write failed, errno %d", errno);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::TakeRemote()
+//  Description: Take what other threads handed over: start the queries'
+//               coroutines and line up the answers for ProcessAnswers().
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::TakeRemote()
+{
+    uint64_t count;
+    if (read(mEventFD, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        ReportError("eventfd read failed, errno %d", errno);
+    }
+
+    vector<unique_ptr<Request>> queries;
+    mRemoteMutex.lock();
+    queries.swap(mRemoteQueries);
+    for (auto &attempt : mRemoteAnswers)
+        mAnswers.push_back(move(attempt));
+    mRemoteAnswers.clear();
+    mRemoteMutex.unlock();
+
+    for (auto &query : queries)
+    {
+        --mQueued;
+        ServeQuery(move(query));
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::ProcessAnswers()
+//  Description: Settle the attempts that came back. Settling resumes
+//               coroutines, which may send more attempts and queue more, so
+//               keep going until there are none.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::ProcessAnswers()
+{
+    while (!mAnswers.empty())
+    {
+        mSettling.swap(mAnswers);
+        for (auto &attempt : mSettling)
+            Settle(move(attempt));
+        mSettling.clear();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Settle()
+//  Description: Account for an attempt that came back. The first answer, or
+//               the last attempt timing out, settles its CoUpstream; the
+//               coroutine is resumed as soon as no attempt is still out.
+//       Inputs: inAttempt (IN) the attempt
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::Settle(unique_ptr<Request> inAttempt)
+{
+    CoUpstream *wait = inAttempt->mCoroWait;
+    unsigned int index = 0;
+    while (index < wait->mAttemptCount &&
+           (!wait->mAttempts[index].mOut || wait->mAttempts[index].mFwdIndex != inAttempt->mFwdIndex ||
+            wait->mAttempts[index].mID != inAttempt->mOurPacketID))
+        ++index;
+    if (index == wait->mAttemptCount)
+    {
+        ReportError("Attempt (id %u) not found", inAttempt->mOurPacketID);
+        return;
+    }
+    wait->mAttempts[index].mOut = false;
+    --wait->mOut;
+
+    if (!wait->mSettled)
+    {
+        if (inAttempt->mPacket.mRawPacketData)
+        {
+            if (index > 0)
+                ++mStatsHedgeWins;
+            wait->mAnswer = move(inAttempt);
+            wait->mSettled = true;
+        }
+        else if (wait->mOut == 0)
+        {
+            // Timed out and nothing else is out there
+            wait->mSettled = true;
+        }
+        if (wait->mSettled)
+            Withdraw(wait);
+    }
+
+    if (wait->mSettled && wait->mOut == 0)
+    {
+        Unlink(wait);
+        wait->mHandle.resume();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Withdraw()
+//  Description: Take a settled CoUpstream's other attempts back out of the
+//               Outbox and stop its hedge timer. An attempt that's already
+//               been claimed is on its way to Settle(), which drops it.
+//       Inputs: inWait (IN) the CoUpstream
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::Withdraw(CoUpstream *inWait)
+{
+    TimerWheel *timers = mPipeline->GetTimers();
+    if (inWait->mHedgeTimer)
+    {
+        timers->Cancel(inWait->mHedgeTimer);
+        inWait->mHedgeTimer = 0;
+    }
+
+    for (unsigned int i = 0; i < inWait->mAttemptCount; ++i)
+    {
+        CoUpstream::Attempt &attempt = inWait->mAttempts[i];
+        if (!attempt.mOut)
+            continue;
+        uint64_t timer = 0;
+        unique_ptr<Request> withdrawn(mPipeline->GetOutbox()->Claim(attempt.mFwdIndex, attempt.mID, timer));
+        if (withdrawn)
+        {
+            timers->Cancel(timer);
+            attempt.mOut = false;
+            --inWait->mOut;
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Unlink()
+//  Description: Take a CoUpstream off the list of waiters, if it's on it.
+//       Inputs: inWait (IN) the CoUpstream
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::Unlink(CoUpstream *inWait)
+{
+    if (!inWait->mPrev && mWaiting != inWait)
+        return;
+    if (inWait->mPrev)
+        inWait->mPrev->mNext = inWait->mNext;
+    else
+        mWaiting = inWait->mNext;
+    --mWaitingCount;
+    if (inWait->mNext)
+        inWait->mNext->mPrev = inWait->mPrev;
+    inWait->mPrev = inWait->mNext = nullptr;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::AttemptTimerFired()
+//  Description: TimerWheel callback for an attempt's timeout. Claimed from its
+//               slot the same way an answer would claim it, so whichever comes
+//               first wins.
+//       Inputs: inContext (IN) the thread
+//               inData (IN) forward index << 16 | packet ID
+//               inTimer (IN) the timer
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::AttemptTimerFired(void *inContext, uint64_t inData, uint64_t inTimer)
+{
+    ServerThreadCoro *coroThread = (ServerThreadCoro*) inContext;
+    unique_ptr<Request> attempt(coroThread->mPipeline->GetOutbox()->ClaimTimer(
+                                    (unsigned short)(inData >> 16), (unsigned short) inData, inTimer));
+    if (attempt)
+        coroThread->QueueAnswer(move(attempt));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::HedgeTimerFired()
+//  Description: TimerWheel callback for a CoUpstream that has waited the hedge
+//               delay: send a second attempt. The timer is cancelled before
+//               the CoUpstream settles, so it is still there.
+//       Inputs: inContext (IN) the thread
+//               inData (IN) the CoUpstream
+//               inTimer (IN) the timer
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::HedgeTimerFired(void *inContext, uint64_t inData, uint64_t /*inTimer*/)
+{
+    ServerThreadCoro *coroThread = (ServerThreadCoro*) inContext;
+    CoUpstream *wait = (CoUpstream*)(uintptr_t) inData;
+    wait->mHedgeTimer = 0;
+    if (wait->mSettled || wait->mAttemptCount >= 2)
+        return;
+
+    ++coroThread->mStatsHedges;
+    coroThread->SendAttempt(wait);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadCoro::Abandon()
+//  Description: Shutting down: destroy the coroutines that are still waiting,
+//               which frees their Requests. Their attempts are dropped with
+//               the Outbox.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadCoro::Abandon()
+{
+    if (mListener)
+    {
+        mListener.destroy();
+        mListener = nullptr;
+    }
+
+    // Destroying the frame destroys the CoUpstream, which unlinks itself
+    mAbandoned = mWaitingCount.load();
+    while (mWaiting)
+        mWaiting->mHandle.destroy();
+
+    mAnswers.clear();
+}
@@ -0,0 +1,180 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerCoro.h
+//
+// Desc: Coroutine engine: every query is a C++20 coroutine on an epoll loop.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SERVER_CORO_H
+#define SERVER_CORO_H
+#include <stdint.h>
+#include <coroutine>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "Server.h"
+#include "CoTask.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: CoUpstream
+//##
+//##  Desc: What a query coroutine co_awaits to ask the remote DNS server. It
+//##        sends the query and resumes the coroutine with the answer, or with
+//##        nullptr once its time is up.
+//##
+//##        Each send is an attempt: a Request of its own in the Outbox, with
+//##        its own packet ID and timer, pointing back here. With hedging a
+//##        second attempt goes out if the first is slow and the first answer
+//##        wins. Once it has its answer (or none) it takes back the attempts
+//##        still in the Outbox, and only resumes the coroutine after every
+//##        attempt is accounted for, so none can come back to a frame that is
+//##        gone. Lives in the coroutine's frame while it waits.
+//##
+//################################################################################
+
+class CoUpstream
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    CoUpstream(ServerThreadCoro *inThread, Request *inQuery, bool inTCP, unsigned int inTimeoutMS);
+    virtual ~CoUpstream();
+
+    //
+    // Awaitable
+    //
+    bool                    await_ready() { return false; }
+    bool                    await_suspend(coroutine_handle<> inHandle);
+    unique_ptr<Request>     await_resume() { return move(mAnswer); }
+
+    //
+    // Public data (used by ServerThreadCoro)
+    //
+    struct Attempt
+    {
+        unsigned short      mFwdIndex;
+        unsigned short      mID;
+        uint64_t            mTimer;
+        bool                mOut;       // In the Outbox, or on its way back to us
+    };
+
+    ServerThreadCoro        *mThread;
+    Request                 *mQuery;
+    bool                    mTCP;
+    int64_t                 mExpiry;    // TimerWheel::NowMS() the attempts time out at
+    coroutine_handle<>      mHandle;
+    unique_ptr<Request>     mAnswer;    // The attempt that won, holding the answer
+    Attempt                 mAttempts[2];
+    unsigned int            mAttemptCount;
+    unsigned int            mOut;       // Attempts with mOut set
+    uint64_t                mHedgeTimer;
+    bool                    mSettled;   // Has its answer (or none), taking back the rest
+    CoUpstream              *mPrev;     // ServerThreadCoro's list of waiters
+    CoUpstream              *mNext;
+};
+
+
+//################################################################################
+//##
+//## Class: ServerThreadCoro
+//##
+//##  Desc: Serves a whole pipeline from one thread, like ServerThreadEventLoop,
+//##        but each query is a coroutine (ServeQuery()) that reads top to
+//##        bottom: check it, look in the cache, co_await the remote DNS
+//##        server, answer. Retries, hedging and asking again over TCP after a
+//##        truncated answer are just more co_awaits in that function.
+//##
+//##        The thread is the only one that ever resumes its coroutines. It
+//##        waits in epoll for the listener socket (Listen(), itself a
+//##        coroutine, reads it and starts a ServeQuery() per query), the
+//##        forward sockets, the pipeline's timer wheel and an eventfd that
+//##        other threads use to hand over work: queries from the TCP thread
+//##        and answers from the upstream TCP connections. Frames come from
+//##        the thread's FramePool.
+//##
+//################################################################################
+
+class ServerThreadCoro : public ServerThread
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadCoro(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadCoro();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+    void QueueQuery(unique_ptr<Request> inReq);
+    void QueueAnswer(unique_ptr<Request> inAttempt);
+    size_t GetInFlight() { return mWaitingCount + mQueued + mAbandoned; }
+
+    //
+    // Public data (statistics, valid once the thread is done)
+    //
+    uint64_t    mStatsRetries;      // Attempts sent again after timing out
+    uint64_t    mStatsHedges;       // Second attempts sent while the first was slow
+    uint64_t    mStatsHedgeWins;    // Answers that came from the second attempt
+    uint64_t    mStatsFrames;       // Coroutine frames (see FramePool)
+    uint64_t    mStatsHeapFrames;
+    size_t      mStatsPeakFrames;
+    size_t      mStatsFrameChunks;
+
+    //
+    // Protected member functions
+    //
+protected:
+    friend class CoUpstream;
+
+    // co_await the listener socket being readable
+    struct ListenerReady
+    {
+        ServerThreadCoro    *mThread;
+        bool                await_ready() { return false; }
+        void                await_suspend(coroutine_handle<> inHandle) { mThread->mListener = inHandle; }
+        void                await_resume() { }
+    };
+
+    int Setup();
+    CoTask Listen(RecvBatch *inBatch);
+    virtual int HandlePacket(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom);
+    CoTask ServeQuery(unique_ptr<Request> inReq);
+    bool Wait(CoUpstream *inWait, coroutine_handle<> inHandle);
+    int SendAttempt(CoUpstream *inWait);
+    void Settle(unique_ptr<Request> inAttempt);
+    void Withdraw(CoUpstream *inWait);
+    void Unlink(CoUpstream *inWait);
+    void TakeRemote();
+    void ProcessAnswers();
+    void Abandon();
+    static void AttemptTimerFired(void *inContext, uint64_t inData, uint64_t inTimer);
+    static void HedgeTimerFired(void *inContext, uint64_t inData, uint64_t inTimer);
+
+    //
+    // Protected data
+    //
+    int                         mEpollFD;
+    int                         mEventFD;       // Wakes us up for work from other threads
+    thread::id                  mThreadID;
+    coroutine_handle<>          mListener;      // Listen(), waiting for the listener socket
+    CoUpstream                  *mWaiting;      // Coroutines waiting on the remote DNS server
+    atomic<size_t>              mWaitingCount;
+    vector<unique_ptr<Request>> mAnswers;       // Attempts back on this thread, to settle
+    vector<unique_ptr<Request>> mSettling;      // The ones Settle() is working through
+    vector<unique_ptr<Request>> mRemoteQueries; // From other threads
+    vector<unique_ptr<Request>> mRemoteAnswers;
+    mutex                       mRemoteMutex;
+    atomic<size_t>              mQueued;        // Queries in mRemoteQueries
+    atomic<size_t>              mAbandoned;     // Waiting coroutines destroyed at shutdown
+};
+
+
+#endif
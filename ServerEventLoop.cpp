@@ -0,0 +1,221 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerEventLoop.cpp
+//
+// Desc: Single threaded, run-to-completion epoll engine.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include "ServerEventLoop.h"
+#include "Request.h"
+#include "TimerWheel.h"
+#include "Error.h"
+
+using namespace std;
+
+//
+// epoll event ids. Forward sockets use their index in the pipeline's pool.
+//
+#define EVENT_ID_SERVER     0xFFFFFFFF
+#define EVENT_ID_TIMER      0xFFFFFFFE
+#define EVENT_ID_STOP       0xFFFFFFFD
+
+
+//################################################################################
+//##
+//## Class: ServerThreadEventLoop
+//##
+//##  Desc: Serves a whole pipeline from one thread using epoll.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadEventLoop::ServerThreadEventLoop()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadEventLoop::ServerThreadEventLoop(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline),
+  mEpollFD(-1)
+{
+    CreateBatches();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadEventLoop::~ServerThreadEventLoop()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadEventLoop::~ServerThreadEventLoop()
+{
+    if (mEpollFD != -1)
+    {
+        close(mEpollFD);
+        mEpollFD = -1;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadEventLoop::Setup()
+//  Description: Create the epoll set and the timeout timer. All sockets are
+//               made non-blocking since we drain them until they run dry.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadEventLoop::Setup()
+{
+    int serverSocket = mPipeline->GetServerSocket();
+    
+    fcntl(serverSocket, F_SETFL, fcntl(serverSocket, F_GETFL) | O_NONBLOCK);
+    
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD == -1)
+    {
+        ReportError("epoll_create1 failed, errno %d", errno);
+        return -1;
+    }
+    
+    vector<pair<int, uint32_t>> fds;
+    fds.push_back(make_pair(serverSocket, (uint32_t)EVENT_ID_SERVER));
+    fds.push_back(make_pair(mPipeline->GetTimers()->GetFD(), (uint32_t)EVENT_ID_TIMER));
+    fds.push_back(make_pair(mServer->GetStopFD(), (uint32_t)EVENT_ID_STOP));
+    for (unsigned int i = 0; i < mPipeline->GetFwdSocketCount(); ++i)
+    {
+        int fwdSocket = mPipeline->GetFwdSocket(i);
+        fcntl(fwdSocket, F_SETFL, fcntl(fwdSocket, F_GETFL) | O_NONBLOCK);
+        fds.push_back(make_pair(fwdSocket, (uint32_t)i));
+    }
+    
+    for (auto fd : fds)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u32 = fd.second;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fd.first, &event))
+        {
+            ReportError("epoll_ctl(%d) failed, errno %d", fd.first, errno);
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadEventLoop::ThreadMain()
+//  Description: Main thread entry point. Waits in epoll_wait, which the
+//               server's stop eventfd wakes up when it's time to go.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadEventLoop::ThreadMain()
+{
+    if (Setup())
+    {
+        ReportError("Event loop %u failed to start", mPipeline->GetIndex());
+        return;
+    }
+    
+    const ServerConfig& config = mServer->GetConfig();
+    unique_ptr<RecvBatch> recvBatch;
+    if (config.mBatchIO)
+    {
+        recvBatch.reset(new RecvBatch(mServer, config.mBatchSize, config.mMaxUDPSize));
+        if (recvBatch->Setup())
+            recvBatch.reset();
+    }
+    
+    vector<struct epoll_event> events(mPipeline->GetFwdSocketCount() + 3);
+    
+    while (!mServer->ShuttingDown())
+    {
+        int count = epoll_wait(mEpollFD, events.data(), (int)events.size(), -1);
+        if (count <= 0)
+        {
+            // EINTR, or we may be shutting down now
+            continue;
+        }
+        
+        // Run everything that is ready to completion
+        mBusy = true;
+        try
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                uint32_t id = events[i].data.u32;
+                if (id == EVENT_ID_SERVER)
+                {
+                    // Once the server is draining the listener is dropped from epoll
+                    if (mServer->Draining())
+                        epoll_ctl(mEpollFD, EPOLL_CTL_DEL, mPipeline->GetServerSocket(), nullptr);
+                    else
+                        ReadRequests(recvBatch.get());
+                }
+                else if (id == EVENT_ID_TIMER)
+                {
+                    mPipeline->RunTimers();
+                }
+                else if (id == EVENT_ID_STOP)
+                {
+                    // ShuttingDown() ends the loop
+                }
+                else
+                {
+                    ReadReplies((unsigned short) id, recvBatch.get());
+                }
+            }
+            FlushBatches(true);
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadEventLoop::HandlePacket()
+//  Description: Turn a client packet into a Request and run the processing
+//               stage on it right away, instead of queueing it for another
+//               thread like ServerThreadInbox does.
+//       Inputs: inData (IN) packet data. Will be copied.
+//               inLen (IN) length of packet data.
+//               inFrom (IN) address this packet came from.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadEventLoop::HandlePacket(
+                                        unsigned char *inData, size_t inLen, const struct sockaddr *inFrom)
+{
+    unique_ptr<Request> newReq = MakeRequest(inData, inLen, inFrom);
+    if (!newReq)
+    {
+        return 0;
+    }
+    mServer->mStats.Add(STATS_PACKETS_IN);
+    
+    return HandleRequest(move(newReq));
+}
+
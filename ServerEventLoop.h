@@ -0,0 +1,56 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerEventLoop.h
+//
+// Desc: Single threaded, run-to-completion epoll engine.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SERVER_EVENT_LOOP_H
+#define SERVER_EVENT_LOOP_H
+#include "Server.h"
+#include "Batch.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: ServerThreadEventLoop
+//##
+//##  Desc: Serves a whole pipeline from one thread. The listener socket, the
+//##        forward sockets and the pipeline's timer wheel are multiplexed with
+//##        epoll and every packet is handled to completion on this thread: no
+//##        inbox queue, no semaphores and no hand off between threads.
+//##
+//################################################################################
+
+class ServerThreadEventLoop : public ServerThread
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadEventLoop(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadEventLoop();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+
+    //
+    // Protected member functions
+    //
+protected:
+    int Setup();
+    virtual int HandlePacket(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom);
+
+    //
+    // Protected data
+    //
+    int     mEpollFD;
+};
+
+
+#endif
+
@@ -0,0 +1,440 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerPacketRing.cpp
+//
+// Desc: PACKET_MMAP (TPACKET_V3) receive ring for the listener port, and the
+//       inbox thread that reads it.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <linux/filter.h>
+#include <net/ethernet.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "ServerPacketRing.h"
+#include "Error.h"
+
+using namespace std;
+
+// A fanout group has a hook of its own, PACKET_IGNORE_OUTGOING on the socket
+// doesn't carry over to it. Only newer kernels know the flag.
+#ifndef PACKET_FANOUT_FLAG_IGNORE_OUTGOING
+#define PACKET_FANOUT_FLAG_IGNORE_OUTGOING  0x4000
+#endif
+
+
+//################################################################################
+//##
+//## Class: PacketRing
+//##
+//##  Desc: AF_PACKET socket with a TPACKET_V3 receive ring.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: PacketRing::PacketRing()
+//  Description: Constructor. Nothing is opened until Open().
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+PacketRing::PacketRing()
+: mStatsPackets(0),
+  mStatsDrops(0),
+  mStatsFreezes(0),
+  mSocket(-1),
+  mMap(nullptr),
+  mMapSize(0),
+  mBlockSize(SERVER_RING_BLOCK_SIZE),
+  mBlockCount(SERVER_RING_BLOCKS)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: PacketRing::~PacketRing()
+//  Description: Destructor. Unmaps the ring and closes the socket.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+PacketRing::~PacketRing()
+{
+    if (mMap)
+    {
+        munmap(mMap, mMapSize);
+        mMap = nullptr;
+    }
+    if (mSocket != -1)
+    {
+        close(mSocket);
+        mSocket = -1;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: PacketRing::Open()
+//  Description: Create the socket and ring and start capturing. The filter is
+//               attached before the socket is bound, so nothing but queries
+//               ever lands in the ring.
+//       Inputs: inInterface (IN) interface name, "any" for all of them
+//               inPort (IN) UDP port to capture (the listener port)
+//               inFamily (IN) listener family, IPv6 is captured for AF_INET6
+//               inFanoutGroup (IN) PACKET_FANOUT group shared by the pipelines
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int PacketRing::Open(const string &inInterface, unsigned short inPort,
+                     int inFamily, unsigned short inFanoutGroup)
+{
+    int ifIndex = 0;
+    if (inInterface != "any")
+    {
+        ifIndex = if_nametoindex(inInterface.c_str());
+        if (ifIndex == 0)
+        {
+            ReportError("Unknown interface %s for the packet ring", inInterface.c_str());
+            return -1;
+        }
+    }
+
+    // Protocol 0: nothing is captured until bind()
+    mSocket = socket(AF_PACKET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (mSocket == -1)
+    {
+        ReportError("Could not create packet socket, errno %d", errno);
+        return -1;
+    }
+
+    int version = TPACKET_V3;
+    if (setsockopt(mSocket, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)))
+    {
+        ReportError("setsockopt(PACKET_VERSION) failed, errno %d", errno);
+        return -1;
+    }
+
+    //
+    // UDP to inPort, unfragmented, without IPv6 extension headers. A
+    // SOCK_DGRAM packet socket filters from the network header on.
+    //
+    struct sock_filter code[] =
+    {
+        BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, (unsigned)SKF_AD_OFF + SKF_AD_PROTOCOL),    //  0
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IP, 0, 7),            //  1 IPv4? else 9
+        BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, 9),                             //  2 protocol
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 11),            //  3
+        BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, 6),                             //  4 flags/fragment
+        BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 0x3FFF, 9, 0),                 //  5 MF or offset
+        BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, 0),                             //  6 X = header length
+        BPF_STMT(BPF_LD  | BPF_H | BPF_IND, 2),                             //  7 UDP dest port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, inPort, 5, 6),                  //  8
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERTYPE_IPV6, 0, 5),          //  9 IPv6?
+        BPF_STMT(BPF_LD  | BPF_B | BPF_ABS, 6),                             // 10 next header
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_UDP, 0, 3),             // 11
+        BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, 42),                            // 12 UDP dest port
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, inPort, 0, 1),                  // 13
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFFFFFF),                              // 14 accept
+        BPF_STMT(BPF_RET | BPF_K, 0),                                       // 15 drop
+    };
+    if (inFamily != AF_INET6)
+        code[9] = BPF_STMT(BPF_RET | BPF_K, 0);
+    struct sock_fprog filter = { sizeof(code) / sizeof(code[0]), code };
+    if (setsockopt(mSocket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)))
+    {
+        ReportError("setsockopt(SO_ATTACH_FILTER) failed, errno %d", errno);
+        return -1;
+    }
+
+    // Our own replies (and loopback's copy of outgoing packets) aren't wanted.
+    // Older kernels don't have this, the frame's packet type is checked too.
+    int on = 1;
+    setsockopt(mSocket, SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+
+    //
+    // Blocks are handed to us when full, or after the retire timeout so a
+    // quiet ring doesn't hold on to a query.
+    //
+    struct tpacket_req3 req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = mBlockSize;
+    req.tp_block_nr = mBlockCount;
+    req.tp_frame_size = SERVER_RING_FRAME_SIZE;
+    req.tp_frame_nr = (mBlockSize / SERVER_RING_FRAME_SIZE) * mBlockCount;
+    req.tp_retire_blk_tov = SERVER_RING_RETIRE_MS;
+    if (setsockopt(mSocket, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)))
+    {
+        ReportError("setsockopt(PACKET_RX_RING) failed, errno %d", errno);
+        return -1;
+    }
+
+    mMapSize = (size_t)mBlockSize * mBlockCount;
+    void *map = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, mSocket, 0);
+    if (map == MAP_FAILED)
+    {
+        ReportError("mmap of the packet ring failed, errno %d", errno);
+        return -1;
+    }
+    mMap = (unsigned char*)map;
+
+    struct sockaddr_ll addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifIndex;
+    if (::bind(mSocket, (struct sockaddr*)&addr, sizeof(addr)))
+    {
+        ReportError("Could not bind the packet ring to %s, errno %d", inInterface.c_str(), errno);
+        return -1;
+    }
+
+    int fanout = inFanoutGroup | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_IGNORE_OUTGOING) << 16);
+    if (setsockopt(mSocket, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)))
+    {
+        fanout = inFanoutGroup | (PACKET_FANOUT_HASH << 16);
+        if (setsockopt(mSocket, SOL_PACKET, PACKET_FANOUT, &fanout, sizeof(fanout)))
+        {
+            ReportError("setsockopt(PACKET_FANOUT) failed, errno %d", errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: PacketRing::UpdateStats()
+//  Description: Add the kernel's counters to ours. Reading them resets them.
+//               Drops are frames lost because every block was still ours;
+//               freezes are the times the ring filled up.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void PacketRing::UpdateStats()
+{
+    struct tpacket_stats_v3 stats;
+    socklen_t len = sizeof(stats);
+    if (mSocket == -1 || getsockopt(mSocket, SOL_PACKET, PACKET_STATISTICS, &stats, &len))
+        return;
+    mStatsPackets += stats.tp_packets;
+    mStatsDrops += stats.tp_drops;
+    mStatsFreezes += stats.tp_freeze_q_cnt;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: PacketRing::MuteSocket()
+//  Description: Attach a drop-everything filter to a UDP socket. The listener
+//               stays bound (so the port is ours and no ICMP port unreachable
+//               goes out) and sends the replies, but the ring gets the queries.
+//       Inputs: inSocket (IN) the socket
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int PacketRing::MuteSocket(int inSocket)
+{
+    struct sock_filter code[] = { BPF_STMT(BPF_RET | BPF_K, 0) };
+    struct sock_fprog filter = { 1, code };
+    if (setsockopt(inSocket, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)))
+    {
+        ReportError("setsockopt(SO_ATTACH_FILTER) failed, errno %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+
+//################################################################################
+//##
+//## Class: ServerThreadPacketRing
+//##
+//##  Desc: Inbox thread for a pipeline's packet ring.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadPacketRing::ServerThreadPacketRing()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline, with its ring already open
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadPacketRing::ServerThreadPacketRing(Server *inServer, ServerPipeline *inPipeline)
+: ServerThreadInbox(inServer, inPipeline),
+  mRing(inPipeline->GetPacketRing()),
+  mPort(inServer->GetServerPort())
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadPacketRing::~ServerThreadPacketRing()
+//  Description: Destructor. The ring belongs to the pipeline.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadPacketRing::~ServerThreadPacketRing()
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadPacketRing::ThreadMain()
+//  Description: Walk the ring's blocks in order. Each one the kernel has
+//               retired is read, its queries go onto the Inbox ring in one
+//               batch and it's handed back; in between we sleep in poll().
+//               Returns once the server is draining.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadPacketRing::ThreadMain()
+{
+    if (!mRing)
+    {
+        ReportError("Packet ring thread started without a ring");
+        return;
+    }
+
+    struct pollfd pfd;
+    pfd.fd = mRing->GetSocket();
+    pfd.events = POLLIN | POLLERR;
+
+    unsigned int blockIndex = 0;
+    while (!mServer->Draining())
+    {
+        struct tpacket_block_desc *block = mRing->GetBlock(blockIndex);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+        {
+            pfd.revents = 0;
+            if (poll(&pfd, 1, SERVER_RING_POLL_MS) == 0)
+                mRing->UpdateStats();
+            continue;
+        }
+
+        // Process Packets
+        mBusy = true;
+        try
+        {
+            ReadBlock(block);
+            QueuePending();
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        mRing->UpdateStats();
+        mBusy = false;
+
+        blockIndex = (blockIndex + 1) % mRing->GetBlockCount();
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadPacketRing::ReadBlock()
+//  Description: Handle every frame of a retired block.
+//       Inputs: inBlock (IN) the block, owned by us until we hand it back
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadPacketRing::ReadBlock(struct tpacket_block_desc *inBlock)
+{
+    unsigned int count = inBlock->hdr.bh1.num_pkts;
+    unsigned char *frame = (unsigned char*)inBlock + inBlock->hdr.bh1.offset_to_first_pkt;
+    for (unsigned int i = 0; i < count; ++i)
+    {
+        struct tpacket3_hdr *hdr = (struct tpacket3_hdr*)frame;
+        const struct sockaddr_ll *link =
+            (const struct sockaddr_ll*)(frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+        if (link->sll_pkttype == PACKET_HOST)
+        {
+            HandleFrame(frame + hdr->tp_net, hdr->tp_snaplen, hdr->tp_len);
+        }
+        frame += hdr->tp_next_offset;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadPacketRing::HandleFrame()
+//  Description: Parse the IP and UDP headers (the filter has already checked
+//               the protocol and port) and queue the payload. Checksums are
+//               not verified.
+//       Inputs: inData (IN) frame data from the network header on
+//               inLen (IN) captured length
+//               inWireLen (IN) length of the packet on the wire
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadPacketRing::HandleFrame(const unsigned char *inData, size_t inLen, size_t inWireLen)
+{
+    if (inLen < inWireLen || inLen < 1)
+        return;
+
+    struct sockaddr_storage from;
+    memset(&from, 0, sizeof(from));
+    size_t udpOffset;
+    size_t ipEnd;
+    if ((inData[0] >> 4) == 4)
+    {
+        size_t headerLen = (inData[0] & 0x0F) * 4;
+        if (headerLen < 20 || inLen < headerLen + 8 || inData[9] != IPPROTO_UDP)
+            return;
+        ipEnd = ((size_t)inData[2] << 8) | inData[3];
+
+        struct sockaddr_in *from4 = (struct sockaddr_in*)&from;
+        from4->sin_family = AF_INET;
+        memcpy(&from4->sin_addr, inData + 12, 4);
+        udpOffset = headerLen;
+    }
+    else if ((inData[0] >> 4) == 6)
+    {
+        if (inLen < 48 || inData[6] != IPPROTO_UDP)
+            return;
+        ipEnd = 40 + (((size_t)inData[4] << 8) | inData[5]);
+
+        struct sockaddr_in6 *from6 = (struct sockaddr_in6*)&from;
+        from6->sin6_family = AF_INET6;
+        memcpy(&from6->sin6_addr, inData + 8, 16);
+        udpOffset = 40;
+    }
+    else
+        return;
+
+    const unsigned char *udp = inData + udpOffset;
+    unsigned short srcPort = (udp[0] << 8) | udp[1];
+    unsigned short dstPort = (udp[2] << 8) | udp[3];
+    size_t udpLen = ((size_t)udp[4] << 8) | udp[5];
+    if (dstPort != mPort || udpLen < 8 || ipEnd > inLen || udpOffset + udpLen > ipEnd)
+        return;
+
+    if (from.ss_family == AF_INET)
+        ((struct sockaddr_in*)&from)->sin_port = htons(srcPort);
+    else
+        ((struct sockaddr_in6*)&from)->sin6_port = htons(srcPort);
+
+    if (this->HandlePacket((unsigned char*)udp + 8, udpLen - 8, (struct sockaddr*)&from))
+    {
+        ReportError("Error handling packet");
+    }
+}
@@ -0,0 +1,112 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerPacketRing.h
+//
+// Desc: PACKET_MMAP (TPACKET_V3) receive ring for the listener port, and the
+//       inbox thread that reads it.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SERVER_PACKET_RING_H
+#define SERVER_PACKET_RING_H
+#include <linux/if_packet.h>
+#include <atomic>
+#include <string>
+#include "Server.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: PacketRing
+//##
+//##  Desc: An AF_PACKET socket with a TPACKET_V3 receive ring mapped into our
+//##        address space. A classic BPF filter keeps everything but UDP to the
+//##        listener port out of it, so the kernel copies each query once into
+//##        the ring and we read it without a system call per packet. Rings of
+//##        several pipelines form one PACKET_FANOUT group, hashed by flow.
+//##
+//################################################################################
+
+class PacketRing
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    PacketRing();
+    virtual ~PacketRing();
+
+    //
+    // Public member functions
+    //
+    int                         Open(const string &inInterface, unsigned short inPort,
+                                     int inFamily, unsigned short inFanoutGroup);
+    int                         GetSocket() { return mSocket; }
+    unsigned int                GetBlockCount() { return mBlockCount; }
+    struct tpacket_block_desc*  GetBlock(unsigned int inIndex)
+                                    { return (struct tpacket_block_desc*)(mMap + inIndex * mBlockSize); }
+    void                        UpdateStats();
+    static int                  MuteSocket(int inSocket);
+
+    //
+    // Public data (ring statistics, see UpdateStats())
+    //
+    atomic<uint64_t>            mStatsPackets;
+    atomic<uint64_t>            mStatsDrops;
+    atomic<uint64_t>            mStatsFreezes;
+
+    //
+    // Protected data
+    //
+protected:
+    int                         mSocket;
+    unsigned char               *mMap;
+    size_t                      mMapSize;
+    unsigned int                mBlockSize;
+    unsigned int                mBlockCount;
+};
+
+
+//################################################################################
+//##
+//## Class: ServerThreadPacketRing
+//##
+//##  Desc: Takes the place of the Inbox thread when the pipeline has a packet
+//##        ring. Waits for the kernel to retire a block, parses the IPv4/IPv6
+//##        and UDP headers of every frame in it and queues the payloads for
+//##        the processing thread just like the Inbox thread does. Replies still
+//##        go out on the listener socket.
+//##
+//################################################################################
+
+class ServerThreadPacketRing : public ServerThreadInbox
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadPacketRing(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadPacketRing();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+
+    //
+    // Protected member functions
+    //
+protected:
+    void ReadBlock(struct tpacket_block_desc *inBlock);
+    void HandleFrame(const unsigned char *inData, size_t inLen, size_t inWireLen);
+
+    //
+    // Protected data
+    //
+    PacketRing      *mRing;
+    unsigned short  mPort;
+};
+
+
+#endif
@@ -0,0 +1,1175 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerTCP.cpp
+//
+// Desc: DNS over TCP (RFC 7766): the client listener and the upstream
+//       connection pool.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include "ServerTCP.h"
+#include "ServerCoro.h"
+#include "Request.h"
+#include "Error.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: TCPConnection
+//##
+//##  Desc: One client connection.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TCPConnection::TCPConnection()
+//  Description: Constructor.
+//       Inputs: inOwner (IN) the thread serving this connection
+//               inSocket (IN) the accepted socket, now owned by us
+//               inAddr (IN) the client address
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+TCPConnection::TCPConnection(ServerThreadTCP *inOwner, int inSocket, const struct sockaddr *inAddr)
+: mOwner(inOwner),
+  mSocket(inSocket),
+  mReadOffset(0),
+  mWriteOffset(0),
+  mEvents(0),
+  mPaused(false),
+  mPeerClosed(false),
+  mLastActive(chrono::steady_clock::now()),
+  mInFlight(0)
+{
+    mAddr.Set(inAddr);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TCPConnection::~TCPConnection()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+TCPConnection::~TCPConnection()
+{
+    if (mSocket != -1)
+    {
+        close(mSocket);
+        mSocket = -1;
+    }
+}
+
+
+//################################################################################
+//##
+//## Class: ServerThreadTCP
+//##
+//##  Desc: Serves every TCP connection of a pipeline from one thread.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::ServerThreadTCP()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadTCP::ServerThreadTCP(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline),
+  mEpollFD(-1),
+  mEventFD(-1),
+  mTimerFD(-1),
+  mDraining(false)
+{
+    CreateBatches();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::~ServerThreadTCP()
+//  Description: Destructor. Closes every connection still open.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadTCP::~ServerThreadTCP()
+{
+    for (auto &entry : mConnections)
+    {
+        close(entry.second->mSocket);
+        entry.second->mSocket = -1;
+    }
+    mConnections.clear();
+    mReplies.clear();
+
+    int fds[] = { mTimerFD, mEventFD, mEpollFD };
+    for (int fd : fds)
+    {
+        if (fd != -1)
+            close(fd);
+    }
+    mTimerFD = mEventFD = mEpollFD = -1;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::Setup()
+//  Description: Create the epoll set, the reply eventfd and the idle scan timer.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadTCP::Setup()
+{
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD == -1)
+    {
+        ReportError("epoll_create1 failed, errno %d", errno);
+        return -1;
+    }
+
+    mEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEventFD == -1)
+    {
+        ReportError("eventfd failed, errno %d", errno);
+        return -1;
+    }
+
+    mTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mTimerFD == -1)
+    {
+        ReportError("timerfd_create failed, errno %d", errno);
+        return -1;
+    }
+
+    struct itimerspec interval;
+    interval.it_interval.tv_sec = SERVER_TIMEOUT_SCAN_MS / 1000;
+    interval.it_interval.tv_nsec = (SERVER_TIMEOUT_SCAN_MS % 1000) * 1000000L;
+    interval.it_value = interval.it_interval;
+    if (timerfd_settime(mTimerFD, 0, &interval, nullptr))
+    {
+        ReportError("timerfd_settime failed, errno %d", errno);
+        return -1;
+    }
+
+    int fds[] = { mPipeline->GetTCPSocket(), mEventFD, mTimerFD, mServer->GetStopFD() };
+    for (int fd : fds)
+    {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, fd, &event))
+        {
+            ReportError("epoll_ctl(%d) failed, errno %d", fd, errno);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::ThreadMain()
+//  Description: Main thread entry point. Waits in epoll_wait, which the
+//               server's stop eventfd wakes up when it's time to go.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::ThreadMain()
+{
+    if (Setup())
+    {
+        ReportError("TCP listener %u failed to start", mPipeline->GetIndex());
+        return;
+    }
+
+    int listenSocket = mPipeline->GetTCPSocket();
+    struct epoll_event events[SERVER_EVENT_BUDGET];
+
+    while (!mServer->ShuttingDown())
+    {
+        int count = epoll_wait(mEpollFD, events, SERVER_EVENT_BUDGET, -1);
+        if (count <= 0)
+        {
+            // EINTR, or we may be shutting down now
+            continue;
+        }
+
+        mBusy = true;
+        try
+        {
+            if (mServer->Draining())
+                Drain();
+            for (int i = 0; i < count; ++i)
+            {
+                int fd = events[i].data.fd;
+                uint64_t expirations;
+                if (fd == listenSocket)
+                {
+                    if (!mDraining)
+                        Accept();
+                }
+                else if (fd == mServer->GetStopFD())
+                {
+                    // ShuttingDown() ends the loop
+                }
+                else if (fd == mEventFD)
+                {
+                    if (read(mEventFD, &expirations, sizeof(expirations)) > 0)
+                        DeliverReplies();
+                }
+                else if (fd == mTimerFD)
+                {
+                    if (read(mTimerFD, &expirations, sizeof(expirations)) > 0)
+                        ScanConnections();
+                }
+                else
+                {
+                    auto found = mConnections.find(fd);
+                    if (found == mConnections.end())
+                        continue;
+
+                    shared_ptr<TCPConnection> conn(found->second);
+                    if (events[i].events & (EPOLLERR | EPOLLHUP))
+                    {
+                        CloseConnection(conn);
+                        continue;
+                    }
+                    if (events[i].events & EPOLLOUT)
+                        WriteReplies(conn);
+                    if (conn->mSocket != -1 && ((events[i].events & EPOLLIN) || conn->mPaused))
+                        ReadQueries(conn);
+                }
+            }
+            FlushBatches(true);
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
+    }
+
+    // Write the replies queued since we last looked, as far as the sockets take them
+    DeliverReplies();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::QueueReply()
+//  Description: Hand a reply to this thread for writing. Safe to call from any
+//               thread; the first reply queued wakes us up through the eventfd.
+//       Inputs: inConn (IN) the Request's connection reference
+//               inData (IN) reply data. Will be copied.
+//               inLen (IN) reply length
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::QueueReply(const shared_ptr<TCPConnection> &inConn,
+                                 const unsigned char *inData, size_t inLen)
+{
+    // Add the 2 byte length prefix
+    vector<unsigned char> framed(inLen + 2);
+    framed[0] = (unsigned char)(inLen >> 8);
+    framed[1] = (unsigned char)(inLen & 0xFF);
+    memcpy(&framed[2], inData, inLen);
+
+    mRepliesMutex.lock();
+    bool wakeUp = mReplies.empty();
+    mReplies.push_back(TCPReply(inConn, move(framed)));
+    mRepliesMutex.unlock();
+
+    if (wakeUp)
+    {
+        uint64_t one = 1;
+        if (write(mEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            ReportError("eventfd write failed, errno %d", errno);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::Accept()
+//  Description: Accept new connections, up to SERVER_EVENT_BUDGET per call.
+//               Connections over the configured cap are closed right away.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::Accept()
+{
+    const ServerConfig& config = mServer->GetConfig();
+    int listenSocket = mPipeline->GetTCPSocket();
+
+    for (int i = 0; i < SERVER_EVENT_BUDGET; ++i)
+    {
+        struct sockaddr_storage addr;
+        socklen_t addrLen = sizeof(addr);
+        int sock = accept4(listenSocket, (struct sockaddr*)&addr, &addrLen,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+                ReportError("accept failed, errno %d", errno);
+            return;
+        }
+
+        if (mConnections.size() >= config.mTCPMaxConns)
+        {
+            close(sock);
+            continue;
+        }
+
+        int on = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        shared_ptr<TCPConnection> conn(new TCPConnection(this, sock, (struct sockaddr*)&addr));
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = conn->mEvents = EPOLLIN;
+        event.data.fd = sock;
+        if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, sock, &event))
+        {
+            ReportError("epoll_ctl(%d) failed, errno %d", sock, errno);
+            continue;
+        }
+        mConnections[sock] = conn;
+        mServer->mStats.Add(STATS_TCP_CONNECTIONS);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::ReadQueries()
+//  Description: Read from a connection and run every complete query through
+//               the processing stage. Stops reading (and stops watching the
+//               socket) once the connection has SERVER_TCP_MAX_INFLIGHT queries
+//               in flight; it picks up again as replies go out.
+//       Inputs: inConn (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::ReadQueries(const shared_ptr<TCPConnection> &inConn)
+{
+    const ServerConfig& config = mServer->GetConfig();
+    int maxInFlight = (int) config.mTCPMaxInFlight;
+    unsigned char chunk[SERVER_BUFFER_SIZE];
+
+    for (int reads = 0; reads < SERVER_EVENT_BUDGET; ++reads)
+    {
+        //
+        // Handle every complete message we have, up to the in-flight cap
+        //
+        vector<unsigned char> &buffer = inConn->mReadBuffer;
+        while (inConn->mInFlight < maxInFlight && buffer.size() - inConn->mReadOffset >= 2)
+        {
+            unsigned char *message = &buffer[inConn->mReadOffset];
+            size_t messageLen = (message[0] << 8) | message[1];
+            if (messageLen == 0 || messageLen > SERVER_BUFFER_SIZE)
+            {
+                ReportError("Bad TCP message length (%d bytes), closing.", (int)messageLen);
+                CloseConnection(inConn);
+                return;
+            }
+            if (buffer.size() - inConn->mReadOffset < messageLen + 2)
+                break;
+
+            //
+            // The Request references the connection through its own handle, so
+            // the in-flight count drops whenever the Request goes away, however
+            // it ends (answered, cached, timed out or failed.)
+            //
+            unique_ptr<Request> newReq(new Request());
+            newReq->mPacket.SetRawData(message + 2, messageLen);
+            newReq->mClientAddr = inConn->mAddr;
+            shared_ptr<TCPConnection> keepAlive(inConn);
+            ++inConn->mInFlight;
+            newReq->mTCPConn = shared_ptr<TCPConnection>(inConn.get(),
+                                                         [keepAlive](TCPConnection *inQueryConn)
+                                                         {
+                                                             --inQueryConn->mInFlight;
+                                                         });
+            inConn->mReadOffset += messageLen + 2;
+            mServer->mStats.Add(STATS_PACKETS_IN);
+            mServer->mStats.Add(STATS_TCP_QUERIES);
+            if (mPipeline->GetCoroThread())
+            {
+                // The coro engine runs every query as a coroutine on its thread
+                mPipeline->GetCoroThread()->QueueQuery(move(newReq));
+            }
+            else if (HandleRequest(move(newReq)))
+            {
+                ReportError("Error handling request");
+            }
+        }
+
+        // Drop what has been parsed
+        if (inConn->mReadOffset == buffer.size())
+        {
+            buffer.clear();
+            inConn->mReadOffset = 0;
+        }
+        else if (inConn->mReadOffset > 0)
+        {
+            buffer.erase(buffer.begin(), buffer.begin() + inConn->mReadOffset);
+            inConn->mReadOffset = 0;
+        }
+
+        inConn->mPaused = inConn->mInFlight >= maxInFlight;
+        if (inConn->mPaused || inConn->mPeerClosed)
+            break;
+
+        //
+        // Read more
+        //
+        ssize_t nbytes = recv(inConn->mSocket, chunk, sizeof(chunk), 0);
+        if (nbytes > 0)
+        {
+            buffer.insert(buffer.end(), chunk, chunk + nbytes);
+            inConn->mLastActive = chrono::steady_clock::now();
+        }
+        else if (nbytes == 0)
+        {
+            // Client is done sending, finish answering what we have first
+            inConn->mPeerClosed = true;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            CloseConnection(inConn);
+            return;
+        }
+    }
+
+    if (inConn->mPeerClosed && inConn->mInFlight == 0 &&
+        inConn->mWriteOffset == inConn->mWriteBuffer.size())
+    {
+        CloseConnection(inConn);
+        return;
+    }
+    UpdateEvents(inConn);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::WriteReplies()
+//  Description: Write as much of a connection's pending replies as the socket
+//               takes. Whatever is left is written when epoll reports the
+//               socket writable.
+//       Inputs: inConn (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::WriteReplies(const shared_ptr<TCPConnection> &inConn)
+{
+    vector<unsigned char> &buffer = inConn->mWriteBuffer;
+    while (inConn->mWriteOffset < buffer.size())
+    {
+        ssize_t nbytes = send(inConn->mSocket, &buffer[inConn->mWriteOffset],
+                              buffer.size() - inConn->mWriteOffset, MSG_NOSIGNAL);
+        if (nbytes > 0)
+        {
+            inConn->mWriteOffset += nbytes;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            CloseConnection(inConn);
+            return;
+        }
+    }
+
+    if (inConn->mWriteOffset == buffer.size())
+    {
+        buffer.clear();
+        inConn->mWriteOffset = 0;
+    }
+    inConn->mLastActive = chrono::steady_clock::now();
+
+    if (inConn->mPeerClosed && inConn->mInFlight == 0 && buffer.empty())
+    {
+        CloseConnection(inConn);
+        return;
+    }
+    UpdateEvents(inConn);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::DeliverReplies()
+//  Description: Move the replies queued by other threads onto their connections
+//               and write them. Connections that were paused at the in-flight
+//               cap start reading again.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::DeliverReplies()
+{
+    vector<TCPReply> replies;
+    mRepliesMutex.lock();
+    replies.swap(mReplies);
+    mRepliesMutex.unlock();
+
+    vector<shared_ptr<TCPConnection>> touched;
+    for (auto &reply : replies)
+    {
+        // The connection may have closed while the query was out
+        TCPConnection *conn = reply.first.get();
+        if (conn->mSocket == -1)
+            continue;
+        auto found = mConnections.find(conn->mSocket);
+        if (found == mConnections.end() || found->second.get() != conn)
+            continue;
+
+        if (conn->mWriteBuffer.empty())
+            touched.push_back(found->second);
+        conn->mWriteBuffer.insert(conn->mWriteBuffer.end(), reply.second.begin(), reply.second.end());
+    }
+
+    // Releases the Requests' handles, so the in-flight counts are current
+    replies.clear();
+
+    for (auto &conn : touched)
+    {
+        if (conn->mSocket != -1)
+            WriteReplies(conn);
+        if (conn->mSocket != -1 && conn->mPaused)
+            ReadQueries(conn);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::Drain()
+//  Description: The server is draining: stop accepting and treat every
+//               connection as if the client were done sending. The queries
+//               in flight are still answered, then the connections close.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::Drain()
+{
+    if (mDraining)
+        return;
+    mDraining = true;
+    epoll_ctl(mEpollFD, EPOLL_CTL_DEL, mPipeline->GetTCPSocket(), nullptr);
+
+    vector<shared_ptr<TCPConnection>> conns;
+    conns.reserve(mConnections.size());
+    for (auto &entry : mConnections)
+        conns.push_back(entry.second);
+
+    for (auto &conn : conns)
+    {
+        conn->mPeerClosed = true;
+        conn->mReadBuffer.clear();
+        conn->mReadOffset = 0;
+        if (conn->mInFlight == 0 && conn->mWriteOffset == conn->mWriteBuffer.size())
+            CloseConnection(conn);
+        else
+            UpdateEvents(conn);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::ScanConnections()
+//  Description: Runs every SERVER_TIMEOUT_SCAN_MS. Closes connections that have
+//               had nothing in flight for the idle timeout, and resumes paused
+//               connections whose queries timed out instead of being answered.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::ScanConnections()
+{
+    const ServerConfig& config = mServer->GetConfig();
+    chrono::steady_clock::time_point rightNow = chrono::steady_clock::now();
+
+    vector<shared_ptr<TCPConnection>> conns;
+    conns.reserve(mConnections.size());
+    for (auto &entry : mConnections)
+        conns.push_back(entry.second);
+
+    for (auto &conn : conns)
+    {
+        if (conn->mPaused && conn->mInFlight < (int) config.mTCPMaxInFlight)
+            ReadQueries(conn);
+        if (conn->mSocket == -1)
+            continue;
+
+        bool idle = conn->mInFlight == 0 && conn->mWriteOffset == conn->mWriteBuffer.size();
+        long idleMS = chrono::duration_cast<chrono::milliseconds>(rightNow - conn->mLastActive).count();
+        if (idle && (conn->mPeerClosed || idleMS >= (long) config.mTCPIdleMS))
+        {
+            CloseConnection(conn);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::UpdateEvents()
+//  Description: Watch for input unless paused or the client is done sending,
+//               and for output while replies are pending.
+//       Inputs: inConn (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::UpdateEvents(const shared_ptr<TCPConnection> &inConn)
+{
+    unsigned int events = 0;
+    if (!inConn->mPaused && !inConn->mPeerClosed)
+        events |= EPOLLIN;
+    if (inConn->mWriteOffset < inConn->mWriteBuffer.size())
+        events |= EPOLLOUT;
+    if (events == inConn->mEvents)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.fd = inConn->mSocket;
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_MOD, inConn->mSocket, &event))
+    {
+        ReportError("epoll_ctl(%d) failed, errno %d", inConn->mSocket, errno);
+        return;
+    }
+    inConn->mEvents = events;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadTCP::CloseConnection()
+//  Description: Close a connection. Requests still out keep the object alive
+//               but their replies are dropped.
+//       Inputs: inConn (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadTCP::CloseConnection(const shared_ptr<TCPConnection> &inConn)
+{
+    shared_ptr<TCPConnection> conn(inConn);
+    int sock = conn->mSocket;
+    if (sock == -1)
+        return;
+
+    epoll_ctl(mEpollFD, EPOLL_CTL_DEL, sock, nullptr);
+    close(sock);
+    conn->mSocket = -1;
+    mConnections.erase(sock);
+}
+
+
+
+//################################################################################
+//##
+//## Class: ServerThreadFwdTCP
+//##
+//##  Desc: A pipeline's pool of TCP connections to the remote DNS server.
+//##
+//################################################################################
+
+#define FWD_EVENT_ID_QUERIES    0xFFFFFFFF      /* epoll id of the eventfd, the rest are connections */
+#define FWD_EVENT_ID_STOP       0xFFFFFFFE      /* epoll id of the server's stop eventfd */
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::ServerThreadFwdTCP()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadFwdTCP::ServerThreadFwdTCP(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline),
+  mEpollFD(-1),
+  mEventFD(-1)
+{
+    CreateBatches();
+
+    FwdConnection closed;
+    closed.mSocket = -1;
+    closed.mConnecting = false;
+    closed.mEvents = 0;
+    closed.mWriteOffset = 0;
+    mConnections.assign(inPipeline->GetFwdTCPCount(), closed);
+
+    // Now, not in ThreadMain(), other threads may queue queries right away
+    Setup();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::~ServerThreadFwdTCP()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadFwdTCP::~ServerThreadFwdTCP()
+{
+    for (auto &conn : mConnections)
+    {
+        if (conn.mSocket != -1)
+        {
+            close(conn.mSocket);
+            conn.mSocket = -1;
+        }
+    }
+
+    if (mEventFD != -1)
+    {
+        close(mEventFD);
+        mEventFD = -1;
+    }
+
+    if (mEpollFD != -1)
+    {
+        close(mEpollFD);
+        mEpollFD = -1;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::Setup()
+//  Description: Create the epoll set and the query eventfd, and watch the
+//               server's stop eventfd. Connections are
+//               opened by the first query sent over them. On failure the fds
+//               stay -1 and ThreadMain() gives up.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadFwdTCP::Setup()
+{
+    mEpollFD = epoll_create1(EPOLL_CLOEXEC);
+    if (mEpollFD == -1)
+    {
+        ReportError("epoll_create1 failed, errno %d", errno);
+        return -1;
+    }
+
+    mEventFD = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEventFD == -1)
+    {
+        ReportError("eventfd failed, errno %d", errno);
+        return -1;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = FWD_EVENT_ID_QUERIES;
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mEventFD, &event))
+    {
+        ReportError("epoll_ctl(%d) failed, errno %d", mEventFD, errno);
+        close(mEpollFD);
+        mEpollFD = -1;
+        return -1;
+    }
+    event.data.u32 = FWD_EVENT_ID_STOP;
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, mServer->GetStopFD(), &event))
+    {
+        ReportError("epoll_ctl(%d) failed, errno %d", mServer->GetStopFD(), errno);
+        close(mEpollFD);
+        mEpollFD = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::ThreadMain()
+//  Description: Main thread entry point. Waits in epoll_wait, which the
+//               server's stop eventfd wakes up when it's time to go.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::ThreadMain()
+{
+    if (mEpollFD == -1 || mEventFD == -1)
+    {
+        ReportError("Upstream TCP %u failed to start", mPipeline->GetIndex());
+        return;
+    }
+
+    struct epoll_event events[SERVER_EVENT_BUDGET];
+
+    while (!mServer->ShuttingDown())
+    {
+        int count = epoll_wait(mEpollFD, events, SERVER_EVENT_BUDGET, -1);
+        if (count <= 0)
+        {
+            // EINTR, or we may be shutting down now
+            continue;
+        }
+
+        mBusy = true;
+        try
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                uint32_t id = events[i].data.u32;
+                if (id == FWD_EVENT_ID_QUERIES)
+                {
+                    uint64_t queued;
+                    if (read(mEventFD, &queued, sizeof(queued)) > 0)
+                        DeliverQueries();
+                    continue;
+                }
+
+                if (id >= mConnections.size() || mConnections[id].mSocket == -1)
+                    continue;
+                if (events[i].events & (EPOLLERR | EPOLLHUP))
+                {
+                    CloseConnection(id);
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    WriteConnection(id);
+                if ((events[i].events & EPOLLIN) && mConnections[id].mSocket != -1)
+                    ReadConnection(id);
+            }
+            FlushBatches(true);
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::QueueQuery()
+//  Description: Hand a query to this thread for sending. Safe to call from any
+//               thread; the first query queued wakes us up through the eventfd.
+//       Inputs: inConnIndex (IN) which connection of the pool to send it on
+//               inData (IN) query data, already carrying our packet ID. Will
+//                      be copied.
+//               inLen (IN) query length
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::QueueQuery(unsigned int inConnIndex, const unsigned char *inData,
+                                    size_t inLen)
+{
+    // Add the 2 byte length prefix
+    vector<unsigned char> framed(inLen + 2);
+    framed[0] = (unsigned char)(inLen >> 8);
+    framed[1] = (unsigned char)(inLen & 0xFF);
+    memcpy(&framed[2], inData, inLen);
+
+    mQueriesMutex.lock();
+    bool wakeUp = mQueries.empty();
+    mQueries.push_back(FwdQuery(inConnIndex, move(framed)));
+    mQueriesMutex.unlock();
+
+    if (wakeUp)
+    {
+        uint64_t one = 1;
+        if (write(mEventFD, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        {
+            ReportError("eventfd write failed, errno %d", errno);
+        }
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::DeliverQueries()
+//  Description: Move the queued queries onto their connections, opening any
+//               that are closed, and write them.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::DeliverQueries()
+{
+    vector<FwdQuery> queries;
+    mQueriesMutex.lock();
+    queries.swap(mQueries);
+    mQueriesMutex.unlock();
+
+    vector<bool> touched(mConnections.size(), false);
+    for (auto &query : queries)
+    {
+        FwdConnection &conn = mConnections[query.first];
+        if (conn.mSocket == -1 && Connect(query.first))
+        {
+            // Dropped, the Request times out in the Outbox
+            continue;
+        }
+        conn.mWriteBuffer.insert(conn.mWriteBuffer.end(), query.second.begin(), query.second.end());
+        touched[query.first] = true;
+    }
+
+    for (unsigned int i = 0; i < touched.size(); ++i)
+    {
+        if (touched[i] && !mConnections[i].mConnecting)
+            WriteConnection(i);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::Connect()
+//  Description: Start a non-blocking connect to the remote DNS server. Queries
+//               queue up on the connection until epoll reports it writable.
+//       Inputs: inConnIndex (IN) the connection
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadFwdTCP::Connect(unsigned int inConnIndex)
+{
+    FwdConnection &conn = mConnections[inConnIndex];
+    const struct sockaddr *fwdAddress = mServer->GetFwdSocketAddr();
+
+    conn.mSocket = socket(fwdAddress->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (conn.mSocket == -1)
+    {
+        ReportError("Could not create socket, errno %d", errno);
+        return -1;
+    }
+
+    int on = 1;
+    setsockopt(conn.mSocket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    conn.mConnecting = false;
+    if (connect(conn.mSocket, fwdAddress, SocketAddress::Length(fwdAddress)))
+    {
+        if (errno != EINPROGRESS)
+        {
+            ReportError("Could not connect to the forward DNS server over TCP, errno %d", errno);
+            close(conn.mSocket);
+            conn.mSocket = -1;
+            return -1;
+        }
+        conn.mConnecting = true;
+    }
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = conn.mEvents = EPOLLIN | (conn.mConnecting ? (uint32_t) EPOLLOUT : (uint32_t) 0);
+    event.data.u32 = inConnIndex;
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_ADD, conn.mSocket, &event))
+    {
+        ReportError("epoll_ctl(%d) failed, errno %d", conn.mSocket, errno);
+        close(conn.mSocket);
+        conn.mSocket = -1;
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::ReadConnection()
+//  Description: Read from a connection and hand every complete reply to the
+//               reply stage, in whatever order the server answers.
+//       Inputs: inConnIndex (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::ReadConnection(unsigned int inConnIndex)
+{
+    FwdConnection &conn = mConnections[inConnIndex];
+    unsigned short fwdIndex = (unsigned short)(mPipeline->GetFwdSocketCount() + inConnIndex);
+    const struct sockaddr *fwdAddress = mServer->GetFwdSocketAddr();
+    unsigned char chunk[SERVER_BUFFER_SIZE];
+
+    for (int reads = 0; reads < SERVER_EVENT_BUDGET; ++reads)
+    {
+        ssize_t nbytes = recv(conn.mSocket, chunk, sizeof(chunk), 0);
+        if (nbytes == 0 || (nbytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        {
+            // Server closed the connection, the next query reopens it
+            CloseConnection(inConnIndex);
+            return;
+        }
+        if (nbytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        vector<unsigned char> &buffer = conn.mReadBuffer;
+        buffer.insert(buffer.end(), chunk, chunk + nbytes);
+
+        size_t offset = 0;
+        while (buffer.size() - offset >= 2)
+        {
+            size_t messageLen = (buffer[offset] << 8) | buffer[offset + 1];
+            if (buffer.size() - offset < messageLen + 2)
+                break;
+            if (HandleReply(&buffer[offset + 2], messageLen, fwdAddress, fwdIndex))
+            {
+                ReportError("Error handling packet");
+            }
+            offset += messageLen + 2;
+        }
+        buffer.erase(buffer.begin(), buffer.begin() + offset);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::WriteConnection()
+//  Description: Write as much of a connection's pending queries as the socket
+//               takes. Also finishes a non-blocking connect.
+//       Inputs: inConnIndex (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::WriteConnection(unsigned int inConnIndex)
+{
+    FwdConnection &conn = mConnections[inConnIndex];
+
+    if (conn.mConnecting)
+    {
+        int error = 0;
+        socklen_t errorLen = sizeof(error);
+        if (getsockopt(conn.mSocket, SOL_SOCKET, SO_ERROR, &error, &errorLen) || error)
+        {
+            ReportError("Could not connect to the forward DNS server over TCP, errno %d", error);
+            CloseConnection(inConnIndex);
+            return;
+        }
+        conn.mConnecting = false;
+    }
+
+    vector<unsigned char> &buffer = conn.mWriteBuffer;
+    while (conn.mWriteOffset < buffer.size())
+    {
+        ssize_t nbytes = send(conn.mSocket, &buffer[conn.mWriteOffset],
+                              buffer.size() - conn.mWriteOffset, MSG_NOSIGNAL);
+        if (nbytes > 0)
+        {
+            conn.mWriteOffset += nbytes;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            break;
+        }
+        else if (errno != EINTR)
+        {
+            CloseConnection(inConnIndex);
+            return;
+        }
+    }
+
+    if (conn.mWriteOffset == buffer.size())
+    {
+        buffer.clear();
+        conn.mWriteOffset = 0;
+    }
+    UpdateEvents(inConnIndex);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::UpdateEvents()
+//  Description: Always watch for replies, and for output while connecting or
+//               while queries are pending.
+//       Inputs: inConnIndex (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::UpdateEvents(unsigned int inConnIndex)
+{
+    FwdConnection &conn = mConnections[inConnIndex];
+    unsigned int events = EPOLLIN;
+    if (conn.mConnecting || conn.mWriteOffset < conn.mWriteBuffer.size())
+        events |= EPOLLOUT;
+    if (events == conn.mEvents)
+        return;
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = events;
+    event.data.u32 = inConnIndex;
+    if (epoll_ctl(mEpollFD, EPOLL_CTL_MOD, conn.mSocket, &event))
+    {
+        ReportError("epoll_ctl(%d) failed, errno %d", conn.mSocket, errno);
+        return;
+    }
+    conn.mEvents = events;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadFwdTCP::CloseConnection()
+//  Description: Close a connection. Queries not yet written are dropped and,
+//               like those still waiting for a reply, time out in the Outbox.
+//       Inputs: inConnIndex (IN) the connection
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadFwdTCP::CloseConnection(unsigned int inConnIndex)
+{
+    FwdConnection &conn = mConnections[inConnIndex];
+    if (conn.mSocket == -1)
+        return;
+
+    epoll_ctl(mEpollFD, EPOLL_CTL_DEL, conn.mSocket, nullptr);
+    close(conn.mSocket);
+    conn.mSocket = -1;
+    conn.mConnecting = false;
+    conn.mEvents = 0;
+    conn.mReadBuffer.clear();
+    conn.mWriteBuffer.clear();
+    conn.mWriteOffset = 0;
+}
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerTCP.h
+//
+// Desc: DNS over TCP (RFC 7766): the client listener and the upstream
+//       connection pool.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SERVER_TCP_H
+#define SERVER_TCP_H
+#include <netinet/in.h>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <chrono>
+#include <unordered_map>
+#include "Server.h"
+#include "SocketAddress.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: TCPConnection
+//##
+//##  Desc: One client connection. Owned by its ServerThreadTCP, and every
+//##        Request read off it holds a reference so the reply can find its way
+//##        back (or be dropped if the connection has closed in the meantime.)
+//##
+//################################################################################
+
+class TCPConnection
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    TCPConnection(ServerThreadTCP *inOwner, int inSocket, const struct sockaddr *inAddr);
+    virtual ~TCPConnection();
+
+    //
+    // Public data (only touched by the owning thread, except mOwner and mInFlight)
+    //
+    ServerThreadTCP                     *mOwner;
+    int                                 mSocket;        // -1 once closed
+    SocketAddress                       mAddr;
+    vector<unsigned char>               mReadBuffer;
+    size_t                              mReadOffset;    // Start of the first unparsed message
+    vector<unsigned char>               mWriteBuffer;
+    size_t                              mWriteOffset;   // Start of the unsent data
+    unsigned int                        mEvents;        // Currently registered epoll events
+    bool                                mPaused;        // Not reading, at the in-flight cap
+    bool                                mPeerClosed;    // Client shut down its side (or we're draining)
+    chrono::steady_clock::time_point    mLastActive;
+    atomic_int                          mInFlight;      // Requests holding a reference
+};
+
+
+//################################################################################
+//##
+//## Class: ServerThreadTCP
+//##
+//##  Desc: Serves every TCP connection of a pipeline from one thread with
+//##        epoll. Queries are read with the 2 byte length framing and run
+//##        through the processing stage right here, any number pipelined per
+//##        connection up to the in-flight cap. Replies come back from whatever
+//##        thread handled them through QueueReply() and are written in the
+//##        order they arrive, which need not be the order of the queries.
+//##
+//################################################################################
+
+class ServerThreadTCP : public ServerThread
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadTCP(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadTCP();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+    void QueueReply(const shared_ptr<TCPConnection> &inConn, const unsigned char *inData,
+                    size_t inLen);
+
+    //
+    // Protected member functions
+    //
+protected:
+    int Setup();
+    void Accept();
+    void ReadQueries(const shared_ptr<TCPConnection> &inConn);
+    void WriteReplies(const shared_ptr<TCPConnection> &inConn);
+    void DeliverReplies();
+    void Drain();
+    void ScanConnections();
+    void UpdateEvents(const shared_ptr<TCPConnection> &inConn);
+    void CloseConnection(const shared_ptr<TCPConnection> &inConn);
+
+    //
+    // Protected data
+    //
+    typedef pair<shared_ptr<TCPConnection>, vector<unsigned char>> TCPReply;
+
+    int                                             mEpollFD;
+    int                                             mEventFD;   // Wakes us up for replies
+    int                                             mTimerFD;   // Idle connection scan
+    unordered_map<int, shared_ptr<TCPConnection>>   mConnections;
+    vector<TCPReply>                                mReplies;   // Framed, from other threads
+    mutex                                           mRepliesMutex;
+    bool                                            mDraining;  // Not accepting or reading queries
+};
+
+
+//################################################################################
+//##
+//## Class: ServerThreadFwdTCP
+//##
+//##  Desc: Keeps a pipeline's pool of persistent TCP connections to the remote
+//##        DNS server. Every connection is a forward index of its own with a
+//##        full 16 bit ID space, so many queries are pipelined on each and the
+//##        replies are matched through the Outbox like UDP replies. Queries
+//##        are handed over from any thread with QueueQuery(); connections are
+//##        (re)opened on demand.
+//##
+//################################################################################
+
+class ServerThreadFwdTCP : public ServerThread
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadFwdTCP(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadFwdTCP();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+    void QueueQuery(unsigned int inConnIndex, const unsigned char *inData, size_t inLen);
+
+    //
+    // Protected member functions
+    //
+protected:
+    int Setup();
+    int Connect(unsigned int inConnIndex);
+    void ReadConnection(unsigned int inConnIndex);
+    void WriteConnection(unsigned int inConnIndex);
+    void DeliverQueries();
+    void UpdateEvents(unsigned int inConnIndex);
+    void CloseConnection(unsigned int inConnIndex);
+
+    //
+    // Protected data
+    //
+    struct FwdConnection
+    {
+        int                     mSocket;        // -1 while closed
+        bool                    mConnecting;    // Non-blocking connect() in progress
+        unsigned int            mEvents;        // Currently registered epoll events
+        vector<unsigned char>   mReadBuffer;
+        vector<unsigned char>   mWriteBuffer;
+        size_t                  mWriteOffset;   // Start of the unsent data
+    };
+    typedef pair<unsigned int, vector<unsigned char>> FwdQuery;
+
+    int                                             mEpollFD;
+    int                                             mEventFD;   // Wakes us up for queries
+    vector<FwdConnection>                           mConnections;
+    vector<FwdQuery>                                mQueries;   // Framed, from other threads
+    mutex                                           mQueriesMutex;
+};
+
+
+#endif
+
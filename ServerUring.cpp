@@ -0,0 +1,808 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerUring.cpp
+//
+// Desc: io_uring engine: multishot recvmsg into a provided buffer ring and
+//       batched sendmsg submissions.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include "ServerUring.h"
+#include "Request.h"
+#include "TimerWheel.h"
+#include "SocketAddress.h"
+#include "Error.h"
+
+using namespace std;
+
+//
+// user_data tags. Receive and send completions carry their registered file
+// index or slot index in the low bits.
+//
+#define URING_TAG_STOP          1ULL
+#define URING_TAG_TIMERS        2ULL
+#define URING_TAG_RECV          (1ULL << 16)
+#define URING_TAG_SEND          (1ULL << 32)
+
+#define URING_FILE_SERVER       0       /* Registered file index of the listener socket */
+#define URING_FILE_FWD          1       /* Registered file index of the first forward socket */
+#define URING_BUFFER_GROUP      0
+
+
+//################################################################################
+//##
+//## Class: IOUring
+//##
+//##  Desc: Thin wrapper around the raw io_uring syscalls and rings.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::IOUring()
+//  Description: Constructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+IOUring::IOUring()
+: mRingFD(-1),
+  mSQRing(MAP_FAILED),
+  mSQRingSize(0),
+  mCQRing(MAP_FAILED),
+  mCQRingSize(0),
+  mSQEs((struct io_uring_sqe*)MAP_FAILED),
+  mSQEsSize(0),
+  mSQLocalTail(0)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::~IOUring()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+IOUring::~IOUring()
+{
+    if (mSQEs != MAP_FAILED)
+        munmap(mSQEs, mSQEsSize);
+    if (mCQRing != MAP_FAILED && mCQRing != mSQRing)
+        munmap(mCQRing, mCQRingSize);
+    if (mSQRing != MAP_FAILED)
+        munmap(mSQRing, mSQRingSize);
+    if (mRingFD != -1)
+        close(mRingFD);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::Setup()
+//  Description: Create the ring and map the submission and completion queues.
+//       Inputs: inEntries (IN) submission queue size
+//      Returns: Non-zero on error (errno is left set.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int IOUring::Setup(unsigned int inEntries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    mRingFD = syscall(__NR_io_uring_setup, inEntries, &params);
+    if (mRingFD < 0)
+    {
+        mRingFD = -1;
+        return -1;
+    }
+
+    mSQRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    mCQRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (mCQRingSize > mSQRingSize)
+            mSQRingSize = mCQRingSize;
+        mCQRingSize = mSQRingSize;
+    }
+
+    mSQRing = mmap(nullptr, mSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   mRingFD, IORING_OFF_SQ_RING);
+    if (mSQRing == MAP_FAILED)
+        return -1;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        mCQRing = mSQRing;
+    }
+    else
+    {
+        mCQRing = mmap(nullptr, mCQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       mRingFD, IORING_OFF_CQ_RING);
+        if (mCQRing == MAP_FAILED)
+            return -1;
+    }
+
+    mSQEsSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    mSQEs = (struct io_uring_sqe*) mmap(nullptr, mSQEsSize, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, mRingFD, IORING_OFF_SQES);
+    if (mSQEs == MAP_FAILED)
+        return -1;
+
+    unsigned char *sq = (unsigned char*) mSQRing;
+    unsigned char *cq = (unsigned char*) mCQRing;
+    mSQHead = (unsigned int*)(sq + params.sq_off.head);
+    mSQTail = (unsigned int*)(sq + params.sq_off.tail);
+    mSQMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+    mSQEntries = (unsigned int*)(sq + params.sq_off.ring_entries);
+    mSQArray = (unsigned int*)(sq + params.sq_off.array);
+    mCQHead = (unsigned int*)(cq + params.cq_off.head);
+    mCQTail = (unsigned int*)(cq + params.cq_off.tail);
+    mCQMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+    mCQEs = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    mSQLocalTail = *mSQTail;
+
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::Register()
+//  Description: io_uring_register() on this ring.
+//      Returns: Non-zero on error (errno is left set.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int IOUring::Register(unsigned int inOpcode, void *inArg, unsigned int inCount)
+{
+    return syscall(__NR_io_uring_register, mRingFD, inOpcode, inArg, inCount) < 0 ? -1 : 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::GetSQE()
+//  Description: Hand out the next free SQE, zeroed. If the submission queue is
+//               full everything pending is submitted first to make room.
+//      Returns: The SQE, or nullptr if there is no room even after submitting.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+struct io_uring_sqe* IOUring::GetSQE()
+{
+    unsigned int head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+    if (mSQLocalTail - head >= *mSQEntries)
+    {
+        Submit(0);
+        head = __atomic_load_n(mSQHead, __ATOMIC_ACQUIRE);
+        if (mSQLocalTail - head >= *mSQEntries)
+            return nullptr;
+    }
+
+    unsigned int index = mSQLocalTail & *mSQMask;
+    struct io_uring_sqe *sqe = &mSQEs[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    mSQArray[index] = index;
+    ++mSQLocalTail;
+    return sqe;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::Submit()
+//  Description: Publish every SQE handed out since the last call and submit
+//               them with a single io_uring_enter().
+//       Inputs: inWaitFor (IN) block until this many completions are ready
+//      Returns: Negative on error, otherwise the number of SQEs consumed.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int IOUring::Submit(unsigned int inWaitFor)
+{
+    unsigned int toSubmit = mSQLocalTail - *mSQTail;
+    __atomic_store_n(mSQTail, mSQLocalTail, __ATOMIC_RELEASE);
+
+    if (toSubmit == 0 && inWaitFor == 0)
+        return 0;
+
+    return syscall(__NR_io_uring_enter, mRingFD, toSubmit, inWaitFor,
+                   inWaitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::PeekCQE()
+//  Description: Look at the next completion without consuming it.
+//      Returns: The CQE or nullptr if there are none ready.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+struct io_uring_cqe* IOUring::PeekCQE()
+{
+    unsigned int head = *mCQHead;
+    if (head == __atomic_load_n(mCQTail, __ATOMIC_ACQUIRE))
+        return nullptr;
+    return &mCQEs[head & *mCQMask];
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: IOUring::SeenCQE()
+//  Description: Consume the completion returned by PeekCQE().
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void IOUring::SeenCQE()
+{
+    __atomic_store_n(mCQHead, *mCQHead + 1, __ATOMIC_RELEASE);
+}
+
+
+//################################################################################
+//##
+//## Class: ServerThreadUring
+//##
+//##  Desc: Serves a whole pipeline from one thread through io_uring.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::ServerThreadUring()
+//  Description: Constructor.
+//       Inputs: inServer (IN) the server
+//               inPipeline (IN) the pipeline this thread serves
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadUring::ServerThreadUring(Server *inServer, ServerPipeline *inPipeline)
+: ServerThread(inServer, inPipeline),
+  mBufRing((struct io_uring_buf_ring*)MAP_FAILED),
+  mBufRingSize(0),
+  mBuffers(nullptr),
+  mBufTail(0),
+  mSends(SERVER_URING_SENDS)
+{
+    unsigned int maxUDPSize = inServer->GetConfig().mMaxUDPSize;
+
+    memset(&mRecvMsg, 0, sizeof(mRecvMsg));
+    mRecvMsg.msg_namelen = sizeof(struct sockaddr_in6);     // Room for either family
+    mBufferSize = sizeof(struct io_uring_recvmsg_out) + mRecvMsg.msg_namelen + maxUDPSize;
+    for (auto &send : mSends)
+        send.mData.resize(maxUDPSize);
+
+    for (unsigned int i = 0; i < SERVER_URING_SENDS; ++i)
+        mFreeSends.push_back(SERVER_URING_SENDS - 1 - i);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::~ServerThreadUring()
+//  Description: Destructor. The ring (and with it the registered buffer ring)
+//               is torn down by mRing's destructor after this.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+ServerThreadUring::~ServerThreadUring()
+{
+    if (mBufRing != MAP_FAILED)
+    {
+        munmap(mBufRing, mBufRingSize);
+        mBufRing = (struct io_uring_buf_ring*)MAP_FAILED;
+    }
+
+    if (mBuffers)
+    {
+        free(mBuffers);
+        mBuffers = nullptr;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::Supported()
+//  Description: Check that this kernel can run the io_uring engine: ring setup,
+//               provided buffer rings and multishot recvmsg. The only reliable
+//               test for the last one is to try it, so we arm a multishot
+//               recvmsg on a loopback socket and send ourselves a datagram.
+//      Returns: True if the engine can be used.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool ServerThreadUring::Supported()
+{
+    IOUring ring;
+    if (ring.Setup(4))
+        return false;
+
+    // Provided buffer ring with a single buffer
+    long pageSize = sysconf(_SC_PAGESIZE);
+    void *bufRing = mmap(nullptr, pageSize, PROT_READ | PROT_WRITE,
+                         MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (bufRing == MAP_FAILED)
+        return false;
+
+    bool supported = false;
+    unsigned char buffer[256];
+    int sock = -1;
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) bufRing;
+    reg.ring_entries = 1;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    do
+    {
+        if (ring.Register(IORING_REGISTER_PBUF_RING, &reg, 1))
+            break;
+
+        struct io_uring_buf_ring *br = (struct io_uring_buf_ring*) bufRing;
+        struct io_uring_buf *bufs = (struct io_uring_buf*) bufRing;
+        bufs[0].addr = (unsigned long) buffer;
+        bufs[0].len = sizeof(buffer);
+        bufs[0].bid = 0;
+        __atomic_store_n(&br->tail, 1, __ATOMIC_RELEASE);
+
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if (sock == -1 || ::bind(sock, (struct sockaddr*)&addr, sizeof(addr)) ||
+            getsockname(sock, (struct sockaddr*)&addr, &addrLen))
+            break;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_namelen = sizeof(struct sockaddr_in);
+        struct io_uring_sqe *sqe = ring.GetSQE();
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->fd = sock;
+        sqe->addr = (unsigned long) &msg;
+        sqe->len = 1;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = URING_BUFFER_GROUP;
+        if (ring.Submit(0) < 0)
+            break;
+
+        if (sendto(sock, "probe", 5, 0, (struct sockaddr*)&addr, sizeof(addr)) != 5)
+            break;
+        if (ring.Submit(1) < 0)
+            break;
+
+        struct io_uring_cqe *cqe = ring.PeekCQE();
+        supported = cqe && cqe->res > 0 && (cqe->flags & IORING_CQE_F_MORE);
+    }
+    while (0);
+
+    if (sock != -1)
+        close(sock);
+    munmap(bufRing, pageSize);
+    return supported;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::Setup()
+//  Description: Create the ring, register all sockets and the provided buffer
+//               ring, then arm the receives and the timer wheel and stop polls.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::Setup()
+{
+    if (mRing.Setup(SERVER_URING_ENTRIES))
+    {
+        ReportError("io_uring_setup failed, errno %d", errno);
+        return -1;
+    }
+
+    // Registered files save an fd table lookup on every operation
+    unsigned int fwdCount = mPipeline->GetFwdSocketCount();
+    vector<int> files(URING_FILE_FWD + fwdCount);
+    files[URING_FILE_SERVER] = mPipeline->GetServerSocket();
+    for (unsigned int i = 0; i < fwdCount; ++i)
+        files[URING_FILE_FWD + i] = mPipeline->GetFwdSocket(i);
+    if (mRing.Register(IORING_REGISTER_FILES, files.data(), (unsigned int)files.size()))
+    {
+        ReportError("IORING_REGISTER_FILES failed, errno %d", errno);
+        return -1;
+    }
+
+    // Provided buffer ring, shared by all sockets
+    mBufRingSize = SERVER_URING_BUFFERS * sizeof(struct io_uring_buf);
+    mBufRing = (struct io_uring_buf_ring*) mmap(nullptr, mBufRingSize, PROT_READ | PROT_WRITE,
+                                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mBufRing == MAP_FAILED)
+    {
+        ReportError("mmap of buffer ring failed, errno %d", errno);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (unsigned long) mBufRing;
+    reg.ring_entries = SERVER_URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (mRing.Register(IORING_REGISTER_PBUF_RING, &reg, 1))
+    {
+        ReportError("IORING_REGISTER_PBUF_RING failed, errno %d", errno);
+        return -1;
+    }
+
+    mBuffers = (unsigned char*) malloc(SERVER_URING_BUFFERS * mBufferSize);
+    for (unsigned int i = 0; i < SERVER_URING_BUFFERS; ++i)
+        RecycleBuffer(i);
+
+    for (unsigned int i = 0; i < files.size(); ++i)
+    {
+        if (ArmRecv(i))
+            return -1;
+    }
+    if (ArmTimers())
+        return -1;
+    return ArmStop();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::ThreadMain()
+//  Description: Main thread entry point. One io_uring_enter() per loop both
+//               submits everything queued by the last round of completions and
+//               waits for the next one. The poll on the server's stop eventfd
+//               wakes us up when it's time to go.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadUring::ThreadMain()
+{
+    if (Setup())
+    {
+        ReportError("io_uring loop %u failed to start", mPipeline->GetIndex());
+        return;
+    }
+
+    while (!mServer->ShuttingDown())
+    {
+        if (mRing.Submit(1) < 0 && errno != EINTR && errno != EBUSY)
+        {
+            ReportError("io_uring_enter failed, errno %d", errno);
+        }
+
+        // Run everything that completed to completion
+        mBusy = true;
+        try
+        {
+            struct io_uring_cqe *cqe;
+            while ((cqe = mRing.PeekCQE()) != nullptr)
+            {
+                struct io_uring_cqe copy = *cqe;
+                mRing.SeenCQE();
+                HandleCompletion(&copy);
+            }
+        }
+        catch (...)
+        {
+            ReportError("Caught exception");
+        }
+        mBusy = false;
+    }
+
+    // Send the replies the last completions queued
+    mRing.Submit(0);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::ArmRecv()
+//  Description: Queue a multishot recvmsg on one of the registered sockets.
+//       Inputs: inFileIndex (IN) URING_FILE_SERVER or URING_FILE_FWD + forward index
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::ArmRecv(unsigned int inFileIndex)
+{
+    struct io_uring_sqe *sqe = mRing.GetSQE();
+    if (!sqe)
+    {
+        ReportError("io_uring submission queue full");
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = inFileIndex;
+    sqe->addr = (unsigned long) &mRecvMsg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = URING_TAG_RECV + inFileIndex;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::ArmStop()
+//  Description: Queue a one shot poll on the server's stop eventfd, which only
+//               completes when the server shuts down.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::ArmStop()
+{
+    struct io_uring_sqe *sqe = mRing.GetSQE();
+    if (!sqe)
+    {
+        ReportError("io_uring submission queue full");
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = mServer->GetStopFD();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TAG_STOP;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::ArmTimers()
+//  Description: Queue a one shot poll on the pipeline's timer wheel, which
+//               becomes readable each time the wheel ticks.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::ArmTimers()
+{
+    struct io_uring_sqe *sqe = mRing.GetSQE();
+    if (!sqe)
+    {
+        ReportError("io_uring submission queue full");
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = mPipeline->GetTimers()->GetFD();
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_TAG_TIMERS;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::HandleCompletion()
+//  Description: Dispatch one completion.
+//       Inputs: inCQE (IN) the completion
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadUring::HandleCompletion(struct io_uring_cqe *inCQE)
+{
+    unsigned long long tag = inCQE->user_data;
+
+    if (tag >= URING_TAG_SEND)
+    {
+        unsigned int slot = (unsigned int)(tag - URING_TAG_SEND);
+        if (inCQE->res < 0)
+        {
+            ReportError("sendmsg failed (slot %u, errno %d)", slot, -inCQE->res);
+        }
+        mFreeSends.push_back(slot);
+    }
+    else if (tag == URING_TAG_STOP)
+    {
+        // ShuttingDown() ends the loop
+    }
+    else if (tag == URING_TAG_TIMERS)
+    {
+        mPipeline->RunTimers();
+        ArmTimers();
+    }
+    else
+    {
+        HandleRecv(inCQE);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::HandleRecv()
+//  Description: Handle a multishot recvmsg completion. The provided buffer holds
+//               an io_uring_recvmsg_out header, the source address and then the
+//               payload. The buffer goes straight back on the ring once handled;
+//               the stages copy whatever they keep.
+//
+//               A multishot receive stops (no IORING_CQE_F_MORE) when the buffer
+//               ring runs dry or on error, in which case it is re-armed. The
+//               listener's isn't once the server is draining, and whatever it
+//               still receives then is dropped.
+//       Inputs: inCQE (IN) the completion
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadUring::HandleRecv(struct io_uring_cqe *inCQE)
+{
+    unsigned int fileIndex = (unsigned int)(inCQE->user_data - URING_TAG_RECV);
+
+    if (fileIndex == URING_FILE_SERVER && mServer->Draining())
+    {
+        if (inCQE->res >= 0 && (inCQE->flags & IORING_CQE_F_BUFFER))
+            RecycleBuffer(inCQE->flags >> IORING_CQE_BUFFER_SHIFT);
+        return;
+    }
+
+    if (inCQE->res >= 0 && (inCQE->flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned short bufferID = inCQE->flags >> IORING_CQE_BUFFER_SHIFT;
+        unsigned char *buffer = mBuffers + bufferID * mBufferSize;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out*) buffer;
+        const struct sockaddr *from = (const struct sockaddr*)(out + 1);
+        unsigned char *payload = (unsigned char*)(out + 1) + mRecvMsg.msg_namelen +
+                                 mRecvMsg.msg_controllen;
+
+        // Like MSG_TRUNC on recvfrom(), a datagram cut short at the buffer
+        // must come out longer than mMaxUDPSize so the handlers can tell
+        size_t payloadLen = out->payloadlen;
+        unsigned int maxUDPSize = mServer->GetConfig().mMaxUDPSize;
+        if ((out->flags & MSG_TRUNC) && payloadLen <= maxUDPSize)
+            payloadLen = maxUDPSize + 1;
+
+        if (fileIndex == URING_FILE_SERVER)
+        {
+            if (HandlePacket(payload, payloadLen, from))
+                ReportError("Error handling packet");
+        }
+        else
+        {
+            if (HandleReply(payload, payloadLen, from, fileIndex - URING_FILE_FWD))
+                ReportError("Error handling packet");
+        }
+        RecycleBuffer(bufferID);
+    }
+    else if (inCQE->res < 0 && inCQE->res != -ENOBUFS)
+    {
+        ReportError("recvmsg failed (errno %d)", -inCQE->res);
+    }
+
+    if (!(inCQE->flags & IORING_CQE_F_MORE))
+    {
+        ArmRecv(fileIndex);
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::RecycleBuffer()
+//  Description: Give a buffer back to the kernel via the provided buffer ring.
+//       Inputs: inBufferID (IN) buffer id
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void ServerThreadUring::RecycleBuffer(unsigned short inBufferID)
+{
+    // Entries are indexed off the ring base directly: in C++ the empty struct
+    // that the uapi header puts in front of bufs[] has size 1, which would
+    // shift every entry by 8 bytes relative to what the kernel reads.
+    struct io_uring_buf *buf = (struct io_uring_buf*) mBufRing + (mBufTail & (SERVER_URING_BUFFERS - 1));
+    buf->addr = (unsigned long)(mBuffers + inBufferID * mBufferSize);
+    buf->len = mBufferSize;
+    buf->bid = inBufferID;
+    ++mBufTail;
+    __atomic_store_n(&mBufRing->tail, mBufTail, __ATOMIC_RELEASE);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::HandlePacket()
+//  Description: Turn a client packet into a Request and run the processing
+//               stage on it right away.
+//       Inputs: inData (IN) packet data. Will be copied.
+//               inLen (IN) length of packet data.
+//               inFrom (IN) address this packet came from.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::HandlePacket(
+                                    unsigned char *inData, size_t inLen, const struct sockaddr *inFrom)
+{
+    unique_ptr<Request> newReq = MakeRequest(inData, inLen, inFrom);
+    if (!newReq)
+    {
+        return 0;
+    }
+    mServer->mStats.Add(STATS_PACKETS_IN);
+
+    return HandleRequest(move(newReq));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ServerThreadUring::SendPacket()
+//  Description: Queue a sendmsg SQE instead of calling sendto(). The data is
+//               copied into a send slot that lives until the completion comes
+//               back. Everything queued goes to the kernel with the next
+//               io_uring_enter(). If every slot is in flight we fall back to a
+//               plain sendto().
+//       Inputs: inBatch (IN) unused, there are no send batches in this engine
+//               inSocket (IN) socket to send on
+//               inData (IN) datagram data
+//               inLen (IN) datagram length
+//               inTo (IN) destination address
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int ServerThreadUring::SendPacket(SendBatch * /*inBatch*/, int inSocket, const unsigned char *inData,
+                                  size_t inLen, const struct sockaddr *inTo)
+{
+    struct io_uring_sqe *sqe = nullptr;
+    if (inLen > mServer->GetConfig().mMaxUDPSize || mFreeSends.empty() || (sqe = mRing.GetSQE()) == nullptr)
+    {
+        return ServerThread::SendPacket(nullptr, inSocket, inData, inLen, inTo);
+    }
+
+    unsigned int slot = mFreeSends.back();
+    mFreeSends.pop_back();
+    UringSend &send = mSends[slot];
+    memcpy(&send.mData[0], inData, inLen);
+    memcpy(&send.mAddr, inTo, SocketAddress::Length(inTo));
+    send.mIovec.iov_base = &send.mData[0];
+    send.mIovec.iov_len = inLen;
+    memset(&send.mMsg, 0, sizeof(send.mMsg));
+    send.mMsg.msg_name = &send.mAddr;
+    send.mMsg.msg_namelen = SocketAddress::Length(inTo);
+    send.mMsg.msg_iov = &send.mIovec;
+    send.mMsg.msg_iovlen = 1;
+
+    // Map the socket back to its registered file index
+    unsigned int fileIndex = URING_FILE_SERVER;
+    for (unsigned int i = 0; i < mPipeline->GetFwdSocketCount(); ++i)
+    {
+        if (mPipeline->GetFwdSocket(i) == inSocket)
+        {
+            fileIndex = URING_FILE_FWD + i;
+            break;
+        }
+    }
+
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fileIndex;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long) &send.mMsg;
+    sqe->len = 1;
+    sqe->user_data = URING_TAG_SEND + slot;
+    return 0;
+}
+
@@ -0,0 +1,139 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: ServerUring.h
+//
+// Desc: io_uring engine: multishot recvmsg into a provided buffer ring and
+//       batched sendmsg submissions.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SERVER_URING_H
+#define SERVER_URING_H
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/io_uring.h>
+#include <vector>
+#include "Server.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: IOUring
+//##
+//##  Desc: Thin wrapper around the raw io_uring syscalls and the mmap'd
+//##        submission/completion rings. Only one thread may use it.
+//##
+//################################################################################
+
+class IOUring
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    IOUring();
+    virtual ~IOUring();
+
+    //
+    // Public member functions
+    //
+    int                     Setup(unsigned int inEntries);
+    int                     Register(unsigned int inOpcode, void *inArg, unsigned int inCount);
+    struct io_uring_sqe*    GetSQE();
+    int                     Submit(unsigned int inWaitFor);
+    struct io_uring_cqe*    PeekCQE();
+    void                    SeenCQE();
+    int                     GetFD() { return mRingFD; }
+
+    //
+    // Protected data
+    //
+protected:
+    int                     mRingFD;
+    void                    *mSQRing;
+    size_t                  mSQRingSize;
+    void                    *mCQRing;
+    size_t                  mCQRingSize;
+    struct io_uring_sqe     *mSQEs;
+    size_t                  mSQEsSize;
+    unsigned int            *mSQHead;
+    unsigned int            *mSQTail;
+    unsigned int            *mSQMask;
+    unsigned int            *mSQEntries;
+    unsigned int            *mSQArray;
+    unsigned int            *mCQHead;
+    unsigned int            *mCQTail;
+    unsigned int            *mCQMask;
+    struct io_uring_cqe     *mCQEs;
+    unsigned int            mSQLocalTail;   // SQEs handed out but not yet published
+};
+
+
+//################################################################################
+//##
+//## Class: ServerThreadUring
+//##
+//##  Desc: Serves a whole pipeline from one thread, like ServerThreadEventLoop,
+//##        but all socket I/O goes through io_uring. Every socket has a
+//##        multishot recvmsg armed that fills buffers from a provided buffer
+//##        ring, and replies are queued as sendmsg SQEs that are submitted
+//##        together with one io_uring_enter() per loop.
+//##
+//################################################################################
+
+class ServerThreadUring : public ServerThread
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    ServerThreadUring(Server *inServer, ServerPipeline *inPipeline);
+    virtual ~ServerThreadUring();
+
+    //
+    // Public member functions
+    //
+    virtual void ThreadMain();
+    static bool  Supported();
+
+    //
+    // Protected member functions
+    //
+protected:
+    int Setup();
+    int ArmRecv(unsigned int inFileIndex);
+    int ArmStop();
+    int ArmTimers();
+    void HandleCompletion(struct io_uring_cqe *inCQE);
+    void HandleRecv(struct io_uring_cqe *inCQE);
+    void RecycleBuffer(unsigned short inBufferID);
+    virtual int HandlePacket(unsigned char *inData, size_t inLen, const struct sockaddr *inFrom);
+    virtual int SendPacket(SendBatch *inBatch, int inSocket, const unsigned char *inData,
+                           size_t inLen, const struct sockaddr *inTo);
+
+    //
+    // Protected data
+    //
+    struct UringSend
+    {
+        struct msghdr       mMsg;
+        struct iovec        mIovec;
+        struct sockaddr_in6 mAddr;      // Either family fits
+        vector<unsigned char> mData;    // mMaxUDPSize
+    };
+
+    IOUring                         mRing;
+    struct io_uring_buf_ring        *mBufRing;      // Provided buffer ring
+    size_t                          mBufRingSize;
+    unsigned char                   *mBuffers;      // Memory behind the buffer ring
+    size_t                          mBufferSize;    // recvmsg header, address and one datagram
+    unsigned short                  mBufTail;
+    struct msghdr                   mRecvMsg;       // Layout template for multishot recvmsg
+    vector<UringSend>               mSends;         // In flight sendmsg slots
+    vector<unsigned int>            mFreeSends;
+};
+
+
+#endif
+
@@ -0,0 +1,268 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: SocketAddress.cpp
+//
+// Desc: IPv4/IPv6 socket address helpers and the compact client address.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <arpa/inet.h>
+#include <string.h>
+#include <stdio.h>
+#include "SocketAddress.h"
+
+static_assert(sizeof(SocketAddress) == sizeof(struct sockaddr_in),
+              "SocketAddress must stay the size of a sockaddr_in");
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::SocketAddress()
+//  Description: Constructor. Starts out unset (AF_UNSPEC).
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SocketAddress::SocketAddress()
+{
+    memset(&mV4, 0, sizeof(mV4));
+    mV4.sin_family = AF_UNSPEC;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::SocketAddress()
+//  Description: Copy constructor.
+//       Inputs: inOther (IN) address to copy
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SocketAddress::SocketAddress(const SocketAddress &inOther)
+: SocketAddress()
+{
+    *this = inOther;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::operator=()
+//  Description: Copy an address, including a heap IPv6 one.
+//       Inputs: inOther (IN) address to copy
+//      Returns: *this
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SocketAddress& SocketAddress::operator=(const SocketAddress &inOther)
+{
+    if (this != &inOther)
+    {
+        if (inOther.GetFamily() == AF_INET6)
+            Set((const struct sockaddr*)inOther.mHeap.mV6);
+        else
+        {
+            Clear();
+            mV4 = inOther.mV4;
+        }
+    }
+    return *this;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::~SocketAddress()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+SocketAddress::~SocketAddress()
+{
+    Clear();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::Clear()
+//  Description: Free a heap IPv6 address and go back to unset.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void SocketAddress::Clear()
+{
+    if (GetFamily() == AF_INET6)
+        delete mHeap.mV6;
+    memset(&mV4, 0, sizeof(mV4));
+    mV4.sin_family = AF_UNSPEC;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::Set()
+//  Description: Store an address. IPv4-mapped IPv6 addresses are stored as the
+//               IPv4 address they carry.
+//       Inputs: inAddr (IN) AF_INET or AF_INET6 address
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void SocketAddress::Set(const struct sockaddr *inAddr)
+{
+    if (inAddr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *addr6 = (const struct sockaddr_in6*)inAddr;
+        if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr))
+        {
+            Clear();
+            mV4.sin_family = AF_INET;
+            mV4.sin_port = addr6->sin6_port;
+            memcpy(&mV4.sin_addr, &addr6->sin6_addr.s6_addr[12], sizeof(mV4.sin_addr));
+            return;
+        }
+
+        if (GetFamily() != AF_INET6)
+        {
+            Clear();
+            mHeap.mFamily = AF_INET6;
+            mHeap.mV6 = new struct sockaddr_in6;
+        }
+        memcpy(mHeap.mV6, addr6, sizeof(struct sockaddr_in6));
+        return;
+    }
+
+    Clear();
+    if (inAddr->sa_family == AF_INET)
+        memcpy(&mV4, inAddr, sizeof(mV4));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::Get()
+//  Description: Build the sockaddr to use on a socket of the given family. An
+//               IPv4 address becomes IPv4-mapped for an AF_INET6 socket.
+//       Inputs: outAddr (OUT) the address
+//               inFamily (IN) family of the socket it's for
+//      Returns: Length of outAddr, 0 if it can't be reached from that family.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+socklen_t SocketAddress::Get(struct sockaddr_storage *outAddr, int inFamily) const
+{
+    if (GetFamily() == AF_INET6)
+    {
+        if (inFamily != AF_INET6)
+            return 0;
+        memcpy(outAddr, mHeap.mV6, sizeof(struct sockaddr_in6));
+        return sizeof(struct sockaddr_in6);
+    }
+
+    if (GetFamily() != AF_INET)
+        return 0;
+
+    if (inFamily == AF_INET)
+    {
+        memcpy(outAddr, &mV4, sizeof(mV4));
+        return sizeof(struct sockaddr_in);
+    }
+
+    struct sockaddr_in6 *addr6 = (struct sockaddr_in6*)outAddr;
+    memset(addr6, 0, sizeof(struct sockaddr_in6));
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = mV4.sin_port;
+    addr6->sin6_addr.s6_addr[10] = 0xFF;
+    addr6->sin6_addr.s6_addr[11] = 0xFF;
+    memcpy(&addr6->sin6_addr.s6_addr[12], &mV4.sin_addr, sizeof(mV4.sin_addr));
+    return sizeof(struct sockaddr_in6);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::Length()
+//  Description: Size of a sockaddr, going by its family.
+//       Inputs: inAddr (IN) the address
+//      Returns: sizeof the matching sockaddr_in/sockaddr_in6, 0 if unknown.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+socklen_t SocketAddress::Length(const struct sockaddr *inAddr)
+{
+    switch (inAddr->sa_family)
+    {
+        case AF_INET:
+            return sizeof(struct sockaddr_in);
+        case AF_INET6:
+            return sizeof(struct sockaddr_in6);
+        default:
+            return 0;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::Equal()
+//  Description: Compare the family, address and port of two sockaddrs.
+//       Inputs: inA (IN) first address
+//               inB (IN) second address
+//      Returns: True if they're the same endpoint.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool SocketAddress::Equal(const struct sockaddr *inA, const struct sockaddr *inB)
+{
+    if (inA->sa_family != inB->sa_family)
+        return false;
+
+    if (inA->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *a = (const struct sockaddr_in*)inA;
+        const struct sockaddr_in *b = (const struct sockaddr_in*)inB;
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+
+    if (inA->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *a = (const struct sockaddr_in6*)inA;
+        const struct sockaddr_in6 *b = (const struct sockaddr_in6*)inB;
+        return a->sin6_port == b->sin6_port &&
+               IN6_ARE_ADDR_EQUAL(&a->sin6_addr, &b->sin6_addr);
+    }
+
+    return false;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: SocketAddress::ToString()
+//  Description: Printable "addr:port" ("[addr]:port" for IPv6.)
+//       Inputs: inAddr (IN) the address
+//      Returns: The string.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+string SocketAddress::ToString(const struct sockaddr *inAddr)
+{
+    char host[INET6_ADDRSTRLEN];
+    char out[INET6_ADDRSTRLEN + 16];
+
+    if (inAddr->sa_family == AF_INET)
+    {
+        const struct sockaddr_in *addr = (const struct sockaddr_in*)inAddr;
+        inet_ntop(AF_INET, &addr->sin_addr, host, sizeof(host));
+        snprintf(out, sizeof(out), "%s:%u", host, (unsigned int)ntohs(addr->sin_port));
+        return out;
+    }
+
+    if (inAddr->sa_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *addr = (const struct sockaddr_in6*)inAddr;
+        inet_ntop(AF_INET6, &addr->sin6_addr, host, sizeof(host));
+        snprintf(out, sizeof(out), "[%s]:%u", host, (unsigned int)ntohs(addr->sin6_port));
+        return out;
+    }
+
+    return "(unknown)";
+}
@@ -0,0 +1,72 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: SocketAddress.h
+//
+// Desc: IPv4/IPv6 socket address helpers and the compact client address.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef SOCKET_ADDRESS_H
+#define SOCKET_ADDRESS_H
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: SocketAddress
+//##
+//##  Desc: A client address kept in the space of a sockaddr_in. IPv4 clients,
+//##        including the IPv4-mapped ones a dual-stack socket reports, are
+//##        stored inline; only a real IPv6 address is put on the heap. Get()
+//##        turns it back into a sockaddr for a socket of either family.
+//##
+//################################################################################
+
+class SocketAddress
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    SocketAddress();
+    SocketAddress(const SocketAddress &inOther);
+    SocketAddress& operator=(const SocketAddress &inOther);
+    ~SocketAddress();
+
+    //
+    // Public member functions
+    //
+    void Set(const struct sockaddr *inAddr);
+    socklen_t Get(struct sockaddr_storage *outAddr, int inFamily) const;
+    int GetFamily() const { return mV4.sin_family; }
+
+    //
+    // Helpers for any sockaddr of a known family
+    //
+    static socklen_t Length(const struct sockaddr *inAddr);
+    static bool Equal(const struct sockaddr *inA, const struct sockaddr *inB);
+    static string ToString(const struct sockaddr *inAddr);
+
+    //
+    // Protected data
+    //
+protected:
+    void Clear();
+
+    union
+    {
+        struct sockaddr_in          mV4;        // AF_INET (or AF_UNSPEC when unset)
+        struct
+        {
+            sa_family_t             mFamily;    // AF_INET6, aliases mV4.sin_family
+            struct sockaddr_in6     *mV6;
+        }                           mHeap;
+    };
+};
+
+
+#endif
@@ -0,0 +1,93 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Stats.cpp
+//
+// Desc: Server wide statistics counters, sharded per thread.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include "Stats.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: Stats
+//##
+//##  Desc: Per thread sharded 64 bit counters.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Stats::~Stats()
+//  Description: Destructor. The threads that counted must be done by now.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+Stats::~Stats()
+{
+    for (auto shard : mShards)
+        delete shard;
+    mShards.clear();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Stats::AddShard()
+//  Description: Give the calling thread its shard, the first time it counts.
+//      Returns: The shard.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+Stats::Shard* Stats::AddShard()
+{
+    Shard *shard = new Shard();
+    lock_guard<mutex> lock(mShardsMutex);
+    mShards.push_back(shard);
+    sShardOwner = this;
+    sShard = shard;
+    return shard;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Stats::Get()
+//  Description: One counter, summed over the threads.
+//       Inputs: inCounter (IN) STATS_*
+//      Returns: The count.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unsigned long long Stats::Get(int inCounter)
+{
+    uint64_t count = 0;
+    lock_guard<mutex> lock(mShardsMutex);
+    for (auto shard : mShards)
+        count += shard->mCounters[inCounter].load(memory_order_relaxed);
+    return count;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Stats::Snapshot()
+//  Description: Every counter, summed over the threads.
+//       Inputs: outSnapshot (OUT) the counts
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void Stats::Snapshot(StatsSnapshot &outSnapshot)
+{
+    for (auto &count : outSnapshot.mCounters)
+        count = 0;
+    lock_guard<mutex> lock(mShardsMutex);
+    for (auto shard : mShards)
+    {
+        for (int i = 0; i < STATS_COUNTERS; ++i)
+            outSnapshot.mCounters[i] += shard->mCounters[i].load(memory_order_relaxed);
+    }
+}
@@ -0,0 +1,158 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Stats.h
+//
+// Desc: Server wide statistics counters, sharded per thread.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef STATS_H
+#define STATS_H
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+#define STATS_CACHE_LINE    64          /* Shards don't share cache lines */
+
+//
+// The counters. The shedding ones are in SERVER_SHED_* order, so the one for
+// a policy is STATS_SHED_DROP_NEWEST + policy.
+//
+enum
+{
+    STATS_PACKETS_IN,
+    STATS_PACKETS_OUT,
+    STATS_REQUESTS,
+    STATS_SERVED,
+    STATS_TIMEOUTS,
+    STATS_WRONG_QUESTIONS,
+    STATS_RECV_BATCHES,
+    STATS_RECV_DATAGRAMS,
+    STATS_SEND_BATCHES,
+    STATS_SEND_DATAGRAMS,
+    STATS_TCP_CONNECTIONS,
+    STATS_TCP_QUERIES,
+    STATS_FWD_TCP_QUERIES,
+    STATS_FWD_TCP_RETRIES,
+    STATS_GSO_SENDS,
+    STATS_GSO_SEGMENTS,
+    STATS_GRO_RECEIVES,
+    STATS_GRO_SEGMENTS,
+    STATS_INBOX_FULL,
+    STATS_SHED_DROP_NEWEST,
+    STATS_SHED_DROP_OLDEST,
+    STATS_SHED_REFUSED,
+    STATS_SHED_TRUNCATED,
+    STATS_SHED_CACHE_MISSES,
+    STATS_SHED_CACHE_HITS,
+    STATS_CACHE_HITS,
+    STATS_CACHE_MISSES,
+    STATS_CACHE_INSERTS,
+    STATS_CACHE_EXPIRED,
+    STATS_CACHE_EVICTED,
+    STATS_INBOX_SPIN_HITS,
+    STATS_INBOX_SLEEPS,
+    STATS_OUTBOX_STALE_REPLIES,
+    STATS_OUTBOX_EVICTIONS,
+    STATS_COUNTERS
+};
+
+
+//################################################################################
+//##
+//## Class: StatsSnapshot
+//##
+//##  Desc: Every counter summed over the threads at one point. Counters that
+//##        are bumped together may be a few counts apart in it, since the
+//##        threads keep counting while it is taken.
+//##
+//################################################################################
+
+class StatsSnapshot
+{
+public:
+    unsigned long long  operator[](int inCounter) const { return mCounters[inCounter]; }
+
+    unsigned long long  mCounters[STATS_COUNTERS];
+};
+
+
+//################################################################################
+//##
+//## Class: Stats
+//##
+//##  Desc: 64 bit counters that every thread bumps on every packet. Each
+//##        thread counts in a shard of its own, on cache lines of its own, so
+//##        counting is a plain load and store with no lock prefix and no
+//##        cache line bouncing between cores. Readers add the shards up
+//##        (Get(), Snapshot()); that is the slow path, for the statistics
+//##        printout and anything that exports them.
+//##
+//##        A thread's shard is made the first time it counts and is kept
+//##        when it exits, so nothing it counted is lost.
+//##
+//################################################################################
+
+class Stats
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    Stats() { }
+    virtual ~Stats();
+
+    //
+    // Public member functions
+    //
+    void                Add(int inCounter, int64_t inCount = 1);
+    unsigned long long  Get(int inCounter);
+    void                Snapshot(StatsSnapshot &outSnapshot);
+
+    //
+    // Protected member functions
+    //
+protected:
+    struct alignas(STATS_CACHE_LINE) Shard
+    {
+        Shard() { for (auto &counter : mCounters) counter.store(0, memory_order_relaxed); }
+
+        atomic<uint64_t> mCounters[STATS_COUNTERS];  // Only the owning thread writes them
+    };
+
+    Shard*              AddShard();
+
+    //
+    // Protected data
+    //
+    vector<Shard*>      mShards;
+    mutex               mShardsMutex;   // Adding shards vs. reading them
+
+    // The calling thread's shard, and whose it is
+    static inline thread_local Stats    *sShardOwner = nullptr;
+    static inline thread_local Shard    *sShard = nullptr;
+};
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Stats::Add()
+//  Description: Count on the calling thread's shard. Only this thread writes
+//               it, so there is no read-modify-write to lock; the atomic
+//               store is just so readers never see a torn value.
+//       Inputs: inCounter (IN) STATS_*
+//               inCount (IN) how much (negative takes back)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+inline void Stats::Add(int inCounter, int64_t inCount)
+{
+    Shard *shard = sShardOwner == this ? sShard : AddShard();
+    atomic<uint64_t> &counter = shard->mCounters[inCounter];
+    counter.store(counter.load(memory_order_relaxed) + (uint64_t) inCount, memory_order_relaxed);
+}
+
+
+#endif
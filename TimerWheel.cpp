@@ -0,0 +1,553 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: TimerWheel.cpp
+//
+// Desc: Hierarchical timing wheel with millisecond ticks.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <algorithm>
+#include "TimerWheel.h"
+#include "Error.h"
+
+using namespace std;
+
+// Ticks covered by all levels below inLevel plus inLevel itself
+#define LEVEL_SPAN(level)   ((int64_t)1 << (TIMER_WHEEL_BITS * ((level) + 1)))
+
+
+//################################################################################
+//##
+//## Class: TimerWheel
+//##
+//##  Desc: Hierarchical timing wheel with millisecond ticks.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::TimerWheel()
+//  Description: Constructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+TimerWheel::TimerWheel()
+: mStatsFired(0),
+  mStatsCascades(0),
+  mChunks(new atomic<Node*>[TIMER_WHEEL_CHUNKS]),
+  mChunkCount(0),
+  mSerial(sNextSerial++),
+  mNow(NowMS()),
+  mCount(0),
+  mTimerFD(-1),
+  mWake(0)
+{
+    for (auto &head : mSlots)
+        head = kNil;
+    for (unsigned int i = 0; i < TIMER_WHEEL_CHUNKS; ++i)
+        mChunks[i].store(nullptr, memory_order_relaxed);
+
+    mTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (mTimerFD == -1)
+        ReportError("timerfd_create failed, errno %d", errno);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::~TimerWheel()
+//  Description: Destructor. Timers still armed never fire.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+TimerWheel::~TimerWheel()
+{
+    for (unsigned int i = 0; i < TIMER_WHEEL_CHUNKS; ++i)
+        delete[] mChunks[i].load();
+    if (mTimerFD != -1)
+    {
+        close(mTimerFD);
+        mTimerFD = -1;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::NowMS()
+//  Description: The wheel's clock.
+//      Returns: CLOCK_MONOTONIC in milliseconds.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int64_t TimerWheel::NowMS()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Arm()
+//  Description: Start a timer: take a node of the calling thread's Producer
+//               and push it onto its pending list, for Advance() to link into
+//               the wheel. The timerfd is brought forward if the timer is due
+//               before it would go off.
+//       Inputs: inDelayMS (IN) how long from now it fires
+//               inCallback (IN) what to call
+//               inContext (IN) passed to inCallback
+//               inData (IN) passed to inCallback
+//      Returns: The timer, for Cancel(). 0 if there are no nodes left (it
+//               never fires.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+uint64_t TimerWheel::Arm(unsigned int inDelayMS, TimerCallback inCallback, void *inContext,
+                         uint64_t inData)
+{
+    Producer *producer = GetProducer();
+    uint32_t index = producer->mFree;
+    if (index == kNil)
+        index = producer->mReturned.exchange(kNil, memory_order_acquire);
+    if (index == kNil)
+        index = AddChunk(producer);
+    if (index == kNil)
+        return 0;
+
+    Node &node = GetNode(index);
+    int64_t expiry = NowMS() + inDelayMS;
+    producer->mFree = node.mNext;
+    node.mExpiry = expiry;
+    node.mSlot = kNil;
+    node.mCancelled = false;
+    node.mOwner = producer;
+    node.mCallback = inCallback;
+    node.mContext = inContext;
+    node.mData = inData;
+    uint64_t timer = ((uint64_t) node.mGeneration << 32) | index;
+
+    // Sequentially consistent, like Advance() setting mWake and then looking
+    // for pending nodes: either it takes this one in, or we see its mWake
+    uint32_t head = producer->mPending.load(memory_order_relaxed);
+    do
+    {
+        node.mNext = head;
+    } while (!producer->mPending.compare_exchange_weak(head, index));
+
+    int64_t wake = mWake.load();
+    if (wake == 0 || expiry < wake)
+    {
+        lock_guard<mutex> guard(mWakeLock);
+        wake = mWake.load();
+        if (wake == 0 || expiry < wake)
+            SetWake(expiry);
+    }
+    return timer;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Cancel()
+//  Description: Stop a timer before it fires. One Advance() hasn't taken in
+//               yet is marked, and Advance() drops it when it does.
+//       Inputs: inTimer (IN) what Arm() returned
+//      Returns: False if it already fired (or is firing right now) or was
+//               cancelled before.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool TimerWheel::Cancel(uint64_t inTimer)
+{
+    uint32_t index = (uint32_t) inTimer;
+    uint32_t generation = (uint32_t)(inTimer >> 32);
+    uint32_t chunk = index >> TIMER_WHEEL_CHUNK_BITS;
+    if (chunk >= TIMER_WHEEL_CHUNKS || !mChunks[chunk].load(memory_order_acquire))
+        return false;
+
+    // Only the wheel changes a node's generation, and only locked
+    lock_guard<mutex> guard(mLock);
+    Node &node = GetNode(index);
+    if (node.mGeneration != generation)
+        return false;
+    if (node.mSlot == kNil)
+    {
+        if (node.mCancelled)
+            return false;
+        node.mCancelled = true;
+        return true;
+    }
+
+    Unlink(index);
+    Free(index);
+    --mCount;
+    return true;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Advance()
+//  Description: Take in the timers armed since last time, then run every tick
+//               up to now, firing the timers that are due. The callbacks run
+//               after the wheel is unlocked, so they may Arm() and Cancel()
+//               themselves.
+//      Returns: How many timers fired.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+size_t TimerWheel::Advance()
+{
+    struct Due
+    {
+        TimerCallback   mCallback;
+        void            *mContext;
+        uint64_t        mData;
+        uint64_t        mTimer;
+    };
+    vector<Due> due;
+
+    // Clear the timerfd, we look at the clock instead of counting expirations
+    uint64_t expirations;
+    if (read(mTimerFD, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        ReportError("timerfd read failed, errno %d", errno);
+
+    {
+        lock_guard<mutex> guard(mLock);
+        do
+        {
+            int64_t now = NowMS();
+            while (mNow <= now && mCount)
+            {
+                // Skip the ticks with nothing to do
+                int64_t next = NextTick();
+                if (next > mNow)
+                {
+                    mNow = next <= now ? next : now + 1;
+                    continue;
+                }
+
+                // Pull the next slot of each level above down, widest last
+                for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+                {
+                    if (mNow & (LEVEL_SPAN(level - 1) - 1))
+                        break;
+                    Cascade(level);
+                }
+
+                uint32_t &head = mSlots[mNow & (TIMER_WHEEL_SLOTS - 1)];
+                while (head != kNil)
+                {
+                    uint32_t index = head;
+                    Node &node = GetNode(index);
+                    Unlink(index);
+                    due.push_back({ node.mCallback, node.mContext, node.mData,
+                                    ((uint64_t) node.mGeneration << 32) | index });
+                    Free(index);
+                    --mCount;
+                }
+                ++mNow;
+            }
+            if (mCount == 0 && mNow <= now)
+                mNow = now + 1;
+
+            // A timer armed after this still sets the timerfd itself
+            lock_guard<mutex> wakeGuard(mWakeLock);
+            SetWake(mCount ? NextTick() : 0);
+        } while (TakePending());
+        mStatsFired += due.size();
+    }
+
+    for (auto &timer : due)
+        timer.mCallback(timer.mContext, timer.mData, timer.mTimer);
+    return due.size();
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::GetProducer()
+//  Description: The calling thread's Producer on this wheel, made the first
+//               time it arms a timer here.
+//      Returns: The Producer.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+TimerWheel::Producer* TimerWheel::GetProducer()
+{
+    for (auto &known : sProducers)
+    {
+        if (known.first == mSerial)
+            return known.second;
+    }
+
+    Producer *producer = new Producer();
+    producer->mPending.store(kNil, memory_order_relaxed);
+    producer->mReturned.store(kNil, memory_order_relaxed);
+    producer->mFree = kNil;
+    {
+        lock_guard<mutex> guard(mProducersMutex);
+        mProducers.emplace_back(producer);
+    }
+    sProducers.push_back(make_pair(mSerial, producer));
+    return producer;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::AddChunk()
+//  Description: Give a Producer a new chunk of free nodes.
+//       Inputs: inProducer (IN) the Producer, its free list is empty
+//      Returns: The first node, kNil if the wheel is out of chunks.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+uint32_t TimerWheel::AddChunk(Producer *inProducer)
+{
+    uint32_t chunk = mChunkCount.fetch_add(1, memory_order_relaxed);
+    if (chunk >= TIMER_WHEEL_CHUNKS)
+    {
+        ReportError("Out of timers (%u)", (unsigned int) TIMER_WHEEL_CHUNKS << TIMER_WHEEL_CHUNK_BITS);
+        return kNil;
+    }
+
+    uint32_t count = 1u << TIMER_WHEEL_CHUNK_BITS;
+    uint32_t first = chunk << TIMER_WHEEL_CHUNK_BITS;
+    Node *nodes = new Node[count];
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        nodes[i].mNext = i + 1 < count ? first + i + 1 : kNil;
+        nodes[i].mPrev = kNil;
+        nodes[i].mGeneration = 1;
+        nodes[i].mSlot = kNil;
+        nodes[i].mCancelled = false;
+        nodes[i].mOwner = inProducer;
+    }
+    mChunks[chunk].store(nodes, memory_order_release);
+    return first;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::TakePending()
+//  Description: Link the nodes armed since last time into the wheel, and
+//               free the ones cancelled before they got here. Locked.
+//      Returns: True if there were any.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool TimerWheel::TakePending()
+{
+    bool took = false;
+    lock_guard<mutex> guard(mProducersMutex);
+    for (auto &producer : mProducers)
+    {
+        uint32_t index = producer->mPending.exchange(kNil);
+        while (index != kNil)
+        {
+            took = true;
+            Node &node = GetNode(index);
+            uint32_t next = node.mNext;
+            if (node.mCancelled)
+            {
+                Free(index);
+            }
+            else
+            {
+                if (mCount == 0)
+                    mNow = max(mNow, NowMS());  // Idle wheel, nothing to run in between
+                Link(index);
+                ++mCount;
+            }
+            index = next;
+        }
+    }
+    return took;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Free()
+//  Description: Start a node's next generation and hand it back to its
+//               Producer. Locked.
+//       Inputs: inNode (IN) the node, not in the wheel
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void TimerWheel::Free(uint32_t inNode)
+{
+    Node &node = GetNode(inNode);
+    if (++node.mGeneration == 0)
+        node.mGeneration = 1;
+
+    atomic<uint32_t> &returned = node.mOwner->mReturned;
+    uint32_t head = returned.load(memory_order_relaxed);
+    do
+    {
+        node.mNext = head;
+    } while (!returned.compare_exchange_weak(head, inNode, memory_order_release, memory_order_relaxed));
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Link()
+//  Description: Put an armed node into the slot for its expiry: the lowest level
+//               whose span reaches it, at the position its expiry has in that
+//               level. Overdue timers go into the slot about to run. Locked.
+//       Inputs: inNode (IN) the node
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void TimerWheel::Link(uint32_t inNode)
+{
+    Node &node = GetNode(inNode);
+    int64_t expiry = node.mExpiry < mNow ? mNow : node.mExpiry;
+    int64_t delta = expiry - mNow;
+
+    unsigned int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= LEVEL_SPAN(level))
+        ++level;
+    if (delta >= LEVEL_SPAN(level))
+        expiry = mNow + LEVEL_SPAN(level) - 1;  // Past the top, comes around again
+
+    uint32_t slot = level * TIMER_WHEEL_SLOTS +
+                    ((expiry >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+    node.mSlot = slot;
+    node.mPrev = kNil;
+    node.mNext = mSlots[slot];
+    if (node.mNext != kNil)
+        GetNode(node.mNext).mPrev = inNode;
+    mSlots[slot] = inNode;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Unlink()
+//  Description: Take a node out of its slot. Locked.
+//       Inputs: inNode (IN) the node
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void TimerWheel::Unlink(uint32_t inNode)
+{
+    Node &node = GetNode(inNode);
+    if (node.mPrev != kNil)
+        GetNode(node.mPrev).mNext = node.mNext;
+    else
+        mSlots[node.mSlot] = node.mNext;
+    if (node.mNext != kNil)
+        GetNode(node.mNext).mPrev = node.mPrev;
+    node.mSlot = kNil;
+    node.mNext = node.mPrev = kNil;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::Cascade()
+//  Description: Re-link the timers in the current slot of a level, which moves
+//               them down to where their expiry is now in reach. Locked.
+//       Inputs: inLevel (IN) the level, 1 or more
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void TimerWheel::Cascade(unsigned int inLevel)
+{
+    uint32_t slot = inLevel * TIMER_WHEEL_SLOTS +
+                    ((mNow >> (TIMER_WHEEL_BITS * inLevel)) & (TIMER_WHEEL_SLOTS - 1));
+    uint32_t index = mSlots[slot];
+    mSlots[slot] = kNil;
+    while (index != kNil)
+    {
+        uint32_t next = GetNode(index).mNext;
+        Link(index);
+        ++mStatsCascades;
+        index = next;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::NextTick()
+//  Description: The first tick from mNow on that has something to do: a
+//               level 0 slot with timers in it, or a slot above with timers
+//               to cascade. Level 0 only holds the next 64 ticks, and a level
+//               above is only looked at on its own slot boundaries, so it is
+//               at most a slot count's worth of looks per level. Locked.
+//      Returns: The tick, or INT64_MAX if the wheel is empty.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int64_t TimerWheel::NextTick()
+{
+    int64_t next = INT64_MAX;
+    for (int64_t tick = mNow; tick < mNow + TIMER_WHEEL_SLOTS; ++tick)
+    {
+        if (mSlots[tick & (TIMER_WHEEL_SLOTS - 1)] != kNil)
+        {
+            next = tick;
+            break;
+        }
+    }
+
+    for (unsigned int level = 1; level < TIMER_WHEEL_LEVELS; ++level)
+    {
+        // Cascades happen when mNow is on a boundary of the level's slots
+        int64_t width = (int64_t) 1 << (TIMER_WHEEL_BITS * level);
+        int64_t tick = (mNow + width - 1) & ~(width - 1);
+        for (unsigned int i = 0; i < TIMER_WHEEL_SLOTS && tick < next; ++i, tick += width)
+        {
+            uint32_t slot = level * TIMER_WHEEL_SLOTS +
+                            ((tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1));
+            if (mSlots[slot] != kNil)
+            {
+                next = tick;
+                break;
+            }
+        }
+    }
+    return next;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: TimerWheel::SetWake()
+//  Description: Set the one-shot timerfd for a tick, or stop it. A tick
+//               already gone fires it right away. With mWakeLock held.
+//       Inputs: inTick (IN) the tick (NowMS() time), 0 to stop it
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+void TimerWheel::SetWake(int64_t inTick)
+{
+    if (inTick == mWake || mTimerFD == -1)
+        return;
+
+    struct itimerspec wake;
+    memset(&wake, 0, sizeof(wake));
+    if (inTick)
+    {
+        wake.it_value.tv_sec = inTick / 1000;
+        wake.it_value.tv_nsec = (inTick % 1000) * 1000000L;
+    }
+    if (timerfd_settime(mTimerFD, TFD_TIMER_ABSTIME, &wake, nullptr))
+    {
+        ReportError("timerfd_settime failed, errno %d", errno);
+        return;
+    }
+    mWake = inTick;
+}
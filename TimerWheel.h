@@ -0,0 +1,144 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: TimerWheel.h
+//
+// Desc: Hierarchical timing wheel with millisecond ticks.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+#define TIMER_WHEEL_BITS        6                           /* Slots per level, as a power of 2 */
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS      4                           /* 64^4 ms, about 4.6 hours, longer is clamped */
+#define TIMER_WHEEL_CHUNK_BITS  12                          /* Nodes are allocated 4K at a time */
+#define TIMER_WHEEL_CHUNKS      16384                       /* Max chunks, 64M timers */
+
+// Called on the thread running Advance(), never with the wheel locked
+typedef void (*TimerCallback)(void *inContext, uint64_t inData, uint64_t inTimer);
+
+
+//################################################################################
+//##
+//## Class: TimerWheel
+//##
+//##  Desc: Timers at 1 ms resolution. Level 0 has a slot per tick, every level
+//##        above has slots 64 times as wide, and a timer drops down a level
+//##        (cascades) when its slot comes up. Nodes are named by index and
+//##        generation, so cancelling a timer that already fired is harmless.
+//##
+//##        Any thread can Arm() and Cancel(). One thread drives the wheel: it
+//##        waits for GetFD() to be readable and then calls Advance(). The
+//##        timerfd is one-shot, set for the next tick that has something to
+//##        do (a timer due, or a slot above to cascade), so the thread only
+//##        wakes when there is work and never while the wheel is empty.
+//##
+//##        Arm() never takes the wheel's lock. Every arming thread has a
+//##        Producer of its own, with its own nodes: it pushes the armed node
+//##        onto its pending list with a CAS, and Advance() takes the whole
+//##        list and links the nodes into the wheel. Fired and cancelled nodes
+//##        go back to their Producer the same way. The wheel's lock is only
+//##        shared by Advance() and Cancel(), and Arm() only takes the timerfd's
+//##        lock when its timer is due before the timerfd would go off.
+//##
+//################################################################################
+
+class TimerWheel
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    TimerWheel();
+    virtual ~TimerWheel();
+
+    //
+    // Public member functions
+    //
+    uint64_t            Arm(unsigned int inDelayMS, TimerCallback inCallback, void *inContext,
+                            uint64_t inData);
+    bool                Cancel(uint64_t inTimer);
+    size_t              Advance();
+    int                 GetFD() { return mTimerFD; }
+    size_t              GetCount() { return mCount; }
+    static int64_t      NowMS();
+
+    //
+    // Public data (statistics)
+    //
+    uint64_t            mStatsFired;
+    uint64_t            mStatsCascades;
+
+    //
+    // Protected member functions
+    //
+protected:
+    struct Producer;
+
+    struct Node
+    {
+        int64_t         mExpiry;
+        uint32_t        mNext;          // Slot, pending or free list
+        uint32_t        mPrev;
+        uint32_t        mGeneration;
+        uint32_t        mSlot;          // Index into mSlots while in the wheel, kNil otherwise
+        bool            mCancelled;     // Cancelled before Advance() took it in
+        Producer        *mOwner;
+        TimerCallback   mCallback;
+        void            *mContext;
+        uint64_t        mData;
+    };
+
+    struct alignas(64) Producer
+    {
+        atomic<uint32_t>    mPending;   // Armed, for Advance() to take in
+        atomic<uint32_t>    mReturned;  // Fired or cancelled, for the owner to take back
+        uint32_t            mFree;      // Owner only
+    };
+
+    enum { kNil = 0xFFFFFFFF };
+
+    Node&               GetNode(uint32_t inNode)
+                        { return mChunks[inNode >> TIMER_WHEEL_CHUNK_BITS].load(memory_order_acquire)
+                                 [inNode & ((1 << TIMER_WHEEL_CHUNK_BITS) - 1)]; }
+    Producer*           GetProducer();
+    uint32_t            AddChunk(Producer *inProducer);
+    bool                TakePending();
+    void                Free(uint32_t inNode);
+    void                Link(uint32_t inNode);
+    void                Unlink(uint32_t inNode);
+    void                Cascade(unsigned int inLevel);
+    int64_t             NextTick();
+    void                SetWake(int64_t inTick);
+
+    //
+    // Protected data
+    //
+    mutex                               mLock;          // Advance() and Cancel()
+    unique_ptr<atomic<Node*>[]>         mChunks;
+    atomic<uint32_t>                    mChunkCount;
+    vector<unique_ptr<Producer>>        mProducers;
+    mutex                               mProducersMutex;
+    uint64_t                            mSerial;        // Tells wheels apart in sProducers
+    uint32_t                            mSlots[TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS];    // List heads
+    int64_t                             mNow;           // Next tick to run
+    size_t                              mCount;         // Timers in the wheel
+    int                                 mTimerFD;
+    mutex                               mWakeLock;      // Setting the timerfd
+    atomic<int64_t>                     mWake;          // Tick the timerfd is set for, 0 if it isn't
+
+    // The calling thread's Producer on every wheel it has armed a timer on
+    static inline thread_local vector<pair<uint64_t, Producer*>>  sProducers;
+    static inline atomic<uint64_t>                                sNextSerial{1};
+};
+
+
+#endif
@@ -0,0 +1,430 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Topology.cpp
+//
+// Desc: CPU/NUMA topology, NIC RX queue IRQs and thread placement.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <algorithm>
+#include "Topology.h"
+#include "Error.h"
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: Topology
+//##
+//##  Desc: CPU/NUMA topology and thread placement.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::Topology()
+//  Description: Constructor. Nothing is known until Load().
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+Topology::Topology()
+: mOnlineCount(0),
+  mMemPolicy(false)
+{
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::Load()
+//  Description: Read the topology. Usable CPUs are the online ones in the
+//               calling thread's affinity mask; each is put on the node sysfs
+//               says it is on, or node 0 when the kernel has no NUMA support.
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::Load()
+{
+    vector<int> online;
+    if (ReadCPUList("/sys/devices/system/cpu/online", online))
+    {
+        for (int cpu = 0; cpu < (int) sysconf(_SC_NPROCESSORS_ONLN); ++cpu)
+            online.push_back(cpu);
+    }
+    mOnlineCount = (unsigned int) online.size();
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+    {
+        ReportError("sched_getaffinity failed, errno %d", errno);
+        return -1;
+    }
+
+    mCPUs.clear();
+    for (auto cpu : online)
+    {
+        if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+            mCPUs.push_back(cpu);
+    }
+    if (mCPUs.empty())
+    {
+        ReportError("No usable CPUs");
+        return -1;
+    }
+
+    // Node of each CPU, from the nodes' CPU lists
+    mCPUNodes.assign(mCPUs.back() + 1, -1);
+    vector<int> nodes;
+    if (ReadCPUList("/sys/devices/system/node/has_cpu", nodes))
+        nodes.clear();
+    for (auto node : nodes)
+    {
+        vector<int> nodeCPUs;
+        if (ReadCPUList("/sys/devices/system/node/node" + to_string(node) + "/cpulist", nodeCPUs))
+            continue;
+        for (auto cpu : nodeCPUs)
+        {
+            if (cpu < (int) mCPUNodes.size())
+                mCPUNodes[cpu] = node;
+        }
+    }
+
+    mNodes.clear();
+    mNodeCPUs.clear();
+    for (auto cpu : mCPUs)
+    {
+        int node = max(mCPUNodes[cpu], 0);
+        mCPUNodes[cpu] = node;
+        if (node >= (int) mNodeCPUs.size())
+            mNodeCPUs.resize(node + 1);
+        if (mNodeCPUs[node].empty())
+            mNodes.push_back(node);
+        mNodeCPUs[node].push_back(cpu);
+    }
+    sort(mNodes.begin(), mNodes.end());
+
+    // Seccomp or an old kernel may not let us set memory policies
+    mMemPolicy = syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0) == 0;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::IsUsable()
+//  Description: Can we run on this CPU?
+//       Inputs: inCPU (IN) the CPU
+//      Returns: True if it is online and in our affinity mask.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+bool Topology::IsUsable(int inCPU)
+{
+    return binary_search(mCPUs.begin(), mCPUs.end(), inCPU);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::GetNode()
+//  Description: The node a CPU is on.
+//       Inputs: inCPU (IN) a usable CPU
+//      Returns: The node, -1 if the CPU isn't usable.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::GetNode(int inCPU)
+{
+    if (inCPU < 0 || inCPU >= (int) mCPUNodes.size())
+        return -1;
+    return mCPUNodes[inCPU];
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::GetNode()
+//  Description: The node a set of CPUs is on.
+//       Inputs: inCPUs (IN) usable CPUs
+//      Returns: The node, -1 if they are spread over several (or none.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::GetNode(const vector<int> &inCPUs)
+{
+    int node = -1;
+    for (auto cpu : inCPUs)
+    {
+        int cpuNode = GetNode(cpu);
+        if (cpuNode < 0 || (node >= 0 && cpuNode != node))
+            return -1;
+        node = cpuNode;
+    }
+    return node;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::GetIRQCPUs()
+//  Description: Find the CPUs a NIC's receive queue interrupts are handled on,
+//               in queue order. The NIC's interrupts are its MSI vectors (of
+//               the interface's device, or its parent for virtio) and any
+//               /proc/interrupts line named after the interface; of those the
+//               receive queues are the ones named like one ("rx", "TxRx",
+//               virtio's "input", mlx5's "comp"), or all but the config and
+//               async ones when none are. Each IRQ counts for the first CPU
+//               it is effectively routed to.
+//       Inputs: inInterface (IN) interface name
+//               outCPUs (OUT) a CPU per receive queue, may repeat
+//      Returns: Non-zero on error (no such interface, no IRQs found.)
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::GetIRQCPUs(const string &inInterface, vector<int> &outCPUs)
+{
+    outCPUs.clear();
+    string netPath = "/sys/class/net/" + inInterface;
+    if (access(netPath.c_str(), F_OK))
+    {
+        ReportError("No interface %s", inInterface.c_str());
+        return -1;
+    }
+
+    vector<int> deviceIRQs;
+    for (const char *msiPath : { "/device/msi_irqs", "/device/../msi_irqs" })
+    {
+        DIR *dir = opendir((netPath + msiPath).c_str());
+        if (!dir)
+            continue;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != nullptr)
+        {
+            if (isdigit((unsigned char) entry->d_name[0]))
+                deviceIRQs.push_back(atoi(entry->d_name));
+        }
+        closedir(dir);
+        if (!deviceIRQs.empty())
+            break;
+    }
+
+    FILE *file = fopen("/proc/interrupts", "r");
+    if (!file)
+    {
+        ReportError("Failed to open /proc/interrupts, errno %d", errno);
+        return -1;
+    }
+
+    // "<irq>: <count per CPU> <chip> <hwirq> <name>", the name is last
+    vector<int> queueIRQs;
+    vector<int> otherIRQs;
+    char line[1024];
+    while (fgets(line, sizeof(line), file))
+    {
+        char *end = nullptr;
+        long irq = strtol(line, &end, 10);
+        if (end == line || *end != ':')
+            continue;
+        char *name = line + strlen(line);
+        while (name > end && isspace((unsigned char) name[-1]))
+            *--name = '\0';
+        while (name > end && !isspace((unsigned char) name[-1]))
+            --name;
+
+        bool ours = strstr(name, inInterface.c_str()) != nullptr ||
+                    find(deviceIRQs.begin(), deviceIRQs.end(), (int) irq) != deviceIRQs.end();
+        if (!ours)
+            continue;
+
+        string lowered(name);
+        for (auto &c : lowered)
+            c = (char) tolower((unsigned char) c);
+        if (lowered.find("rx") != string::npos || lowered.find("input") != string::npos ||
+            lowered.find("comp") != string::npos)
+            queueIRQs.push_back((int) irq);
+        else if (lowered.find("config") == string::npos && lowered.find("async") == string::npos)
+            otherIRQs.push_back((int) irq);
+    }
+    fclose(file);
+
+    if (queueIRQs.empty())
+        queueIRQs = otherIRQs;
+    for (auto irq : queueIRQs)
+    {
+        string irqPath = "/proc/irq/" + to_string(irq);
+        vector<int> irqCPUs;
+        if (ReadCPUList(irqPath + "/effective_affinity_list", irqCPUs) || irqCPUs.empty())
+            ReadCPUList(irqPath + "/smp_affinity_list", irqCPUs);
+        if (!irqCPUs.empty())
+            outCPUs.push_back(irqCPUs[0]);
+    }
+
+    if (outCPUs.empty())
+    {
+        ReportError("No receive queue IRQs found for %s", inInterface.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::BindThread()
+//  Description: Bind the calling thread to CPUs and prefer a node's memory for
+//               the pages it touches from now on. Threads it creates start out
+//               bound the same way.
+//       Inputs: inCPUs (IN) CPUs to run on, empty for every usable one
+//               inNode (IN) node to take memory from, -1 for the default
+//                   (whichever node the thread happens to run on)
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::BindThread(const vector<int> &inCPUs, int inNode)
+{
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    for (auto cpu : inCPUs.empty() ? mCPUs : inCPUs)
+    {
+        if (cpu < CPU_SETSIZE)
+            CPU_SET(cpu, &cpuSet);
+    }
+
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (rc)
+    {
+        ReportError("pthread_setaffinity_np failed, errno %d", rc);
+        return -1;
+    }
+
+    if (!mMemPolicy)
+        return 0;
+
+    unsigned long nodeMask[1024 / (8 * sizeof(unsigned long))];
+    memset(nodeMask, 0, sizeof(nodeMask));
+    if (inNode < 0 || inNode >= (int)(8 * sizeof(nodeMask)))
+        rc = (int) syscall(SYS_set_mempolicy, MPOL_DEFAULT, nullptr, 0);
+    else
+    {
+        nodeMask[inNode / (8 * sizeof(unsigned long))] |= 1UL << (inNode % (8 * sizeof(unsigned long)));
+        rc = (int) syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, 8 * sizeof(nodeMask) + 1);
+    }
+    if (rc)
+    {
+        ReportError("set_mempolicy failed, errno %d", errno);
+        return -1;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::ParseCPUList()
+//  Description: Parse a kernel style CPU list ("0-3,8,10-11").
+//       Inputs: inList (IN) the list
+//               outCPUs (OUT) the CPUs in it, sorted, no repeats
+//      Returns: Non-zero if it isn't one.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::ParseCPUList(const char *inList, vector<int> &outCPUs)
+{
+    outCPUs.clear();
+    const char *pos = inList;
+    while (*pos && !isspace((unsigned char) *pos))
+    {
+        char *end = nullptr;
+        long first = strtol(pos, &end, 10);
+        if (end == pos || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        long last = first;
+        if (*end == '-')
+        {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos || last < first || last >= CPU_SETSIZE)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last; ++cpu)
+            outCPUs.push_back((int) cpu);
+        if (*end == ',')
+            ++end;
+        else if (*end && !isspace((unsigned char) *end))
+            return -1;
+        pos = end;
+    }
+
+    sort(outCPUs.begin(), outCPUs.end());
+    outCPUs.erase(unique(outCPUs.begin(), outCPUs.end()), outCPUs.end());
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::FormatCPUList()
+//  Description: Write CPUs as a kernel style CPU list.
+//       Inputs: inCPUs (IN) sorted CPUs
+//      Returns: The list ("0-3,8").
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+string Topology::FormatCPUList(const vector<int> &inCPUs)
+{
+    string list;
+    for (size_t i = 0; i < inCPUs.size(); )
+    {
+        size_t j = i;
+        while (j + 1 < inCPUs.size() && inCPUs[j + 1] == inCPUs[j] + 1)
+            ++j;
+        if (!list.empty())
+            list += ",";
+        list += to_string(inCPUs[i]);
+        if (j > i)
+            list += "-" + to_string(inCPUs[j]);
+        i = j + 1;
+    }
+    return list;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Topology::ReadCPUList()
+//  Description: Read a CPU list file (sysfs/procfs).
+//       Inputs: inPath (IN) the file
+//               outCPUs (OUT) the CPUs in it
+//      Returns: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Topology::ReadCPUList(const string &inPath, vector<int> &outCPUs)
+{
+    outCPUs.clear();
+    FILE *file = fopen(inPath.c_str(), "r");
+    if (!file)
+        return -1;
+
+    char list[4096];
+    bool read = fgets(list, sizeof(list), file) != nullptr;
+    fclose(file);
+    if (!read)
+        return -1;
+    return ParseCPUList(list, outCPUs);
+}
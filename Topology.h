@@ -0,0 +1,80 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Topology.h
+//
+// Desc: CPU/NUMA topology, NIC RX queue IRQs and thread placement.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+//################################################################################
+//##
+//## Class: Topology
+//##
+//##  Desc: The CPUs we may run on and the NUMA nodes they belong to, read from
+//##        sysfs and our affinity mask (a cgroup cpuset or taskset shrinks
+//##        it). Also finds which CPUs a NIC's RX queue interrupts are steered
+//##        to, and binds the calling thread to CPUs and a memory node.
+//##
+//##        Binding the calling thread is all the server needs: threads start
+//##        with their creator's CPU mask and memory policy, so the main
+//##        thread binds itself the way the next thread should run before it
+//##        creates it (see Server::EnterPlacement()).
+//##
+//################################################################################
+
+class Topology
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    Topology();
+    virtual ~Topology() { }
+
+    //
+    // Get/set member functions
+    //
+    const vector<int>&  GetCPUs() { return mCPUs; }
+    unsigned int        GetOnlineCount() { return mOnlineCount; }
+    const vector<int>&  GetNodes() { return mNodes; }
+    const vector<int>&  GetNodeCPUs(int inNode) { return mNodeCPUs[inNode]; }
+    bool                HasMemPolicy() { return mMemPolicy; }
+
+    //
+    // Public member functions
+    //
+    int                 Load();
+    bool                IsUsable(int inCPU);
+    int                 GetNode(int inCPU);
+    int                 GetNode(const vector<int> &inCPUs);
+    int                 GetIRQCPUs(const string &inInterface, vector<int> &outCPUs);
+    int                 BindThread(const vector<int> &inCPUs, int inNode);
+    static int          ParseCPUList(const char *inList, vector<int> &outCPUs);
+    static string       FormatCPUList(const vector<int> &inCPUs);
+
+    //
+    // Protected member functions
+    //
+protected:
+    static int          ReadCPUList(const string &inPath, vector<int> &outCPUs);
+
+    //
+    // Protected data
+    //
+    vector<int>         mCPUs;          // Usable: online and in our affinity mask
+    unsigned int        mOnlineCount;
+    vector<int>         mNodes;         // Nodes with usable CPUs
+    vector<vector<int>> mNodeCPUs;      // Usable CPUs, by node id
+    vector<int>         mCPUNodes;      // Node id, by CPU (-1 unknown)
+    bool                mMemPolicy;     // set_mempolicy works here
+};
+
+
+#endif
@@ -0,0 +1,182 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Wakeup.cpp
+//
+// Desc: Spin-then-block counting wakeup for the thread handoffs.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include "Wakeup.h"
+#include "Stats.h"
+#include "Error.h"
+
+using namespace std;
+
+//
+// Tell the CPU we're spinning (lets the sibling hyperthread run.)
+//
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX()     __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define CPU_RELAX()     asm volatile("yield" ::: "memory")
+#else
+#define CPU_RELAX()     do { } while (0)
+#endif
+
+
+//################################################################################
+//##
+//## Class: Wakeup
+//##
+//##  Desc: Spin-then-block counting semaphore.
+//##
+//################################################################################
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Wakeup::Wakeup()
+//  Description: Constructor.
+//       Inputs: inSpinCount (IN) rounds Wait() spins before parking, 0 parks
+//                   right away
+//               inStats (IN) where to count, nullptr not to
+//               inSpinHitsCounter (IN) STATS_* for waits satisfied spinning
+//               inSleepsCounter (IN) STATS_* for waits that parked
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+Wakeup::Wakeup(unsigned int inSpinCount, Stats *inStats, int inSpinHitsCounter, int inSleepsCounter)
+: mCount(0),
+  mWaiters(0),
+  mEventFD(-1),
+  mSpinCount(inSpinCount),
+  mStats(inStats),
+  mSpinHitsCounter(inSpinHitsCounter),
+  mSleepsCounter(inSleepsCounter)
+{
+    // Semaphore mode: every Post() to a parked thread is one read's worth
+    mEventFD = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
+    if (mEventFD == -1)
+        ReportError("eventfd failed, errno %d", errno);
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Wakeup::~Wakeup()
+//  Description: Destructor.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+Wakeup::~Wakeup()
+{
+    if (mEventFD != -1)
+    {
+        close(mEventFD);
+        mEventFD = -1;
+    }
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Wakeup::Post()
+//  Description: Add to the count, waking parked threads if there are any. A
+//               woken thread takes one, so no more are woken than are parked
+//               (a token nobody reads would only wake the next one for
+//               nothing.)
+//       Inputs: inCount (IN) how much to add
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Wakeup::Post(unsigned int inCount)
+{
+    mCount += inCount;
+
+    // Both sides are sequentially consistent: either the waiter sees the new
+    // count before it parks, or we see it waiting here.
+    int waiters = mWaiters.load();
+    if (waiters > 0)
+    {
+        uint64_t value = (unsigned int) waiters < inCount ? (unsigned int) waiters : inCount;
+        if (write(mEventFD, &value, sizeof(value)) != sizeof(value))
+        {
+            ReportError("eventfd write failed, errno %d", errno);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Wakeup::Take()
+//  Description: Take up to inMax from the count without blocking. A consumer
+//               that found more work than it waited for takes the extra here.
+//       Inputs: inMax (IN) most to take
+//      Returns: How much was taken, 0 if the count was zero.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+unsigned int Wakeup::Take(unsigned int inMax)
+{
+    // Sequentially consistent, it is what a parking Wait() rechecks after
+    // showing itself in mWaiters
+    int count = mCount.load();
+    while (count > 0 && inMax > 0)
+    {
+        int take = count < (int)inMax ? count : (int)inMax;
+        if (mCount.compare_exchange_weak(count, count - take, memory_order_acquire,
+                                         memory_order_relaxed))
+            return take;
+    }
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: Wakeup::Wait()
+//  Description: Take one from the count, spinning and then blocking until it
+//               isn't zero. A parked thread can be woken by a Post() that
+//               another thread's TryWait() then beats it to, so it just goes
+//               around again.
+//      Returns: Non-zero on failure.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+int Wakeup::Wait()
+{
+    for (unsigned int spin = 0; spin < mSpinCount; ++spin)
+    {
+        if (mCount.load() > 0 && TryWait() == 0)
+        {
+            if (mStats)
+                mStats->Add(mSpinHitsCounter);
+            return 0;
+        }
+        CPU_RELAX();
+    }
+
+    if (mStats)
+        mStats->Add(mSleepsCounter);
+    ++mWaiters;
+    int rc = 0;
+    while (TryWait())
+    {
+        uint64_t value;
+        if (read(mEventFD, &value, sizeof(value)) != sizeof(value) && errno != EINTR)
+        {
+            ReportError("eventfd read failed, errno %d", errno);
+            rc = -1;
+            break;
+        }
+    }
+    --mWaiters;
+    return rc;
+}
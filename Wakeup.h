@@ -0,0 +1,60 @@
+//////////////////////////////////////////////////////////////////////////////////
+//
+// File: Wakeup.h
+//
+// Desc: Spin-then-block counting wakeup for the thread handoffs.
+//
+//////////////////////////////////////////////////////////////////////////////////
+#ifndef WAKEUP_H
+#define WAKEUP_H
+#include <atomic>
+
+using namespace std;
+
+class Stats;
+
+
+//################################################################################
+//##
+//## Class: Wakeup
+//##
+//##  Desc: A counting semaphore private to this process. Wait() first spins on
+//##        the count for a configurable number of rounds and only then parks
+//##        the thread on an eventfd, so a busy consumer takes its work without
+//##        any system call. Post() only writes the eventfd when someone is
+//##        parked.
+//##
+//################################################################################
+
+class Wakeup
+{
+public:
+    //
+    // Constructors/Destructors
+    //
+    Wakeup(unsigned int inSpinCount, Stats *inStats, int inSpinHitsCounter, int inSleepsCounter);
+    virtual ~Wakeup();
+
+    //
+    // Public member functions
+    //
+    int                 Post(unsigned int inCount = 1);
+    int                 Wait();
+    int                 TryWait() { return Take(1) ? 0 : -1; }
+    unsigned int        Take(unsigned int inMax);
+
+    //
+    // Protected data
+    //
+protected:
+    atomic_int          mCount;
+    atomic_int          mWaiters;       // Threads parked (or about to park) on mEventFD
+    int                 mEventFD;
+    unsigned int        mSpinCount;
+    Stats               *mStats;
+    int                 mSpinHitsCounter;   // STATS_*, waits satisfied while spinning
+    int                 mSleepsCounter;     // STATS_*, waits that parked
+};
+
+
+#endif
@@ -0,0 +1,120 @@
+#!/usr/bin/perl
+
+#
+# Compares the 3-stage pipeline (inbox -> processing -> outbox threads) with
+# fused stages (--fuse-stages) at several thread counts. Each run starts the
+# server, keeps $window queries outstanding for $duration seconds and prints
+# queries/sec and latency.
+#
+# Usage: ./benchStages.pl [forward_addr [forward_port]]
+#
+
+use strict;
+use warnings;
+use Socket;
+use IO::Socket::INET;
+use IO::Select;
+use POSIX ":sys_wait_h";
+use Time::HiRes qw(time sleep);
+
+#
+# Settings
+#
+my $server_bin = "./simpleServerDNS";
+my $listen_port = 5300;
+my $fwd_addr = $ARGV[0] || "8.8.8.8";
+my $fwd_port = $ARGV[1] || 53;
+my $duration = 10;          # Seconds per run
+my $window = 200;           # Queries kept outstanding
+my $timeout = 2.0;          # Seconds before an outstanding query counts as lost
+my @thread_counts = (1, 2, 4, 8);
+my @modes = (
+    [ "3-stage", sub { "--inbox-threads=$_[0] --process-threads=$_[0]" } ],
+    [ "fused",   sub { "--fuse-stages --inbox-threads=$_[0]" } ],
+);
+my @domains = ("google.com", "facebook.com", "twitter.com", "apple.com", "ebay.com",
+               "paypal.com", "amazon.com", "youtube.com", "yahoo.com", "yelp.com");
+
+#
+# Script
+#
+sub build_query
+{
+    my ($id, $name) = @_;
+    my $qname = join("", map { chr(length($_)) . $_ } split(/\./, $name)) . "\0";
+    return pack("nnnnnn", $id, 0x0100, 1, 0, 0, 0) . $qname . pack("nn", 1, 1);
+}
+
+sub run_load
+{
+    my $sock = IO::Socket::INET->new(Proto => "udp", PeerAddr => "127.0.0.1",
+                                     PeerPort => $listen_port) or die "socket: $!";
+    my $select = IO::Select->new($sock);
+    my %sent;               # id -> send time
+    my @latencies;
+    my ($next_id, $lost) = (0, 0);
+    my $end = time() + $duration;
+
+    while (time() < $end)
+    {
+        while (keys(%sent) < $window)
+        {
+            $next_id = ($next_id + 1) & 0xFFFF while exists $sent{$next_id};
+            $sock->send(build_query($next_id, $domains[int(rand(@domains))]));
+            $sent{$next_id} = time();
+            $next_id = ($next_id + 1) & 0xFFFF;
+        }
+        foreach my $ready ($select->can_read(0.05))
+        {
+            my $reply;
+            while (defined($ready->recv($reply, 4096, MSG_DONTWAIT)) && length($reply) >= 2)
+            {
+                my $id = unpack("n", $reply);
+                next unless exists $sent{$id};
+                push(@latencies, time() - delete $sent{$id});
+            }
+        }
+        my $now = time();
+        foreach my $id (keys %sent)
+        {
+            if ($now - $sent{$id} > $timeout)
+            {
+                delete $sent{$id};
+                ++$lost;
+            }
+        }
+    }
+
+    @latencies = sort { $a <=> $b } @latencies;
+    my $count = scalar(@latencies);
+    return ($count, $lost, 0, 0, 0) unless $count;
+    my $sum = 0;
+    $sum += $_ foreach @latencies;
+    return ($count, $lost, $sum / $count * 1000, $latencies[int($count * 0.5)] * 1000,
+            $latencies[int($count * 0.99)] * 1000);
+}
+
+printf("Forwarding to %s:%d, %d outstanding, %ds per run\n\n", $fwd_addr, $fwd_port, $window, $duration);
+printf("%-8s %7s %10s %8s %8s %8s %8s\n", "mode", "threads", "qps", "avg ms", "p50 ms", "p99 ms", "lost");
+foreach my $threads (@thread_counts)
+{
+    foreach my $mode (@modes)
+    {
+        my $args = $mode->[1]->($threads);
+        my $pid = fork();
+        die "fork: $!" unless defined $pid;
+        if ($pid == 0)
+        {
+            open(STDOUT, ">", "/dev/null");
+            exec("$server_bin $args $listen_port $fwd_addr $fwd_port") or exit(1);
+        }
+        sleep(1);
+
+        my ($count, $lost, $avg, $p50, $p99) = run_load();
+        printf("%-8s %7d %10.0f %8.2f %8.2f %8.2f %8d\n", $mode->[0], $threads,
+               $count / $duration, $avg, $p50, $p99, $lost);
+
+        kill("INT", $pid);
+        waitpid($pid, 0);
+    }
+}
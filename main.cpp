@@ -5,12 +5,86 @@
 //////////////////////////////////////////////////////////////////////////////////
 //
 // Usage:
-//    ./simpleServerDNS [<listenPort> <remoteDNSAddr> <remoteDNSPort>]
+//    ./simpleServerDNS [options] [<listenPort> <remoteDNSAddr> <remoteDNSPort>]
 //
 //    listenPort: is what our server listens on. (default: 53)
-//    remoteDNSAddr: Where to forward DNS requests (default: 8.8.8.8)
+//    remoteDNSAddr: Where to forward DNS requests, IPv4 or IPv6 (default: 8.8.8.8)
 //    remoteDNSPort: Where to forward DNS requests (default: 53)
 //
+// Options:
+//    --batch                 Batch socket I/O with recvmmsg/sendmmsg
+//    --batch-size=<n>        Max datagrams per recvmmsg/sendmmsg, up to 1024 (default: 32)
+//    --batch-flush-us=<us>   Max time a queued reply waits to be sent (default: 200)
+//    --reuseport[=<n>]       Run <n> pipelines on SO_REUSEPORT sockets (default: 1 per core)
+//    --engine=<name>         pipeline: inbox/processing/outbox threads (default)
+//                            eventloop: one epoll thread per pipeline, run to completion
+//                            uring: like eventloop but on io_uring (falls back to pipeline)
+//                            coro: like eventloop, each query a C++20 coroutine
+//    --coro-retries=<n>      Coro engine: ask again up to <n> times when there's no
+//                            answer, splitting the timeout between tries (default: 0)
+//    --coro-hedge-ms=<ms>    Coro engine: also ask under another packet ID when there's
+//                            no answer after <ms>, first answer wins, 0 = off (default: 0)
+//    --fwd-sockets=<n>       Forward over <n> sockets per pipeline, each with its own
+//                            packet ID space and 1K Outbox slots, 0 = enough for 64K
+//                            queries in flight (default: 0, which is 64 sockets)
+//    --no-tcp                Don't serve DNS over TCP on the listen port
+//    --tcp-idle-ms=<ms>      Close idle TCP connections after this long (default: 10000)
+//    --tcp-max-inflight=<n>  Max pipelined queries per TCP connection (default: 64)
+//    --tcp-max-conns=<n>     Max TCP connections per pipeline (default: 65536)
+//    --fwd-tcp               Forward everything over the upstream TCP connections
+//    --fwd-tcp-conns=<n>     Upstream TCP connections per pipeline, each with its own
+//                            packet ID space and Outbox slots, 0 disables (default: 2)
+//    --no-ipv6               Listen on IPv4 only (default: dual-stack IPv6+IPv4 when
+//                            the host has IPv6)
+//    --max-udp-size=<n>      Cap on the EDNS0 UDP payload size clients may advertise,
+//                            512 turns EDNS0 large replies off (default: 1232)
+//    --udp-gso               Send runs of same sized replies to one destination as a
+//                            single UDP_SEGMENT (GSO) message and take UDP_GRO receives.
+//                            Implies --batch; not used by the uring engine.
+//    --packet-ring=<if>      Read UDP queries from a TPACKET_V3 (PACKET_MMAP) ring on
+//                            interface <if> ("any" for all) instead of the listener
+//                            socket. Needs CAP_NET_RAW and the pipeline engine.
+//    --wakeup-spin=<n>       Rounds the processing thread spins waiting for work
+//                            before it sleeps, 0 always sleeps (default: 1000)
+//    --inbox-threads=<n>     Inbox threads per pipeline (default: 1)
+//    --process-threads=<n>   Processing threads per pipeline, a work stealing pool;
+//                            0 sizes it from the cgroup CPU quota (default: 0)
+//    --inbox-limit=<n>       Pipeline engine: max queries waiting in a pipeline's Inbox,
+//                            the rest are shed, 0 = as many as the rings hold (default: 4096)
+//    --shed=<policy>         What happens to queries over the Inbox limit:
+//                            drop-newest: dropped (default)
+//                            drop-oldest: the longest waiting ones are dropped instead
+//                            refused: answered REFUSED
+//                            tc: answered TC=1, the client asks again over TCP
+//                            cache-first: answered if they are in the cache, else dropped
+//                            (needs --cache)
+//    --fuse-stages           Pipeline engine: the inbox threads process each query
+//                            themselves (no processing threads, no Inbox ring);
+//                            upstream replies still go through the outbox thread
+//    --drain-ms=<ms>         On shutdown, keep answering the queries in flight for up
+//                            to this long, 0 drops them (default: 2000)
+//    --numa                  Spread the pipelines over the NUMA nodes: each one's
+//                            threads run on its node's CPUs and its memory (rings,
+//                            Outbox, buffers) comes from that node
+//    --pin=<role>:<cpus>     Pin the threads of a role round robin to single CPUs
+//                            from a list ("0-3,8"), may be repeated. Roles: listener
+//                            (inbox/eventloop/uring/coro), process, outbox, tcp,
+//                            fwdtcp, maint. Overrides --numa for that role.
+//    --irq-affinity=<if>     Pin listener threads round robin to the CPUs handling
+//                            interface <if>'s RX queue interrupts (overrides
+//                            --pin=listener); with --reuseport the kernel is asked
+//                            to steer each CPU's packets to its own pipeline
+//    --cache                 Answer repeated questions (same name in any case, type,
+//                            class and DNSSEC OK bit) from a cache of the remote DNS
+//                            server's answers, each kept as long as its smallest TTL
+//                            (its SOA's for NXDOMAIN/no data)
+//    --cache-entries=<n>     Max answers in the cache, the ones closest to expiring
+//                            make room (default: 100000)
+//    --cache-max-ttl=<s>     Max seconds an answer is cached (default: 86400)
+//    --cache-shards=<n>      Split the cache into <n> shards (rounded up to a power
+//                            of 2) that are written independently; lookups never
+//                            lock (default: 4 per CPU of the quota)
+//
 //
 //////////////////////////////////////////////////////////////////////////////////
 //
@@ -18,16 +92,24 @@
 //
 //    4 threads handle the server. Summary of the thread processing loops below.
 //
+//    With --reuseport the inbox/processing/outbox threads (and both sockets)
+//    are repeated once per pipeline, one pipeline per core by default. The
+//    pipelines share nothing but the maintainence thread and the statistics.
+//
 //    Inbox thread:
 //        - Reads packets on port 53 (blocking) [Socket #1]
-//        - Adds them to the processing queue as a request object
+//        - Adds them to the processing queue (a lock-free ring) as request objects
+//        - Sheds what doesn't fit under the queue's limit (see --shed)
 //    Processing thread:
 //        - Pops request objects off the processing queue
 //        - Decodes and verifies raw packet data in the request object
-//        - (Optionally) checks cache and responds with cache hit [Done.]
+//        - (Optionally) checks cache and responds with cache hit [Done.] (see --cache)
 //        - Replaces the packet ID with our own ID
 //        - Sends packet to remote DNS server [Socket #2]
 //        - Adds request to the outbox
+//        (Socket #2 is really a pool of forward sockets, see --fwd-sockets.
+//        Every one has its own packet ID space, which is what bounds the
+//        number of requests in flight.)
 // Outbox thread:
 //        - Reads packet responses from remote DNS server [Socket #2]
 //        - Matches remote DNS server response with request object in the outbox
@@ -36,8 +118,41 @@
 //        - Checks timeout threshold before sending
 //        - Sends response packet to the original requestee [Socket #1]
 // Maintainence thread:
-//        - Runs every X milliseconds
-//        - Actively culls timed out request objects from the outbox
+//        - Drives each pipeline's timer wheel (1 ms ticks, woken only when one is due)
+//        - Actively culls timed out request objects from the outbox as their timers fire
+//
+//    TCP clients (RFC 7766) are served by one more thread per pipeline that
+//    multiplexes every connection with epoll, runs the processing steps for
+//    each query itself and writes back replies as the outbox hands them over.
+//    A truncated (TC=1) upstream answer to a TCP client is asked again over
+//    a small pool of persistent upstream TCP connections, owned by another
+//    thread per pipeline, with many queries in flight on each.
+//
+//    The eventloop engine replaces all of the above with one thread per pipeline
+//    that waits on both sockets and a timer with epoll, and runs each packet
+//    through the processing or outbox steps to completion on that thread.
+//
+//    The coro engine has the same thread, but every query (TCP ones too) is a
+//    coroutine that goes through all the steps in order, waiting for the remote
+//    DNS server's answer or its timeout in between, and may ask again (retries,
+//    hedging, over TCP after a truncated answer) before it answers the client.
+//
+//    --fuse-stages sits in between: the pipeline engine's inbox threads run the
+//    processing steps on each query as soon as they read it, so cache hits and
+//    forwards skip the Inbox ring and the thread handoff, and only upstream
+//    replies take the separate outbox thread path.
+//
+//    Threads float unless placed (--numa, --pin, --irq-affinity). A placed
+//    thread starts out on its CPUs with its memory on their node, since the
+//    main thread takes on each thread's placement just before creating it.
+//    The CPUs, nodes and where each pipeline's threads went are printed at
+//    startup.
+//
+//    With --cache every thread that processes queries shares one answer
+//    cache. It is split into shards by question, each written under its own
+//    lock, and looking an answer up takes no lock at all: writers link new
+//    entries in and retire the old ones, which are only freed once no
+//    lookup can still be reading them.
 //
 //////////////////////////////////////////////////////////////////////////////////
 //
@@ -45,6 +160,8 @@
 //
 // To gracefully shutdown this server:
 //        "kill -s TERM <pid>" or just hit Ctrl+C
+//    It stops taking queries, answers the ones in flight (see --drain-ms) and
+//    then exits. A second signal exits right away.
 //
 // To test the server running port 2000:
 //         dig @127.0.0.1 -p 2000 google.com
@@ -59,6 +176,10 @@
 // Now onto the code!
 //
 #include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <iostream>
 #include <cassert>
 #include <thread>
@@ -76,6 +197,300 @@ using namespace std;
 //################################################################################
 
 
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ParseNumber
+//  Description: Parse a number off the command line: decimal digits only, no
+//               sign, nothing after them, and between inMin and inMax.
+//               Reports what was wrong with it.
+//       Inputs: inName: what it is, for the error.
+//               inValue: the string to parse.
+//               inMin, inMax: the range it must be in.
+//               outValue: (OUT) the number.
+//      Outputs: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+static int ParseNumber(const char *inName, const char *inValue, unsigned long inMin, unsigned long inMax,
+                       unsigned int &outValue)
+{
+    char *end = nullptr;
+    unsigned long value = 0;
+    errno = 0;
+    if (isdigit((unsigned char) inValue[0]))
+        value = strtoul(inValue, &end, 10);
+    if (!end || *end || errno == ERANGE || value < inMin || value > inMax)
+    {
+        ReportError("Invalid %s %s (%lu to %lu)", inName, inValue, inMin, inMax);
+        return -1;
+    }
+    outValue = (unsigned int) value;
+    return 0;
+}
+
+
+//////////////////////////////////////////////////////////////////////////////////
+//
+//     Function: ParseOptions
+//  Description: Parse the --options off the command line into a ServerConfig.
+//               Anything that isn't an option is left for the positional
+//               arguments, starting at argv[optind].
+//       Inputs: argc: number of arguments.
+//               argv: string argument list.
+//               outConfig: (OUT) settings to fill in.
+//      Outputs: Non-zero on error.
+//
+//////////////////////////////////////////////////////////////////////////////////
+
+static int ParseOptions(int argc, char * const argv[], ServerConfig &outConfig)
+{
+    enum
+    {
+        OPT_BATCH = 256,
+        OPT_BATCH_SIZE,
+        OPT_BATCH_FLUSH_US,
+        OPT_REUSEPORT,
+        OPT_ENGINE,
+        OPT_CORO_RETRIES,
+        OPT_CORO_HEDGE_MS,
+        OPT_FWD_SOCKETS,
+        OPT_NO_TCP,
+        OPT_TCP_IDLE_MS,
+        OPT_TCP_MAX_INFLIGHT,
+        OPT_TCP_MAX_CONNS,
+        OPT_FWD_TCP,
+        OPT_FWD_TCP_CONNS,
+        OPT_NO_IPV6,
+        OPT_MAX_UDP_SIZE,
+        OPT_UDP_GSO,
+        OPT_PACKET_RING,
+        OPT_WAKEUP_SPIN,
+        OPT_INBOX_THREADS,
+        OPT_PROCESS_THREADS,
+        OPT_INBOX_LIMIT,
+        OPT_SHED,
+        OPT_FUSE_STAGES,
+        OPT_DRAIN_MS,
+        OPT_NUMA,
+        OPT_PIN,
+        OPT_IRQ_AFFINITY,
+        OPT_CACHE,
+        OPT_CACHE_ENTRIES,
+        OPT_CACHE_MAX_TTL,
+        OPT_CACHE_SHARDS,
+    };
+    static const struct option options[] =
+    {
+        { "batch",              no_argument,        nullptr, OPT_BATCH },
+        { "batch-size",         required_argument,  nullptr, OPT_BATCH_SIZE },
+        { "batch-flush-us",     required_argument,  nullptr, OPT_BATCH_FLUSH_US },
+        { "reuseport",          optional_argument,  nullptr, OPT_REUSEPORT },
+        { "engine",             required_argument,  nullptr, OPT_ENGINE },
+        { "coro-retries",       required_argument,  nullptr, OPT_CORO_RETRIES },
+        { "coro-hedge-ms",      required_argument,  nullptr, OPT_CORO_HEDGE_MS },
+        { "fwd-sockets",        required_argument,  nullptr, OPT_FWD_SOCKETS },
+        { "no-tcp",             no_argument,        nullptr, OPT_NO_TCP },
+        { "tcp-idle-ms",        required_argument,  nullptr, OPT_TCP_IDLE_MS },
+        { "tcp-max-inflight",   required_argument,  nullptr, OPT_TCP_MAX_INFLIGHT },
+        { "tcp-max-conns",      required_argument,  nullptr, OPT_TCP_MAX_CONNS },
+        { "fwd-tcp",            no_argument,        nullptr, OPT_FWD_TCP },
+        { "fwd-tcp-conns",      required_argument,  nullptr, OPT_FWD_TCP_CONNS },
+        { "no-ipv6",            no_argument,        nullptr, OPT_NO_IPV6 },
+        { "max-udp-size",       required_argument,  nullptr, OPT_MAX_UDP_SIZE },
+        { "udp-gso",            no_argument,        nullptr, OPT_UDP_GSO },
+        { "packet-ring",        required_argument,  nullptr, OPT_PACKET_RING },
+        { "wakeup-spin",        required_argument,  nullptr, OPT_WAKEUP_SPIN },
+        { "inbox-threads",      required_argument,  nullptr, OPT_INBOX_THREADS },
+        { "process-threads",    required_argument,  nullptr, OPT_PROCESS_THREADS },
+        { "inbox-limit",        required_argument,  nullptr, OPT_INBOX_LIMIT },
+        { "shed",               required_argument,  nullptr, OPT_SHED },
+        { "fuse-stages",        no_argument,        nullptr, OPT_FUSE_STAGES },
+        { "drain-ms",           required_argument,  nullptr, OPT_DRAIN_MS },
+        { "numa",               no_argument,        nullptr, OPT_NUMA },
+        { "pin",                required_argument,  nullptr, OPT_PIN },
+        { "irq-affinity",       required_argument,  nullptr, OPT_IRQ_AFFINITY },
+        { "cache",              no_argument,        nullptr, OPT_CACHE },
+        { "cache-entries",      required_argument,  nullptr, OPT_CACHE_ENTRIES },
+        { "cache-max-ttl",      required_argument,  nullptr, OPT_CACHE_MAX_TTL },
+        { "cache-shards",       required_argument,  nullptr, OPT_CACHE_SHARDS },
+        { nullptr,              0,                  nullptr, 0 }
+    };
+    
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_BATCH:
+                outConfig.mBatchIO = true;
+                break;
+            case OPT_BATCH_SIZE:
+                if (ParseNumber("--batch-size", optarg, 1, SERVER_BATCH_SIZE_MAX, outConfig.mBatchSize))
+                    return -1;
+                break;
+            case OPT_BATCH_FLUSH_US:
+                if (ParseNumber("--batch-flush-us", optarg, 0, 1000000, outConfig.mBatchFlushUS))
+                    return -1;
+                break;
+            case OPT_REUSEPORT:
+                outConfig.mReusePort = true;
+                outConfig.mPipelines = 0;
+                if (optarg && ParseNumber("--reuseport", optarg, 0, INT_MAX, outConfig.mPipelines))
+                    return -1;
+                break;
+            case OPT_ENGINE:
+                if (!strcmp(optarg, "pipeline"))
+                    outConfig.mEngine = SERVER_ENGINE_PIPELINE;
+                else if (!strcmp(optarg, "eventloop"))
+                    outConfig.mEngine = SERVER_ENGINE_EVENTLOOP;
+                else if (!strcmp(optarg, "uring"))
+                    outConfig.mEngine = SERVER_ENGINE_URING;
+                else if (!strcmp(optarg, "coro"))
+                    outConfig.mEngine = SERVER_ENGINE_CORO;
+                else
+                {
+                    ReportError("Unknown --engine %s", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_CORO_RETRIES:
+                if (ParseNumber("--coro-retries", optarg, 0, INT_MAX, outConfig.mCoroRetries))
+                    return -1;
+                break;
+            case OPT_CORO_HEDGE_MS:
+                if (ParseNumber("--coro-hedge-ms", optarg, 0, INT_MAX, outConfig.mCoroHedgeMS))
+                    return -1;
+                break;
+            case OPT_FWD_SOCKETS:
+                if (ParseNumber("--fwd-sockets", optarg, 0, USHRT_MAX, outConfig.mFwdSockets))
+                    return -1;
+                break;
+            case OPT_NO_TCP:
+                outConfig.mTCP = false;
+                break;
+            case OPT_TCP_IDLE_MS:
+                if (ParseNumber("--tcp-idle-ms", optarg, 0, INT_MAX, outConfig.mTCPIdleMS))
+                    return -1;
+                break;
+            case OPT_TCP_MAX_INFLIGHT:
+                if (ParseNumber("--tcp-max-inflight", optarg, 1, INT_MAX, outConfig.mTCPMaxInFlight))
+                    return -1;
+                break;
+            case OPT_TCP_MAX_CONNS:
+                if (ParseNumber("--tcp-max-conns", optarg, 0, INT_MAX, outConfig.mTCPMaxConns))
+                    return -1;
+                break;
+            case OPT_FWD_TCP:
+                outConfig.mFwdTCPAlways = true;
+                break;
+            case OPT_FWD_TCP_CONNS:
+                if (ParseNumber("--fwd-tcp-conns", optarg, 0, USHRT_MAX, outConfig.mFwdTCPConns))
+                    return -1;
+                break;
+            case OPT_NO_IPV6:
+                outConfig.mIPv6 = false;
+                break;
+            case OPT_MAX_UDP_SIZE:
+                if (ParseNumber("--max-udp-size", optarg, SERVER_MAX_PACKET_SIZE, USHRT_MAX, outConfig.mMaxUDPSize))
+                    return -1;
+                break;
+            case OPT_UDP_GSO:
+                outConfig.mUDPGSO = true;
+                break;
+            case OPT_PACKET_RING:
+                outConfig.mPacketRing = optarg;
+                break;
+            case OPT_WAKEUP_SPIN:
+                if (ParseNumber("--wakeup-spin", optarg, 0, INT_MAX, outConfig.mWakeupSpin))
+                    return -1;
+                break;
+            case OPT_INBOX_THREADS:
+                if (ParseNumber("--inbox-threads", optarg, 1, INT_MAX, outConfig.mInboxThreadCount))
+                    return -1;
+                break;
+            case OPT_PROCESS_THREADS:
+                if (ParseNumber("--process-threads", optarg, 0, INT_MAX, outConfig.mProcessThreadCount))
+                    return -1;
+                break;
+            case OPT_INBOX_LIMIT:
+                if (ParseNumber("--inbox-limit", optarg, 0, INT_MAX, outConfig.mInboxLimit))
+                    return -1;
+                break;
+            case OPT_SHED:
+                outConfig.mShedPolicy = Server::GetShedPolicy(optarg);
+                if (outConfig.mShedPolicy < 0)
+                {
+                    ReportError("Unknown --shed %s", optarg);
+                    return -1;
+                }
+                break;
+            case OPT_FUSE_STAGES:
+                outConfig.mFuseStages = true;
+                break;
+            case OPT_DRAIN_MS:
+                if (ParseNumber("--drain-ms", optarg, 0, INT_MAX, outConfig.mDrainMS))
+                    return -1;
+                break;
+            case OPT_NUMA:
+                outConfig.mNUMA = true;
+                break;
+            case OPT_PIN:
+            {
+                const char *cpuList = strchr(optarg, ':');
+                string roleName(optarg, cpuList ? cpuList - optarg : strlen(optarg));
+                int role = Server::GetRole(roleName.c_str());
+                vector<int> cpus;
+                if (role < 0 || !cpuList || Topology::ParseCPUList(cpuList + 1, cpus) || cpus.empty())
+                {
+                    ReportError("Invalid --pin %s", optarg);
+                    return -1;
+                }
+                outConfig.mPinCPUs[role] = cpuList + 1;
+                break;
+            }
+            case OPT_IRQ_AFFINITY:
+                outConfig.mIRQAffinity = optarg;
+                break;
+            case OPT_CACHE:
+                outConfig.mCache = true;
+                break;
+            case OPT_CACHE_ENTRIES:
+                if (ParseNumber("--cache-entries", optarg, 1, INT_MAX, outConfig.mCacheEntries))
+                    return -1;
+                break;
+            case OPT_CACHE_MAX_TTL:
+                if (ParseNumber("--cache-max-ttl", optarg, 0, INT_MAX, outConfig.mCacheMaxTTL))
+                    return -1;
+                break;
+            case OPT_CACHE_SHARDS:
+                if (ParseNumber("--cache-shards", optarg, 1, 65536, outConfig.mCacheShards))
+                    return -1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    
+    // Forward sockets and upstream TCP connections share the forward indexes
+    if (outConfig.mFwdSockets + outConfig.mFwdTCPConns > USHRT_MAX + 1)
+    {
+        ReportError("Too many forward sockets and upstream TCP connections");
+        return -1;
+    }
+    if (outConfig.mFwdTCPAlways && !outConfig.mFwdTCPConns)
+    {
+        ReportError("--fwd-tcp needs upstream TCP connections");
+        return -1;
+    }
+    if (outConfig.mShedPolicy == SERVER_SHED_CACHE_FIRST && !outConfig.mCache)
+    {
+        ReportError("--shed=cache-first needs --cache");
+        return -1;
+    }
+    return 0;
+}
+
+
 //////////////////////////////////////////////////////////////////////////////////
 //
 //     Function: main
@@ -89,15 +504,30 @@ using namespace std;
 int main(int argc, char * const argv[])
 {
     int rc;
+    ServerConfig config;
     
-    cout << "\nStarting server...\n";
-    unsigned short listenPort = argc > 1 ? atoi(argv[1]) : 53;
+    if (ParseOptions(argc, argv, config))
+    {
+        cerr << "Usage: " << argv[0] << " [options] [<listenPort> <remoteDNSAddr> <remoteDNSPort>]\n";
+        return -1;
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+    
+    unsigned int listenPort = 53;
     const char *fwdTo = argc > 2 ? argv[2] : "8.8.8.8"; /* Google's public DNS server */
-    unsigned short fwdToPort = argc > 3 ? atoi(argv[3]) : 53;
+    unsigned int fwdToPort = 53;
+    if ((argc > 1 && ParseNumber("listenPort", argv[1], 1, USHRT_MAX, listenPort)) ||
+        (argc > 3 && ParseNumber("remoteDNSPort", argv[3], 1, USHRT_MAX, fwdToPort)))
+    {
+        return -1;
+    }
+    
+    cout << "\nStarting server...\n";
     
     try
     {
-        Server dnsServer(listenPort, fwdTo, fwdToPort);
+        Server dnsServer(listenPort, fwdTo, fwdToPort, config);
         rc = dnsServer.RunServer();
         if (rc)
         {